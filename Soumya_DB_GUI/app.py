@@ -1,10 +1,11 @@
-from flask import Flask, render_template_string, request, jsonify
+from flask import Flask, Response, render_template_string, request, jsonify
 from flask_cors import CORS
 import subprocess
 import json
 import os
 import tempfile
 import re
+import struct
 
 app = Flask(__name__)
 CORS(app)
@@ -41,6 +42,128 @@ def run_dbms_command(query):
     except Exception as e:
         return {"success": False, "error": str(e)}
 
+# Value type tags of the binary result protocol (see beginResult in main.c)
+VALUE_NULL, VALUE_INT, VALUE_FLOAT, VALUE_TEXT = 0, 1, 2, 3
+
+def decode_binary_output(data):
+    """Decode the engine's binary frames into result sets, messages and errors"""
+    results, messages, errors = [], [], []
+    current = None
+    pos = 0
+    while pos + 5 <= len(data):
+        kind = data[pos:pos + 1]
+        (length,) = struct.unpack_from('<I', data, pos + 1)
+        payload = data[pos + 5:pos + 5 + length]
+        pos += 5 + length
+
+        if kind == b'H':
+            (title_len,) = struct.unpack_from('<H', payload, 0)
+            off = 2
+            title = payload[off:off + title_len].decode('utf-8', 'replace')
+            off += title_len
+            (num_columns,) = struct.unpack_from('<H', payload, off)
+            off += 2
+            columns = []
+            for _ in range(num_columns):
+                value_type, name_len = struct.unpack_from('<BH', payload, off)
+                off += 3
+                name = payload[off:off + name_len].decode('utf-8', 'replace')
+                off += name_len
+                columns.append({"name": name, "type": value_type})
+            current = {"title": title, "columns": columns, "rows": []}
+            results.append(current)
+        elif kind == b'R' and current is not None:
+            row = []
+            off = 0
+            while off < len(payload):
+                tag = payload[off]
+                off += 1
+                if tag == VALUE_INT:
+                    row.append(struct.unpack_from('<q', payload, off)[0])
+                    off += 8
+                elif tag == VALUE_FLOAT:
+                    row.append(struct.unpack_from('<d', payload, off)[0])
+                    off += 8
+                elif tag == VALUE_TEXT:
+                    (text_len,) = struct.unpack_from('<I', payload, off)
+                    off += 4
+                    row.append(payload[off:off + text_len].decode('utf-8', 'replace'))
+                    off += text_len
+                else:
+                    row.append(None)
+            current["rows"].append(row)
+        elif kind == b'E' and current is not None:
+            current["count"] = struct.unpack_from('<Q', payload, 0)[0]
+            current = None
+        elif kind == b'M':
+            messages.append(payload.decode('utf-8', 'replace'))
+        elif kind == b'X':
+            errors.append(payload.decode('utf-8', 'replace'))
+
+    return {"results": results, "messages": messages, "errors": errors}
+
+def run_dbms_rows(query):
+    """Execute DBMS query with binary output and return typed rows"""
+    try:
+        process = subprocess.Popen(
+            [DBMS_EXECUTABLE],
+            stdin=subprocess.PIPE,
+            stdout=subprocess.PIPE,
+            stderr=subprocess.PIPE,
+            cwd=os.getcwd()
+        )
+
+        stdout, stderr = process.communicate(
+            input=b"SET OUTPUT BINARY\n" + query.encode('utf-8') + b"\n", timeout=10)
+
+        if process.returncode != 0 and stderr:
+            return {"success": False, "error": stderr.decode('utf-8', 'replace')}
+
+        decoded = decode_binary_output(stdout)
+        decoded["success"] = not decoded["errors"]
+        if decoded["errors"]:
+            decoded["error"] = "\n".join(decoded["errors"])
+        return decoded
+
+    except subprocess.TimeoutExpired:
+        process.kill()
+        return {"success": False, "error": "Query execution timeout"}
+    except FileNotFoundError:
+        return {"success": False, "error": f"DBMS executable not found at {DBMS_EXECUTABLE}"}
+    except Exception as e:
+        return {"success": False, "error": str(e)}
+
+def stream_dbms_json(process, query):
+    """Feed the query to the DBMS with JSON output, yielding its output as it is produced"""
+    try:
+        process.stdin.write(b"SET OUTPUT JSON\n" + query.encode('utf-8') + b"\n")
+        process.stdin.close()
+        for chunk in iter(lambda: process.stdout.read1(65536), b''):
+            yield chunk
+    finally:
+        process.stdout.close()
+        try:
+            process.wait(timeout=10)
+        except subprocess.TimeoutExpired:
+            process.kill()
+
+def json_stream_response(query):
+    """Stream engine JSON lines straight to the client"""
+    try:
+        process = subprocess.Popen(
+            [DBMS_EXECUTABLE],
+            stdin=subprocess.PIPE,
+            stdout=subprocess.PIPE,
+            stderr=subprocess.DEVNULL,
+            cwd=os.getcwd()
+        )
+    except FileNotFoundError:
+        return jsonify({"success": False, "error": f"DBMS executable not found at {DBMS_EXECUTABLE}"}), 500
+    return Response(stream_dbms_json(process, query), mimetype='application/x-ndjson')
+
+def valid_table_name(name):
+    return re.fullmatch(r'\w+', name) is not None
+
 # HTML Template
 HTML_TEMPLATE = '''
 <!DOCTYPE html>
@@ -579,6 +702,7 @@ HTML_TEMPLATE = '''
                             <input type="text" class="colName" placeholder="Column name">
                             <select class="colType">
                                 <option>INT</option>
+                                <option>BIGINT</option>
                                 <option>FLOAT</option>
                                 <option>VARCHAR</option>
                             </select>
@@ -600,6 +724,7 @@ HTML_TEMPLATE = '''
                     <input type="text" class="colName" placeholder="Column name">
                     <select class="colType">
                         <option>INT</option>
+                        <option>BIGINT</option>
                         <option>FLOAT</option>
                         <option>VARCHAR</option>
                     </select>
@@ -678,7 +803,7 @@ HTML_TEMPLATE = '''
         // Load Tables List for Manage
         async function loadTablesList() {
             try {
-                const response = await fetch(`${API_URL}/query`, {
+                const response = await fetch(`${API_URL}/rows`, {
                     method: 'POST',
                     headers: { 'Content-Type': 'application/json' },
                     body: JSON.stringify({ query: 'SHOW TABLES;' })
@@ -687,16 +812,11 @@ HTML_TEMPLATE = '''
                 const result = await response.json();
                 const select = document.getElementById('manageTableSelect');
                 
-                if (result.success) {
-                    const lines = result.data.split('\\n').filter(line => 
-                        line.trim() && !line.includes('---') && !line.includes('Tables')
-                    );
+                if (result.success && result.results.length) {
                     select.innerHTML = '<option value="">-- Select a table --</option>';
-                    lines.forEach(line => {
-                        const tableName = line.split('(')[0].trim();
-                        if (tableName) {
-                            select.innerHTML += `<option value="${tableName}">${tableName}</option>`;
-                        }
+                    result.results[0].rows.forEach(row => {
+                        const tableName = row[0];
+                        select.innerHTML += `<option value="${tableName}">${tableName}</option>`;
                     });
                 }
             } catch (error) {
@@ -710,28 +830,60 @@ HTML_TEMPLATE = '''
             if (!tableName) return;
 
             try {
-                const response = await fetch(`${API_URL}/query`, {
+                const container = document.getElementById('dataContainer');
+                container.innerHTML = `
+                    <button class="btn btn-primary btn-small" onclick="openInsertModal('${tableName}')">+ Insert Record</button>
+                    <table style="margin-top: 1rem;"><thead></thead><tbody></tbody></table>
+                `;
+                const thead = container.querySelector('thead');
+                const tbody = container.querySelector('tbody');
+                const errors = [];
+
+                await streamQuery(`${API_URL}/stream`, {
                     method: 'POST',
                     headers: { 'Content-Type': 'application/json' },
                     body: JSON.stringify({ query: `SELECT * FROM ${tableName};` })
+                }, line => {
+                    if (Array.isArray(line)) {
+                        tbody.insertAdjacentHTML('beforeend',
+                            `<tr>${line.map(v => `<td>${escapeHtml(v)}</td>`).join('')}</tr>`);
+                    } else if (line.columns) {
+                        thead.innerHTML = `<tr>${line.columns.map(c => `<th>${escapeHtml(c.name)}</th>`).join('')}</tr>`;
+                    } else if (line.error) {
+                        errors.push(line.error);
+                    }
                 });
 
-                const result = await response.json();
-                const container = document.getElementById('dataContainer');
-                
-                if (result.success) {
-                    container.innerHTML = `
-                        <button class="btn btn-primary btn-small" onclick="openInsertModal('${tableName}')">+ Insert Record</button>
-                        <div class="output" style="margin-top: 1rem;">${result.data}</div>
-                    `;
-                } else {
-                    container.innerHTML = `<div class="alert error" style="display: block;">Error: ${result.error}</div>`;
+                if (errors.length) {
+                    container.innerHTML = `<div class="alert error" style="display: block;">${escapeHtml(errors.join(' '))}</div>`;
                 }
             } catch (error) {
                 document.getElementById('dataContainer').innerHTML = `<div class="alert error" style="display: block;">Error: ${error.message}</div>`;
             }
         }
 
+        function escapeHtml(value) {
+            return String(value ?? 'NULL')
+                .replace(/&/g, '&amp;').replace(/</g, '&lt;').replace(/>/g, '&gt;');
+        }
+
+        // Stream a query's JSON lines from the engine, calling onLine for each one as it arrives
+        async function streamQuery(url, options, onLine) {
+            const response = await fetch(url, options);
+            const reader = response.body.getReader();
+            const decoder = new TextDecoder();
+            let pending = '';
+            while (true) {
+                const { done, value } = await reader.read();
+                if (done) break;
+                pending += decoder.decode(value, { stream: true });
+                const lines = pending.split('\\n');
+                pending = lines.pop();
+                lines.filter(line => line.trim()).forEach(line => onLine(JSON.parse(line)));
+            }
+            if (pending.trim()) onLine(JSON.parse(pending));
+        }
+
         // Modal Functions
         function openInsertModal(tableName) {
             document.getElementById('modalTitle').textContent = `Insert into ${tableName}`;
@@ -766,6 +918,70 @@ def execute_query():
     result = run_dbms_command(query)
     return jsonify(result)
 
+@app.route('/api/rows', methods=['POST'])
+def execute_query_rows():
+    """Execute SQL query and return typed result sets decoded from binary output"""
+    data = request.json
+    query = data.get('query', '').strip()
+    
+    if not query:
+        return jsonify({"success": False, "error": "Query cannot be empty"}), 400
+    
+    result = run_dbms_rows(query)
+    return jsonify(result)
+
+@app.route('/api/stream', methods=['POST'])
+def execute_query_stream():
+    """Execute SQL query and stream the engine's JSON lines"""
+    data = request.json
+    query = data.get('query', '').strip()
+    
+    if not query:
+        return jsonify({"success": False, "error": "Query cannot be empty"}), 400
+    
+    return json_stream_response(query)
+
+@app.route('/api/tables')
+def list_tables():
+    return json_stream_response("SHOW TABLES")
+
+@app.route('/api/describe/<table_name>')
+def describe_table(table_name):
+    if not valid_table_name(table_name):
+        return jsonify({"success": False, "error": "Invalid table name"}), 400
+    return json_stream_response(f"DESCRIBE {table_name}")
+
+@app.route('/api/select/<table_name>')
+def select_table(table_name):
+    if not valid_table_name(table_name):
+        return jsonify({"success": False, "error": "Invalid table name"}), 400
+    return json_stream_response(f"SELECT * FROM {table_name}")
+
+@app.route('/metrics')
+def metrics():
+    """Engine counters, latency histograms and table gauges for Prometheus"""
+    try:
+        process = subprocess.Popen(
+            [DBMS_EXECUTABLE],
+            stdin=subprocess.PIPE,
+            stdout=subprocess.PIPE,
+            stderr=subprocess.DEVNULL,
+            cwd=os.getcwd()
+        )
+        stdout, _ = process.communicate(input=b"SET OUTPUT JSON\nSHOW METRICS\n", timeout=10)
+    except subprocess.TimeoutExpired:
+        process.kill()
+        return Response("Metrics timeout\n", status=500, mimetype='text/plain')
+    except FileNotFoundError:
+        return Response(f"DBMS executable not found at {DBMS_EXECUTABLE}\n", status=500, mimetype='text/plain')
+
+    # Each metrics line arrives as a one-value JSON row; the banner is skipped
+    lines = []
+    for line in stdout.decode('utf-8', 'replace').splitlines():
+        if line.startswith('["'):
+            lines.append(json.loads(line)[0])
+    return Response("\n".join(lines) + "\n", mimetype='text/plain; version=0.0.4')
+
 if __name__ == '__main__':
     print("Starting DBMS Dashboard...")
     print("Open http://localhost:5000 in your browser")
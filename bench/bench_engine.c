@@ -0,0 +1,539 @@
+// YCSB-style benchmark of the storage engine. Loads a table, then runs point
+// reads, range scans, inserts, updates and deletes on their own and in the YCSB
+// core mixes A-F, reporting throughput and p50/p99/p999 latency per operation.
+// After the load it reports the table's size on disk and full-scan throughput,
+// with the buffer cache cold and warm, so -c lz4 can be compared with -c none.
+// -e lsm runs the same workloads on an ENGINE LSM table.
+//
+//   cmake -S . -B build && cmake --build build --target bench
+//   ./build/bench_engine [-n rows] [-o ops] [-t threads] [-s scan length] [-w workloads]
+//                        [-d uniform|zipf] [-m syscall|uring|mmap] [-c none|lz4] [-e heap|lsm]
+//                        [-r seed]
+//
+// Runs are reproducible: every thread draws from its own generator seeded from
+// -r. The B+ tree has no latches, so readers run in parallel while inserts,
+// updates and deletes are serialized here with a read-write lock.
+#define SOUMYADB_NO_MAIN
+#include "../src/main.c"
+
+#include <math.h>
+#include <time.h>
+
+#define BENCH_DIR "bench_engine_data"
+#define BENCH_MAX_THREADS 64
+#define ZIPF_THETA 0.99
+
+enum { OP_READ, OP_SCAN, OP_INSERT, OP_UPDATE, OP_DELETE, OP_RMW, OP_KINDS };
+
+const char* op_names[OP_KINDS] = {"read", "scan", "insert", "update", "delete", "rmw"};
+
+// Percentages of each operation kind
+typedef struct Workload {
+    const char* name;
+    int mix[OP_KINDS];
+    int latest;        // Reads favour the most recently inserted keys (YCSB D)
+} Workload;
+
+Workload workloads[] = {
+    {"read",   {100, 0, 0, 0, 0, 0}, 0},
+    {"scan",   {0, 100, 0, 0, 0, 0}, 0},
+    {"insert", {0, 0, 100, 0, 0, 0}, 0},
+    {"update", {0, 0, 0, 100, 0, 0}, 0},
+    {"delete", {0, 0, 0, 0, 100, 0}, 0},
+    {"a",      {50, 0, 0, 50, 0, 0}, 0},   // Update heavy
+    {"b",      {95, 0, 0, 5, 0, 0}, 0},    // Read mostly
+    {"c",      {100, 0, 0, 0, 0, 0}, 0},   // Read only
+    {"d",      {95, 0, 5, 0, 0, 0}, 1},    // Read latest
+    {"e",      {0, 95, 5, 0, 0, 0}, 0},    // Short ranges
+    {"f",      {50, 0, 0, 0, 0, 50}, 0},   // Read-modify-write
+};
+
+// State shared by the worker threads of a run
+typedef struct BenchState {
+    Table* table;
+    pthread_rwlock_t lock;
+    long rows;             // Keys 1..rows were loaded, in the order of load_order
+    long* load_order;
+    long next_key;         // Next key to insert
+    long next_delete;      // Deletes take keys in load order
+    int scan_length;
+    int zipf;
+    double zeta_n;         // Zipfian constants over rows items
+    double alpha;
+    double eta;
+    double zipf_half;      // 1 + 0.5^theta
+} BenchState;
+
+// One worker's share of a run and its latencies in nanoseconds per operation kind
+typedef struct BenchThread {
+    pthread_t tid;
+    BenchState* state;
+    const Workload* w;
+    long ops;
+    long first;            // Load phase: slice of load_order to insert
+    unsigned long long rng;
+    uint64_t* latencies[OP_KINDS];
+    long counts[OP_KINDS];
+    long sum;              // Checksum of the rows read, so reads are not optimized away
+} BenchThread;
+
+// Row callback of a range scan: stop after the requested number of rows
+typedef struct ScanCount {
+    long remaining;
+    long sum;
+} ScanCount;
+
+// Monotonic clock in nanoseconds
+uint64_t nowNanos(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+// xorshift64
+unsigned long long benchRandom(unsigned long long* state) {
+    *state ^= *state << 13;
+    *state ^= *state >> 7;
+    *state ^= *state << 17;
+    return *state;
+}
+
+// Uniform double in [0, 1)
+double benchUniform(unsigned long long* state) {
+    return (benchRandom(state) >> 11) * (1.0 / 9007199254740992.0);
+}
+
+// Spread Zipfian ranks over the key space so hot keys are not neighbours
+unsigned long long scrambleRank(unsigned long long rank) {
+    unsigned long long h = 14695981039346656037ULL;
+    for (int i = 0; i < 8; i++) {
+        h ^= (rank >> (8 * i)) & 0xff;
+        h *= 1099511628211ULL;
+    }
+    return h;
+}
+
+// Precompute the constants of the Zipfian generator (Gray et al., as in YCSB)
+void initZipf(BenchState* s) {
+    double zeta_2 = 1.0 + pow(0.5, ZIPF_THETA);
+    s->zeta_n = 0;
+    for (long i = 1; i <= s->rows; i++) s->zeta_n += 1.0 / pow((double)i, ZIPF_THETA);
+    s->alpha = 1.0 / (1.0 - ZIPF_THETA);
+    s->eta = (1.0 - pow(2.0 / s->rows, 1.0 - ZIPF_THETA)) / (1.0 - zeta_2 / s->zeta_n);
+    s->zipf_half = zeta_2;
+}
+
+// Zipfian rank in [0, rows): rank 0 is the most popular
+long zipfRank(BenchState* s, unsigned long long* rng) {
+    double u = benchUniform(rng);
+    double uz = u * s->zeta_n;
+    if (uz < 1.0) return 0;
+    if (uz < s->zipf_half) return 1;
+    long rank = (long)(s->rows * pow(s->eta * u - s->eta + 1.0, s->alpha));
+    return rank < s->rows ? rank : s->rows - 1;
+}
+
+// Key of an existing row for a read, scan or update
+long chooseKey(BenchThread* t) {
+    BenchState* s = t->state;
+    long last = __sync_fetch_and_add(&s->next_key, 0) - 1;
+    if (t->w->latest) {
+        long key = last - zipfRank(s, &t->rng);
+        return key >= 1 ? key : 1;
+    }
+    if (s->zipf) return 1 + (long)(scrambleRank(zipfRank(s, &t->rng)) % (unsigned long long)s->rows);
+    return 1 + (long)(benchRandom(&t->rng) % (unsigned long long)last);
+}
+
+// Fill every column of the benchmark row for key; version changes the payload
+void fillRow(Table* table, Record* rec, long key, long version) {
+    TableSchema* schema = &table->schema;
+    memset(rec, 0, schema->row_size);
+    rec->id = (int)key;
+    if (!schema->key_in_id) {
+        rec->id = 1;
+        snprintf(recordField(table, rec, 0), schema->columns[0].size, "%ld", key);
+    }
+    snprintf(recordField(table, rec, 1), schema->columns[1].size, "user%ld-%ld", key, version);
+    snprintf(recordField(table, rec, 2), schema->columns[2].size, "%ld.5", (key + version) % 100);
+    snprintf(recordField(table, rec, 3), schema->columns[3].size, "dept%ld", key % 7);
+}
+
+int benchScanRow(void* ctx, Record* rec) {
+    ScanCount* sc = (ScanCount*)ctx;
+    sc->sum += rec->id;
+    return --sc->remaining > 0;
+}
+
+// Report the table's size on disk against the bytes of its rows, then scan it
+// end to end twice: first with none of its pages in the buffer cache, then warm.
+// Dropping the cached pages writes the dirty ones back first.
+void reportStorage(BenchState* s, FILE* report) {
+    Table* table = s->table;
+    dropCachedPages(table);
+    long logical = (long)table->record_count * table->schema.row_size;
+    long on_disk = tableFileSize(table);
+    fprintf(report, "%-8s %ld bytes of rows, %ld bytes on disk (%.2fx)\n", "storage", logical, on_disk,
+            on_disk > 0 ? (double)logical / on_disk : 0.0);
+    for (int pass = 0; pass < 2; pass++) {
+        ScanCount sc = {LONG_MAX, 0};
+        uint64_t start = nowNanos();
+        long n = scanTable(table, NULL, NULL, ALL_COLUMNS, benchScanRow, &sc);
+        double seconds = (nowNanos() - start) / 1e9;
+        fprintf(report, "%-8s %-7s %7d %10ld %12.0f\n", "fullscan", pass ? "warm" : "cold", 1, n,
+                n / seconds);
+    }
+    fflush(report);
+}
+
+// Pick the next operation of the workload's mix
+int chooseOp(BenchThread* t) {
+    int roll = (int)(benchRandom(&t->rng) % 100);
+    for (int k = 0; k < OP_KINDS; k++) {
+        if (roll < t->w->mix[k]) return k;
+        roll -= t->w->mix[k];
+    }
+    return OP_READ;
+}
+
+// Run one operation of the given kind; returns 0 if there was nothing left to do
+int runOp(BenchThread* t, int kind, Record* rec, Record* buf) {
+    BenchState* s = t->state;
+    Table* table = s->table;
+    IndexKey key;
+
+    switch (kind) {
+    case OP_READ: {
+        key = intKey(chooseKey(t));
+        pthread_rwlock_rdlock(&s->lock);
+        const Record* row = findRecord(table, &key, buf);
+        if (row) t->sum += row->data[0];
+        releaseRecord(table, row, buf);
+        pthread_rwlock_unlock(&s->lock);
+        return 1;
+    }
+    case OP_SCAN: {
+        ScanCount sc = {1 + (long)(benchRandom(&t->rng) % s->scan_length), 0};
+        key = intKey(chooseKey(t));
+        pthread_rwlock_rdlock(&s->lock);
+        scanTable(table, &key, NULL, ALL_COLUMNS, benchScanRow, &sc);
+        pthread_rwlock_unlock(&s->lock);
+        t->sum += sc.sum;
+        return 1;
+    }
+    case OP_INSERT: {
+        long k = __sync_fetch_and_add(&s->next_key, 1);
+        fillRow(table, rec, k, 0);
+        pthread_rwlock_wrlock(&s->lock);
+        insertRecord(table, rec);
+        pthread_rwlock_unlock(&s->lock);
+        return 1;
+    }
+    case OP_UPDATE: {
+        long k = chooseKey(t);
+        key = intKey(k);
+        fillRow(table, rec, k, (long)(benchRandom(&t->rng) % 1000) + 1);
+        pthread_rwlock_wrlock(&s->lock);
+        updateRecord(table, &key, rec);
+        pthread_rwlock_unlock(&s->lock);
+        return 1;
+    }
+    case OP_DELETE: {
+        long i = __sync_fetch_and_add(&s->next_delete, 1);
+        if (i >= s->rows) return 0;
+        key = intKey(s->load_order[i]);
+        pthread_rwlock_wrlock(&s->lock);
+        deleteRecord(table, &key);
+        pthread_rwlock_unlock(&s->lock);
+        return 1;
+    }
+    default: {
+        // Read-modify-write: read the row and write it back with a new payload
+        long k = chooseKey(t);
+        key = intKey(k);
+        pthread_rwlock_wrlock(&s->lock);
+        const Record* row = findRecord(table, &key, buf);
+        if (row) {
+            memcpy(rec, row, table->schema.row_size);
+            releaseRecord(table, row, buf);
+            snprintf(recordField(table, rec, 1), table->schema.columns[1].size, "user%ld-rmw", k);
+            updateRecord(table, &key, rec);
+        }
+        pthread_rwlock_unlock(&s->lock);
+        return 1;
+    }
+    }
+}
+
+// Worker thread: run t->ops operations (or insert its slice of the load)
+void* benchWorker(void* arg) {
+    BenchThread* t = (BenchThread*)arg;
+    Table* table = t->state->table;
+    Record* rec = allocRecord(table);
+    Record* buf = allocRecord(table);
+    if (!rec || !buf) {
+        free(rec);
+        free(buf);
+        return NULL;
+    }
+
+    for (long i = 0; i < t->ops; i++) {
+        int kind = t->w ? chooseOp(t) : OP_INSERT;
+        uint64_t start = nowNanos();
+        if (t->w) {
+            if (!runOp(t, kind, rec, buf)) break;
+        } else {
+            // Load phase
+            long k = t->state->load_order[t->first + i];
+            fillRow(table, rec, k, 0);
+            pthread_rwlock_wrlock(&t->state->lock);
+            insertRecord(table, rec);
+            pthread_rwlock_unlock(&t->state->lock);
+        }
+        t->latencies[kind][t->counts[kind]++] = nowNanos() - start;
+    }
+    free(rec);
+    free(buf);
+    return NULL;
+}
+
+int compareLatencies(const void* a, const void* b) {
+    uint64_t x = *(const uint64_t*)a;
+    uint64_t y = *(const uint64_t*)b;
+    return (x > y) - (x < y);
+}
+
+// Print one line of results: throughput over the run's wall time, latency percentiles
+void reportLatencies(FILE* report, const char* workload, const char* op, int threads,
+                     uint64_t* lat, long n, double seconds) {
+    qsort(lat, n, sizeof(uint64_t), compareLatencies);
+    double p50 = lat[(long)((n - 1) * 0.50)] / 1000.0;
+    double p99 = lat[(long)((n - 1) * 0.99)] / 1000.0;
+    double p999 = lat[(long)((n - 1) * 0.999)] / 1000.0;
+    fprintf(report, "%-8s %-7s %7d %10ld %12.0f %10.2f %10.2f %10.2f\n", workload, op, threads, n,
+            n / seconds, p50, p99, p999);
+    fflush(report);
+}
+
+// Run a workload (NULL = the load phase) on the given number of threads and report it
+int runWorkload(BenchState* s, const Workload* w, long ops, int threads, unsigned long long seed,
+                FILE* report) {
+    BenchThread* workers = (BenchThread*)calloc(threads, sizeof(BenchThread));
+    if (!workers) return 0;
+    int ok = 1;
+    for (int i = 0; i < threads; i++) {
+        BenchThread* t = &workers[i];
+        t->state = s;
+        t->w = w;
+        t->ops = ops / threads + (i < ops % threads ? 1 : 0);
+        t->first = i * (ops / threads) + (i < ops % threads ? i : ops % threads);
+        t->rng = (seed + 1) * 0x9E3779B97F4A7C15ULL ^ (unsigned long long)(i + 1) * 0xBF58476D1CE4E5B9ULL;
+        if (!t->rng) t->rng = 1;
+        for (int k = 0; k < OP_KINDS; k++) {
+            if (w ? w->mix[k] == 0 : k != OP_INSERT) continue;
+            t->latencies[k] = (uint64_t*)malloc((t->ops ? t->ops : 1) * sizeof(uint64_t));
+            if (!t->latencies[k]) ok = 0;
+        }
+    }
+
+    int started = 0;
+    uint64_t start = nowNanos();
+    for (; ok && started < threads; started++) {
+        if (pthread_create(&workers[started].tid, NULL, benchWorker, &workers[started]) != 0) break;
+    }
+    for (int i = 0; i < started; i++) pthread_join(workers[i].tid, NULL);
+    double seconds = (nowNanos() - start) / 1e9;
+    if (started < threads) ok = 0;
+
+    const char* name = w ? w->name : "load";
+    uint64_t* all = NULL;
+    long total = 0;
+    if (ok) all = (uint64_t*)malloc((ops ? ops : 1) * sizeof(uint64_t));
+    for (int k = 0; all && k < OP_KINDS; k++) {
+        long n = 0;
+        for (int i = 0; i < threads; i++) {
+            memcpy(all + n, workers[i].latencies[k], workers[i].counts[k] * sizeof(uint64_t));
+            n += workers[i].counts[k];
+        }
+        if (n > 0) reportLatencies(report, name, op_names[k], threads, all, n, seconds);
+        total += n;
+    }
+    // Mixed workloads also get a line over all their operations
+    int kinds = 0;
+    for (int k = 0; w && k < OP_KINDS; k++) kinds += w->mix[k] > 0;
+    if (all && kinds > 1 && total > 0) {
+        long n = 0;
+        for (int k = 0; k < OP_KINDS; k++) {
+            for (int i = 0; i < threads; i++) {
+                if (!workers[i].counts[k]) continue;
+                memcpy(all + n, workers[i].latencies[k], workers[i].counts[k] * sizeof(uint64_t));
+                n += workers[i].counts[k];
+            }
+        }
+        reportLatencies(report, name, "total", threads, all, n, seconds);
+    }
+    if (!ok) fprintf(report, "%-8s failed (out of memory or threads)\n", name);
+
+    free(all);
+    for (int i = 0; i < threads; i++) {
+        for (int k = 0; k < OP_KINDS; k++) free(workers[i].latencies[k]);
+    }
+    free(workers);
+    return ok;
+}
+
+void usage(FILE* out) {
+    fprintf(out, "usage: bench_engine [-n rows] [-o ops] [-t threads] [-s scan length]\n"
+                 "                    [-w workload,...] [-d uniform|zipf] [-m syscall|uring|mmap]\n"
+                 "                    [-c none|lz4] [-e heap|lsm] [-r seed]\n"
+                 "workloads: read scan insert update delete a b c d e f (default: all, delete last)\n");
+}
+
+int main(int argc, char** argv) {
+    long rows = 100000;
+    long ops = 100000;
+    int threads = 1;
+    int scan_length = 100;
+    int zipf = 1;
+    int io_mode = IO_URING;
+    int compression = COMPRESSION_NONE;
+    int engine = ENGINE_HEAP;
+    unsigned long long seed = 42;
+    const char* list = "read,scan,insert,update,a,b,c,d,e,f,delete";
+
+    for (int i = 1; i < argc; i++) {
+        const char* arg = argv[i];
+        const char* val = i + 1 < argc ? argv[i + 1] : NULL;
+        if (!val || arg[0] != '-' || strlen(arg) != 2) {
+            usage(stderr);
+            return 1;
+        }
+        i++;
+        switch (arg[1]) {
+        case 'n': rows = atol(val); break;
+        case 'o': ops = atol(val); break;
+        case 't': threads = atoi(val); break;
+        case 's': scan_length = atoi(val); break;
+        case 'w': list = val; break;
+        case 'r': seed = strtoull(val, NULL, 10); break;
+        case 'd':
+            if (strcasecmp(val, "uniform") != 0 && strcasecmp(val, "zipf") != 0) {
+                usage(stderr);
+                return 1;
+            }
+            zipf = strcasecmp(val, "zipf") == 0;
+            break;
+        case 'm':
+            if (strcasecmp(val, "syscall") == 0) {
+                io_mode = IO_SYSCALL;
+            } else if (strcasecmp(val, "uring") == 0) {
+                io_mode = IO_URING;
+            } else if (strcasecmp(val, "mmap") == 0) {
+                io_mode = IO_MMAP;
+            } else {
+                usage(stderr);
+                return 1;
+            }
+            break;
+        case 'c':
+            if (strcasecmp(val, "none") == 0) {
+                compression = COMPRESSION_NONE;
+            } else if (strcasecmp(val, "lz4") == 0) {
+                compression = COMPRESSION_LZ4;
+            } else {
+                usage(stderr);
+                return 1;
+            }
+            break;
+        case 'e':
+            if (strcasecmp(val, "heap") == 0) {
+                engine = ENGINE_HEAP;
+            } else if (strcasecmp(val, "lsm") == 0) {
+                engine = ENGINE_LSM;
+            } else {
+                usage(stderr);
+                return 1;
+            }
+            break;
+        default:
+            usage(stderr);
+            return 1;
+        }
+    }
+    if (rows < 2 || rows > INT_MAX / 2 || ops < 1 || threads < 1 || threads > BENCH_MAX_THREADS ||
+        scan_length < 1 || (engine == ENGINE_LSM && compression != COMPRESSION_NONE)) {
+        usage(stderr);
+        return 1;
+    }
+
+    // Results go to the real stdout; the engine's status messages to /dev/null
+    fflush(stdout);
+    FILE* report = fdopen(dup(1), "w");
+    int devnull = open("/dev/null", O_WRONLY);
+    if (!report || devnull < 0) return 1;
+    dup2(devnull, 1);
+    close(devnull);
+
+    unlink(BENCH_DIR "/catalog.dat");
+    unlink(BENCH_DIR "/bench.dat");
+    removeLsmFiles(BENCH_DIR, "bench");
+    Database* db = createDatabase(BENCH_DIR);
+    if (!db) return 1;
+    Column columns[4] = {{"id", "INT", INT_FIELD_SIZE, 0, 0}, {"name", "VARCHAR", MAX_FIELD, 0, 0},
+                         {"score", "FLOAT", FLOAT_FIELD_SIZE, 0, 0}, {"dept", "VARCHAR", MAX_FIELD, 0, 0}};
+    int key_columns[1] = {0};
+    createTable(db, "bench", columns, 4, key_columns, 1, compression, engine);
+    setIoMode(db, io_mode);
+
+    BenchState state;
+    memset(&state, 0, sizeof(state));
+    state.table = findTable(db, "bench");
+    state.rows = rows;
+    state.next_key = rows + 1;
+    state.scan_length = scan_length;
+    state.zipf = zipf;
+    state.load_order = (long*)malloc(rows * sizeof(long));
+    if (!state.table || !state.load_order) return 1;
+    pthread_rwlock_init(&state.lock, NULL);
+    initZipf(&state);
+
+    // Load the keys in a shuffled (but fixed) order
+    unsigned long long rng = seed * 0x9E3779B97F4A7C15ULL + 1;
+    for (long i = 0; i < rows; i++) state.load_order[i] = i + 1;
+    for (long i = rows - 1; i > 0; i--) {
+        long j = (long)(benchRandom(&rng) % (unsigned long long)(i + 1));
+        long tmp = state.load_order[i];
+        state.load_order[i] = state.load_order[j];
+        state.load_order[j] = tmp;
+    }
+
+    static const char* mode_names[] = {"syscall", "uring", "mmap"};
+    fprintf(report, "rows=%ld ops=%ld threads=%d scan<=%d keys=%s io=%s compression=%s engine=%s seed=%llu\n",
+            rows, ops, threads, scan_length, zipf ? "zipf" : "uniform", mode_names[db->io_mode],
+            compression == COMPRESSION_LZ4 ? "lz4" : "none", engine == ENGINE_LSM ? "lsm" : "heap", seed);
+    fprintf(report, "%-8s %-7s %7s %10s %12s %10s %10s %10s\n", "workload", "op", "threads", "ops",
+            "ops/s", "p50 us", "p99 us", "p999 us");
+    int ok = runWorkload(&state, NULL, rows, threads, seed, report);
+    if (ok) reportStorage(&state, report);
+
+    char names[256];
+    snprintf(names, sizeof(names), "%s", list);
+    for (char* name = strtok(names, ","); ok && name; name = strtok(NULL, ",")) {
+        const Workload* w = NULL;
+        for (size_t i = 0; i < sizeof(workloads) / sizeof(workloads[0]); i++) {
+            if (strcasecmp(workloads[i].name, name) == 0) w = &workloads[i];
+        }
+        if (!w) {
+            fprintf(report, "Unknown workload '%s'\n", name);
+            ok = 0;
+            break;
+        }
+        ok = runWorkload(&state, w, ops, threads, seed, report);
+    }
+
+    pthread_rwlock_destroy(&state.lock);
+    free(state.load_order);
+    freeDatabase(db);
+    fclose(report);
+    return ok ? 0 : 1;
+}
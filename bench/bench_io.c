@@ -0,0 +1,139 @@
+// Compare the pread, io_uring and mmap I/O paths of the storage engine on
+// full scans, random point lookups and batched (IN list) lookups.
+//
+//   gcc -O2 -pthread -o bench_io bench/bench_io.c
+//   ./bench_io [rows] [lookups]
+#define SOUMYADB_NO_MAIN
+#include "../src/main.c"
+
+#include <time.h>
+
+#define BENCH_DIR "bench_io_data"
+#define SCAN_PASSES 5
+
+// Monotonic clock in seconds
+double nowSeconds(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// Send the engine's status messages to /dev/null while loading
+int silenceStdout(void) {
+    fflush(stdout);
+    int saved = dup(1);
+    int devnull = open("/dev/null", O_WRONLY);
+    dup2(devnull, 1);
+    close(devnull);
+    return saved;
+}
+
+void restoreStdout(int saved) {
+    fflush(stdout);
+    dup2(saved, 1);
+    close(saved);
+}
+
+// Touch every row so mapped pages are really read
+int benchScanCallback(void* ctx, Record* rec) {
+    long* sum = (long*)ctx;
+    *sum += rec->id + rec->data[0];
+    return 1;
+}
+
+// xorshift64 so every run looks up the same ids
+unsigned long long benchRandom(unsigned long long* state) {
+    *state ^= *state << 13;
+    *state ^= *state >> 7;
+    *state ^= *state << 17;
+    return *state;
+}
+
+void runBench(Database* db, Table* table, int mode, int rows, int lookups) {
+    static const char* names[] = {"SYSCALL", "URING", "MMAP"};
+    int saved = silenceStdout();
+    setIoMode(db, mode);
+    restoreStdout(saved);
+    
+    long sum = 0;
+    scanTable(table, NULL, NULL, ALL_COLUMNS, benchScanCallback, &sum); // warm up
+    double start = nowSeconds();
+    for (int pass = 0; pass < SCAN_PASSES; pass++) {
+        scanTable(table, NULL, NULL, ALL_COLUMNS, benchScanCallback, &sum);
+    }
+    double scan_time = nowSeconds() - start;
+    
+    unsigned long long rng = 88172645463325252ULL;
+    Record* buf = allocRecord(table);
+    int hits = 0;
+    start = nowSeconds();
+    for (int i = 0; i < lookups; i++) {
+        IndexKey key = intKey((long long)(benchRandom(&rng) % rows) + 1);
+        const Record* rec = findRecord(table, &key, buf);
+        if (rec) {
+            sum += rec->data[0];
+            hits++;
+        }
+        releaseRecord(table, rec, buf);
+    }
+    double lookup_time = nowSeconds() - start;
+    free(buf);
+    
+    // Same ids again, AIO_QUEUE_DEPTH at a time as WHERE id IN (...) would issue them
+    IndexKey keys[AIO_QUEUE_DEPTH];
+    rng = 88172645463325252ULL;
+    start = nowSeconds();
+    for (int i = 0; i < lookups; i += AIO_QUEUE_DEPTH) {
+        int n = 0;
+        for (; n < AIO_QUEUE_DEPTH && i + n < lookups; n++) {
+            keys[n] = intKey((long long)(benchRandom(&rng) % rows) + 1);
+        }
+        qsort(keys, n, sizeof(IndexKey), compareIndexKeys);
+        lookupRecords(table, keys, n, ALL_COLUMNS, benchScanCallback, &sum);
+    }
+    double batch_time = nowSeconds() - start;
+    
+    printf("%-8s %14.0f %14.0f %14.0f   (checksum %ld, hits %d)\n", names[mode],
+           (double)rows * SCAN_PASSES / scan_time, lookups / lookup_time, lookups / batch_time,
+           sum, hits);
+}
+
+int main(int argc, char** argv) {
+    int rows = argc > 1 ? atoi(argv[1]) : 100000;
+    int lookups = argc > 2 ? atoi(argv[2]) : 200000;
+    
+    unlink(BENCH_DIR "/catalog.dat");
+    unlink(BENCH_DIR "/bench.dat");
+    Database* db = createDatabase(BENCH_DIR);
+    if (!db) return 1;
+    
+    // Load with mmap enabled so the appends exercise remap-on-grow
+    int saved = silenceStdout();
+    Column columns[4] = {{"id", "INT", INT_FIELD_SIZE, 0, 0}, {"name", "VARCHAR", MAX_FIELD, 0, 0},
+                         {"score", "FLOAT", FLOAT_FIELD_SIZE, 0, 0}, {"dept", "VARCHAR", MAX_FIELD, 0, 0}};
+    int key_columns[1] = {0};
+    createTable(db, "bench", columns, 4, key_columns, 1, COMPRESSION_NONE, ENGINE_HEAP);
+    Table* table = findTable(db, "bench");
+    setIoMode(db, IO_MMAP);
+    Record* rec = allocRecord(table);
+    for (int i = 1; i <= rows; i++) {
+        memset(rec, 0, table->schema.row_size);
+        rec->id = i;
+        snprintf(recordField(table, rec, 1), columns[1].size, "user%d", i);
+        snprintf(recordField(table, rec, 2), columns[2].size, "%d.5", i % 100);
+        snprintf(recordField(table, rec, 3), columns[3].size, "dept%d", i % 7);
+        insertRecord(table, rec);
+    }
+    free(rec);
+    restoreStdout(saved);
+    
+    printf("rows=%d lookups=%d\n", rows, lookups);
+    printf("io_uring %s\n", aioContext()->ring_fd >= 0 ? "available" : "unavailable (pread fallback)");
+    printf("%-8s %14s %14s %14s\n", "mode", "scan rows/s", "lookups/s", "batched/s");
+    runBench(db, table, IO_SYSCALL, rows, lookups);
+    runBench(db, table, IO_URING, rows, lookups);
+    runBench(db, table, IO_MMAP, rows, lookups);
+    
+    freeDatabase(db);
+    return 0;
+}
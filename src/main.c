@@ -1,7 +1,16 @@
+#if defined(__linux__) && !defined(_GNU_SOURCE)
+    #define _GNU_SOURCE  // mremap
+#endif
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <ctype.h>
+#include <limits.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdarg.h>
+#include <errno.h>
+#include <time.h>
 
 #ifdef _WIN32
     #include <io.h>
@@ -14,46 +23,245 @@
     #define read _read
     #define write _write
     #define lseek _lseek
+    #define ftruncate _chsize
     #define ssize_t int
 #else
     #include <fcntl.h>
     #include <unistd.h>
+    #include <pthread.h>
     #include <sys/file.h>
+    #include <sys/stat.h>
+    #include <sys/mman.h>
+#endif
+#ifdef __linux__
+    #include <sys/syscall.h>
+    #include <linux/io_uring.h>
 #endif
 
 // Constants
 #define MAX_NAME 50
 #define MAX_FIELD 50
-#define MAX_RECORDS 10000
 #define ORDER 4
-#define MAX_QUERY 512
-#define MAX_TABLES 50
-#define MAX_COLUMNS 10
+#define MAX_QUERY 8192
+#define MAX_COLUMNS 256                    // Per table; bounds select lists and result sets
+#define MAX_SELECT_COLUMNS (2 * MAX_COLUMNS)
+#define MAX_VARCHAR 65535
+#define INT_FIELD_SIZE 21                  // Text of any 64-bit integer plus the terminator
+#define FLOAT_FIELD_SIZE 32
+#define LEGACY_COLUMNS 10                  // Row layout of tables created before VARCHAR(n):
+#define LEGACY_ROW_SIZE (4 + LEGACY_COLUMNS * MAX_FIELD)   // 10 fixed 50-byte fields
+#define CATALOG_VERSION 6
+#define CATALOG_MAGIC "SDBCAT01"
+#define TABLE_INDEX_MIN 64                 // Initial size of the table name index (power of two)
+#define ALL_COLUMNS (~0u)
+#define MMAP_CHUNK (1024 * 1024)           // Mappings grow in steps of this many bytes
+#define AIO_QUEUE_DEPTH 64                 // Reads kept in flight by scans and batched lookups
+#define MAX_IN_LIST (MAX_QUERY / 2)
+#define MAX_KEY_COLUMNS 8                  // Columns of a composite primary key
+#define MAX_KEY_BYTES 1024                 // Longest normalized key (see encodeKeyValue)
+#define NODE_SLAB_MIN 64                   // B+-tree nodes in a table's first arena slab
+#define NODE_SLAB_MAX 8192                 // Later slabs double up to this many nodes
+
+// Page compression (CREATE TABLE ... COMPRESSION LZ4)
+#define COMPRESSION_NONE 0
+#define COMPRESSION_LZ4 1
+#define PAGE_TARGET_BYTES (32 * 1024)      // A compressed table's pages hold as many rows as fit in this
+#define PAGE_HEADER 16                     // Stored length, used length, codec
+#define PAGE_ALIGN 4096                    // Pages sit in whole-block slots so their unused tails can be punched out
+#define PAGE_CODEC_RAW 0                   // Stored as is: the page did not compress
+#define PAGE_CODEC_LZ4 1
+#define BUFFER_CACHE_PAGES 1024            // Decompressed pages kept in memory, shared by all tables
+#define WAL_MAGIC 0x4C415750u              // "PWAL": a compressed table's redo log (<table>.wal)
+#define WAL_HEADER 16                      // Magic, reserved, then the LSN of the first record
+#define WAL_RECORD 17                      // CRC of the rest of the record, its kind, offset in the table, length
+#define WAL_WRITE 0                        // Record of bytes written to the table
+#define WAL_PAGE_IMAGE 1                   // Record of a whole page, at the offset of its first row
+#define CHECKPOINT_INTERVAL_MS 1000        // The checkpointer wakes at least this often
+#define CHECKPOINT_LOG_BYTES (16 * 1024 * 1024)         // and as soon as a log grows past this,
+#define CHECKPOINT_DIRTY_PAGES (BUFFER_CACHE_PAGES / 2) // or this many cached pages are dirty
+#define LZ4_HASH_BITS 12
+#define LZ4_MIN_MATCH 4
+#define LZ4_LAST_LITERALS 5                // The block format ends with at least this many literals
+#define LZ4_MATCH_LIMIT 12                 // and starts no match closer than this to the end
+
+// Dictionary encoding of low-cardinality VARCHAR columns
+#define DICT_CODE_SIZE 4                   // Bytes an encoded value takes in the row
+#define DICT_MIN_ROWS 1024                 // COPY FROM looks at tables from this many rows, then each time they double
+#define DICT_MAX_VALUES 1024               // Columns with more distinct values stay plain,
+#define DICT_MIN_REPEATS 8                 // as do columns whose values repeat fewer times on average
+
+// Bloom filters over the primary keys (see keyMayExist)
+#define KEY_FILTER_COUNTERS_PER_KEY 10     // About 1% false positives at capacity
+#define KEY_FILTER_HASHES 7
+#define KEY_FILTER_MIN_KEYS 1024           // Filters are sized for twice the rows, at least this many
+#define KEY_FILTER_MAX_COUNT 15            // 4-bit counters stick here: they can no longer tell how many keys share them
+
+// LSM storage engine (CREATE TABLE ... ENGINE LSM)
+#define ENGINE_HEAP 0                      // Rows in the data file at fixed offsets, indexed by the B+ tree
+#define ENGINE_LSM 1                       // Log and memtable, flushed to sorted runs that are merged in the background
+#define LSM_MEMTABLE_BYTES (4 * 1024 * 1024) // A memtable this large is frozen and flushed to a run
+#define LSM_MAX_HEIGHT 16                  // Skiplist levels; a node reaches each next level with probability 1/4
+#define LSM_BLOCK_BYTES 4096               // Point lookups read a run a block at a time, one fence key per block
+#define LSM_SCAN_BYTES (64 * 1024)         // Scans and merges read runs in chunks of about this size
+#define LSM_BLOOM_BITS_PER_KEY 10
+#define LSM_BLOOM_HASHES 7
+#define LSM_FANOUT 4                       // This many runs of a level are merged into one run of the next
+#define LSM_MERGE_CHECK 4096               // Rows a merge writes between checks for a memtable to flush
+#define LSM_TRAILER 32                     // Footer offset, rows, row size, rows per block, magic
+#define LSM_RUN_MAGIC "SDBRUN01"
+#define LSM_MANIFEST_MAGIC "SDBLSM01"
+#define LSM_LOG_BUFFER (64 * 1024)         // Log appends are buffered up to this many bytes
+#define LSM_LOG_FLUSH_MS 100               // A buffered append reaches the log file within about this long
+
+// I/O modes for table files
+#define IO_SYSCALL 0   // Synchronous pread
+#define IO_URING 1     // pread semantics, but batched and asynchronous through io_uring
+#define IO_MMAP 2      // Zero-copy reads from a shared mapping
+#define JOIN_MEM_LIMIT (8 * 1024 * 1024) // Build-side bytes kept in memory before partitioning
+#define JOIN_PARTITIONS 16
+#define JOIN_KEY_MAX 64
+#define TOPN_MAX_ROWS 1024                 // ORDER BY ... LIMIT n up to this uses a bounded heap
+#define SORT_MEM_LIMIT (4 * 1024 * 1024)   // Bytes of rows sorted in memory before spilling a run
+#define SORT_MERGE_FAN_IN 32
+#define COPY_BATCH_BYTES (16 * 1024 * 1024)  // Input read per round of parser threads
+#define COPY_BATCH_ROWS 65536                // Rows parsed per round, bounding parsed-row memory
+#define COPY_MAX_THREADS 8
+#define COPY_MIN_CHUNK (256 * 1024)          // Less input than this per thread is parsed inline
+
+// Output formats
+#define OUTPUT_TABLE 0     // Human-readable text
+#define OUTPUT_BINARY 1    // Length-prefixed typed frames (see beginResult)
+#define OUTPUT_JSON 2      // One JSON value per line
+#define OUTPUT_CSV 3
+#define OUTPUT_BUFFER_SIZE (64 * 1024)   // Results are formatted here and handed to stdout in chunks
+
+// Operators of a SELECT plan that EXPLAIN ANALYZE charges time and I/O to
+#define PROF_STATEMENT 0   // Parsing and anything outside an operator
+#define PROF_SCAN 1        // Reads of the FROM table; PROF_SCAN + 1 for the joined table
+#define PROF_JOIN 3
+#define PROF_SORT 4
+#define PROF_LIMIT 5
+#define PROF_OUTPUT 6
+#define PROF_OPS 7
+
+// EXPLAIN modes
+#define EXPLAIN_NONE 0
+#define EXPLAIN_PLAN 1     // Describe the plan without running it
+#define EXPLAIN_ANALYZE 2  // Run the statement, discard its rows and report the counters
+
+// Engine counters (see metricsAdd); SHOW STATS and SHOW METRICS report them
+#define METRIC_ROWS_READ 0
+#define METRIC_ROWS_WRITTEN 1
+#define METRIC_BYTES_READ 2
+#define METRIC_SYSCALLS 3
+#define METRIC_CACHE_HITS 4        // Rows used in place from the mapping or the buffer cache
+#define METRIC_CACHE_MISSES 5      // Row and page reads that went to the file
+#define METRIC_LOCKS 6
+#define METRIC_LOCK_WAIT_NANOS 7
+#define METRIC_ERRORS 8
+#define METRIC_RESULT_HITS 9       // Statements answered from the result cache
+#define METRIC_RESULT_MISSES 10
+#define METRIC_FILTER_SKIPS 11     // Key lookups the Bloom filter answered without the index
+#define METRIC_COUNTERS 12
+
+// Statement types counted and timed separately
+#define STMT_SELECT 0
+#define STMT_INSERT 1
+#define STMT_UPDATE 2
+#define STMT_DELETE 3
+#define STMT_CREATE 4
+#define STMT_DROP 5
+#define STMT_ALTER 6
+#define STMT_COPY 7
+#define STMT_SHOW 8
+#define STMT_DESCRIBE 9
+#define STMT_SET 10
+#define STMT_EXPLAIN 11
+#define STMT_OTHER 12
+#define STMT_TYPES 13
+
+// Latency histograms: LATENCY_SUB_BUCKETS linear buckets per power of two of
+// nanoseconds, so a recorded latency is known to within 12.5%
+#define LATENCY_SUB_BITS 3
+#define LATENCY_SUB_BUCKETS (1 << LATENCY_SUB_BITS)
+#define LATENCY_BUCKETS ((64 - LATENCY_SUB_BITS + 1) * LATENCY_SUB_BUCKETS)
+#define METRICS_MAGIC "SDBSTA01"
+
+// Slow query log
+#define SLOWLOG_ENTRIES 128        // Ring slots; entries that find it full are dropped and counted
+#define SLOWLOG_TEXT 1024          // Statement text kept per entry; longer statements are cut
+#define SLOWLOG_PLAN 1024
+#define SLOWLOG_FLUSH_MS 200       // The writer thread wakes at least this often
+
+// Result cache (SET CACHE)
+#define RESULT_CACHE_BUCKETS 1024
+#define RESULT_CACHE_TABLES 2      // Tables a cached SELECT can depend on (FROM and JOIN)
+
+// Value types in result sets
+#define VALUE_NULL 0
+#define VALUE_INT 1
+#define VALUE_FLOAT 2
+#define VALUE_TEXT 3
 
 // Column definition
 typedef struct Column {
     char name[MAX_FIELD];
-    char type[20]; // INT, FLOAT, VARCHAR
-    int size;
+    char type[20]; // INT, BIGINT, FLOAT, VARCHAR
+    int size;      // Bytes of the stored value including its terminator
+    int offset;    // Position of the value in Record.data; a key kept in the id has no field
+    int encoded;   // Stored as a DICT_CODE_SIZE dictionary code rather than as text
 } Column;
 
 // Table schema
 typedef struct TableSchema {
     char name[MAX_FIELD];
-    Column columns[MAX_COLUMNS];
+    Column* columns;
     int num_columns;
-    int primary_key_index;
+    int primary_key_index;                // First key column
+    int key_columns[MAX_KEY_COLUMNS];     // Primary key columns in key order
+    int num_key_columns;
+    int key_in_id;  // Single INT key stored as Record.id; other keys live in fields
+    int row_size;   // Bytes per stored row, computed from the columns
+    int compression;  // COMPRESSION_NONE or COMPRESSION_LZ4
+    int engine;       // ENGINE_HEAP or ENGINE_LSM
 } TableSchema;
 
-// Generic record (flexible storage)
+// Schema layout of the schemas.dat files written before the catalog
+typedef struct LegacyColumn {
+    char name[MAX_FIELD];
+    char type[20];
+    int size;
+} LegacyColumn;
+
+typedef struct LegacyTableSchema {
+    char name[MAX_FIELD];
+    LegacyColumn columns[LEGACY_COLUMNS];
+    int num_columns;
+    int primary_key_index;
+} LegacyTableSchema;
+
+// Stored row: the id followed by the column values at the offsets of the
+// table's layout; always handled through a buffer of schema.row_size bytes.
+// Tables whose key lives in fields (BIGINT, text or composite keys) set id to 1
+// for a live row; 0 marks a deleted row in every table.
 typedef struct Record {
     int id;
-    char data[MAX_COLUMNS][MAX_FIELD];
+    char data[];
 } Record;
 
-// B+-tree node
+// Primary key in normalized form (see encodeKeyValue): a byte string that sorts
+// with memcmp in key order. The first 8 bytes are held big-endian in head, so
+// integer keys and most comparisons never leave the node; the rest is in tail.
+typedef struct IndexKey {
+    uint64_t head;
+    unsigned char* tail;   // len - 8 bytes, NULL when len <= 8
+    uint32_t len;
+} IndexKey;
+
+// B+-tree node. Leaves own their keys' tails; internal nodes hold the shortest
+// prefixes that still separate their children.
 typedef struct BPTNode {
-    int keys[ORDER];
+    IndexKey keys[ORDER];
     struct BPTNode* children[ORDER + 1];
     long offsets[ORDER];
     int num_keys;
@@ -61,70 +269,1498 @@ typedef struct BPTNode {
     struct BPTNode* next;
 } BPTNode;
 
+// Block of B+-tree nodes handed out in allocation order
+typedef struct NodeSlab {
+    struct NodeSlab* next;
+    int capacity;
+    int used;
+    BPTNode nodes[];
+} NodeSlab;
+
+// Per-table node allocator. The tree never frees a single node (deletes leave
+// emptied leaves in place), so nodes are carved from slabs front to back and
+// given back all at once when the tree is rebuilt or dropped.
+typedef struct NodeArena {
+    NodeSlab* first;
+    NodeSlab* current;
+} NodeArena;
+
+// Planner statistics, kept current in memory and stored in the catalog
+typedef struct TableStats {
+    long dead_rows;      // Deleted slots still in the data file
+    uint64_t min_head;   // Bounds of the live keys' heads (the whole key for
+    uint64_t max_head;   // integers); deletes leave them conservative
+} TableStats;
+
+// Values of a dictionary encoded column. Code 0 is the empty value; the others
+// number the values in the order they were added, which is also their order in
+// the table's .dict file.
+typedef struct ColumnDict {
+    char** values;       // By code; values[0] is unused
+    uint32_t count;      // Codes in use, including 0
+    uint32_t capacity;
+    uint32_t* slots;     // Open-addressing hash of the values to their codes, 0 = empty, at most half full
+    uint32_t num_slots;
+} ColumnDict;
+
+// Memtable entry: the newest version of a row, with id 0 for a delete
+typedef struct MemNode {
+    IndexKey key;            // Its tail is stored after the row
+    Record* row;
+    int height;
+    struct MemNode* next[];
+} MemNode;
+
+// Skiplist of the rows written since the last flush, in key order
+typedef struct Memtable {
+    MemNode* head;           // Sentinel with LSM_MAX_HEIGHT links
+    int height;
+    long entries;
+    size_t bytes;
+} Memtable;
+
+// Immutable sorted run: rows in key order, deletes included, then the first key
+// of every block (fence pointers) and a Bloom filter over all the keys
+typedef struct LsmRun {
+    uint64_t seq;            // Its file is <table>.run.<seq>
+    int level;               // 0 for a flushed memtable, one more for each merge
+    int fd;
+    long rows;
+    long rows_per_block;
+    long num_blocks;
+    IndexKey* fences;        // First key of each block, owning their tails
+    unsigned char* bloom;
+    uint64_t bloom_bits;     // A power of two
+    long file_bytes;
+} LsmRun;
+
+// Storage of an ENGINE LSM table. Writes go to the log and the active memtable.
+// A full memtable is frozen, and the worker writes it out as a level-0 run,
+// then merges the runs of a level once LSM_FANOUT of them have piled up.
+typedef struct LsmTree {
+    char base[256];          // <db_dir>/<table>, the prefix of its file names
+    Memtable* active;        // Logged in <table>.log
+    Memtable* frozen;        // Being flushed, NULL if none; logged in <table>.log.frozen
+    int log_fd;
+    char* log_buf;           // Rows logged but not yet written to <table>.log, while the worker runs
+    size_t log_len;
+    uint64_t log_since;      // profileClock() when the first of them was buffered
+    LsmRun** runs;           // Oldest first; only the worker changes the list
+    int num_runs;
+    uint64_t next_seq;
+    uint32_t random;         // Skiplist heights
+    uint64_t flushes;
+    uint64_t merges;
+#ifndef _WIN32
+    pthread_rwlock_t lock;   // Shared while frozen and runs are read; the worker swaps them exclusively
+    pthread_mutex_t work_lock;
+    pthread_cond_t wake;     // A memtable was frozen, or the worker is to stop
+    pthread_cond_t flushed;  // The frozen memtable is gone, for writers waiting to freeze another
+    pthread_mutex_t log_lock; // Guards log_buf, and log_fd while a freeze swaps the log files
+    pthread_t worker;
+    int running;
+    int stop;
+#endif
+} LsmTree;
+
+// Counting Bloom filter over a table's primary keys. Counters are 4 bits, two
+// to a byte, so deletes can take keys back out.
+typedef struct KeyFilter {
+    unsigned char* counters;  // NULL until the table's rows are loaded
+    uint64_t num_counters;    // A power of two
+    long capacity;            // Keys it was sized for; it is rebuilt larger past this
+} KeyFilter;
+
 // Table structure
 typedef struct Table {
     TableSchema schema;
     BPTNode* root;
+    NodeArena nodes;
+    KeyFilter filter;
     int record_count;
+    TableStats stats;
     int fd;
+    long file_size;
+    char* map;         // Read-only mapping of the data file in mmap I/O mode
+    size_t map_len;
+    int map_advice;
+#ifndef _WIN32
+    pthread_rwlock_t map_lock;  // Shared while views into map are pinned; remaps take it exclusively
+#endif
+    int use_uring;     // Batch reads through io_uring when the kernel supports it
+    uint64_t version;  // Bumped by every write, so cached results can tell they are stale
+    long page_bytes;   // Compressed tables: rows per page times the row size; 0 = rows stored as is
+    long slot_bytes;   // Room each page has in the file, in whole blocks
+    ColumnDict* dicts; // MAX_COLUMNS dictionaries, allocated once a column is encoded
+    int dict_fd;       // The .dict file the dictionaries are appended to, -1 = none yet
+    long dict_checked; // Row count at the last look for columns to encode
+#ifndef _WIN32
+    pthread_mutex_t dict_lock;  // COPY FROM encodes values from several threads
+#endif
+    LsmTree* lsm;      // ENGINE LSM tables; NULL for heap tables
+    struct PageLog* wal;  // Compressed tables: redo log of writes not yet checkpointed; NULL writes pages through
 } Table;
 
+// Redo log of a compressed table. A write changes the cached pages and appends
+// the bytes it wrote to <table>.wal; the checkpointer writes the dirty pages
+// back later. The first change to a page in each log file logs the whole page
+// instead, since a checkpoint rewrites pages in place and a crash part way
+// through can leave one that cannot be read. Each checkpoint starts a new log,
+// whose header holds the checkpoint LSN, and deletes the old one
+// (<table>.wal.old) once the pages are synced.
+typedef struct PageLog {
+    Table* table;
+    char path[272];
+    int fd;
+    uint64_t lsn;              // LSN of the next record: bytes logged since the table was created
+    uint64_t start_lsn;        // LSN of the first record in the current file
+    uint64_t checkpoint_lsn;   // Every record before it is in the data file
+    long bytes;                // Size of the current file
+    int old_pending;           // A failed checkpoint left <table>.wal.old behind
+    uint64_t checkpoints;
+    unsigned char* buf;        // Record being appended
+    size_t buf_cap;
+    struct PageLog* next;
+} PageLog;
+
+// A decompressed page of a compressed table in the buffer cache
+typedef struct CachedPage {
+    Table* table;
+    long page;
+    char* data;
+    long used;                  // Bytes of rows on the page; only the last page is partly filled
+    long cap;
+    int dirty;                  // Changed since it was last written to the data file
+    int writing;                // Being written back by a checkpoint, so it cannot be evicted
+    int loading;                // Being read in by fetchPage, outside the buffer cache lock
+    uint64_t imaged;            // One past the start LSN of the log file the whole page was last logged to
+    struct CachedPage* prev;    // LRU list, most recently used first
+    struct CachedPage* next;
+    struct CachedPage* chain;
+} CachedPage;
+
+typedef struct BufferCache {
+    CachedPage** buckets;
+    CachedPage* head;
+    CachedPage* tail;
+    int count;                  // Grows past BUFFER_CACHE_PAGES only while every page is dirty
+    int dirty;
+    unsigned char* scratch;     // Compressed image of the page being written
+    size_t scratch_cap;
+} BufferCache;
+
+// Background thread writing back the dirty pages of compressed tables. Only
+// one checkpoint runs at a time (checkpoint_lock); closing a table waits for it.
+typedef struct Checkpointer {
+    PageLog* logs;              // Every open compressed table
+    char* page;                 // Copy of the page being written
+    unsigned char* image;       // and its compressed image
+    size_t cap;
+#ifndef _WIN32
+    pthread_mutex_t wake_lock;
+    pthread_cond_t wake;
+    pthread_t thread;
+    int running;
+    int requested;
+    int stop;
+#endif
+} Checkpointer;
+
+// Output of a statement kept by the result cache, with the versions it was computed at
+typedef struct CachedResult {
+    char* key;                 // Output format, then the normalized statement text
+    unsigned long hash;
+    uint64_t schema_version;
+    Table* tables[RESULT_CACHE_TABLES];
+    int num_tables;            // -1 = depends on every table (SHOW TABLES)
+    uint64_t data_version;     // Sum of the tables' versions, which only ever grow
+    char* data;                // Bytes the statement wrote to stdout
+    size_t len;
+    struct CachedResult* prev; // LRU list, most recently used first
+    struct CachedResult* next;
+    struct CachedResult* chain;
+} CachedResult;
+
+typedef struct ResultCache {
+    CachedResult** buckets;
+    CachedResult* head;
+    CachedResult* tail;
+    size_t bytes;
+    size_t capacity;           // 0 = disabled
+} ResultCache;
+
 // Database structure
 typedef struct Database {
-    Table tables[MAX_TABLES];
+    Table** tables;    // Heap-allocated so Table pointers stay valid as the catalog grows
     int num_tables;
+    int table_capacity;
     char* db_dir;
+    int io_mode;       // IO_SYSCALL, IO_URING or IO_MMAP
+    int* table_index;  // Hash of the case-folded name -> table slot + 1, at most half full
+    int index_size;
+    uint64_t schema_version;  // Bumped when a table is created, dropped or altered
+    ResultCache results;
+    TableSchema* unopened;    // Catalog entries of tables that could not be opened, saved back as they are
+    int num_unopened;
 } Database;
 
+// Bounds-checked cursor over a catalog image; ok drops to 0 on a short read
+typedef struct CatalogReader {
+    const unsigned char* p;
+    const unsigned char* end;
+    int ok;
+} CatalogReader;
+
+// Column reference inside a SELECT (side 0 = FROM table, side 1 = JOIN table)
+typedef struct ColumnRef {
+    int side;
+    int col;
+} ColumnRef;
+
+// Parsed SELECT statement
+typedef struct SelectQuery {
+    Table* tables[2];
+    int num_tables;
+    ColumnRef join_on[2];
+    ColumnRef columns[MAX_SELECT_COLUMNS];
+    int num_columns;       // 0 = SELECT *
+    unsigned needed[2];    // Bitmask of the columns each side has to read
+    int key_bounded;       // WHERE on the key: only keys from key_lo to key_hi,
+    IndexKey key_lo;       // where key_hi also admits the keys it is a prefix of
+    IndexKey key_hi;
+    unsigned char key_bytes[2 * MAX_KEY_BYTES];   // Encodings key_lo and key_hi point into
+    IndexKey* in_keys;     // WHERE key IN (...), sorted and deduplicated, owning their tails
+    int num_in_keys;       // -1 = no IN list
+    int filter_col;        // WHERE col = value on a FROM table column outside the key, -1 = none
+    char* filter_value;
+    double filter_num;     // The value of a numeric column
+    long filter_code;      // The value's code when the column is encoded, -1 = not in the dictionary
+    int has_order;
+    ColumnRef order_by;
+    int order_desc;
+    long limit;    // -1 = no LIMIT
+    ColumnRef output[MAX_SELECT_COLUMNS];   // Result columns, SELECT * expanded
+    int num_output;
+} SelectQuery;
+
+// Row callbacks used by scans and joins; returning 0 stops the producer
+typedef int (*ScanCallback)(void* ctx, Record* rec);
+typedef int (*RowCallback)(void* ctx, Record** rows);
+
+// Downstream consumer of rows, optionally cut off after limit rows
+typedef struct RowSink {
+    RowCallback cb;
+    void* ctx;
+    long limit;
+    long emitted;
+} RowSink;
+
+// A row callback run as its own operator of an analyzed plan (see profileEnter)
+typedef struct ProfiledCallback {
+    ScanCallback scan;
+    RowCallback row;
+    void* ctx;
+    int op;
+} ProfiledCallback;
+
+// ORDER BY key description shared by all sort items
+typedef struct SortKey {
+    ColumnRef col;
+    int numeric;
+    int desc;
+} SortKey;
+
+// Row buffered by ORDER BY: its precomputed key plus copies of the records
+typedef struct SortItem {
+    const SortKey* key;
+    double num;
+    const char* str;   // Points into the rows the key was computed from
+    int is_null;
+    long seq;
+    char* recs;        // The query's rows back to back, see SortState.row_offset
+} SortItem;
+
+// State of a top-N heap or external merge sort
+typedef struct SortState {
+    SelectQuery* q;
+    SortKey key;
+    RowSink out;
+    SortItem* items;
+    long count;
+    long capacity;
+    long seq;
+    FILE** runs;
+    int num_runs;
+    int failed;
+    size_t row_offset[2];  // Position of each table's row in SortItem.recs
+    size_t row_bytes;
+} SortState;
+
+// Build-side entry of a hash join; the row and then the key follow the struct
+typedef struct JoinEntry {
+    unsigned long hash;
+    const char* key;
+    struct JoinEntry* next;
+    char row[];
+} JoinEntry;
+
+// Join execution state shared by the scan callbacks
+typedef struct JoinState {
+    SelectQuery* q;
+    RowCallback cb;
+    void* ctx;
+    int outer;     // Side driving the scan (nested loop) or probing (hash join)
+    JoinEntry** buckets;
+    size_t num_buckets;
+    FILE* parts[JOIN_PARTITIONS];
+    int matches;
+    int stopped;
+    int failed;          // A build or spill step failed: the join stopped with its result incomplete
+    Record* inner_row;   // Lookup buffer of the index join
+} JoinState;
+
+// One positional read of an async batch
+typedef struct AioRequest {
+    int fd;
+    long offset;
+    void* buf;
+    size_t len;
+    ssize_t result;
+    int done;
+} AioRequest;
+
+// Async read context: an io_uring on Linux, ring_fd = -1 falls back to pread
+typedef struct AioContext {
+    int initialized;
+    int ring_fd;
+    unsigned entries;
+    unsigned inflight;
+#ifdef __linux__
+    void* sq_ring;
+    void* cq_ring;
+    size_t sq_ring_size;
+    size_t cq_ring_size;
+    size_t sqes_size;
+    unsigned* sq_tail;
+    unsigned* sq_mask;
+    unsigned* sq_array;
+    unsigned* cq_head;
+    unsigned* cq_tail;
+    unsigned* cq_mask;
+    struct io_uring_sqe* sqes;
+    struct io_uring_cqe* cqes;
+#endif
+} AioContext;
+
+// Rows read by one async batch
+typedef struct ScanBatch {
+    AioRequest reqs[AIO_QUEUE_DEPTH];
+    char* rows;    // AIO_QUEUE_DEPTH rows of the table's row size
+    int n;
+} ScanBatch;
+
+// Slice of a COPY FROM batch parsed by one thread
+typedef struct CopyChunk {
+    Table* table;
+    const char* start;
+    const char* end;
+    char* rows;            // count parsed rows of the table's row size
+    long* row_lines;       // Line of each parsed row within the chunk, from 1
+    long count;
+    long capacity;
+    char* field;           // Value being parsed, field_cap bytes
+    size_t field_cap;
+    long lines;            // Newlines consumed, for error positions
+    long error_line;       // Line of the first bad row within the chunk, 0 = none
+    char error[MAX_QUERY];
+} CopyChunk;
+
+// Distinct values of the columns considered for dictionary encoding
+typedef struct DistinctScan {
+    Table* table;
+    ColumnDict* seen;              // Per column
+    int candidate[MAX_COLUMNS];    // Still under the limits
+} DistinctScan;
+
+// Layout a table is rewritten from while columns become dictionary encoded
+typedef struct RowEncoding {
+    Table* table;
+    const Column* old_columns;
+} RowEncoding;
+
+// Scan of the FROM table passing on only the rows that satisfy the WHERE filter
+typedef struct FilterScan {
+    SelectQuery* q;
+    ScanCallback cb;
+    void* ctx;
+} FilterScan;
+
+// Row conversion applied while a table is rewritten; 0 fails the rewrite
+typedef int (*RowConverter)(void* ctx, const Record* from, Record* to);
+
+// Index entry handed to the bulk B+ tree build
+typedef struct KeyOffset {
+    IndexKey key;
+    long offset;
+} KeyOffset;
+
+// Run of an LSM table being written: rows in key order, then the footer
+typedef struct RunWriter {
+    FILE* out;
+    uint64_t seq;
+    char path[272];
+    char tmp[280];           // Written here and renamed to path once complete
+    int row_size;
+    long rows;
+    long rows_per_block;
+    IndexKey* fences;        // First key of each block
+    long num_fences;
+    long fence_capacity;
+    unsigned char* bloom;
+    uint64_t bloom_bits;
+    int ok;
+} RunWriter;
+
+// Position in a memtable or a run during an LSM scan or merge
+typedef struct LsmCursor {
+    Table* table;
+    MemNode* node;           // Memtable cursors
+    LsmRun* run;             // Run cursors, with a chunk of the run buffered
+    char* buf;
+    long chunk_rows;
+    long buf_first;
+    long buf_rows;
+    long pos;
+    int failed;              // A read of the run failed
+    Record* row;             // NULL once past the end
+    IndexKey key;
+    unsigned char key_buf[MAX_KEY_BYTES];
+} LsmCursor;
+
+// Rewrite of an LSM table into a single run
+typedef struct LsmRewrite {
+    Table* table;
+    RowConverter convert;
+    void* ctx;
+    char* row;
+    RunWriter w;
+} LsmRewrite;
+
+// Column of a result set
+typedef struct ResultColumn {
+    char name[2 * MAX_FIELD + 1];   // Qualified as table.column in joins
+    int type;                       // VALUE_INT, VALUE_FLOAT or VALUE_TEXT
+    int is_key;                     // Labelled "ID" in table output
+} ResultColumn;
+
+// Result writer shared by every statement; rows are streamed as they are produced
+// Copy of everything a statement writes, taken for the result cache
+typedef struct OutputCapture {
+    char* data;
+    size_t len;
+    size_t cap;
+    size_t limit;      // Results larger than this are not kept
+    int failed;        // Over the limit, out of memory, an error or output on stderr
+} OutputCapture;
+
+typedef struct OutputWriter {
+    int format;
+    char* buf;
+    size_t len;
+    size_t cap;
+    size_t frame;                   // Start of the frame being written
+    ResultColumn columns[MAX_SELECT_COLUMNS];
+    int num_columns;
+    int column;                     // Column of the next value in the current row
+    long rows;
+    FILE* out;
+    int discard;                    // Format rows but drop them (EXPLAIN ANALYZE)
+    OutputCapture* capture;         // Set while the result cache copies a statement's output
+} OutputWriter;
+
+// Work done by one operator of a statement run under EXPLAIN ANALYZE
+typedef struct OpProfile {
+    long rows;             // Rows the operator produced
+    uint64_t nanos;        // Time spent in the operator itself
+    uint64_t bytes;        // Bytes read from table files
+    long syscalls;         // pread and io_uring_enter calls
+    long cache_hits;       // Rows used in place from the mapping, without a syscall
+    long nodes;            // B+-tree nodes visited
+    long locks;            // File locks taken
+    uint64_t lock_nanos;   // Time spent acquiring them
+} OpProfile;
+
+// Counters of the statement being analyzed. Whatever runs is charged to the
+// current operator; row callbacks switch operators as rows move up the plan.
+typedef struct QueryProfile {
+    OpProfile ops[PROF_OPS];
+    int current;
+    uint64_t mark;         // When the current operator was last switched to
+    uint64_t start;
+    uint64_t exec_start;   // End of parsing; 0 if the statement never got there
+    int explained;         // The SELECT printed its plan with the counters
+} QueryProfile;
+
+// Counters and latency histograms of one thread. Only the owning thread
+// writes them; readers sum every thread's copy.
+typedef struct Metrics {
+    uint64_t counters[METRIC_COUNTERS];
+    uint64_t queries[STMT_TYPES];
+    uint64_t latency_nanos[STMT_TYPES];
+    uint64_t latency[STMT_TYPES][LATENCY_BUCKETS];
+} Metrics;
+
+// A logged statement: its text, plan (SELECT only) and what it cost
+typedef struct SlowQuery {
+    uint64_t seq;            // Ring ticket this slot is free for, or ticket + 1 once written
+    time_t when;
+    int type;                // STMT_*
+    int sampled;             // Logged by sampling rather than for being slow
+    uint64_t total_nanos;
+    uint64_t parse_nanos;
+    uint64_t counters[METRIC_COUNTERS];   // Deltas of this thread's counters during the statement
+    char text[SLOWLOG_TEXT];
+    char plan[SLOWLOG_PLAN];
+} SlowQuery;
+
+// Bounded multi-producer ring drained by one writer thread. Producers claim a
+// ticket with a compare-and-swap and never wait: when the ring is full the
+// entry is dropped.
+typedef struct SlowLog {
+    SlowQuery* ring;
+    uint64_t head;                // Next ticket to claim
+    uint64_t tail;                // Next ticket the writer reads
+    uint64_t dropped;
+    uint64_t reported_dropped;
+    int enabled;
+    uint64_t threshold_nanos;
+    double sample;                // Share of faster statements logged anyway
+    char path[256];
+    FILE* out;
+#ifndef _WIN32
+    pthread_t writer;
+    int running;
+    int stop;
+    pthread_mutex_t lock;
+    pthread_cond_t wake;
+#endif
+} SlowLog;
+
+// Registry entry; slots are never unlinked, and a thread that exits leaves
+// its counters for the next thread to continue
+typedef struct MetricsSlot {
+    Metrics m;
+    int in_use;
+    struct MetricsSlot* next;
+} MetricsSlot;
+
+// Scan state of COPY TO
+typedef struct CopyExport {
+    Table* table;
+    OutputWriter writer;
+    long rows;
+} CopyExport;
+
 // Function prototypes
 Database* createDatabase(const char* db_dir);
-void createTable(Database* db, const char* table_name, Column* columns, int num_columns, int pk_index);
+void createTable(Database* db, const char* table_name, Column* columns, int num_columns,
+                 const int* key_columns, int num_key_columns, int compression, int engine);
 Table* findTable(Database* db, const char* table_name);
 void listTables(Database* db);
 void describeTable(Database* db, const char* table_name);
-void insertRecord(Database* db, const char* table_name, Record* rec);
-void updateRecord(Database* db, const char* table_name, int id, Record* rec);
-void deleteRecord(Database* db, const char* table_name, int id);
-Record* findRecord(Table* table, int id);
-void selectRecords(Table* table, int min_id, int max_id);
+void insertRecord(Table* table, Record* rec);
+void updateRecord(Table* table, const IndexKey* key, Record* rec);
+void deleteRecord(Table* table, const IndexKey* key);
+long findRecordOffset(Table* table, const IndexKey* key);
+const Record* findRecord(Table* table, const IndexKey* key, Record* buf);
+void releaseRecord(Table* table, const Record* rec, Record* buf);
+void selectRecords(Table* table, long long min_id, long long max_id);
 void selectAllRecords(Table* table);
-BPTNode* createBPTNode(int is_leaf);
-void insertIntoBPTree(Table* table, int key, long offset);
-void insertIntoBPTreeRecursive(BPTNode* node, int key, long offset);
-BPTNode* findLeaf(BPTNode* node, int key);
-void splitChild(BPTNode* parent, int index);
-void displayRecord(Table* table, Record* rec);
-void freeBPTree(BPTNode* node);
+BPTNode* createBPTNode(NodeArena* arena, int is_leaf);
+void resetNodeArena(NodeArena* arena);
+void freeNodeArena(NodeArena* arena);
+int insertIntoBPTree(Table* table, const IndexKey* key, long offset);
+void removeFromBPTree(Table* table, const IndexKey* key);
+int insertIntoBPTreeRecursive(NodeArena* arena, BPTNode* node, const IndexKey* key, long offset);
+BPTNode* findLeaf(BPTNode* node, const IndexKey* key);
+void splitChild(NodeArena* arena, BPTNode* parent, int index);
+int keysHaveTails(const TableSchema* schema);
+void clearBPTree(Table* table, int leaf_keys);
+void freeBPTree(Table* table);
+void freeBPTreeKeys(BPTNode* node, int leaf_keys);
+IndexKey makeKey(const unsigned char* bytes, uint32_t len);
+IndexKey intKey(long long v);
+long long keyInt(const IndexKey* key);
+IndexKey copyKey(const IndexKey* key, uint32_t len);
+void freeKey(IndexKey* key);
+unsigned keyByte(const IndexKey* key, uint32_t i);
+int compareKeys(const IndexKey* a, const IndexKey* b);
+int compareKeyPrefix(const IndexKey* key, const IndexKey* bound);
+int compareIndexKeys(const void* a, const void* b);
+IndexKey separatorKey(const IndexKey* left, const IndexKey* right);
+int isKeyColumn(const TableSchema* schema, int col);
+int isIdColumn(const TableSchema* schema, int col);
+int keyColumnIndex(Table* table, const char* name);
+int encodeKeyValue(Table* table, int col, const char* text, size_t len, unsigned char* out);
+int recordKey(Table* table, Record* rec, unsigned char* buf, IndexKey* key);
+void formatKey(Table* table, const IndexKey* key, char* out, size_t cap);
+void noteKeyStats(Table* table, const IndexKey* key);
+uint64_t hashIndexKey(const IndexKey* key);
+void updateKeyFilter(KeyFilter* filter, const IndexKey* key, int delta);
+int rebuildKeyFilter(Table* table);
+void addKeyFilter(Table* table, const IndexKey* key);
+void removeKeyFilter(Table* table, const IndexKey* key);
+int keyMayExist(Table* table, const IndexKey* key);
+void freeKeyFilter(Table* table);
+int startsWithKeyword(const char* s, const char* kw);
+int parseKeyRef(Table* table, char** pos);
+int parseKeyValue(Table* table, int num_columns, char** pos, unsigned char* buf, IndexKey* key);
+int parseKeyEquals(Table* table, char* text, unsigned char* buf, IndexKey* key);
+char* parseKeyCondition(SelectQuery* q, char* text, int* point);
+int keyInQuery(SelectQuery* q, const IndexKey* key);
+void freeSelectQuery(SelectQuery* q);
 void freeDatabase(Database* db);
 char* trim(char* str);
 void processQuery(Database* db, char* query);
 long getNextOffset(int fd);
 char* stristr(const char* haystack, const char* needle);
-void saveTableSchema(Database* db, Table* table);
-void loadTableSchemas(Database* db);
+int saveCatalog(Database* db);
+unsigned char* catalogPutTable(unsigned char* p, const TableSchema* schema, const Table* table);
+void keepUnopenedTable(Database* db, const TableSchema* schema);
+int isUnopenedTable(Database* db, const char* table_name);
+int loadCatalog(Database* db);
+void loadLegacySchemas(Database* db, const char* path);
+Table* attachTable(Database* db, const TableSchema* schema);
+void dropTable(Database* db, const char* table_name);
+void freeTable(Table* table);
+void addColumn(Database* db, Table* table, const Column* column);
+unsigned long hashTableName(const char* name);
+void indexTable(Database* db, int slot);
+int rebuildTableIndex(Database* db, int size);
+int columnSize(const char* type);
+int parseColumnType(const char* text, Column* column);
+const char* columnTypeName(const Column* column, char* buf);
+void legacyLayout(TableSchema* schema);
+void layoutSchema(TableSchema* schema);
+int rewriteTable(Database* db, Table* table, int row_size, RowConverter convert, void* ctx);
+int storedSize(const Column* column);
+Record* allocRecord(Table* table);
+char* recordField(Table* table, Record* rec, int col);
+unsigned columnBit(int col);
+int storeField(Table* table, Record* rec, int col, const char* text, size_t len);
+uint32_t computeCrc32(const void* data, size_t len);
+unsigned char* catalogPut(unsigned char* p, uint64_t v, int bytes);
+unsigned char* catalogPutString(unsigned char* p, const char* s);
+uint64_t catalogGet(CatalogReader* r, int bytes);
+void catalogGetString(CatalogReader* r, char* out, size_t cap);
 void loadRecords(Table* table);
+int readRecordAt(Table* table, long offset, Record* rec);
+const Record* viewRecord(Table* table, long offset, Record* buf, unsigned columns);
+void openTableFile(Database* db, Table* table);
+int mapTable(Table* table);
+void pinTableMap(Table* table);
+void unpinTableMap(Table* table);
+void unmapTable(Table* table);
+void adviseTable(Table* table, int sequential);
+void noteTableGrowth(Table* table, long size);
+void setIoMode(Database* db, int mode);
+AioContext* aioContext(void);
+void aioShutdown(void);
+ssize_t preadFull(int fd, void* buf, size_t len, long offset);
+void aioReap(AioContext* aio, int block);
+void aioSubmit(AioContext* aio, int fd, AioRequest* reqs, int n, int async);
+void aioWait(AioContext* aio, AioRequest* reqs, int n);
+size_t recordReadSize(Table* table, unsigned columns);
+void fillScanBatch(Table* table, ScanBatch* batch, BPTNode** leaf, int* pos, const IndexKey* hi,
+                   size_t len);
+int scanTableAsync(Table* table, BPTNode* leaf, const IndexKey* lo, const IndexKey* hi,
+                   unsigned columns, ScanCallback cb, void* ctx);
+int scanPagedTable(Table* table, BPTNode* leaf, const IndexKey* lo, const IndexKey* hi,
+                   unsigned columns, ScanCallback cb, void* ctx);
+int lookupRecords(Table* table, const IndexKey* keys, int n, unsigned columns, ScanCallback cb,
+                  void* ctx);
+int readRecordColumns(Table* table, long offset, Record* rec, unsigned columns);
+int scanTable(Table* table, const IndexKey* lo, const IndexKey* hi, unsigned columns,
+              ScanCallback cb, void* ctx);
+const char* fieldValue(Table* table, Record* rec, int col, char* buf);
+int resolveColumn(SelectQuery* q, const char* name, ColumnRef* ref);
+int isPrimaryKeyRef(SelectQuery* q, const char* name);
+char* findKeyword(char* s, const char* kw);
+const char* joinKey(Table* table, Record* rec, int col, char* buf);
+int executeJoin(SelectQuery* q, RowCallback cb, void* ctx);
+void initSelectQuery(SelectQuery* q, Table* table);
+int scanRowAdapter(void* ctx, Record* rec);
+void produceRows(SelectQuery* q, RowCallback cb, void* ctx);
+int limitRowCallback(void* ctx, Record** rows);
+void computeSortKey(SortState* st, SortItem* item, Record** rows);
+int compareSortItems(const void* a, const void* b);
+int copySortRows(SortState* st, SortItem* item, Record** rows);
+void sortItemRows(SortState* st, SortItem* item, Record** rows);
+int emitSortItem(SortState* st, SortItem* item);
+void siftDownSortHeap(SortItem* heap, long n, long i);
+int topNRowCallback(void* ctx, Record** rows);
+int spillSortRun(SortState* st);
+int sortRowCallback(void* ctx, Record** rows);
+int readSortRun(SortState* st, FILE* run, SortItem* item);
+int mergeSortRuns(SortState* st, FILE** runs, int n, FILE* out);
+void finishExternalSort(SortState* st);
+long sortRows(SelectQuery* q, RowCallback cb, void* ctx);
+long runSelect(SelectQuery* q, RowCallback cb, void* ctx);
+int displaySelectRow(void* ctx, Record** rows);
+void planColumns(SelectQuery* q);
+int resolveSelectColumn(SelectQuery* q, const char* name, ColumnRef* ref);
+void executeSelect(SelectQuery* q);
+unsigned long hashJoinKey(const char* key);
+int emitJoinedRow(JoinState* js, Record* outer_rec, Record* inner_rec);
+void scanJoinSide(JoinState* js, int side, ScanCallback cb);
+int indexJoinProbe(void* ctx, Record* rec);
+int hashJoinBuild(void* ctx, Record* rec);
+int hashJoinProbe(void* ctx, Record* rec);
+int hashJoinPartition(void* ctx, Record* rec);
+int allocJoinBuckets(JoinState* js, long rows);
+void freeJoinBuckets(JoinState* js);
+void graceHashJoin(JoinState* js, int build, int probe);
+OutputWriter* outputWriter(void);
+void setOutputFormat(int format);
+void outputFlush(void);
+void flushWriter(OutputWriter* w);
+void outputReserve(OutputWriter* w, size_t n);
+void outputLittleEndian(OutputWriter* w, uint64_t v, int bytes);
+void outputBytes(OutputWriter* w, const void* data, size_t len);
+void outputString(OutputWriter* w, const char* s);
+int formatInt(char* out, long long v);
+void outputInt(OutputWriter* w, long long v);
+void outputJsonString(OutputWriter* w, const char* s);
+void outputCsvField(OutputWriter* w, const char* s);
+int isJsonNumber(const char* s);
+const ResultColumn* nextValue(OutputWriter* w);
+void openFrame(OutputWriter* w, char type);
+void closeFrame(OutputWriter* w);
+void outputMessage(const char* fmt, ...);
+int valueType(const char* type);
+void beginResult(const char* title, const ResultColumn* columns, int num_columns);
+void beginRow(void);
+void outputValue(const char* text);
+void outputIntValue(long long v);
+void endRow(void);
+void endResult(void);
+int planOutput(SelectQuery* q, ResultColumn* columns);
+void bulkLoadBPTree(Table* table, KeyOffset* entries, long n);
+int compareKeyOffsets(const void* a, const void* b);
+int copyThreads(void);
+long splitCopyInput(const char* buf, long len, int at_eof, int parts, long* bounds);
+int storeCopyValue(Table* table, Record* rec, int col, const char* text, char* err);
+int parseCopyRow(CopyChunk* c, const char** pos, Record* rec);
+void* parseCopyChunk(void* arg);
+int writeFull(int fd, const void* buf, size_t len);
+int pwriteFull(int fd, const void* buf, size_t len, long offset);
+void copyFrom(Table* table, const char* path, int header);
+int copyToRow(void* ctx, Record* rec);
+void copyTo(Table* table, const char* path, int header);
+uint64_t profileClock(void);
+int profileEnter(int op);
+void profileLeave(int prev);
+OpProfile* profileOp(void);
+void profileRows(int op, long rows);
+void profileLock(uint64_t nanos);
+Metrics* metricsLocal(void);
+void metricsAdd(int counter, uint64_t n);
+void metricsSnapshot(Metrics* total);
+int latencyBucket(uint64_t nanos);
+uint64_t latencyBucketLimit(int bucket);
+uint64_t latencyPercentile(const uint64_t* buckets, uint64_t count, double p);
+int statementType(const char* query);
+void recordStatement(int type, uint64_t nanos);
+void lockFile(int fd, int exclusive);
+void unlockFile(int fd);
+void loadMetrics(Database* db);
+int saveMetrics(Database* db);
+int treeHeight(Table* table);
+long treeNodeCount(Table* table);
+long tableFileSize(Table* table);
+void showStats(Database* db);
+void showMetrics(Database* db);
+void executeStatement(Database* db, char* query);
+int configureSlowLog(Database* db, double threshold_ms, double sample);
+void stopSlowLog(void);
+void slowLogBegin(uint64_t start, uint64_t* before);
+void slowLogEnd(const char* query, int type, uint64_t nanos, const uint64_t* before);
+int slowLogWants(void);
+void captureSelectPlan(SelectQuery* q, int point);
+void drainSlowLog(void);
+int resultCacheKey(const char* query, char* key, size_t size);
+void captureOutput(OutputCapture* c, const void* data, size_t len);
+int configureResultCache(Database* db, size_t capacity);
+void clearResultCache(ResultCache* cache);
+void evictCachedResult(ResultCache* cache, CachedResult* e);
+uint64_t resultDataVersion(Database* db, const CachedResult* e);
+void storeCachedResult(ResultCache* cache, CachedResult* e);
+int cachedStatement(Database* db, char* query);
+int lz4Compress(const unsigned char* src, int len, unsigned char* dst, int cap);
+int lz4Decompress(const unsigned char* src, int len, unsigned char* dst, int cap);
+void openPages(Table* table);
+size_t pageBucket(const Table* table, long page);
+void lockBufferCache(void);
+void unlockBufferCache(void);
+CachedPage* fetchPage(Table* table, long page);
+long loadPage(Table* table, long page, char* data);
+void evictPage(CachedPage* p);
+void dropCachedPages(Table* table);
+int storePage(Table* table, CachedPage* p);
+int readPagedRows(Table* table, long offset, void* buf, size_t len);
+int writePagedRows(Table* table, long offset, const void* data, size_t len);
+int truncatePages(Table* table, long size);
+int writePageImage(Table* table, long page, const char* data, long used, unsigned char* image);
+unsigned char* beginPageRecord(PageLog* log, int kind, long offset, size_t len);
+int appendPageRecord(PageLog* log, size_t len);
+int logPageImage(PageLog* log, CachedPage* p, long within, const char* src, size_t n);
+int restorePageImage(Table* table, long page, const char* data, long used);
+int growScratch(size_t bytes);
+int rotatePageLog(PageLog* log, const char* old_path);
+int comparePages(const void* a, const void* b);
+int checkpointPages(PageLog* log);
+void checkpointAll(void);
+void lockCheckpointer(void);
+void unlockCheckpointer(void);
+void wakeCheckpointer(void);
+void startCheckpointer(void);
+void stopCheckpointer(void);
+int replayPageLog(Table* table, const char* path, uint64_t* lsn);
+int openPageLog(Database* db, Table* table);
+int closePageLog(Table* table, int force);
+long cachedDirtyPages(Table* table);
+long tableEnd(Table* table);
+int writeRows(Table* table, long offset, const void* data, size_t len);
+int truncateRows(Table* table, long size);
+Memtable* createMemtable(void);
+void freeMemtable(Memtable* m);
+MemNode* memtableSeek(Memtable* m, const IndexKey* key, MemNode** prev);
+MemNode* memtableFind(Memtable* m, const IndexKey* key);
+int memtablePut(LsmTree* lsm, Memtable* m, const IndexKey* key, const Record* row, int row_size);
+void runBloomAdd(unsigned char* bits, uint64_t num_bits, const IndexKey* key);
+int runMayContain(const LsmRun* run, const IndexKey* key);
+void runPath(const LsmTree* lsm, uint64_t seq, char* out, size_t size);
+int beginRun(LsmTree* lsm, RunWriter* w, const char* kind, int row_size, long expected_rows);
+void runAppend(RunWriter* w, const IndexKey* key, const void* row);
+void abortRun(RunWriter* w);
+LsmRun* finishRun(LsmTree* lsm, RunWriter* w, int level);
+LsmRun* openRun(LsmTree* lsm, uint64_t seq, int level, int row_size);
+void freeRun(LsmTree* lsm, LsmRun* run, int remove_file);
+long runBlockFor(const LsmRun* run, const IndexKey* key);
+int runFind(Table* table, const LsmRun* run, const IndexKey* key, Record* out);
+void pinLsm(LsmTree* lsm);
+void unpinLsm(LsmTree* lsm);
+int lsmFind(Table* table, const IndexKey* key, Record* out);
+void openMemCursor(LsmCursor* c, Table* table, Memtable* m, const IndexKey* lo);
+void loadRunRow(LsmCursor* c);
+void openRunCursor(LsmCursor* c, Table* table, LsmRun* run, const IndexKey* lo);
+void advanceCursor(LsmCursor* c);
+void closeCursor(LsmCursor* c);
+int mergeWinner(LsmCursor* cursors, int n);
+void advanceMerge(LsmCursor* cursors, int n, int winner);
+int lsmScan(Table* table, const IndexKey* lo, const IndexKey* hi, ScanCallback cb, void* ctx);
+int writeManifest(LsmTree* lsm, LsmRun** runs, int num_runs, LsmRun** obsolete, int num_obsolete);
+void installRuns(LsmTree* lsm, LsmRun** runs, int num_runs, Memtable** flushed);
+int flushMemtable(Table* table);
+int mergeInterrupt(LsmTree* lsm);
+int mergeRuns(Table* table);
+#ifndef _WIN32
+void* lsmWorker(void* arg);
+#endif
+void startLsmWorker(Table* table);
+void stopLsmWorker(Table* table);
+int openLsmLog(Table* table);
+int appendLsmLog(LsmTree* lsm, const void* buf, size_t len);
+int flushLsmLog(LsmTree* lsm);
+void syncLsmLog(LsmTree* lsm, uint64_t age);
+void freezeMemtable(Table* table);
+int lsmApply(Table* table, const char* rows, long n);
+int lsmLog(Table* table, const void* rows, long n);
+int lsmWrite(Table* table, const Record* rec);
+int copyLsmRows(Table* table, CopyChunk* c, long line_base, KeyOffset* keys, long* num_keys);
+void finishLsmCopy(Table* table, KeyOffset* keys, long num_keys, int failed);
+void insertLsmRecord(Table* table, const IndexKey* key, Record* rec);
+void writeLsmRecord(Table* table, const IndexKey* key, Record* rec);
+int replayLog(Table* table, const char* path, Memtable* m);
+int countLiveRow(void* ctx, Record* rec);
+int openLsm(Database* db, Table* table);
+void freeLsm(Table* table);
+int rewriteLsmRow(void* ctx, Record* rec);
+int rewriteLsm(Database* db, Table* table, int row_size, RowConverter convert, void* ctx);
+void removeLsmFiles(const char* db_dir, const char* name);
+long lsmFileSize(Table* table);
+int rewritePagedRows(Table* table, const char* path, int row_size, RowConverter convert, void* ctx);
+uint32_t fieldCode(const char* field);
+void storeCode(char* field, uint32_t code);
+uint32_t hashDictValue(const char* text, size_t len);
+ColumnDict* columnDict(Table* table, int col);
+long dictFind(const ColumnDict* dict, const char* text, size_t len);
+int dictReserve(ColumnDict* dict);
+uint32_t dictInsert(ColumnDict* dict, char* value);
+long dictAdd(ColumnDict* dict, const char* text, size_t len);
+void freeDict(ColumnDict* dict);
+void freeDicts(Table* table);
+int openDictionary(Database* db, Table* table, int create);
+void lockDict(Table* table);
+void unlockDict(Table* table);
+int appendDictValue(Table* table, int col, const char* text, size_t len);
+long encodeValue(Table* table, int col, const char* text, size_t len);
+const char* dictValue(Table* table, int col, uint32_t code);
+const char* fieldText(Table* table, Record* rec, int col);
+int countDistinctRow(void* ctx, Record* rec);
+int encodeRow(void* ctx, const Record* from, Record* to);
+int encodeColumns(Database* db, Table* table, int force);
+int columnIndex(Table* table, const char* name);
+char* parseCondition(SelectQuery* q, char* text, int* point);
+char* parseFilterCondition(SelectQuery* q, int col, char* text);
+int filterMatches(SelectQuery* q, Record* rec);
+int filterScanRow(void* ctx, Record* rec);
+int filterMayMatch(SelectQuery* q);
+int profiledScanRow(void* ctx, Record* rec);
+int profiledRow(void* ctx, Record** rows);
+void writeOut(OutputWriter* w, const void* data, size_t len);
+void outputTextLine(const char* text);
+int rangeMayMatch(SelectQuery* q);
+int indexJoinInner(SelectQuery* q);
+int usesIndexOrder(SelectQuery* q);
+void describeScan(SelectQuery* q, int side, const char* role, char* out, size_t size);
+void formatOpProfile(const OpProfile* op, char* out, size_t size);
+void explainStep(int depth, int op, const char* text);
+void explainPlan(SelectQuery* q, int point);
+void explainSelect(SelectQuery* q, int point);
+void explainQuery(Database* db, const char* query);
+
+// Statement being run under EXPLAIN ANALYZE on this thread, NULL otherwise.
+// Every hook tests it first, so they cost one branch when nothing is analyzed.
+static _Thread_local QueryProfile* active_profile;
+static _Thread_local int explain_mode;
+
+// Every thread that has counted something, newest first (pushed lock-free)
+static MetricsSlot* metrics_slots;
+static _Thread_local MetricsSlot* metrics_slot;
+// Totals of earlier sessions, loaded from metrics.dat at startup
+static Metrics metrics_saved;
+#ifndef _WIN32
+static pthread_key_t metrics_key;
+static pthread_once_t metrics_once = PTHREAD_ONCE_INIT;
+#endif
+static SlowLog slow_log;
+static BufferCache buffer_cache;
+static Checkpointer checkpointer;
+#ifndef _WIN32
+static pthread_mutex_t buffer_cache_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t pages_cleaned = PTHREAD_COND_INITIALIZER;     // A checkpoint took a table's dirty pages
+static pthread_cond_t page_loaded = PTHREAD_COND_INITIALIZER;       // fetchPage finished reading a page in
+static pthread_mutex_t checkpoint_lock = PTHREAD_MUTEX_INITIALIZER; // Held through a checkpoint and to change logs
+#endif
+#ifndef _WIN32
+static pthread_mutex_t slow_log_config = PTHREAD_MUTEX_INITIALIZER;
+#endif
+// Slow log state of the statement running on this thread
+static _Thread_local uint64_t statement_start;
+static _Thread_local uint64_t statement_parsed;   // 0 until a SELECT has been parsed
+static _Thread_local int slow_sampled;
+static _Thread_local uint64_t slow_random;
+static _Thread_local char slow_plan[SLOWLOG_PLAN];
+static _Thread_local char* plan_capture;         // explainStep appends here instead of printing
+// Entry whose statement is running to be cached; findTable records its tables
+static _Thread_local CachedResult* result_deps;
+static const char* metric_names[METRIC_COUNTERS] = {
+    "rows_read", "rows_written", "bytes_read", "syscalls", "cache_hits",
+    "cache_misses", "locks", "lock_wait_nanos", "errors", "result_cache_hits",
+    "result_cache_misses", "key_filter_skips"
+};
+static const char* statement_names[STMT_TYPES] = {
+    "select", "insert", "update", "delete", "create", "drop", "alter",
+    "copy", "show", "describe", "set", "explain", "other"
+};
+
+// Monotonic clock in nanoseconds
+uint64_t profileClock(void) {
+#ifdef _WIN32
+    LARGE_INTEGER freq;
+    LARGE_INTEGER now;
+    QueryPerformanceFrequency(&freq);
+    QueryPerformanceCounter(&now);
+    return (uint64_t)(now.QuadPart / freq.QuadPart * 1000000000ULL +
+                      now.QuadPart % freq.QuadPart * 1000000000ULL / freq.QuadPart);
+#else
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + (uint64_t)ts.tv_nsec;
+#endif
+}
+
+// Charge the time since the last switch to the running operator and make op
+// the running one. Returns the operator to hand back to with profileLeave.
+int profileEnter(int op) {
+    QueryProfile* p = active_profile;
+    if (!p) return PROF_STATEMENT;
+    uint64_t now = profileClock();
+    int prev = p->current;
+    p->ops[prev].nanos += now - p->mark;
+    p->mark = now;
+    p->current = op;
+    return prev;
+}
+
+void profileLeave(int prev) {
+    if (active_profile) profileEnter(prev);
+}
+
+// Counters of the running operator, NULL when nothing is analyzed
+OpProfile* profileOp(void) {
+    return active_profile ? &active_profile->ops[active_profile->current] : NULL;
+}
+
+void profileRows(int op, long rows) {
+    if (active_profile) active_profile->ops[op].rows += rows;
+}
+
+// Callback adapters that charge the wrapped callback to its operator
+int profiledScanRow(void* ctx, Record* rec) {
+    ProfiledCallback* pc = (ProfiledCallback*)ctx;
+    int prev = profileEnter(pc->op);
+    int more = pc->scan(pc->ctx, rec);
+    profileLeave(prev);
+    return more;
+}
+
+int profiledRow(void* ctx, Record** rows) {
+    ProfiledCallback* pc = (ProfiledCallback*)ctx;
+    int prev = profileEnter(pc->op);
+    int more = pc->row(pc->ctx, rows);
+    profileLeave(prev);
+    return more;
+}
+
+// Count a file lock that took nanos to acquire
+void profileLock(uint64_t nanos) {
+    metricsAdd(METRIC_LOCKS, 1);
+    metricsAdd(METRIC_LOCK_WAIT_NANOS, nanos);
+    OpProfile* op = profileOp();
+    if (!op) return;
+    op->locks++;
+    op->lock_nanos += nanos;
+}
+
+#ifndef _WIN32
+// Hand a slot back when its thread exits
+void metricsRelease(void* slot) {
+    __atomic_store_n(&((MetricsSlot*)slot)->in_use, 0, __ATOMIC_RELEASE);
+}
+
+void metricsKeyInit(void) {
+    pthread_key_create(&metrics_key, metricsRelease);
+}
+#endif
+
+// This thread's counters. The first call claims a slot an exited thread
+// released, or pushes a new one onto the registry, without taking a lock.
+Metrics* metricsLocal(void) {
+    if (metrics_slot) return &metrics_slot->m;
+    
+    MetricsSlot* slot = __atomic_load_n(&metrics_slots, __ATOMIC_ACQUIRE);
+    for (; slot; slot = slot->next) {
+        int idle = 0;
+        if (__atomic_compare_exchange_n(&slot->in_use, &idle, 1, 0, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)) break;
+    }
+    if (!slot) {
+        static Metrics unregistered;   // Counts of a thread that could not get a slot are dropped
+        slot = (MetricsSlot*)calloc(1, sizeof(MetricsSlot));
+        if (!slot) return &unregistered;
+        slot->in_use = 1;
+        slot->next = __atomic_load_n(&metrics_slots, __ATOMIC_RELAXED);
+        while (!__atomic_compare_exchange_n(&metrics_slots, &slot->next, slot, 0, __ATOMIC_RELEASE,
+                                            __ATOMIC_RELAXED)) {
+        }
+    }
+#ifndef _WIN32
+    pthread_once(&metrics_once, metricsKeyInit);
+    pthread_setspecific(metrics_key, slot);
+#endif
+    metrics_slot = slot;
+    return &slot->m;
+}
+
+// Bump a counter of this thread. There is one writer per slot, so a plain
+// add published with a relaxed store is enough for readers summing the slots.
+void metricsAdd(int counter, uint64_t n) {
+    Metrics* m = metricsLocal();
+    __atomic_store_n(&m->counters[counter], m->counters[counter] + n, __ATOMIC_RELAXED);
+}
+
+// Sum of every thread's counters and the saved totals of earlier sessions
+void metricsSnapshot(Metrics* total) {
+    uint64_t* out = (uint64_t*)total;
+    size_t n = sizeof(Metrics) / sizeof(uint64_t);
+    memcpy(total, &metrics_saved, sizeof(Metrics));
+    for (MetricsSlot* slot = __atomic_load_n(&metrics_slots, __ATOMIC_ACQUIRE); slot; slot = slot->next) {
+        const uint64_t* in = (const uint64_t*)&slot->m;
+        for (size_t i = 0; i < n; i++) out[i] += __atomic_load_n(&in[i], __ATOMIC_RELAXED);
+    }
+}
+
+// Histogram bucket of a latency: exact below LATENCY_SUB_BUCKETS nanoseconds,
+// then LATENCY_SUB_BUCKETS buckets per power of two
+int latencyBucket(uint64_t nanos) {
+    if (nanos < LATENCY_SUB_BUCKETS) return (int)nanos;
+    int msb = 63 - __builtin_clzll(nanos);
+    int shift = msb - LATENCY_SUB_BITS;
+    return (shift + 1) * LATENCY_SUB_BUCKETS + (int)((nanos >> shift) - LATENCY_SUB_BUCKETS);
+}
+
+// Largest latency that falls in a bucket
+uint64_t latencyBucketLimit(int bucket) {
+    if (bucket < LATENCY_SUB_BUCKETS) return (uint64_t)bucket;
+    int shift = bucket / LATENCY_SUB_BUCKETS - 1;
+    uint64_t next = (uint64_t)(LATENCY_SUB_BUCKETS + bucket % LATENCY_SUB_BUCKETS + 1);
+    if (shift + LATENCY_SUB_BITS + 1 >= 64) return UINT64_MAX;
+    return (next << shift) - 1;
+}
+
+// Latency at or below which a fraction p of the recorded statements finished
+uint64_t latencyPercentile(const uint64_t* buckets, uint64_t count, double p) {
+    uint64_t target = (uint64_t)(p * count + 0.999999);
+    uint64_t seen = 0;
+    if (target == 0) target = 1;
+    for (int b = 0; b < LATENCY_BUCKETS; b++) {
+        seen += buckets[b];
+        if (seen >= target) return latencyBucketLimit(b);
+    }
+    return 0;
+}
+
+// Classify a statement by its first word
+int statementType(const char* query) {
+    static const char* words[] = {"SELECT", "INSERT", "UPDATE", "DELETE", "CREATE", "DROP", "ALTER",
+                                  "COPY", "SHOW", "DESCRIBE", "SET", "EXPLAIN"};
+    while (isspace((unsigned char)*query)) query++;
+    size_t len = 0;
+    while (isalpha((unsigned char)query[len])) len++;
+    for (int t = 0; t < STMT_OTHER; t++) {
+        if (strlen(words[t]) == len && strncasecmp(query, words[t], len) == 0) return t;
+    }
+    if (len == 4 && strncasecmp(query, "DESC", 4) == 0) return STMT_DESCRIBE;
+    return STMT_OTHER;
+}
+
+// Count a finished statement and add its latency to the type's histogram
+void recordStatement(int type, uint64_t nanos) {
+    Metrics* m = metricsLocal();
+    uint64_t* bucket = &m->latency[type][latencyBucket(nanos)];
+    __atomic_store_n(&m->queries[type], m->queries[type] + 1, __ATOMIC_RELAXED);
+    __atomic_store_n(&m->latency_nanos[type], m->latency_nanos[type] + nanos, __ATOMIC_RELAXED);
+    __atomic_store_n(bucket, *bucket + 1, __ATOMIC_RELAXED);
+}
+
+// Load the totals of earlier sessions. A file from a build with a different
+// set of counters is ignored and overwritten on exit.
+void loadMetrics(Database* db) {
+    char path[256];
+    snprintf(path, sizeof(path), "%s/metrics.dat", db->db_dir);
+    memset(&metrics_saved, 0, sizeof(metrics_saved));
+    
+    FILE* fp = fopen(path, "rb");
+    if (!fp) return;
+    size_t n = sizeof(Metrics) / sizeof(uint64_t);
+    size_t size = 14 + 8 * n;
+    unsigned char* buf = (unsigned char*)malloc(size);
+    int ok = buf && fread(buf, 1, size, fp) == size && memcmp(buf, METRICS_MAGIC, 8) == 0;
+    fclose(fp);
+    
+    CatalogReader r = {buf + 8, buf + size, ok};
+    if (ok && catalogGet(&r, 2) == METRIC_COUNTERS && catalogGet(&r, 2) == STMT_TYPES &&
+        catalogGet(&r, 2) == LATENCY_BUCKETS) {
+        uint64_t* out = (uint64_t*)&metrics_saved;
+        for (size_t i = 0; i < n; i++) out[i] = catalogGet(&r, 8);
+    }
+    free(buf);
+}
+
+// Add this session's counters to metrics.dat; called once, on exit. The file
+// is locked while it is read back and rewritten, so sessions that exit
+// together both count.
+int saveMetrics(Database* db) {
+    char path[256];
+    snprintf(path, sizeof(path), "%s/metrics.dat", db->db_dir);
+#ifdef _WIN32
+    int fd = open(path, _O_CREAT | _O_RDWR | _O_BINARY, _S_IREAD | _S_IWRITE);
+#else
+    int fd = open(path, O_CREAT | O_RDWR, 0644);
+#endif
+    if (fd < 0) return 0;
+    lockFile(fd, 1);
+    
+    Metrics* startup = (Metrics*)malloc(sizeof(Metrics));
+    Metrics* total = (Metrics*)malloc(sizeof(Metrics));
+    size_t n = sizeof(Metrics) / sizeof(uint64_t);
+    size_t size = 14 + 8 * n;
+    unsigned char* buf = (unsigned char*)malloc(size);
+    int ok = startup && total && buf;
+    if (ok) {
+        // Other sessions may have saved since startup: add to what is on disk now
+        memcpy(startup, &metrics_saved, sizeof(Metrics));
+        loadMetrics(db);
+        metricsSnapshot(total);
+        memcpy(&metrics_saved, startup, sizeof(Metrics));
+        
+        const uint64_t* out = (const uint64_t*)total;
+        unsigned char* p = buf;
+        memcpy(p, METRICS_MAGIC, 8);
+        p = catalogPut(p + 8, METRIC_COUNTERS, 2);
+        p = catalogPut(p, STMT_TYPES, 2);
+        p = catalogPut(p, LATENCY_BUCKETS, 2);
+        for (size_t i = 0; i < n; i++) p = catalogPut(p, out[i], 8);
+        ok = lseek(fd, 0, SEEK_SET) == 0 && writeFull(fd, buf, size);
+    }
+    unlockFile(fd);
+    close(fd);
+    free(buf);
+    free(total);
+    free(startup);
+    return ok;
+}
+
+// Write out every entry in the ring. Only the writer thread (or, on Windows,
+// the statement that just logged) calls this.
+void drainSlowLog(void) {
+    SlowLog* log = &slow_log;
+    if (!log->ring) return;
+    if (!log->out) log->out = fopen(log->path, "a");
+    
+    int wrote = 0;
+    for (;;) {
+        SlowQuery* e = &log->ring[log->tail % SLOWLOG_ENTRIES];
+        if (__atomic_load_n(&e->seq, __ATOMIC_ACQUIRE) != log->tail + 1) break;
+        if (log->out) {
+            char when[32];
+            struct tm* tm = gmtime(&e->when);
+            strftime(when, sizeof(when), "%Y-%m-%dT%H:%M:%SZ", tm);
+            fprintf(log->out, "# Time: %s  Type: %s%s\n", when, statement_names[e->type],
+                    e->sampled ? "  (sampled)" : "");
+            fprintf(log->out, "# Total: %.3f ms  Parse: %.3f ms  Lock wait: %.3f ms\n", e->total_nanos / 1e6,
+                    e->parse_nanos / 1e6, e->counters[METRIC_LOCK_WAIT_NANOS] / 1e6);
+            fprintf(log->out, "# Rows examined: %llu  Rows written: %llu  Bytes read: %llu  Syscalls: %llu"
+                    "  Cache hits: %llu\n",
+                    (unsigned long long)e->counters[METRIC_ROWS_READ],
+                    (unsigned long long)e->counters[METRIC_ROWS_WRITTEN],
+                    (unsigned long long)e->counters[METRIC_BYTES_READ],
+                    (unsigned long long)e->counters[METRIC_SYSCALLS],
+                    (unsigned long long)e->counters[METRIC_CACHE_HITS]);
+            if (e->plan[0]) fprintf(log->out, "# Plan: %s\n", e->plan);
+            fprintf(log->out, "%s;\n", e->text);
+        }
+        __atomic_store_n(&e->seq, log->tail + SLOWLOG_ENTRIES, __ATOMIC_RELEASE);
+        log->tail++;
+        wrote = 1;
+    }
+    
+    uint64_t dropped = __atomic_load_n(&log->dropped, __ATOMIC_RELAXED);
+    if (log->out && dropped != log->reported_dropped) {
+        fprintf(log->out, "# %llu entries dropped: the log could not keep up\n",
+                (unsigned long long)(dropped - log->reported_dropped));
+        log->reported_dropped = dropped;
+        wrote = 1;
+    }
+    if (log->out && wrote) fflush(log->out);
+}
+
+#ifndef _WIN32
+// Background writer: sleeps until woken by a new entry (or every
+// SLOWLOG_FLUSH_MS, in case the wakeup was missed) and drains the ring
+void* slowLogWriter(void* arg) {
+    (void)arg;
+    SlowLog* log = &slow_log;
+    pthread_mutex_lock(&log->lock);
+    while (!log->stop) {
+        struct timespec deadline;
+        clock_gettime(CLOCK_REALTIME, &deadline);
+        deadline.tv_nsec += SLOWLOG_FLUSH_MS * 1000000L;
+        if (deadline.tv_nsec >= 1000000000L) {
+            deadline.tv_sec++;
+            deadline.tv_nsec -= 1000000000L;
+        }
+        pthread_cond_timedwait(&log->wake, &log->lock, &deadline);
+        pthread_mutex_unlock(&log->lock);
+        drainSlowLog();
+        pthread_mutex_lock(&log->lock);
+    }
+    pthread_mutex_unlock(&log->lock);
+    drainSlowLog();
+    return NULL;
+}
+#endif
+
+// SET SLOWLOG: log statements slower than threshold_ms, plus a random share
+// sample of the others, to slow_query.log in the database directory. A
+// negative threshold turns the log off; the writer keeps running until exit.
+int configureSlowLog(Database* db, double threshold_ms, double sample) {
+    SlowLog* log = &slow_log;
+    if (threshold_ms < 0) {
+        __atomic_store_n(&log->enabled, 0, __ATOMIC_RELEASE);
+        return 1;
+    }
+    
+#ifndef _WIN32
+    pthread_mutex_lock(&slow_log_config);
+#endif
+    int ok = 1;
+    if (!log->ring) {
+        log->ring = (SlowQuery*)malloc(SLOWLOG_ENTRIES * sizeof(SlowQuery));
+        if (log->ring) {
+            for (uint64_t i = 0; i < SLOWLOG_ENTRIES; i++) log->ring[i].seq = i;
+            snprintf(log->path, sizeof(log->path), "%s/slow_query.log", db->db_dir);
+#ifndef _WIN32
+            pthread_mutex_init(&log->lock, NULL);
+            pthread_cond_init(&log->wake, NULL);
+            log->stop = 0;
+            log->running = pthread_create(&log->writer, NULL, slowLogWriter, NULL) == 0;
+#endif
+        }
+        ok = log->ring != NULL;
+    }
+    if (ok) {
+        log->threshold_nanos = (uint64_t)(threshold_ms * 1e6);
+        log->sample = sample;
+        __atomic_store_n(&log->enabled, 1, __ATOMIC_RELEASE);
+    }
+#ifndef _WIN32
+    pthread_mutex_unlock(&slow_log_config);
+#endif
+    return ok;
+}
+
+// Stop the writer after it has drained the ring
+void stopSlowLog(void) {
+    SlowLog* log = &slow_log;
+    if (!log->ring) return;
+    __atomic_store_n(&log->enabled, 0, __ATOMIC_RELEASE);
+#ifndef _WIN32
+    if (log->running) {
+        pthread_mutex_lock(&log->lock);
+        log->stop = 1;
+        pthread_cond_signal(&log->wake);
+        pthread_mutex_unlock(&log->lock);
+        pthread_join(log->writer, NULL);
+        log->running = 0;
+    }
+#endif
+    drainSlowLog();
+    if (log->out) fclose(log->out);
+    log->out = NULL;
+    free(log->ring);
+    log->ring = NULL;
+}
+
+// Note where a statement starts and whether it is sampled
+void slowLogBegin(uint64_t start, uint64_t* before) {
+    memcpy(before, metricsLocal()->counters, sizeof(uint64_t) * METRIC_COUNTERS);
+    statement_start = start;
+    statement_parsed = 0;
+    slow_plan[0] = '\0';
+    slow_sampled = 0;
+    if (slow_log.sample > 0) {
+        if (!slow_random) slow_random = start | 1;
+        slow_random ^= slow_random << 13;
+        slow_random ^= slow_random >> 7;
+        slow_random ^= slow_random << 17;
+        slow_sampled = (slow_random >> 11) * (1.0 / 9007199254740992.0) < slow_log.sample;
+    }
+}
+
+// Whether the running statement is going to be logged (sampled, or already slow)
+int slowLogWants(void) {
+    if (!__atomic_load_n(&slow_log.enabled, __ATOMIC_ACQUIRE) || !statement_start) return 0;
+    return slow_sampled || profileClock() - statement_start >= slow_log.threshold_nanos;
+}
+
+// Summarize the plan of the SELECT that just ran for its log entry
+void captureSelectPlan(SelectQuery* q, int point) {
+    slow_plan[0] = '\0';
+    plan_capture = slow_plan;
+    explainPlan(q, point);
+    plan_capture = NULL;
+}
 
-// Platform-specific file locking
+// Queue the statement that just finished if it was slow or sampled. Never
+// waits: a full ring drops the entry.
+void slowLogEnd(const char* query, int type, uint64_t nanos, const uint64_t* before) {
+    SlowLog* log = &slow_log;
+    uint64_t threshold = log->threshold_nanos;
+    uint64_t start = statement_start;
+    statement_start = 0;
+    if (!log->ring || (!slow_sampled && nanos < threshold)) return;
+    
+    uint64_t ticket = __atomic_load_n(&log->head, __ATOMIC_RELAXED);
+    SlowQuery* e;
+    for (;;) {
+        e = &log->ring[ticket % SLOWLOG_ENTRIES];
+        uint64_t seq = __atomic_load_n(&e->seq, __ATOMIC_ACQUIRE);
+        if (seq == ticket) {
+            if (__atomic_compare_exchange_n(&log->head, &ticket, ticket + 1, 1, __ATOMIC_RELAXED,
+                                            __ATOMIC_RELAXED)) break;
+        } else if ((int64_t)(seq - ticket) < 0) {
+            __atomic_fetch_add(&log->dropped, 1, __ATOMIC_RELAXED);
+            return;
+        } else {
+            ticket = __atomic_load_n(&log->head, __ATOMIC_RELAXED);
+        }
+    }
+    
+    const uint64_t* after = metricsLocal()->counters;
+    e->when = time(NULL);
+    e->type = type;
+    e->sampled = nanos < threshold;
+    e->total_nanos = nanos;
+    e->parse_nanos = statement_parsed ? statement_parsed - start : 0;
+    for (int i = 0; i < METRIC_COUNTERS; i++) e->counters[i] = after[i] - before[i];
+    size_t len = strlen(query);
+    if (len >= SLOWLOG_TEXT) {
+        memcpy(e->text, query, SLOWLOG_TEXT - 4);
+        strcpy(e->text + SLOWLOG_TEXT - 4, "...");
+    } else {
+        memcpy(e->text, query, len + 1);
+    }
+    snprintf(e->plan, sizeof(e->plan), "%s", slow_plan);
+    __atomic_store_n(&e->seq, ticket + 1, __ATOMIC_RELEASE);
+    
+#ifdef _WIN32
+    drainSlowLog();
+#else
+    pthread_cond_signal(&log->wake);
+#endif
+}
+
+// Platform-specific file locking. LSM tables have no data file (fd -1), so
+// there is nothing to lock.
 #ifdef _WIN32
 void lockFile(int fd, int exclusive) {
-    HANDLE hFile = (HANDLE)_get_osfhandle(fd);
-    OVERLAPPED overlapped = {0};
-    DWORD flags = exclusive ? LOCKFILE_EXCLUSIVE_LOCK : 0;
-    LockFileEx(hFile, flags, 0, MAXDWORD, MAXDWORD, &overlapped);
+    uint64_t start = profileClock();
+    if (fd >= 0) {
+        HANDLE hFile = (HANDLE)_get_osfhandle(fd);
+        OVERLAPPED overlapped = {0};
+        DWORD flags = exclusive ? LOCKFILE_EXCLUSIVE_LOCK : 0;
+        LockFileEx(hFile, flags, 0, MAXDWORD, MAXDWORD, &overlapped);
+    }
+    profileLock(profileClock() - start);
 }
 
 void unlockFile(int fd) {
+    if (fd < 0) return;
     HANDLE hFile = (HANDLE)_get_osfhandle(fd);
     OVERLAPPED overlapped = {0};
     UnlockFileEx(hFile, 0, MAXDWORD, MAXDWORD, &overlapped);
 }
 #else
 void lockFile(int fd, int exclusive) {
-    flock(fd, exclusive ? LOCK_EX : LOCK_SH);
+    uint64_t start = profileClock();
+    if (fd >= 0) flock(fd, exclusive ? LOCK_EX : LOCK_SH);
+    profileLock(profileClock() - start);
 }
 
 void unlockFile(int fd) {
-    flock(fd, LOCK_UN);
+    if (fd >= 0) flock(fd, LOCK_UN);
 }
 #endif
 
@@ -133,8 +1769,22 @@ Database* createDatabase(const char* db_dir) {
     Database* db = (Database*)malloc(sizeof(Database));
     if (!db) return NULL;
     
+    db->tables = NULL;
     db->num_tables = 0;
+    db->table_capacity = 0;
     db->db_dir = strdup(db_dir);
+    db->io_mode = IO_URING;
+    db->table_index = NULL;
+    db->index_size = 0;
+    db->schema_version = 0;
+    memset(&db->results, 0, sizeof(db->results));
+    db->unopened = NULL;
+    db->num_unopened = 0;
+    if (!rebuildTableIndex(db, TABLE_INDEX_MIN)) {
+        free(db->db_dir);
+        free(db);
+        return NULL;
+    }
     
     // Create directory if it doesn't exist
 #ifdef _WIN32
@@ -143,7 +1793,11 @@ Database* createDatabase(const char* db_dir) {
     mkdir(db_dir, 0755);
 #endif
     
-    loadTableSchemas(db);
+    if (!loadCatalog(db)) {
+        freeDatabase(db);
+        return NULL;
+    }
+    loadMetrics(db);
     return db;
 }
 
@@ -180,465 +1834,7881 @@ long getNextOffset(int fd) {
     return lseek(fd, 0, SEEK_END);
 }
 
-// Create B+-tree node
-BPTNode* createBPTNode(int is_leaf) {
-    BPTNode* node = (BPTNode*)malloc(sizeof(BPTNode));
-    if (node) {
-        node->num_keys = 0;
-        node->is_leaf = is_leaf;
-        node->next = NULL;
-        for (int i = 0; i < ORDER + 1; i++) {
-            node->children[i] = NULL;
-        }
-        for (int i = 0; i < ORDER; i++) {
-            node->offsets[i] = -1;
+// Create B+-tree node in the table's arena, starting a new slab when the
+// current one is full
+BPTNode* createBPTNode(NodeArena* arena, int is_leaf) {
+    NodeSlab* slab = arena->current;
+    while (slab && slab->used == slab->capacity) {
+        slab = slab->next;
+        if (slab) arena->current = slab;
+    }
+    if (!slab) {
+        int capacity = arena->current ? arena->current->capacity * 2 : NODE_SLAB_MIN;
+        if (capacity > NODE_SLAB_MAX) capacity = NODE_SLAB_MAX;
+        slab = (NodeSlab*)malloc(sizeof(NodeSlab) + capacity * sizeof(BPTNode));
+        if (!slab) return NULL;
+        slab->next = NULL;
+        slab->capacity = capacity;
+        slab->used = 0;
+        if (arena->current) {
+            arena->current->next = slab;
+        } else {
+            arena->first = slab;
         }
+        arena->current = slab;
+    }
+    
+    BPTNode* node = &slab->nodes[slab->used++];
+    node->num_keys = 0;
+    node->is_leaf = is_leaf;
+    node->next = NULL;
+    for (int i = 0; i < ORDER + 1; i++) {
+        node->children[i] = NULL;
+    }
+    for (int i = 0; i < ORDER; i++) {
+        node->offsets[i] = -1;
     }
     return node;
 }
 
-// Save table schema
-void saveTableSchema(Database* db, Table* table) {
-    char schema_file[256];
-    snprintf(schema_file, sizeof(schema_file), "%s/schemas.dat", db->db_dir);
-    
-    FILE* fp = fopen(schema_file, "ab");
-    if (fp) {
-        fwrite(&table->schema, sizeof(TableSchema), 1, fp);
-        fclose(fp);
+// Give back every node at once, keeping the slabs for the next tree
+void resetNodeArena(NodeArena* arena) {
+    for (NodeSlab* slab = arena->first; slab; slab = slab->next) slab->used = 0;
+    arena->current = arena->first;
+}
+
+// Release the arena's slabs
+void freeNodeArena(NodeArena* arena) {
+    NodeSlab* slab = arena->first;
+    while (slab) {
+        NodeSlab* next = slab->next;
+        free(slab);
+        slab = next;
     }
+    arena->first = NULL;
+    arena->current = NULL;
 }
 
-// Load table schemas
-void loadTableSchemas(Database* db) {
-    char schema_file[256];
-    snprintf(schema_file, sizeof(schema_file), "%s/schemas.dat", db->db_dir);
-    
-    FILE* fp = fopen(schema_file, "rb");
-    if (!fp) return;
-    
-    TableSchema schema;
-    while (fread(&schema, sizeof(TableSchema), 1, fp) == 1) {
-        if (db->num_tables >= MAX_TABLES) break;
-        
-        Table* table = &db->tables[db->num_tables];
-        table->schema = schema;
-        table->root = createBPTNode(1);
-        table->record_count = 0;
-        
-        // Open data file
-        char data_file[256];
-        snprintf(data_file, sizeof(data_file), "%s/%s.dat", db->db_dir, schema.name);
-#ifdef _WIN32
-        table->fd = open(data_file, _O_CREAT | _O_RDWR | _O_BINARY, _S_IREAD | _S_IWRITE);
-#else
-        table->fd = open(data_file, O_CREAT | O_RDWR, 0644);
-#endif
-        
-        if (table->fd >= 0) {
-            loadRecords(table);
-            db->num_tables++;
+// CRC-32 (IEEE 802.3 polynomial, as used by zip and PNG)
+uint32_t computeCrc32(const void* data, size_t len) {
+    static uint32_t table[256];
+    static int ready = 0;
+    if (!ready) {
+        for (uint32_t i = 0; i < 256; i++) {
+            uint32_t c = i;
+            for (int k = 0; k < 8; k++) c = (c & 1) ? 0xEDB88320u ^ (c >> 1) : c >> 1;
+            table[i] = c;
         }
+        ready = 1;
     }
-    
-    fclose(fp);
+    const unsigned char* p = (const unsigned char*)data;
+    uint32_t crc = 0xFFFFFFFFu;
+    while (len--) crc = table[(crc ^ *p++) & 0xFF] ^ (crc >> 8);
+    return crc ^ 0xFFFFFFFFu;
 }
 
-// Load records from table file
-void loadRecords(Table* table) {
-    lseek(table->fd, 0, SEEK_SET);
-    Record rec;
-    long offset = 0;
-    
-    while (read(table->fd, &rec, sizeof(Record)) == sizeof(Record)) {
-        if (rec.id != 0) {
-            insertIntoBPTree(table, rec.id, offset);
-            table->record_count++;
-        }
-        offset += sizeof(Record);
+unsigned char* catalogPut(unsigned char* p, uint64_t v, int bytes) {
+    for (int i = 0; i < bytes; i++) *p++ = (unsigned char)(v >> (8 * i));
+    return p;
+}
+
+// Strings are stored as a u8 length and the bytes
+unsigned char* catalogPutString(unsigned char* p, const char* s) {
+    size_t len = strlen(s);
+    p = catalogPut(p, len, 1);
+    memcpy(p, s, len);
+    return p + len;
+}
+
+uint64_t catalogGet(CatalogReader* r, int bytes) {
+    uint64_t v = 0;
+    if (r->end - r->p < bytes) {
+        r->ok = 0;
+        return 0;
     }
+    for (int i = 0; i < bytes; i++) v |= (uint64_t)*r->p++ << (8 * i);
+    return v;
 }
 
-// Create table
-void createTable(Database* db, const char* table_name, Column* columns, int num_columns, int pk_index) {
-    if (db->num_tables >= MAX_TABLES) {
-        printf("Error: Maximum number of tables reached!\n");
+void catalogGetString(CatalogReader* r, char* out, size_t cap) {
+    size_t len = (size_t)catalogGet(r, 1);
+    if (!r->ok || len >= cap || (size_t)(r->end - r->p) < len) {
+        r->ok = 0;
+        out[0] = '\0';
         return;
     }
+    memcpy(out, r->p, len);
+    out[len] = '\0';
+    r->p += len;
+}
+
+// Write the catalog: a 24-byte header (magic, u32 version, u32 table count,
+// u32 payload length, u32 CRC-32 of the payload) followed by one entry per
+// table -- name, u16 column count, u16 primary key index, u32 row size, u8 key
+// column count, u16 per key column, u8 set when the key is kept in the id, each
+// column's name, type, size, offset and u8 set when it is dictionary encoded,
+// then the table statistics. Version 4 columns had no encoding byte. Version 2
+// entries had a single key kept in the id and 32-bit key bounds; version 1
+// entries also had 8-bit counts and no layout (every table used LEGACY_ROW_SIZE).
+// The file is written to a temporary name and renamed over the old one, so a
+// crash leaves either version intact.
+int saveCatalog(Database* db) {
+    char path[256];
+    char tmp[260];
+    snprintf(path, sizeof(path), "%s/catalog.dat", db->db_dir);
+    snprintf(tmp, sizeof(tmp), "%s.tmp", path);
     
-    if (findTable(db, table_name)) {
-        printf("Error: Table '%s' already exists!\n", table_name);
-        return;
+    size_t size = 24;
+    for (int i = 0; i < db->num_tables + db->num_unopened; i++) {
+        const TableSchema* schema = i < db->num_tables ? &db->tables[i]->schema : &db->unopened[i - db->num_tables];
+        size += 1 + MAX_FIELD + 8 + 2 + 2 * MAX_KEY_COLUMNS + 1 + 29;
+        size += schema->num_columns * (2 + MAX_FIELD + sizeof(((Column*)0)->type) + 9);
     }
+    unsigned char* buf = (unsigned char*)malloc(size);
+    if (!buf) return 0;
     
-    Table* table = &db->tables[db->num_tables];
-    strncpy(table->schema.name, table_name, MAX_FIELD - 1);
-    table->schema.num_columns = num_columns;
-    table->schema.primary_key_index = pk_index;
-    
-    for (int i = 0; i < num_columns; i++) {
-        table->schema.columns[i] = columns[i];
+    unsigned char* p = buf + 24;
+    for (int i = 0; i < db->num_tables; i++) {
+        p = catalogPutTable(p, &db->tables[i]->schema, db->tables[i]);
     }
+    for (int i = 0; i < db->num_unopened; i++) p = catalogPutTable(p, &db->unopened[i], NULL);
     
-    table->root = createBPTNode(1);
-    table->record_count = 0;
+    size_t payload = (size_t)(p - buf) - 24;
+    memcpy(buf, CATALOG_MAGIC, 8);
+    unsigned char* h = catalogPut(buf + 8, CATALOG_VERSION, 4);
+    h = catalogPut(h, (uint32_t)(db->num_tables + db->num_unopened), 4);
+    h = catalogPut(h, (uint32_t)payload, 4);
+    catalogPut(h, computeCrc32(buf + 24, payload), 4);
     
-    // Create data file
-    char data_file[256];
-    snprintf(data_file, sizeof(data_file), "%s/%s.dat", db->db_dir, table_name);
+    FILE* fp = fopen(tmp, "wb");
+    int ok = fp && fwrite(buf, 1, 24 + payload, fp) == 24 + payload;
+    if (fp && fclose(fp) != 0) ok = 0;
+    free(buf);
 #ifdef _WIN32
-    table->fd = open(data_file, _O_CREAT | _O_RDWR | _O_BINARY, _S_IREAD | _S_IWRITE);
-#else
-    table->fd = open(data_file, O_CREAT | O_RDWR, 0644);
+    if (ok) remove(path);
 #endif
-    
-    if (table->fd < 0) {
-        printf("Error: Could not create table file!\n");
-        return;
-    }
-    
-    saveTableSchema(db, table);
-    db->num_tables++;
-    printf("Table '%s' created successfully.\n", table_name);
+    if (ok && rename(tmp, path) != 0) ok = 0;
+    if (!ok) remove(tmp);
+    return ok;
 }
 
-// Find table by name
-Table* findTable(Database* db, const char* table_name) {
-    for (int i = 0; i < db->num_tables; i++) {
-        if (strcasecmp(db->tables[i].schema.name, table_name) == 0) {
-            return &db->tables[i];
-        }
+// Append a table's catalog entry; a table that is not open (NULL) has no statistics
+unsigned char* catalogPutTable(unsigned char* p, const TableSchema* schema, const Table* table) {
+    p = catalogPutString(p, schema->name);
+    p = catalogPut(p, schema->num_columns, 2);
+    p = catalogPut(p, schema->primary_key_index, 2);
+    p = catalogPut(p, (uint32_t)schema->row_size, 4);
+    p = catalogPut(p, schema->num_key_columns, 1);
+    for (int k = 0; k < schema->num_key_columns; k++) {
+        p = catalogPut(p, schema->key_columns[k], 2);
     }
-    return NULL;
+    p = catalogPut(p, schema->key_in_id, 1);
+    p = catalogPut(p, schema->compression, 1);
+    p = catalogPut(p, schema->engine, 1);
+    for (int c = 0; c < schema->num_columns; c++) {
+        p = catalogPutString(p, schema->columns[c].name);
+        p = catalogPutString(p, schema->columns[c].type);
+        p = catalogPut(p, (uint32_t)schema->columns[c].size, 4);
+        p = catalogPut(p, (uint32_t)schema->columns[c].offset, 4);
+        p = catalogPut(p, schema->columns[c].encoded, 1);
+    }
+    p = catalogPut(p, table ? (uint32_t)table->record_count : 0, 4);
+    p = catalogPut(p, table ? (uint64_t)table->stats.dead_rows : 0, 8);
+    p = catalogPut(p, table ? table->stats.min_head : 0, 8);
+    return catalogPut(p, table ? table->stats.max_head : 0, 8);
 }
 
-// List all tables
-void listTables(Database* db) {
-    if (db->num_tables == 0) {
-        printf("No tables in database.\n");
-        return;
-    }
-    
-    printf("\n--- Tables ---\n");
-    for (int i = 0; i < db->num_tables; i++) {
-        printf("%s (%d records)\n", db->tables[i].schema.name, db->tables[i].record_count);
+// Remember the catalog entry of a table that could not be opened (its log
+// could not be redone, say), so the catalog keeps it and its name stays taken
+void keepUnopenedTable(Database* db, const TableSchema* schema) {
+    TableSchema* unopened = (TableSchema*)realloc(db->unopened, (db->num_unopened + 1) * sizeof(TableSchema));
+    if (!unopened) return;
+    db->unopened = unopened;
+    Column* columns = (Column*)malloc(schema->num_columns * sizeof(Column));
+    if (!columns) return;
+    memcpy(columns, schema->columns, schema->num_columns * sizeof(Column));
+    unopened[db->num_unopened] = *schema;
+    unopened[db->num_unopened++].columns = columns;
+}
+
+int isUnopenedTable(Database* db, const char* table_name) {
+    for (int i = 0; i < db->num_unopened; i++) {
+        if (strcasecmp(db->unopened[i].name, table_name) == 0) return 1;
     }
-    printf("--- End ---\n");
+    return 0;
 }
 
-// Describe table structure
-void describeTable(Database* db, const char* table_name) {
-    Table* table = findTable(db, table_name);
-    if (!table) {
-        printf("Error: Table '%s' not found!\n", table_name);
-        return;
+// Load the catalog with a single read and attach every table. A missing
+// catalog is created, migrating a legacy schemas.dat if there is one; a
+// damaged catalog or one written by a newer version is refused.
+int loadCatalog(Database* db) {
+    char path[256];
+    snprintf(path, sizeof(path), "%s/catalog.dat", db->db_dir);
+    
+    FILE* fp = fopen(path, "rb");
+    if (!fp) {
+        char legacy[256];
+        char renamed[270];
+        snprintf(legacy, sizeof(legacy), "%s/schemas.dat", db->db_dir);
+        snprintf(renamed, sizeof(renamed), "%s.legacy", legacy);
+        loadLegacySchemas(db, legacy);
+        if (!saveCatalog(db)) {
+            outputMessage("Error: Could not write '%s'!\n", path);
+            return 0;
+        }
+        if (db->num_tables > 0) rename(legacy, renamed);
+        return 1;
     }
     
-    printf("\n--- Table: %s ---\n", table->schema.name);
-    printf("Column Name          Type          Primary Key\n");
-    printf("------------------------------------------------\n");
-    for (int i = 0; i < table->schema.num_columns; i++) {
-        printf("%-20s %-13s %s\n", 
-               table->schema.columns[i].name,
-               table->schema.columns[i].type,
-               (i == table->schema.primary_key_index) ? "YES" : "NO");
+    fseek(fp, 0, SEEK_END);
+    long size = ftell(fp);
+    rewind(fp);
+    unsigned char* buf = (unsigned char*)malloc(size > 0 ? size : 1);
+    int read_ok = buf && size >= 24 && fread(buf, 1, size, fp) == (size_t)size;
+    fclose(fp);
+    if (!read_ok || memcmp(buf, CATALOG_MAGIC, 8) != 0) {
+        outputMessage("Error: '%s' is not a catalog file!\n", path);
+        free(buf);
+        return 0;
     }
-    printf("--- End ---\n");
-}
-
-// Split child node
-void splitChild(BPTNode* parent, int index) {
-    BPTNode* full_child = parent->children[index];
-    BPTNode* new_child = createBPTNode(full_child->is_leaf);
     
-    int mid = ORDER / 2;
+    CatalogReader r = {buf + 8, buf + size, 1};
+    uint32_t version = (uint32_t)catalogGet(&r, 4);
+    uint32_t num_tables = (uint32_t)catalogGet(&r, 4);
+    uint32_t payload = (uint32_t)catalogGet(&r, 4);
+    uint32_t crc = (uint32_t)catalogGet(&r, 4);
+    if (version > CATALOG_VERSION) {
+        outputMessage("Error: Catalog version %u is newer than this build supports (%d)!\n",
+                      version, CATALOG_VERSION);
+        free(buf);
+        return 0;
+    }
+    if ((long)payload != size - 24 || computeCrc32(buf + 24, payload) != crc) {
+        outputMessage("Error: Catalog checksum mismatch in '%s'!\n", path);
+        free(buf);
+        return 0;
+    }
     
-    if (full_child->is_leaf) {
-        new_child->num_keys = ORDER - mid;
-        for (int i = 0; i < new_child->num_keys; i++) {
-            new_child->keys[i] = full_child->keys[mid + i];
-            new_child->offsets[i] = full_child->offsets[mid + i];
+    Column columns[MAX_COLUMNS];
+    int count_bytes = version >= 2 ? 2 : 1;
+    for (uint32_t i = 0; i < num_tables && r.ok; i++) {
+        TableSchema schema;
+        memset(&schema, 0, sizeof(schema));
+        memset(columns, 0, sizeof(columns));
+        schema.columns = columns;
+        catalogGetString(&r, schema.name, sizeof(schema.name));
+        schema.num_columns = (int)catalogGet(&r, count_bytes);
+        schema.primary_key_index = (int)catalogGet(&r, count_bytes);
+        if (version >= 2) schema.row_size = (int)catalogGet(&r, 4);
+        if (version >= 3) {
+            schema.num_key_columns = (int)catalogGet(&r, 1);
+            for (int k = 0; k < schema.num_key_columns && k < MAX_KEY_COLUMNS; k++) {
+                schema.key_columns[k] = (int)catalogGet(&r, 2);
+            }
+            schema.key_in_id = (int)catalogGet(&r, 1);
+            if (version >= 4) schema.compression = (int)catalogGet(&r, 1);
+            if (version >= 6) schema.engine = (int)catalogGet(&r, 1);
+        } else {
+            schema.num_key_columns = 1;
+            schema.key_columns[0] = schema.primary_key_index;
+            schema.key_in_id = 1;
         }
-        new_child->next = full_child->next;
-        full_child->next = new_child;
-        full_child->num_keys = mid;
-    } else {
-        new_child->num_keys = ORDER - mid - 1;
-        for (int i = 0; i < new_child->num_keys; i++) {
-            new_child->keys[i] = full_child->keys[mid + 1 + i];
-            new_child->children[i] = full_child->children[mid + 1 + i];
+        if (schema.num_columns > MAX_COLUMNS || schema.primary_key_index >= schema.num_columns ||
+            schema.num_key_columns < 1 || schema.num_key_columns > MAX_KEY_COLUMNS ||
+            schema.key_columns[0] != schema.primary_key_index || schema.compression > COMPRESSION_LZ4 ||
+            schema.engine > ENGINE_LSM || (schema.engine == ENGINE_LSM && schema.key_in_id)) {
+            r.ok = 0;
+            break;
+        }
+        for (int k = 1; k < schema.num_key_columns; k++) {
+            if (schema.key_columns[k] >= schema.num_columns) r.ok = 0;
+        }
+        for (int c = 0; c < schema.num_columns; c++) {
+            catalogGetString(&r, columns[c].name, sizeof(columns[c].name));
+            catalogGetString(&r, columns[c].type, sizeof(columns[c].type));
+            columns[c].size = (int)catalogGet(&r, 4);
+            if (version >= 2) columns[c].offset = (int)catalogGet(&r, 4);
+            if (version >= 5) columns[c].encoded = (int)catalogGet(&r, 1);
+            // A key kept in the id has no field of its own
+            if (columns[c].encoded > 1 ||
+                (version >= 2 && (columns[c].size <= 0 ||
+                                  (!isIdColumn(&schema, c) &&
+                                   4 + columns[c].offset + storedSize(&columns[c]) > schema.row_size)))) {
+                r.ok = 0;
+            }
+        }
+        if (version < 2) legacyLayout(&schema);
+        // Statistics are refreshed by loadRecords while the index is rebuilt
+        catalogGet(&r, 4);
+        catalogGet(&r, 8);
+        catalogGet(&r, version >= 3 ? 8 : 4);
+        catalogGet(&r, version >= 3 ? 8 : 4);
+        if (r.ok && !attachTable(db, &schema)) {
+            outputMessage("Error: Could not open table '%s'!\n", schema.name);
+            keepUnopenedTable(db, &schema);
         }
-        new_child->children[new_child->num_keys] = full_child->children[ORDER];
-        full_child->num_keys = mid;
     }
+    free(buf);
     
-    for (int i = parent->num_keys; i > index; i--) {
-        parent->keys[i] = parent->keys[i - 1];
-        parent->children[i + 1] = parent->children[i];
+    if (!r.ok) {
+        outputMessage("Error: Catalog '%s' is truncated!\n", path);
+        return 0;
     }
-    parent->keys[index] = full_child->keys[mid];
-    parent->children[index + 1] = new_child;
-    parent->num_keys++;
+    return 1;
 }
 
-// Insert into non-full node
-void insertIntoBPTreeRecursive(BPTNode* node, int key, long offset) {
-    int i = node->num_keys - 1;
+// Read the raw TableSchema structs appended by earlier versions
+void loadLegacySchemas(Database* db, const char* path) {
+    FILE* fp = fopen(path, "rb");
+    if (!fp) return;
     
-    if (node->is_leaf) {
-        while (i >= 0 && node->keys[i] > key) {
-            node->keys[i + 1] = node->keys[i];
-            node->offsets[i + 1] = node->offsets[i];
-            i--;
-        }
-        node->keys[i + 1] = key;
-        node->offsets[i + 1] = offset;
-        node->num_keys++;
-    } else {
-        while (i >= 0 && node->keys[i] > key) i--;
-        i++;
-        
-        if (node->children[i]->num_keys == ORDER) {
-            splitChild(node, i);
-            if (key > node->keys[i]) i++;
+    LegacyTableSchema legacy;
+    Column columns[LEGACY_COLUMNS];
+    while (fread(&legacy, sizeof(LegacyTableSchema), 1, fp) == 1) {
+        if (legacy.num_columns < 1 || legacy.num_columns > LEGACY_COLUMNS) continue;
+        TableSchema schema;
+        memset(&schema, 0, sizeof(schema));
+        memset(columns, 0, sizeof(columns));
+        memcpy(schema.name, legacy.name, MAX_FIELD);
+        schema.name[MAX_FIELD - 1] = '\0';
+        schema.columns = columns;
+        schema.num_columns = legacy.num_columns;
+        schema.primary_key_index = legacy.primary_key_index;
+        schema.num_key_columns = 1;
+        schema.key_columns[0] = legacy.primary_key_index;
+        schema.key_in_id = 1;
+        for (int c = 0; c < legacy.num_columns; c++) {
+            memcpy(columns[c].name, legacy.columns[c].name, MAX_FIELD);
+            memcpy(columns[c].type, legacy.columns[c].type, sizeof(columns[c].type));
+            columns[c].name[MAX_FIELD - 1] = '\0';
+            columns[c].type[sizeof(columns[c].type) - 1] = '\0';
         }
-        insertIntoBPTreeRecursive(node->children[i], key, offset);
+        legacyLayout(&schema);
+        attachTable(db, &schema);
     }
+    
+    fclose(fp);
 }
 
-// Insert into B+-tree
-void insertIntoBPTree(Table* table, int key, long offset) {
-    if (!table->root) {
-        table->root = createBPTNode(1);
+// Storage size of a column type declared without a length
+int columnSize(const char* type) {
+    if (strcasecmp(type, "INT") == 0 || strcasecmp(type, "BIGINT") == 0) return INT_FIELD_SIZE;
+    if (strcasecmp(type, "FLOAT") == 0) return FLOAT_FIELD_SIZE;
+    return MAX_FIELD;
+}
+
+// Parse a column type such as INT, TEXT or VARCHAR(n) into column->type and
+// column->size; 0 if the length is malformed or out of range
+int parseColumnType(const char* text, Column* column) {
+    int j = 0;
+    while (*text && *text != '(' && !isspace((unsigned char)*text) && j < (int)sizeof(column->type) - 1) {
+        column->type[j++] = toupper((unsigned char)*text++);
     }
+    column->type[j] = '\0';
+    column->size = columnSize(column->type);
     
-    if (table->root->num_keys == ORDER) {
-        BPTNode* new_root = createBPTNode(0);
-        new_root->children[0] = table->root;
-        splitChild(new_root, 0);
-        table->root = new_root;
+    while (isspace((unsigned char)*text)) text++;
+    if (*text != '(') return j > 0;
+    char* end;
+    long n = strtol(text + 1, &end, 10);
+    while (isspace((unsigned char)*end)) end++;
+    if (end == text + 1 || *end != ')' || n < 1 || n > MAX_VARCHAR) return 0;
+    // INT(11)-style display widths do not change how numbers are stored
+    if (column->size == MAX_FIELD) column->size = (int)n + 1;
+    return 1;
+}
+
+// Declared type of a column, with the length when one was given
+const char* columnTypeName(const Column* column, char* buf) {
+    if (strcasecmp(column->type, "VARCHAR") != 0 ||
+        column->size == columnSize(column->type)) return column->type;
+    sprintf(buf, "%s(%d)", column->type, column->size - 1);
+    return buf;
+}
+
+// Layout of tables created before per-column sizes: ten 50-byte slots, one per
+// column position, the primary key's slot left unused
+void legacyLayout(TableSchema* schema) {
+    for (int c = 0; c < schema->num_columns; c++) {
+        schema->columns[c].size = MAX_FIELD;
+        schema->columns[c].offset = c * MAX_FIELD;
     }
-    
-    insertIntoBPTreeRecursive(table->root, key, offset);
+    schema->row_size = LEGACY_ROW_SIZE;
 }
 
-// Find leaf node
-BPTNode* findLeaf(BPTNode* node, int key) {
-    if (!node) return NULL;
-    if (node->is_leaf) return node;
-    
-    int i = 0;
-    while (i < node->num_keys && key > node->keys[i]) i++;
-    return findLeaf(node->children[i], key);
+// Bytes a column's value takes in the row
+int storedSize(const Column* column) {
+    return column->encoded ? DICT_CODE_SIZE : column->size;
+}
+
+// Pack the columns back to back after the id; a key kept in the id is stored
+// only there. Rows are padded to a multiple of 4 so every id stays aligned.
+void layoutSchema(TableSchema* schema) {
+    int offset = 0;
+    for (int c = 0; c < schema->num_columns; c++) {
+        schema->columns[c].offset = offset;
+        if (!isIdColumn(schema, c)) offset += storedSize(&schema->columns[c]);
+    }
+    schema->row_size = (4 + offset + 3) & ~3;
 }
 
-// Find record by ID
-Record* findRecord(Table* table, int id) {
-    static Record rec;
-    BPTNode* leaf = findLeaf(table->root, id);
+// Add a table to the in-memory catalog, open its data file and rebuild its index
+Table* attachTable(Database* db, const TableSchema* schema) {
+    if (db->num_tables == db->table_capacity) {
+        int capacity = db->table_capacity ? db->table_capacity * 2 : 16;
+        Table** tables = (Table**)realloc(db->tables, capacity * sizeof(Table*));
+        if (!tables) return NULL;
+        db->tables = tables;
+        db->table_capacity = capacity;
+    }
+    if (2 * (db->num_tables + 1) > db->index_size && !rebuildTableIndex(db, db->index_size * 2)) {
+        return NULL;
+    }
     
-    for (int i = 0; i < leaf->num_keys; i++) {
-        if (leaf->keys[i] == id) {
-            lockFile(table->fd, 0);
-            lseek(table->fd, leaf->offsets[i], SEEK_SET);
-            ssize_t bytes = read(table->fd, &rec, sizeof(Record));
-            unlockFile(table->fd);
-            if (bytes == sizeof(Record) && rec.id == id) return &rec;
+    Table* table = (Table*)calloc(1, sizeof(Table));
+    if (!table) return NULL;
+    table->schema = *schema;
+    table->schema.columns = (Column*)malloc(schema->num_columns * sizeof(Column));
+    if (!table->schema.columns) {
+        free(table);
+        return NULL;
+    }
+    memcpy(table->schema.columns, schema->columns, schema->num_columns * sizeof(Column));
+    table->root = createBPTNode(&table->nodes, 1);
+    table->dict_fd = -1;
+#ifndef _WIN32
+    pthread_rwlock_init(&table->map_lock, NULL);
+    pthread_mutex_init(&table->dict_lock, NULL);
+#endif
+    
+    openTableFile(db, table);
+    if (table->fd < 0 && table->schema.engine != ENGINE_LSM) {
+        freeTable(table);
+        return NULL;
+    }
+    openDictionary(db, table, 0);
+    if (table->schema.engine == ENGINE_LSM) {
+        if (!openLsm(db, table)) {
+            freeTable(table);
+            return NULL;
         }
+    } else {
+        loadRecords(table);
     }
-    return NULL;
+    db->tables[db->num_tables++] = table;
+    indexTable(db, db->num_tables - 1);
+    db->schema_version++;
+    return table;
 }
 
-// Display record
-void displayRecord(Table* table, Record* rec) {
-    printf("ID: %d", rec->id);
-    for (int i = 1; i < table->schema.num_columns; i++) {
-        printf(", %s: %s", table->schema.columns[i].name, rec->data[i]);
+// Case-folded FNV-1a hash of a table name
+unsigned long hashTableName(const char* name) {
+    unsigned long h = 2166136261u;
+    for (; *name; name++) {
+        h ^= (unsigned char)tolower((unsigned char)*name);
+        h *= 16777619u;
     }
-    printf("\n");
+    return h;
 }
 
-// Insert record
-void insertRecord(Database* db, const char* table_name, Record* rec) {
-    Table* table = findTable(db, table_name);
-    if (!table) {
-        printf("Error: Table '%s' not found!\n", table_name);
-        return;
+// Add db->tables[slot] to the name index (linear probing)
+void indexTable(Database* db, int slot) {
+    unsigned long mask = db->index_size - 1;
+    unsigned long h = hashTableName(db->tables[slot]->schema.name);
+    while (db->table_index[h & mask] != 0) h++;
+    db->table_index[h & mask] = slot + 1;
+}
+
+// Reallocate the name index with size buckets and re-add every table
+int rebuildTableIndex(Database* db, int size) {
+    int* index = (int*)calloc(size, sizeof(int));
+    if (!index) return 0;
+    free(db->table_index);
+    db->table_index = index;
+    db->index_size = size;
+    for (int i = 0; i < db->num_tables; i++) indexTable(db, i);
+    return 1;
+}
+
+// Open (creating if needed) the data file of a table and map it in mmap mode.
+// LSM tables have no data file, and keep fd at -1.
+void openTableFile(Database* db, Table* table) {
+    table->fd = -1;
+    table->map = NULL;
+    table->map_len = 0;
+    table->file_size = 0;
+    table->page_bytes = 0;
+    if (table->schema.engine == ENGINE_LSM) return;
+    char data_file[256];
+    snprintf(data_file, sizeof(data_file), "%s/%s.dat", db->db_dir, table->schema.name);
+#ifdef _WIN32
+    table->fd = open(data_file, _O_CREAT | _O_RDWR | _O_BINARY, _S_IREAD | _S_IWRITE);
+#else
+    table->fd = open(data_file, O_CREAT | O_RDWR, 0644);
+#endif
+    table->file_size = table->fd >= 0 ? lseek(table->fd, 0, SEEK_END) : 0;
+    table->use_uring = (db->io_mode == IO_URING);
+    if (table->fd >= 0 && table->schema.compression != COMPRESSION_NONE) {
+        openPages(table);
+        if (!openPageLog(db, table)) {
+            close(table->fd);
+            table->fd = -1;
+        }
     }
+    if (table->fd >= 0 && db->io_mode == IO_MMAP) mapTable(table);
+}
+
+#ifndef _WIN32
+// Map the data file read-only. The mapping extends past the end of the file in
+// MMAP_CHUNK steps so appends only need a remap once they cross a chunk boundary.
+// Compressed tables are not mapped; their rows are read through the buffer cache.
+// Nor are LSM tables, which keep their rows in runs.
+int mapTable(Table* table) {
+    if (table->page_bytes || table->lsm || table->schema.engine == ENGINE_LSM) return 1;
+    size_t len = ((size_t)table->file_size / MMAP_CHUNK + 1) * MMAP_CHUNK;
+    void* map = mmap(NULL, len, PROT_READ, MAP_SHARED, table->fd, 0);
+    if (map == MAP_FAILED) return 0;
+    table->map = (char*)map;
+    table->map_len = len;
+    table->map_advice = -1;
+    return 1;
+}
+
+// Drop the mapping and fall back to read(), once no view into it is pinned
+void unmapTable(Table* table) {
+    pthread_rwlock_wrlock(&table->map_lock);
+    if (table->map) munmap(table->map, table->map_len);
+    table->map = NULL;
+    table->map_len = 0;
+    pthread_rwlock_unlock(&table->map_lock);
+}
+
+// Keep the mapping where it is while rows are read in place from it
+void pinTableMap(Table* table) {
+    pthread_rwlock_rdlock(&table->map_lock);
+}
+
+void unpinTableMap(Table* table) {
+    pthread_rwlock_unlock(&table->map_lock);
+}
+
+// Tell the kernel how the mapping is about to be read: sequentially for scans
+// (aggressive readahead) or randomly for point lookups (no readahead)
+void adviseTable(Table* table, int sequential) {
+    if (!table->map || table->map_advice == sequential) return;
+    madvise(table->map, table->map_len, sequential ? MADV_SEQUENTIAL : MADV_RANDOM);
+    table->map_advice = sequential;
+}
+
+// Record that the data file grew to size bytes, remapping if it outgrew the mapping
+void noteTableGrowth(Table* table, long size) {
+    if (size <= table->file_size) return;
+    table->file_size = size;
+    if (!table->map || (size_t)size <= table->map_len) return;
     
-    if (findRecord(table, rec->id)) {
-        printf("Error: Record with ID %d already exists!\n", rec->id);
+    // Moving the mapping waits for pinned views to be released
+    int advice = table->map_advice;
+    pthread_rwlock_wrlock(&table->map_lock);
+#ifdef __linux__
+    size_t len = ((size_t)size / MMAP_CHUNK + 1) * MMAP_CHUNK;
+    void* map = mremap(table->map, table->map_len, len, MREMAP_MAYMOVE);
+    if (map != MAP_FAILED) {
+        table->map = (char*)map;
+        table->map_len = len;
+        pthread_rwlock_unlock(&table->map_lock);
         return;
     }
-    
-    lockFile(table->fd, 1);
-    long offset = getNextOffset(table->fd);
-    lseek(table->fd, offset, SEEK_SET);
-    write(table->fd, rec, sizeof(Record));
-    insertIntoBPTree(table, rec->id, offset);
-    table->record_count++;
-    unlockFile(table->fd);
-    printf("Record inserted successfully.\n");
+#endif
+    munmap(table->map, table->map_len);
+    table->map = NULL;
+    table->map_len = 0;
+    pthread_rwlock_unlock(&table->map_lock);
+    if (mapTable(table) && advice >= 0) adviseTable(table, advice);
+}
+#else
+int mapTable(Table* table) {
+    (void)table;
+    return 0;
 }
 
-// Update record
-void updateRecord(Database* db, const char* table_name, int id, Record* rec) {
-    Table* table = findTable(db, table_name);
-    if (!table) {
-        printf("Error: Table '%s' not found!\n", table_name);
+void unmapTable(Table* table) {
+    (void)table;
+}
+
+void pinTableMap(Table* table) {
+    (void)table;
+}
+
+void unpinTableMap(Table* table) {
+    (void)table;
+}
+
+void adviseTable(Table* table, int sequential) {
+    (void)table;
+    (void)sequential;
+}
+
+void noteTableGrowth(Table* table, long size) {
+    if (size > table->file_size) table->file_size = size;
+}
+#endif
+
+// Switch every table (and tables created later) between pread, io_uring and mmap I/O
+void setIoMode(Database* db, int mode) {
+    static const char* names[] = {"SYSCALL", "URING", "MMAP"};
+#ifdef _WIN32
+    if (mode == IO_MMAP) {
+        outputMessage("Error: mmap I/O is not supported on this platform!\n");
         return;
     }
+#endif
+    if (mode == IO_URING && aioContext()->ring_fd < 0) {
+        outputMessage("Note: io_uring is unavailable, reads fall back to pread.\n");
+    }
+    db->io_mode = mode;
+    for (int i = 0; i < db->num_tables; i++) {
+        Table* table = db->tables[i];
+        table->use_uring = (mode == IO_URING);
+        if (mode == IO_MMAP && !table->map && !mapTable(table)) {
+            outputMessage("Error: Could not map table '%s', it stays on read()!\n", table->schema.name);
+        } else if (mode != IO_MMAP) {
+            unmapTable(table);
+        }
+    }
+    outputMessage("I/O mode set to %s.\n", names[mode]);
+}
+
+// Load records from table file
+void loadRecords(Table* table) {
+    lseek(table->fd, 0, SEEK_SET);
+    Record* rec = allocRecord(table);
+    unsigned char buf[MAX_KEY_BYTES];
+    IndexKey key;
+    long offset = 0;
+    int row_size = table->schema.row_size;
+    if (!rec) return;
     
-    BPTNode* leaf = findLeaf(table->root, id);
-    long offset = -1;
-    for (int i = 0; i < leaf->num_keys; i++) {
-        if (leaf->keys[i] == id) {
-            offset = leaf->offsets[i];
-            break;
+    while (table->page_bytes ? readPagedRows(table, offset, rec, row_size)
+                             : read(table->fd, rec, row_size) == row_size) {
+        if (rec->id != 0 && recordKey(table, rec, buf, &key) && insertIntoBPTree(table, &key, offset)) {
+            noteKeyStats(table, &key);
+            table->record_count++;
+        } else {
+            table->stats.dead_rows++;
         }
+        offset += table->schema.row_size;
+    }
+    free(rec);
+    rebuildKeyFilter(table);
+}
+
+// Create table. A single INT key is kept in the row's id; BIGINT, FLOAT, text
+// and composite keys are stored as ordinary fields. Tables created with
+// COMPRESSION_LZ4 store their rows in compressed pages. ENGINE_LSM tables keep
+// every key in fields, as their rows use the id to tell writes from deletes.
+void createTable(Database* db, const char* table_name, Column* columns, int num_columns,
+                 const int* key_columns, int num_key_columns, int compression, int engine) {
+    if (findTable(db, table_name) || isUnopenedTable(db, table_name)) {
+        outputMessage("Error: Table '%s' already exists!\n", table_name);
+        return;
     }
     
-    if (offset == -1) {
-        printf("Error: Record not found!\n");
+    TableSchema schema;
+    memset(&schema, 0, sizeof(schema));
+    strncpy(schema.name, table_name, MAX_FIELD - 1);
+    schema.columns = columns;
+    schema.num_columns = num_columns;
+    schema.primary_key_index = key_columns[0];
+    memcpy(schema.key_columns, key_columns, num_key_columns * sizeof(int));
+    schema.num_key_columns = num_key_columns;
+    schema.key_in_id = engine == ENGINE_HEAP && num_key_columns == 1 &&
+                       strcasecmp(columns[key_columns[0]].type, "INT") == 0;
+    schema.compression = compression;
+    schema.engine = engine;
+    layoutSchema(&schema);
+    
+    if (!attachTable(db, &schema)) {
+        outputMessage("Error: Could not create table file!\n");
         return;
     }
     
-    rec->id = id;
-    lockFile(table->fd, 1);
-    lseek(table->fd, offset, SEEK_SET);
-    write(table->fd, rec, sizeof(Record));
-    unlockFile(table->fd);
-    printf("Record updated successfully.\n");
+    if (!saveCatalog(db)) {
+        outputMessage("Error: Could not save the catalog!\n");
+        return;
+    }
+    outputMessage("Table '%s' created successfully.\n", table_name);
 }
 
-// Delete record
-void deleteRecord(Database* db, const char* table_name, int id) {
+// Find table by name through the catalog's hash index
+Table* findTable(Database* db, const char* table_name) {
+    unsigned long mask = db->index_size - 1;
+    for (unsigned long h = hashTableName(table_name);; h++) {
+        int slot = db->table_index[h & mask];
+        if (slot == 0) return NULL;
+        if (strcasecmp(db->tables[slot - 1]->schema.name, table_name) == 0) {
+            Table* table = db->tables[slot - 1];
+            CachedResult* e = result_deps;
+            if (e && e->num_tables >= 0) {
+                int i = 0;
+                while (i < e->num_tables && e->tables[i] != table) i++;
+                if (i == RESULT_CACHE_TABLES) {
+                    e->num_tables = -1;
+                } else if (i == e->num_tables) {
+                    e->tables[e->num_tables++] = table;
+                }
+            }
+            return table;
+        }
+    }
+}
+
+// Drop a table: take it out of the catalog, then delete its data file
+void dropTable(Database* db, const char* table_name) {
     Table* table = findTable(db, table_name);
     if (!table) {
-        printf("Error: Table '%s' not found!\n", table_name);
+        outputMessage("Error: Table '%s' not found!\n", table_name);
         return;
     }
     
-    BPTNode* leaf = findLeaf(table->root, id);
-    long offset = -1;
-    int key_index = -1;
+    char name[MAX_FIELD];
+    char data_file[256];
+    char dict_file[256];
+    char wal_file[256];
+    char old_wal_file[260];
+    int engine = table->schema.engine;
+    strcpy(name, table->schema.name);
+    snprintf(data_file, sizeof(data_file), "%s/%s.dat", db->db_dir, name);
+    snprintf(dict_file, sizeof(dict_file), "%s/%s.dict", db->db_dir, name);
+    snprintf(wal_file, sizeof(wal_file), "%s/%s.wal", db->db_dir, name);
+    snprintf(old_wal_file, sizeof(old_wal_file), "%s.old", wal_file);
+    int slot = 0;
+    while (db->tables[slot] != table) slot++;
+    memmove(&db->tables[slot], &db->tables[slot + 1], (db->num_tables - slot - 1) * sizeof(Table*));
+    db->num_tables--;
+    freeTable(table);
+    memset(db->table_index, 0, db->index_size * sizeof(int));
+    for (int i = 0; i < db->num_tables; i++) indexTable(db, i);
+    db->schema_version++;
     
-    for (int i = 0; i < leaf->num_keys; i++) {
-        if (leaf->keys[i] == id) {
-            offset = leaf->offsets[i];
-            key_index = i;
-            break;
+    if (!saveCatalog(db)) {
+        outputMessage("Error: Could not save the catalog!\n");
+        return;
+    }
+    remove(data_file);
+    remove(dict_file);
+    remove(wal_file);
+    remove(old_wal_file);
+    if (engine == ENGINE_LSM) removeLsmFiles(db->db_dir, name);
+    outputMessage("Table '%s' dropped successfully.\n", name);
+}
+
+// Release a table's index, mapping, data and dictionary files and memory
+void freeTable(Table* table) {
+    freeLsm(table);
+    freeBPTree(table);
+    freeKeyFilter(table);
+    unmapTable(table);
+    closePageLog(table, 1);
+    dropCachedPages(table);
+    if (table->fd >= 0) close(table->fd);
+    if (table->dict_fd >= 0) close(table->dict_fd);
+    freeDicts(table);
+#ifndef _WIN32
+    pthread_rwlock_destroy(&table->map_lock);
+    pthread_mutex_destroy(&table->dict_lock);
+#endif
+    free(table->schema.columns);
+    free(table);
+}
+
+// ALTER TABLE ... ADD COLUMN. The column goes after the last field of the row
+// layout. When the rows have unused space there (tables in the legacy layout
+// keep ten slots) no data is rewritten and existing rows read the column as
+// empty; otherwise the data file is rewritten with wider rows.
+void addColumn(Database* db, Table* table, const Column* column) {
+    TableSchema* schema = &table->schema;
+    if (schema->num_columns >= MAX_COLUMNS) {
+        outputMessage("Error: Table '%s' already has %d columns!\n", schema->name, MAX_COLUMNS);
+        return;
+    }
+    for (int i = 0; i < schema->num_columns; i++) {
+        if (strcasecmp(schema->columns[i].name, column->name) == 0) {
+            outputMessage("Error: Column '%s' already exists!\n", column->name);
+            return;
         }
     }
     
-    if (offset == -1) {
-        printf("Error: Record not found!\n");
+    Column* columns = (Column*)realloc(schema->columns, (schema->num_columns + 1) * sizeof(Column));
+    if (!columns) {
+        outputMessage("Error: Out of memory!\n");
         return;
     }
+    schema->columns = columns;
     
-    lockFile(table->fd, 1);
-    Record empty = {0};
-    lseek(table->fd, offset, SEEK_SET);
-    write(table->fd, &empty, sizeof(Record));
+    int end = 0;
+    for (int i = 0; i < schema->num_columns; i++) {
+        if (isIdColumn(schema, i)) continue;
+        int field_end = columns[i].offset + storedSize(&columns[i]);
+        if (field_end > end) end = field_end;
+    }
+    Column* added = &columns[schema->num_columns];
+    *added = *column;
+    added->offset = end;
+    int row_size = (4 + end + added->size + 3) & ~3;
+    // rewriteTable saves the catalog with the column, or leaves the old data file in place
+    schema->num_columns++;
+    if (row_size > schema->row_size) {
+        if (!rewriteTable(db, table, row_size, NULL, NULL)) {
+            schema->num_columns--;
+            outputMessage("Error: Could not rewrite the data of '%s'!\n", schema->name);
+            return;
+        }
+    } else if (!saveCatalog(db)) {
+        schema->num_columns--;
+        outputMessage("Error: Could not save the catalog!\n");
+        return;
+    }
+    db->schema_version++;
+    outputMessage("Column '%s' added to '%s'.\n", column->name, schema->name);
+}
+
+// Copy the live rows into a new data file with row_size-byte rows, swap it in,
+// save the catalog and rebuild the index; dead rows are dropped. Rows go
+// through convert when one is given, otherwise they keep their bytes and the
+// extra ones are zeroed. The caller changes the schema's columns first and
+// puts them back if this fails; the old data file is kept until the catalog
+// is saved, so a failure leaves the table as it was.
+int rewriteTable(Database* db, Table* table, int row_size, RowConverter convert, void* ctx) {
+    if (table->lsm) return rewriteLsm(db, table, row_size, convert, ctx);
+    char path[256];
+    char tmp[260];
+    char old_path[260];
+    snprintf(path, sizeof(path), "%s/%s.dat", db->db_dir, table->schema.name);
+    snprintf(tmp, sizeof(tmp), "%s.tmp", path);
+    snprintf(old_path, sizeof(old_path), "%s.old", path);
     
-    for (int i = key_index; i < leaf->num_keys - 1; i++) {
-        leaf->keys[i] = leaf->keys[i + 1];
-        leaf->offsets[i] = leaf->offsets[i + 1];
+    int old_size = table->schema.row_size;
+    FILE* out = table->page_bytes ? NULL : fopen(tmp, "wb");
+    char* row = (char*)calloc(1, row_size > old_size ? row_size : old_size);
+    char* converted = convert ? (char*)calloc(1, row_size) : row;
+    int ok = (out || table->page_bytes) && row && converted;
+    lockFile(table->fd, 1);
+    if (table->page_bytes) {
+        if (ok) ok = rewritePagedRows(table, tmp, row_size, convert, ctx);
+    } else {
+        lseek(table->fd, 0, SEEK_SET);
+        while (ok && read(table->fd, row, old_size) == old_size) {
+            if (((Record*)row)->id == 0) continue;
+            if (convert && !convert(ctx, (Record*)row, (Record*)converted)) ok = 0;
+            if (ok && fwrite(converted, row_size, 1, out) != 1) ok = 0;
+        }
+    }
+    if (out && fclose(out) != 0) ok = 0;
+    if (converted != row) free(converted);
+    free(row);
+    // The old file takes the logged writes first, so no log outlives it
+    if (ok) ok = closePageLog(table, 0);
+    if (!ok) {
+        unlockFile(table->fd);
+        remove(tmp);
+        return 0;
     }
-    leaf->num_keys--;
     
-    table->record_count--;
+    unmapTable(table);
+    dropCachedPages(table);
     unlockFile(table->fd);
-    printf("Record deleted successfully.\n");
+    close(table->fd);
+    // The old file stays linked as old_path until the catalog is saved
+    remove(old_path);
+#ifdef _WIN32
+    int swapped = rename(path, old_path) == 0;
+    if (swapped && rename(tmp, path) != 0) {
+        rename(old_path, path);
+        swapped = 0;
+    }
+#else
+    int swapped = link(path, old_path) == 0;
+    if (swapped && rename(tmp, path) != 0) {
+        remove(old_path);
+        swapped = 0;
+    }
+#endif
+    table->schema.row_size = row_size;
+    if (swapped && !saveCatalog(db)) {
+#ifdef _WIN32
+        remove(path);
+#endif
+        rename(old_path, path);
+        swapped = 0;
+    }
+    if (!swapped) {
+        // The index still points into the old file
+        remove(tmp);
+        table->schema.row_size = old_size;
+        openTableFile(db, table);
+        return 0;
+    }
+    remove(old_path);
+    
+    clearBPTree(table, 1);
+    table->root = createBPTNode(&table->nodes, 1);
+    table->record_count = 0;
+    memset(&table->stats, 0, sizeof(table->stats));
+    openTableFile(db, table);
+    if (table->fd < 0) return 0;
+    loadRecords(table);
+    return 1;
 }
 
-// Select all records
-void selectAllRecords(Table* table) {
-    printf("\n--- All Records from %s ---\n", table->schema.name);
-    BPTNode* leaf = table->root;
-    while (leaf && !leaf->is_leaf) leaf = leaf->children[0];
+// Write the live rows of a compressed table, converted or widened to row_size
+// bytes as rewriteTable does, to a new compressed data file at path, a page at a time
+int rewritePagedRows(Table* table, const char* path, int row_size, RowConverter convert, void* ctx) {
+    Table out;
+    memset(&out, 0, sizeof(out));
+    out.schema = table->schema;
+    out.schema.row_size = row_size;
+#ifdef _WIN32
+    out.fd = open(path, _O_CREAT | _O_TRUNC | _O_RDWR | _O_BINARY, _S_IREAD | _S_IWRITE);
+#else
+    out.fd = open(path, O_CREAT | O_TRUNC | O_RDWR, 0644);
+#endif
+    if (out.fd < 0) return 0;
+    openPages(&out);
     
-    int found = 0;
-    while (leaf) {
-        for (int i = 0; i < leaf->num_keys; i++) {
-            Record rec;
-            lockFile(table->fd, 0);
-            lseek(table->fd, leaf->offsets[i], SEEK_SET);
-            read(table->fd, &rec, sizeof(Record));
-            unlockFile(table->fd);
-            if (rec.id != 0) {
-                displayRecord(table, &rec);
-                found++;
-            }
+    int old_size = table->schema.row_size;
+    char* chunk = (char*)calloc(1, out.page_bytes);
+    Record* row = (Record*)malloc(old_size);
+    long n = 0;
+    int ok = chunk && row;
+    for (long offset = 0; ok && offset < table->file_size; offset += old_size) {
+        if (!readPagedRows(table, offset, row, old_size)) ok = 0;
+        if (!ok || row->id == 0) continue;
+        Record* rec = (Record*)(chunk + n);
+        memset(rec, 0, row_size);
+        if (convert && !convert(ctx, row, rec)) {
+            ok = 0;
+            continue;
+        }
+        if (!convert) memcpy(rec, row, old_size);
+        n += row_size;
+        if (n == out.page_bytes) {
+            ok = writePagedRows(&out, out.file_size, chunk, n);
+            n = 0;
         }
-        leaf = leaf->next;
     }
-    if (!found) printf("No records found.\n");
-    printf("--- End ---\n");
+    if (ok && n > 0) ok = writePagedRows(&out, out.file_size, chunk, n);
+    dropCachedPages(&out);
+    close(out.fd);
+    free(row);
+    free(chunk);
+    return ok;
 }
 
-// Select records in range
-void selectRecords(Table* table, int min_id, int max_id) {
-    if (min_id > max_id) {
-        printf("Error: Invalid range!\n");
-        return;
+// Scan callback counting the distinct values of the candidate columns; a column
+// drops out once it has more than DICT_MAX_VALUES, and the scan stops when none is left
+int countDistinctRow(void* ctx, Record* rec) {
+    DistinctScan* ds = (DistinctScan*)ctx;
+    Table* table = ds->table;
+    int remaining = 0;
+    for (int c = 0; c < table->schema.num_columns; c++) {
+        if (!ds->candidate[c]) continue;
+        const char* field = recordField(table, rec, c);
+        ColumnDict* seen = &ds->seen[c];
+        if (dictAdd(seen, field, strnlen(field, table->schema.columns[c].size)) < 0 ||
+            seen->count > DICT_MAX_VALUES + 1) {
+            ds->candidate[c] = 0;
+            freeDict(seen);
+        } else {
+            remaining++;
+        }
+    }
+    return remaining > 0;
+}
+
+// Row converter of encodeColumns: move every field to the new layout, turning
+// the values of the newly encoded columns into their codes
+int encodeRow(void* ctx, const Record* from, Record* to) {
+    RowEncoding* enc = (RowEncoding*)ctx;
+    Table* table = enc->table;
+    TableSchema* schema = &table->schema;
+    to->id = from->id;
+    for (int c = 0; c < schema->num_columns; c++) {
+        if (isIdColumn(schema, c)) continue;
+        const Column* old = &enc->old_columns[c];
+        const char* field = from->data + old->offset;
+        char* dest = to->data + schema->columns[c].offset;
+        if (schema->columns[c].encoded && !old->encoded) {
+            long code = encodeValue(table, c, field, strnlen(field, old->size));
+            if (code < 0) return 0;
+            storeCode(dest, (uint32_t)code);
+        } else {
+            memcpy(dest, field, storedSize(old));
+        }
+    }
+    return 1;
+}
+
+// Dictionary encode the VARCHAR columns outside the key whose values repeat a
+// lot, so their rows hold a DICT_CODE_SIZE code instead of the text. Unless
+// forced, a table is only looked at once it has DICT_MIN_ROWS rows and again
+// each time its row count doubles. Looking reads the whole table, and encoding
+// columns rewrites the data file in the new layout, so only COPY FROM and
+// ALTER TABLE ... ENCODE call this, never a single-row INSERT. Returns the
+// number of columns encoded, or -1 if the rewrite failed.
+int encodeColumns(Database* db, Table* table, int force) {
+    TableSchema* schema = &table->schema;
+    if (!force && (table->record_count < DICT_MIN_ROWS || table->record_count < 2 * table->dict_checked)) return 0;
+    table->dict_checked = table->record_count;
+    
+    DistinctScan ds;
+    memset(&ds, 0, sizeof(ds));
+    ds.table = table;
+    unsigned columns = 0;
+    for (int c = 0; c < schema->num_columns; c++) {
+        Column* column = &schema->columns[c];
+        ds.candidate[c] = !column->encoded && !isKeyColumn(schema, c) &&
+                          valueType(column->type) == VALUE_TEXT && column->size > DICT_CODE_SIZE;
+        if (ds.candidate[c]) columns |= columnBit(c);
+    }
+    if (!columns) return 0;
+    ds.seen = (ColumnDict*)calloc(schema->num_columns, sizeof(ColumnDict));
+    if (!ds.seen) {
+        outputMessage("Error: Out of memory!\n");
+        return -1;
+    }
+    scanTable(table, NULL, NULL, columns, countDistinctRow, &ds);
+    
+    int chosen = 0;
+    for (int c = 0; c < schema->num_columns; c++) {
+        if (ds.candidate[c] && (long)ds.seen[c].count * DICT_MIN_REPEATS > table->record_count) {
+            ds.candidate[c] = 0;
+        }
+        chosen += ds.candidate[c];
+        freeDict(&ds.seen[c]);
+    }
+    free(ds.seen);
+    if (!chosen) return 0;
+    if (table->dict_fd < 0 && !openDictionary(db, table, 1)) {
+        outputMessage("Error: Could not create the dictionary of '%s'!\n", schema->name);
+        return -1;
+    }
+    
+    Column* old_columns = (Column*)malloc(schema->num_columns * sizeof(Column));
+    if (!old_columns) {
+        outputMessage("Error: Out of memory!\n");
+        return -1;
+    }
+    memcpy(old_columns, schema->columns, schema->num_columns * sizeof(Column));
+    int old_size = schema->row_size;
+    for (int c = 0; c < schema->num_columns; c++) {
+        if (ds.candidate[c]) schema->columns[c].encoded = 1;
+    }
+    layoutSchema(schema);
+    int row_size = schema->row_size;
+    schema->row_size = old_size;
+    
+    RowEncoding enc = {table, old_columns};
+    if (!rewriteTable(db, table, row_size, encodeRow, &enc)) {
+        memcpy(schema->columns, old_columns, schema->num_columns * sizeof(Column));
+        schema->row_size = old_size;
+        outputMessage("Error: Could not rewrite the data of '%s'!\n", schema->name);
+        chosen = -1;
+    }
+    free(old_columns);
+    return chosen;
+}
+
+// Zeroed row buffer for a table
+Record* allocRecord(Table* table) {
+    return (Record*)calloc(1, table->schema.row_size);
+}
+
+// Stored value of a column not kept in the id
+char* recordField(Table* table, Record* rec, int col) {
+    return rec->data + table->schema.columns[col].offset;
+}
+
+// Projection bit of a column; columns past 30 share the top bit
+unsigned columnBit(int col) {
+    return 1u << (col < 31 ? col : 31);
+}
+
+// Store a value into a row, refusing values longer than the column holds; an
+// encoded column gets the value's dictionary code
+int storeField(Table* table, Record* rec, int col, const char* text, size_t len) {
+    Column* column = &table->schema.columns[col];
+    if (len >= (size_t)column->size) {
+        outputMessage("Error: Value for column '%s' is longer than %d bytes!\n",
+                      column->name, column->size - 1);
+        return 0;
+    }
+    char* field = recordField(table, rec, col);
+    if (column->encoded) {
+        long code = encodeValue(table, col, text, len);
+        if (code < 0) {
+            outputMessage("Error: Could not add '%.*s' to the dictionary of column '%s'!\n",
+                          (int)len, text, column->name);
+            return 0;
+        }
+        storeCode(field, (uint32_t)code);
+        return 1;
+    }
+    memcpy(field, text, len);
+    field[len] = '\0';
+    return 1;
+}
+
+// Dictionary code held by the field of an encoded column
+uint32_t fieldCode(const char* field) {
+    uint32_t code;
+    memcpy(&code, field, DICT_CODE_SIZE);
+    return code;
+}
+
+void storeCode(char* field, uint32_t code) {
+    memcpy(field, &code, DICT_CODE_SIZE);
+}
+
+// Stored value of a column not kept in the id as text, decoding dictionary codes
+const char* fieldText(Table* table, Record* rec, int col) {
+    const char* field = recordField(table, rec, col);
+    return table->schema.columns[col].encoded ? dictValue(table, col, fieldCode(field)) : field;
+}
+
+// FNV-1a hash of a dictionary value
+uint32_t hashDictValue(const char* text, size_t len) {
+    uint32_t h = 2166136261u;
+    for (size_t i = 0; i < len; i++) {
+        h ^= (unsigned char)text[i];
+        h *= 16777619u;
+    }
+    return h;
+}
+
+// Code of a value in a dictionary, -1 if it is not there
+long dictFind(const ColumnDict* dict, const char* text, size_t len) {
+    if (len == 0) return 0;
+    if (!dict->num_slots) return -1;
+    uint32_t mask = dict->num_slots - 1;
+    for (uint32_t h = hashDictValue(text, len) & mask; dict->slots[h]; h = (h + 1) & mask) {
+        const char* value = dict->values[dict->slots[h]];
+        if (strncmp(value, text, len) == 0 && value[len] == '\0') return dict->slots[h];
+    }
+    return -1;
+}
+
+// Make room for one more value, so that dictInsert cannot fail
+int dictReserve(ColumnDict* dict) {
+    if (dict->count == 0) dict->count = 1;
+    if (dict->count >= dict->capacity) {
+        uint32_t capacity = dict->capacity ? dict->capacity * 2 : 16;
+        char** values = (char**)realloc(dict->values, capacity * sizeof(char*));
+        if (!values) return 0;
+        values[0] = NULL;
+        dict->values = values;
+        dict->capacity = capacity;
+    }
+    if (2 * dict->count > dict->num_slots) {
+        uint32_t size = dict->num_slots ? dict->num_slots * 2 : 32;
+        uint32_t* slots = (uint32_t*)calloc(size, sizeof(uint32_t));
+        if (!slots) return 0;
+        for (uint32_t code = 1; code < dict->count; code++) {
+            uint32_t h = hashDictValue(dict->values[code], strlen(dict->values[code])) & (size - 1);
+            while (slots[h]) h = (h + 1) & (size - 1);
+            slots[h] = code;
+        }
+        free(dict->slots);
+        dict->slots = slots;
+        dict->num_slots = size;
+    }
+    return 1;
+}
+
+// Add a value the dictionary does not hold, taking over the string; the
+// caller has called dictReserve. Returns the value's code.
+uint32_t dictInsert(ColumnDict* dict, char* value) {
+    uint32_t code = dict->count++;
+    uint32_t mask = dict->num_slots - 1;
+    uint32_t h = hashDictValue(value, strlen(value)) & mask;
+    while (dict->slots[h]) h = (h + 1) & mask;
+    dict->slots[h] = code;
+    dict->values[code] = value;
+    return code;
+}
+
+// Code of a value, added to the dictionary if it is new; -1 if out of memory
+long dictAdd(ColumnDict* dict, const char* text, size_t len) {
+    long code = dictFind(dict, text, len);
+    if (code >= 0) return code;
+    char* value = dictReserve(dict) ? (char*)malloc(len + 1) : NULL;
+    if (!value) return -1;
+    memcpy(value, text, len);
+    value[len] = '\0';
+    return dictInsert(dict, value);
+}
+
+void freeDict(ColumnDict* dict) {
+    for (uint32_t code = 1; code < dict->count; code++) free(dict->values[code]);
+    free(dict->values);
+    free(dict->slots);
+    memset(dict, 0, sizeof(*dict));
+}
+
+void freeDicts(Table* table) {
+    if (!table->dicts) return;
+    for (int c = 0; c < MAX_COLUMNS; c++) freeDict(&table->dicts[c]);
+    free(table->dicts);
+    table->dicts = NULL;
+}
+
+// Dictionary of a column, allocating the table's dictionaries on first use
+ColumnDict* columnDict(Table* table, int col) {
+    if (!table->dicts) table->dicts = (ColumnDict*)calloc(MAX_COLUMNS, sizeof(ColumnDict));
+    return table->dicts ? &table->dicts[col] : NULL;
+}
+
+// Value of a dictionary code; unknown codes read as empty
+const char* dictValue(Table* table, int col, uint32_t code) {
+    ColumnDict* dict = table->dicts ? &table->dicts[col] : NULL;
+    return dict && code > 0 && code < dict->count ? dict->values[code] : "";
+}
+
+void lockDict(Table* table) {
+#ifndef _WIN32
+    pthread_mutex_lock(&table->dict_lock);
+#else
+    (void)table;
+#endif
+}
+
+void unlockDict(Table* table) {
+#ifndef _WIN32
+    pthread_mutex_unlock(&table->dict_lock);
+#else
+    (void)table;
+#endif
+}
+
+// Open the .dict file of a table and load its dictionaries: entries of a u16
+// column, a u16 length and the value's bytes, in code order per column. A torn
+// entry at the end, left by a crash while a value was appended, is cut off.
+// Without create, a table that has no file keeps dict_fd at -1.
+int openDictionary(Database* db, Table* table, int create) {
+    char path[256];
+    snprintf(path, sizeof(path), "%s/%s.dict", db->db_dir, table->schema.name);
+#ifdef _WIN32
+    int fd = open(path, _O_RDWR | _O_APPEND | _O_BINARY | (create ? _O_CREAT : 0), _S_IREAD | _S_IWRITE);
+#else
+    int fd = open(path, O_RDWR | O_APPEND | (create ? O_CREAT : 0), 0644);
+#endif
+    if (fd < 0) return 0;
+    long size = lseek(fd, 0, SEEK_END);
+    unsigned char* buf = (unsigned char*)malloc(size > 0 ? size : 1);
+    if (!buf || size < 0 || preadFull(fd, buf, size, 0) != (ssize_t)size) {
+        free(buf);
+        close(fd);
+        return 0;
+    }
+    
+    freeDicts(table);
+    CatalogReader r = {buf, buf + size, 1};
+    int ok = 1;
+    while (r.p < r.end) {
+        const unsigned char* entry = r.p;
+        int col = (int)catalogGet(&r, 2);
+        size_t len = (size_t)catalogGet(&r, 2);
+        if (!r.ok || col >= MAX_COLUMNS || len == 0 || (size_t)(r.end - r.p) < len) {
+            ok = ftruncate(fd, (long)(entry - buf)) == 0;
+            break;
+        }
+        ColumnDict* dict = columnDict(table, col);
+        char* value = dict && dictReserve(dict) ? (char*)malloc(len + 1) : NULL;
+        if (!value) break;
+        memcpy(value, r.p, len);
+        value[len] = '\0';
+        dictInsert(dict, value);
+        r.p += len;
+    }
+    free(buf);
+    if (!ok) {
+        close(fd);
+        return 0;
+    }
+    table->dict_fd = fd;
+    return 1;
+}
+
+// Append a value to the table's .dict file
+int appendDictValue(Table* table, int col, const char* text, size_t len) {
+    if (table->dict_fd < 0) return 0;
+    unsigned char* entry = (unsigned char*)malloc(4 + len);
+    if (!entry) return 0;
+    unsigned char* p = catalogPut(entry, (uint64_t)col, 2);
+    p = catalogPut(p, (uint64_t)len, 2);
+    memcpy(p, text, len);
+    long end = lseek(table->dict_fd, 0, SEEK_END);
+    int ok = write(table->dict_fd, entry, 4 + len) == (ssize_t)(4 + len);
+    if (!ok && end >= 0 && ftruncate(table->dict_fd, end) != 0) ok = 0;
+    free(entry);
+    return ok;
+}
+
+// Dictionary code of a value for an encoded column. A new value is written to
+// the .dict file before any row can refer to it. -1 if it could not be added.
+long encodeValue(Table* table, int col, const char* text, size_t len) {
+    if (len == 0) return 0;
+    lockDict(table);
+    ColumnDict* dict = columnDict(table, col);
+    long code = dict ? dictFind(dict, text, len) : -1;
+    if (dict && code < 0 && dictReserve(dict)) {
+        char* value = (char*)malloc(len + 1);
+        if (value && appendDictValue(table, col, text, len)) {
+            memcpy(value, text, len);
+            value[len] = '\0';
+            code = dictInsert(dict, value);
+        } else {
+            free(value);
+        }
+    }
+    unlockDict(table);
+    return code;
+}
+
+// Is col one of the primary key columns?
+int isKeyColumn(const TableSchema* schema, int col) {
+    for (int k = 0; k < schema->num_key_columns; k++) {
+        if (schema->key_columns[k] == col) return 1;
+    }
+    return 0;
+}
+
+// Is col the key kept in Record.id rather than in a field?
+int isIdColumn(const TableSchema* schema, int col) {
+    return schema->key_in_id && col == schema->primary_key_index;
+}
+
+// Position in the primary key of the column name refers to ("col" or
+// "table.col"; "id" also names a single-column key), -1 if none
+int keyColumnIndex(Table* table, const char* name) {
+    TableSchema* schema = &table->schema;
+    const char* dot = strchr(name, '.');
+    if (dot) {
+        if ((size_t)(dot - name) != strlen(schema->name) ||
+            strncasecmp(name, schema->name, dot - name) != 0) return -1;
+        name = dot + 1;
+    }
+    if (schema->num_key_columns == 1 && strcasecmp(name, "id") == 0) return 0;
+    for (int k = 0; k < schema->num_key_columns; k++) {
+        if (strcasecmp(name, schema->columns[schema->key_columns[k]].name) == 0) return k;
+    }
+    return -1;
+}
+
+// Column of a table that name refers to ("col" or "table.col"), -1 if none
+int columnIndex(Table* table, const char* name) {
+    TableSchema* schema = &table->schema;
+    const char* dot = strchr(name, '.');
+    if (dot) {
+        if ((size_t)(dot - name) != strlen(schema->name) ||
+            strncasecmp(name, schema->name, dot - name) != 0) return -1;
+        name = dot + 1;
+    }
+    for (int c = 0; c < schema->num_columns; c++) {
+        if (strcasecmp(name, schema->columns[c].name) == 0) return c;
+    }
+    return -1;
+}
+
+// Write the normalized encoding of one key column's value to out. Integers are
+// 8 bytes big-endian with the sign bit flipped, FLOATs their IEEE bits arranged
+// to sort numerically, text its bytes and a 0 terminator (so a string sorts
+// before its extensions and composite keys stay prefix-free). The encodings of
+// a composite key's columns are concatenated, and memcmp on the result orders
+// keys column by column. Returns the bytes written, -1 if the value is invalid.
+int encodeKeyValue(Table* table, int col, const char* text, size_t len, unsigned char* out) {
+    Column* column = &table->schema.columns[col];
+    int id = isIdColumn(&table->schema, col);
+    int type = id ? VALUE_INT : valueType(column->type);
+    char num[FLOAT_FIELD_SIZE + 1];
+    char* end;
+    uint64_t bits;
+    
+    if (type == VALUE_TEXT) {
+        if (len >= (size_t)column->size || memchr(text, '\0', len)) return -1;
+        memcpy(out, text, len);
+        out[len] = 0;
+        return (int)len + 1;
+    }
+    if (len == 0 || len >= sizeof(num)) return -1;
+    memcpy(num, text, len);
+    num[len] = '\0';
+    errno = 0;
+    if (type == VALUE_INT) {
+        long long v = strtoll(num, &end, 10);
+        if (*end || errno || (id && (v == 0 || v < INT_MIN || v > INT_MAX))) return -1;
+        bits = (uint64_t)v ^ 0x8000000000000000ULL;
+    } else {
+        double d = strtod(num, &end);
+        if (*end || d != d) return -1;
+        if (d == 0) d = 0;   // -0.0 and 0.0 are the same key
+        memcpy(&bits, &d, sizeof(bits));
+        bits = (bits & 0x8000000000000000ULL) ? ~bits : bits ^ 0x8000000000000000ULL;
+    }
+    for (int i = 0; i < 8; i++) out[i] = (unsigned char)(bits >> (56 - 8 * i));
+    return 8;
+}
+
+// Primary key of a stored row, encoded into buf (MAX_KEY_BYTES) when it lives
+// in fields; 0 if the row holds no valid key
+int recordKey(Table* table, Record* rec, unsigned char* buf, IndexKey* key) {
+    TableSchema* schema = &table->schema;
+    if (schema->key_in_id) {
+        *key = intKey(rec->id);
+        return rec->id != 0;
+    }
+    uint32_t len = 0;
+    for (int k = 0; k < schema->num_key_columns; k++) {
+        int col = schema->key_columns[k];
+        const char* field = recordField(table, rec, col);
+        int n = encodeKeyValue(table, col, field, strnlen(field, schema->columns[col].size), buf + len);
+        if (n < 0) return 0;
+        len += (uint32_t)n;
+    }
+    *key = makeKey(buf, len);
+    return 1;
+}
+
+// Key as text for messages and titles: the value of a single-column key, else
+// the tuple of the (leading) key values the key holds
+void formatKey(Table* table, const IndexKey* key, char* out, size_t cap) {
+    TableSchema* schema = &table->schema;
+    int composite = schema->num_key_columns > 1;
+    size_t n = 0;
+    uint32_t pos = 0;
+    
+    out[0] = '\0';
+    if (composite) n += snprintf(out, cap, "(");
+    for (int k = 0; k < schema->num_key_columns && pos < key->len && n < cap; k++) {
+        int col = schema->key_columns[k];
+        int type = isIdColumn(schema, col) ? VALUE_INT : valueType(schema->columns[col].type);
+        if (k > 0) n += snprintf(out + n, cap - n, ", ");
+        if (n >= cap) break;
+        if (type == VALUE_TEXT) {
+            char text[MAX_FIELD];
+            size_t len = 0;
+            while (pos < key->len && keyByte(key, pos) != 0) {
+                if (len < sizeof(text) - 1) text[len++] = (char)keyByte(key, pos);
+                pos++;
+            }
+            text[len] = '\0';
+            pos++;
+            n += snprintf(out + n, cap - n, composite ? "'%s'" : "%s", text);
+            continue;
+        }
+        uint64_t bits = 0;
+        for (int i = 0; i < 8; i++) bits = (bits << 8) | (pos < key->len ? keyByte(key, pos++) : 0);
+        if (type == VALUE_INT) {
+            n += snprintf(out + n, cap - n, "%lld", (long long)(bits ^ 0x8000000000000000ULL));
+        } else {
+            double d;
+            bits = (bits & 0x8000000000000000ULL) ? bits ^ 0x8000000000000000ULL : ~bits;
+            memcpy(&d, &bits, sizeof(d));
+            n += snprintf(out + n, cap - n, "%.15g", d);
+        }
+    }
+    if (composite && n < cap) snprintf(out + n, cap - n, ")");
+}
+
+// Widen the key bounds in the statistics to cover key; called before the row is counted
+void noteKeyStats(Table* table, const IndexKey* key) {
+    if (table->record_count == 0 || key->head < table->stats.min_head) table->stats.min_head = key->head;
+    if (table->record_count == 0 || key->head > table->stats.max_head) table->stats.max_head = key->head;
+}
+
+// List all tables
+void listTables(Database* db) {
+    if (outputWriter()->format != OUTPUT_TABLE) {
+        ResultColumn columns[2] = {{"name", VALUE_TEXT, 0}, {"records", VALUE_INT, 0}};
+        beginResult("Tables", columns, 2);
+        for (int i = 0; i < db->num_tables; i++) {
+            beginRow();
+            outputValue(db->tables[i]->schema.name);
+            outputIntValue(db->tables[i]->record_count);
+            endRow();
+        }
+        endResult();
+        return;
+    }
+    
+    if (db->num_tables == 0) {
+        outputMessage("No tables in database.\n");
+        return;
+    }
+    
+    outputMessage("\n--- Tables ---\n");
+    for (int i = 0; i < db->num_tables; i++) {
+        outputMessage("%s (%d records)\n", db->tables[i]->schema.name, db->tables[i]->record_count);
+    }
+    outputMessage("--- End ---\n");
+}
+
+// Levels of a table's B+ tree
+int treeHeight(Table* table) {
+    int height = 0;
+    for (BPTNode* node = table->root; node; node = node->is_leaf ? NULL : node->children[0]) height++;
+    return height;
+}
+
+// Nodes in use in a table's arena
+long treeNodeCount(Table* table) {
+    long nodes = 0;
+    for (NodeSlab* slab = table->nodes.first; slab; slab = slab->next) nodes += slab->used;
+    return nodes;
+}
+
+// Bytes a table's data file takes; for a compressed table, the blocks actually
+// allocated, as the unused tails of its page slots are holes, and for an LSM
+// table, its logs and runs
+long tableFileSize(Table* table) {
+    struct stat st;
+    if (table->lsm) return lsmFileSize(table);
+    if (table->fd < 0 || fstat(table->fd, &st) != 0) return 0;
+#ifndef _WIN32
+    if (table->page_bytes) return (long)st.st_blocks * 512;
+#endif
+    return (long)st.st_size;
+}
+
+// SHOW STATS: engine counters since the database was created, statement
+// counts and latency percentiles, and the shape of every table
+void showStats(Database* db) {
+    Metrics* m = (Metrics*)malloc(sizeof(Metrics));
+    if (!m) {
+        outputMessage("Error: Out of memory!\n");
+        return;
+    }
+    metricsSnapshot(m);
+    
+    ResultColumn columns[2] = {{"metric", VALUE_TEXT, 0}, {"value", VALUE_FLOAT, 0}};
+    char name[2 * MAX_FIELD + 64];
+    char value[64];
+    beginResult("Engine Statistics", columns, 2);
+    for (int i = 0; i < METRIC_COUNTERS; i++) {
+        beginRow();
+        outputValue(metric_names[i]);
+        outputIntValue((long long)m->counters[i]);
+        endRow();
+    }
+    for (int t = 0; t < STMT_TYPES; t++) {
+        if (!m->queries[t]) continue;
+        static const char* suffixes[] = {"p50_ms", "p99_ms", "p999_ms"};
+        static const double fractions[] = {0.5, 0.99, 0.999};
+        snprintf(name, sizeof(name), "%s_queries", statement_names[t]);
+        beginRow();
+        outputValue(name);
+        outputIntValue((long long)m->queries[t]);
+        endRow();
+        for (int q = 0; q < 3; q++) {
+            snprintf(name, sizeof(name), "%s_%s", statement_names[t], suffixes[q]);
+            snprintf(value, sizeof(value), "%.3f", latencyPercentile(m->latency[t], m->queries[t], fractions[q]) / 1e6);
+            beginRow();
+            outputValue(name);
+            outputValue(value);
+            endRow();
+        }
+    }
+    for (int i = 0; i < db->num_tables; i++) {
+        Table* table = db->tables[i];
+        long slots = table->record_count + table->stats.dead_rows;
+        long long gauges[5] = {table->record_count, tableFileSize(table), treeHeight(table), treeNodeCount(table),
+                               (long long)(table->filter.num_counters / 2)};
+        static const char* gauge_names[] = {"rows", "file_bytes", "tree_height", "tree_nodes", "key_filter_bytes"};
+        for (int g = 0; g < 5; g++) {
+            snprintf(name, sizeof(name), "%s.%s", table->schema.name, gauge_names[g]);
+            beginRow();
+            outputValue(name);
+            outputIntValue(gauges[g]);
+            endRow();
+        }
+        snprintf(name, sizeof(name), "%s.dead_ratio", table->schema.name);
+        snprintf(value, sizeof(value), "%.4f", slots ? (double)table->stats.dead_rows / slots : 0.0);
+        beginRow();
+        outputValue(name);
+        outputValue(value);
+        endRow();
+        if (table->lsm) {
+            LsmTree* lsm = table->lsm;
+            pinLsm(lsm);
+            long long figures[4] = {lsm->num_runs, (long long)(lsm->active->bytes + (lsm->frozen ? lsm->frozen->bytes : 0)),
+                                    (long long)lsm->flushes, (long long)lsm->merges};
+            unpinLsm(lsm);
+            static const char* figure_names[] = {"lsm_runs", "memtable_bytes", "lsm_flushes", "lsm_merges"};
+            for (int f = 0; f < 4; f++) {
+                snprintf(name, sizeof(name), "%s.%s", table->schema.name, figure_names[f]);
+                beginRow();
+                outputValue(name);
+                outputIntValue(figures[f]);
+                endRow();
+            }
+        }
+        if (table->wal) {
+            PageLog* log = table->wal;
+            long long figures[4] = {cachedDirtyPages(table), 0, 0, 0};
+            lockBufferCache();
+            figures[1] = log->bytes;
+            figures[2] = (long long)log->checkpoint_lsn;
+            figures[3] = (long long)log->checkpoints;
+            unlockBufferCache();
+            static const char* figure_names[] = {"dirty_pages", "wal_bytes", "checkpoint_lsn", "checkpoints"};
+            for (int f = 0; f < 4; f++) {
+                snprintf(name, sizeof(name), "%s.%s", table->schema.name, figure_names[f]);
+                beginRow();
+                outputValue(name);
+                outputIntValue(figures[f]);
+                endRow();
+            }
+        }
+        for (int c = 0; c < table->schema.num_columns; c++) {
+            if (!table->schema.columns[c].encoded) continue;
+            ColumnDict* dict = columnDict(table, c);
+            snprintf(name, sizeof(name), "%s.%s.dict_values", table->schema.name, table->schema.columns[c].name);
+            beginRow();
+            outputValue(name);
+            outputIntValue(dict && dict->count ? dict->count - 1 : 0);
+            endRow();
+        }
+    }
+    endResult();
+    free(m);
+}
+
+// SHOW METRICS: the same figures in the Prometheus text exposition format, one
+// line per row. Latencies become a histogram over fixed bounds.
+void showMetrics(Database* db) {
+    static const double bounds[] = {0.00001, 0.00005, 0.0001, 0.0005, 0.001, 0.005,
+                                    0.01, 0.05, 0.1, 0.5, 1, 5};
+    int num_bounds = (int)(sizeof(bounds) / sizeof(bounds[0]));
+    Metrics* m = (Metrics*)malloc(sizeof(Metrics));
+    if (!m) {
+        outputMessage("Error: Out of memory!\n");
+        return;
+    }
+    metricsSnapshot(m);
+    
+    ResultColumn column = {"line", VALUE_TEXT, 0};
+    char line[MAX_FIELD + 256];
+    beginResult("Metrics", &column, 1);
+    for (int i = 0; i < METRIC_COUNTERS; i++) {
+        snprintf(line, sizeof(line), "# TYPE soumyadb_%s_total counter", metric_names[i]);
+        outputTextLine(line);
+        snprintf(line, sizeof(line), "soumyadb_%s_total %llu", metric_names[i], (unsigned long long)m->counters[i]);
+        outputTextLine(line);
+    }
+    
+    outputTextLine("# TYPE soumyadb_query_duration_seconds histogram");
+    for (int t = 0; t < STMT_TYPES; t++) {
+        if (!m->queries[t]) continue;
+        uint64_t below = 0;
+        int b = 0;
+        for (int k = 0; k < num_bounds; k++) {
+            uint64_t limit = (uint64_t)(bounds[k] * 1e9);
+            for (; b < LATENCY_BUCKETS && latencyBucketLimit(b) <= limit; b++) below += m->latency[t][b];
+            snprintf(line, sizeof(line), "soumyadb_query_duration_seconds_bucket{type=\"%s\",le=\"%g\"} %llu",
+                     statement_names[t], bounds[k], (unsigned long long)below);
+            outputTextLine(line);
+        }
+        snprintf(line, sizeof(line), "soumyadb_query_duration_seconds_bucket{type=\"%s\",le=\"+Inf\"} %llu",
+                 statement_names[t], (unsigned long long)m->queries[t]);
+        outputTextLine(line);
+        snprintf(line, sizeof(line), "soumyadb_query_duration_seconds_sum{type=\"%s\"} %.9f",
+                 statement_names[t], m->latency_nanos[t] / 1e9);
+        outputTextLine(line);
+        snprintf(line, sizeof(line), "soumyadb_query_duration_seconds_count{type=\"%s\"} %llu",
+                 statement_names[t], (unsigned long long)m->queries[t]);
+        outputTextLine(line);
+    }
+    
+    static const char* gauge_names[] = {"rows", "file_bytes", "tree_height", "tree_nodes", "dead_ratio",
+                                        "key_filter_bytes"};
+    for (int g = 0; g < 6; g++) {
+        snprintf(line, sizeof(line), "# TYPE soumyadb_table_%s gauge", gauge_names[g]);
+        outputTextLine(line);
+        for (int i = 0; i < db->num_tables; i++) {
+            Table* table = db->tables[i];
+            long slots = table->record_count + table->stats.dead_rows;
+            double v = g == 0 ? table->record_count
+                     : g == 1 ? tableFileSize(table)
+                     : g == 2 ? treeHeight(table)
+                     : g == 3 ? treeNodeCount(table)
+                     : g == 4 ? (slots ? (double)table->stats.dead_rows / slots : 0.0)
+                     : (double)(table->filter.num_counters / 2);
+            snprintf(line, sizeof(line), "soumyadb_table_%s{table=\"%s\"} %.10g", gauge_names[g],
+                     table->schema.name, v);
+            outputTextLine(line);
+        }
+    }
+    endResult();
+    free(m);
+}
+
+// Describe table structure
+void describeTable(Database* db, const char* table_name) {
+    Table* table = findTable(db, table_name);
+    if (!table) {
+        outputMessage("Error: Table '%s' not found!\n", table_name);
+        return;
+    }
+    
+    if (outputWriter()->format != OUTPUT_TABLE) {
+        ResultColumn columns[3] = {{"column", VALUE_TEXT, 0}, {"type", VALUE_TEXT, 0},
+                                   {"primary_key", VALUE_TEXT, 0}};
+        char title[MAX_FIELD + 8];
+        snprintf(title, sizeof(title), "Table: %s", table->schema.name);
+        beginResult(title, columns, 3);
+        for (int i = 0; i < table->schema.num_columns; i++) {
+            char type[40];
+            beginRow();
+            outputValue(table->schema.columns[i].name);
+            outputValue(columnTypeName(&table->schema.columns[i], type));
+            outputValue(isKeyColumn(&table->schema, i) ? "YES" : "NO");
+            endRow();
+        }
+        endResult();
+        return;
+    }
+    
+    outputMessage("\n--- Table: %s ---\n", table->schema.name);
+    outputMessage("Column Name          Type          Primary Key\n");
+    outputMessage("------------------------------------------------\n");
+    for (int i = 0; i < table->schema.num_columns; i++) {
+        char type[40];
+        outputMessage("%-20s %-13s %s\n", 
+               table->schema.columns[i].name,
+               columnTypeName(&table->schema.columns[i], type),
+               isKeyColumn(&table->schema, i) ? "YES" : "NO");
+    }
+    outputMessage("--- End ---\n");
+}
+
+// Key from its normalized bytes; the tail points into bytes
+IndexKey makeKey(const unsigned char* bytes, uint32_t len) {
+    IndexKey key = {0, NULL, len};
+    for (uint32_t i = 0; i < 8; i++) key.head = (key.head << 8) | (i < len ? bytes[i] : 0);
+    if (len > 8) key.tail = (unsigned char*)bytes + 8;
+    return key;
+}
+
+// Key of an integer: 8 bytes big-endian with the sign bit flipped, so that
+// negative numbers sort first
+IndexKey intKey(long long v) {
+    IndexKey key = {(uint64_t)v ^ 0x8000000000000000ULL, NULL, 8};
+    return key;
+}
+
+// Integer held by a key made with intKey
+long long keyInt(const IndexKey* key) {
+    return (long long)(key->head ^ 0x8000000000000000ULL);
+}
+
+// Copy of the first len bytes of a key, owning its tail
+IndexKey copyKey(const IndexKey* key, uint32_t len) {
+    IndexKey copy = {key->head, NULL, len};
+    if (len < 8) copy.head = len ? copy.head & (~0ULL << (8 * (8 - len))) : 0;
+    if (len > 8) {
+        copy.tail = (unsigned char*)malloc(len - 8);
+        if (copy.tail) memcpy(copy.tail, key->tail, len - 8);
+    }
+    return copy;
+}
+
+void freeKey(IndexKey* key) {
+    free(key->tail);
+    key->tail = NULL;
+}
+
+// Byte i of a key's normalized form
+unsigned keyByte(const IndexKey* key, uint32_t i) {
+    return i < 8 ? (unsigned)(key->head >> (56 - 8 * i)) & 0xFF : key->tail[i - 8];
+}
+
+// memcmp order of the normalized bytes, a key sorting before its extensions
+int compareKeys(const IndexKey* a, const IndexKey* b) {
+    if (a->head != b->head) return a->head < b->head ? -1 : 1;
+    if (a->len > 8 && b->len > 8) {
+        int c = memcmp(a->tail, b->tail, (a->len < b->len ? a->len : b->len) - 8);
+        if (c) return c;
+    }
+    return (a->len > b->len) - (a->len < b->len);
+}
+
+// Compare only as much of key as bound is long, so keys that bound is a
+// prefix of compare equal to it (inclusive upper bounds on leading columns)
+int compareKeyPrefix(const IndexKey* key, const IndexKey* bound) {
+    if (key->len <= bound->len) return compareKeys(key, bound);
+    IndexKey prefix = *key;
+    prefix.len = bound->len;
+    if (bound->len < 8) prefix.head &= ~0ULL << (8 * (8 - bound->len));
+    return compareKeys(&prefix, bound);
+}
+
+// 64-bit hash of a key's normalized bytes
+uint64_t hashIndexKey(const IndexKey* key) {
+    uint64_t h = key->head ^ ((uint64_t)key->len << 56) ^ 0x9E3779B97F4A7C15ULL;
+    for (uint32_t i = 8; i < key->len; i++) h = (h ^ key->tail[i - 8]) * 0x100000001B3ULL;
+    h ^= h >> 30;
+    h *= 0xBF58476D1CE4E5B9ULL;
+    h ^= h >> 27;
+    h *= 0x94D049BB133111EBULL;
+    return h ^ (h >> 31);
+}
+
+// Size a table's key filter for twice its rows and fill it from the leaves.
+// Returns 0 if there is no memory for it; lookups then go to the index.
+int rebuildKeyFilter(Table* table) {
+    long capacity = 2L * table->record_count;
+    if (capacity < KEY_FILTER_MIN_KEYS) capacity = KEY_FILTER_MIN_KEYS;
+    uint64_t num_counters = 1;
+    while (num_counters < (uint64_t)capacity * KEY_FILTER_COUNTERS_PER_KEY) num_counters <<= 1;
+    
+    freeKeyFilter(table);
+    table->filter.counters = (unsigned char*)calloc(num_counters / 2, 1);
+    if (!table->filter.counters) return 0;
+    table->filter.num_counters = num_counters;
+    table->filter.capacity = capacity;
+    for (BPTNode* leaf = findLeaf(table->root, NULL); leaf; leaf = leaf->next) {
+        for (int i = 0; i < leaf->num_keys; i++) addKeyFilter(table, &leaf->keys[i]);
+    }
+    return 1;
+}
+
+// Step the counters of a key up (delta 1) or down (delta -1). Saturated
+// counters stay put, so a key is never taken out of a filter it is still in.
+void updateKeyFilter(KeyFilter* filter, const IndexKey* key, int delta) {
+    uint64_t h = hashIndexKey(key);
+    uint64_t h1 = (uint32_t)h;
+    uint64_t h2 = (h >> 32) | 1;
+    uint64_t mask = filter->num_counters - 1;
+    for (int k = 0; k < KEY_FILTER_HASHES; k++) {
+        uint64_t c = (h1 + k * h2) & mask;
+        unsigned char* byte = &filter->counters[c >> 1];
+        int shift = (int)(c & 1) * 4;
+        int count = (*byte >> shift) & 0xF;
+        if (count == KEY_FILTER_MAX_COUNT || (delta < 0 && count == 0)) continue;
+        count += delta;
+        *byte = (unsigned char)((*byte & ~(0xF << shift)) | (count << shift));
+    }
+}
+
+// Add a key to the filter, growing it once the table outgrows its capacity
+void addKeyFilter(Table* table, const IndexKey* key) {
+    if (!table->filter.counters) return;
+    if (table->record_count >= table->filter.capacity) {
+        rebuildKeyFilter(table);
+        return;   // The rebuild found the key in the leaves
+    }
+    updateKeyFilter(&table->filter, key, 1);
+}
+
+// Take a deleted key out of the filter
+void removeKeyFilter(Table* table, const IndexKey* key) {
+    if (table->filter.counters) updateKeyFilter(&table->filter, key, -1);
+}
+
+// Could the table hold this key? 0 means it certainly does not, and the index
+// need not be searched; 1 means it may (or that there is no filter).
+int keyMayExist(Table* table, const IndexKey* key) {
+    const KeyFilter* filter = &table->filter;
+    if (!filter->counters) return 1;
+    uint64_t h = hashIndexKey(key);
+    uint64_t h1 = (uint32_t)h;
+    uint64_t h2 = (h >> 32) | 1;
+    uint64_t mask = filter->num_counters - 1;
+    for (int k = 0; k < KEY_FILTER_HASHES; k++) {
+        uint64_t c = (h1 + k * h2) & mask;
+        if (!((filter->counters[c >> 1] >> ((c & 1) * 4)) & 0xF)) {
+            metricsAdd(METRIC_FILTER_SKIPS, 1);
+            return 0;
+        }
+    }
+    return 1;
+}
+
+void freeKeyFilter(Table* table) {
+    free(table->filter.counters);
+    memset(&table->filter, 0, sizeof(table->filter));
+}
+
+// qsort/bsearch comparator over IndexKey arrays
+int compareIndexKeys(const void* a, const void* b) {
+    return compareKeys((const IndexKey*)a, (const IndexKey*)b);
+}
+
+// Separator for a leaf split: the shortest prefix of right that still sorts
+// after left. Internal nodes only have to route searches, so they keep just
+// the bytes up to the first one where the two sides differ.
+IndexKey separatorKey(const IndexKey* left, const IndexKey* right) {
+    uint32_t n = 0;
+    while (n < left->len && n < right->len && keyByte(left, n) == keyByte(right, n)) n++;
+    return copyKey(right, n < right->len ? n + 1 : right->len);
+}
+
+// Split child node
+void splitChild(NodeArena* arena, BPTNode* parent, int index) {
+    BPTNode* full_child = parent->children[index];
+    BPTNode* new_child = createBPTNode(arena, full_child->is_leaf);
+    
+    int mid = ORDER / 2;
+    IndexKey separator;
+    
+    if (full_child->is_leaf) {
+        new_child->num_keys = ORDER - mid;
+        for (int i = 0; i < new_child->num_keys; i++) {
+            new_child->keys[i] = full_child->keys[mid + i];
+            new_child->offsets[i] = full_child->offsets[mid + i];
+        }
+        new_child->next = full_child->next;
+        full_child->next = new_child;
+        full_child->num_keys = mid;
+        separator = separatorKey(&full_child->keys[mid - 1], &new_child->keys[0]);
+    } else {
+        new_child->num_keys = ORDER - mid - 1;
+        for (int i = 0; i < new_child->num_keys; i++) {
+            new_child->keys[i] = full_child->keys[mid + 1 + i];
+            new_child->children[i] = full_child->children[mid + 1 + i];
+        }
+        new_child->children[new_child->num_keys] = full_child->children[ORDER];
+        full_child->num_keys = mid;
+        separator = full_child->keys[mid];
+    }
+    
+    for (int i = parent->num_keys; i > index; i--) {
+        parent->keys[i] = parent->keys[i - 1];
+        parent->children[i + 1] = parent->children[i];
+    }
+    parent->keys[index] = separator;
+    parent->children[index + 1] = new_child;
+    parent->num_keys++;
+}
+
+// Insert into non-full node unless the key is already there (returns 0); the
+// leaf stores its own copy of key
+int insertIntoBPTreeRecursive(NodeArena* arena, BPTNode* node, const IndexKey* key, long offset) {
+    int i = node->num_keys - 1;
+    
+    if (node->is_leaf) {
+        int cmp = 1;
+        while (i >= 0 && (cmp = compareKeys(&node->keys[i], key)) > 0) i--;
+        if (i >= 0 && cmp == 0) return 0;
+        i++;
+        memmove(&node->keys[i + 1], &node->keys[i], (node->num_keys - i) * sizeof(IndexKey));
+        memmove(&node->offsets[i + 1], &node->offsets[i], (node->num_keys - i) * sizeof(long));
+        node->keys[i] = copyKey(key, key->len);
+        node->offsets[i] = offset;
+        node->num_keys++;
+        return 1;
+    }
+    
+    while (i >= 0 && compareKeys(&node->keys[i], key) > 0) i--;
+    i++;
+    
+    if (node->children[i]->num_keys == ORDER) {
+        splitChild(arena, node, i);
+        if (compareKeys(key, &node->keys[i]) >= 0) i++;
+    }
+    return insertIntoBPTreeRecursive(arena, node->children[i], key, offset);
+}
+
+// Insert into B+-tree in one descent, checking for a duplicate at the leaf.
+// Returns 0 (tree unchanged apart from splits on the way) if key is present.
+int insertIntoBPTree(Table* table, const IndexKey* key, long offset) {
+    if (!table->root) {
+        table->root = createBPTNode(&table->nodes, 1);
+    }
+    
+    if (table->root->num_keys == ORDER) {
+        BPTNode* new_root = createBPTNode(&table->nodes, 0);
+        new_root->children[0] = table->root;
+        splitChild(&table->nodes, new_root, 0);
+        table->root = new_root;
+    }
+    
+    return insertIntoBPTreeRecursive(&table->nodes, table->root, key, offset);
+}
+
+// Take a key out of its leaf; as with deletes, leaves are left to underflow
+void removeFromBPTree(Table* table, const IndexKey* key) {
+    BPTNode* leaf = findLeaf(table->root, key);
+    for (int i = 0; leaf && i < leaf->num_keys; i++) {
+        if (compareKeys(&leaf->keys[i], key) != 0) continue;
+        freeKey(&leaf->keys[i]);
+        for (int j = i; j < leaf->num_keys - 1; j++) {
+            leaf->keys[j] = leaf->keys[j + 1];
+            leaf->offsets[j] = leaf->offsets[j + 1];
+        }
+        leaf->num_keys--;
+        return;
+    }
+}
+
+// Build the table's B+ tree bottom-up from entries sorted by key: full leaves
+// linked left to right, then levels of up to ORDER + 1 children. The leaves
+// take over the entries' key tails; the old tree must already be cleared, so
+// the new nodes are laid out level by level in the arena.
+void bulkLoadBPTree(Table* table, KeyOffset* entries, long n) {
+    long count = (n + ORDER - 1) / ORDER;
+    BPTNode** level = (BPTNode**)malloc((count ? count : 1) * sizeof(BPTNode*));
+    IndexKey* mins = (IndexKey*)malloc((count ? count : 1) * sizeof(IndexKey));
+    IndexKey* maxs = (IndexKey*)malloc((count ? count : 1) * sizeof(IndexKey));
+    table->root = NULL;
+    
+    if (!level || !mins || !maxs) {
+        free(level);
+        free(mins);
+        free(maxs);
+        for (long i = 0; i < n; i++) {
+            insertIntoBPTree(table, &entries[i].key, entries[i].offset);
+            freeKey(&entries[i].key);
+        }
+        if (!table->root) table->root = createBPTNode(&table->nodes, 1);
+        return;
+    }
+    
+    // mins and maxs borrow the smallest and largest leaf key under each node
+    for (long i = 0; i < count; i++) {
+        BPTNode* leaf = createBPTNode(&table->nodes, 1);
+        long first = i * ORDER;
+        leaf->num_keys = (n - first < ORDER) ? (int)(n - first) : ORDER;
+        for (int k = 0; k < leaf->num_keys; k++) {
+            leaf->keys[k] = entries[first + k].key;
+            leaf->offsets[k] = entries[first + k].offset;
+        }
+        if (i > 0) level[i - 1]->next = leaf;
+        level[i] = leaf;
+        mins[i] = leaf->keys[0];
+        maxs[i] = leaf->keys[leaf->num_keys - 1];
+    }
+    
+    while (count > 1) {
+        long parents = (count + ORDER) / (ORDER + 1);
+        long c = 0;
+        for (long p = 0; p < parents; p++) {
+            long take = (count - c < ORDER + 1) ? count - c : ORDER + 1;
+            // Leave at least two children for the last parent
+            if (p == parents - 2 && count - c - take == 1) take--;
+            BPTNode* node = createBPTNode(&table->nodes, 0);
+            IndexKey min = mins[c];
+            IndexKey max = maxs[c + take - 1];
+            for (long j = 0; j < take; j++) {
+                node->children[j] = level[c + j];
+                if (j > 0) node->keys[j - 1] = separatorKey(&maxs[c + j - 1], &mins[c + j]);
+            }
+            node->num_keys = (int)take - 1;
+            level[p] = node;
+            mins[p] = min;
+            maxs[p] = max;
+            c += take;
+        }
+        count = parents;
+    }
+    
+    table->root = count ? level[0] : createBPTNode(&table->nodes, 1);
+    free(level);
+    free(mins);
+    free(maxs);
+}
+
+// Find the leaf that holds key; a NULL key finds the leftmost leaf
+BPTNode* findLeaf(BPTNode* node, const IndexKey* key) {
+    if (!node) return NULL;
+    OpProfile* prof = profileOp();
+    if (prof) prof->nodes++;
+    if (node->is_leaf) return node;
+    
+    // Separators sort after everything on their left, so equal keys go right
+    int i = 0;
+    while (key && i < node->num_keys && compareKeys(key, &node->keys[i]) >= 0) i++;
+    return findLeaf(node->children[i], key);
+}
+
+// Compress src in the LZ4 block format (greedy matching, one hash probe per
+// position). Returns the compressed length, or 0 if it does not fit in cap.
+int lz4Compress(const unsigned char* src, int len, unsigned char* dst, int cap) {
+    int table[1 << LZ4_HASH_BITS];   // Position + 1 of the last 4-byte sequence with each hash
+    const unsigned char* ip = src;
+    const unsigned char* anchor = src;
+    const unsigned char* end = src + len;
+    unsigned char* op = dst;
+    unsigned char* oend = dst + cap;
+    memset(table, 0, sizeof(table));
+    
+    while (end - ip >= LZ4_MATCH_LIMIT) {
+        uint32_t seq;
+        memcpy(&seq, ip, 4);
+        uint32_t h = (seq * 2654435761u) >> (32 - LZ4_HASH_BITS);
+        const unsigned char* ref = table[h] ? src + table[h] - 1 : NULL;
+        uint32_t found = 0;
+        table[h] = (int)(ip - src) + 1;
+        if (ref) memcpy(&found, ref, 4);
+        if (!ref || ip - ref > 65535 || found != seq) {
+            ip++;
+            continue;
+        }
+        
+        const unsigned char* m = ip + LZ4_MIN_MATCH;
+        const unsigned char* r = ref + LZ4_MIN_MATCH;
+        while (m < end - LZ4_LAST_LITERALS && *m == *r) {
+            m++;
+            r++;
+        }
+        size_t literals = (size_t)(ip - anchor);
+        size_t match = (size_t)(m - ip) - LZ4_MIN_MATCH;
+        if ((size_t)(oend - op) < 1 + literals / 255 + 1 + literals + 2 + match / 255 + 1) return 0;
+        
+        unsigned char* token = op++;
+        *token = (unsigned char)((literals >= 15 ? 15 : literals) << 4);
+        if (literals >= 15) {
+            size_t rest = literals - 15;
+            for (; rest >= 255; rest -= 255) *op++ = 255;
+            *op++ = (unsigned char)rest;
+        }
+        memcpy(op, anchor, literals);
+        op += literals;
+        *op++ = (unsigned char)(ip - ref);
+        *op++ = (unsigned char)((ip - ref) >> 8);
+        *token |= (unsigned char)(match >= 15 ? 15 : match);
+        if (match >= 15) {
+            size_t rest = match - 15;
+            for (; rest >= 255; rest -= 255) *op++ = 255;
+            *op++ = (unsigned char)rest;
+        }
+        ip = anchor = m;
+    }
+    
+    size_t literals = (size_t)(end - anchor);
+    if ((size_t)(oend - op) < 1 + literals / 255 + 1 + literals) return 0;
+    *op++ = (unsigned char)((literals >= 15 ? 15 : literals) << 4);
+    if (literals >= 15) {
+        size_t rest = literals - 15;
+        for (; rest >= 255; rest -= 255) *op++ = 255;
+        *op++ = (unsigned char)rest;
+    }
+    memcpy(op, anchor, literals);
+    op += literals;
+    return (int)(op - dst);
+}
+
+// Decode an LZ4 block, checking every length against both buffers. Returns
+// the decompressed length, or -1 if the block is damaged.
+int lz4Decompress(const unsigned char* src, int len, unsigned char* dst, int cap) {
+    const unsigned char* ip = src;
+    const unsigned char* iend = src + len;
+    unsigned char* op = dst;
+    unsigned char* oend = dst + cap;
+    
+    while (ip < iend) {
+        unsigned token = *ip++;
+        size_t literals = token >> 4;
+        if (literals == 15) {
+            unsigned b;
+            do {
+                if (ip >= iend) return -1;
+                b = *ip++;
+                literals += b;
+            } while (b == 255);
+        }
+        if ((size_t)(iend - ip) < literals || (size_t)(oend - op) < literals) return -1;
+        memcpy(op, ip, literals);
+        op += literals;
+        ip += literals;
+        if (ip == iend) break;   // The last sequence has no match
+        
+        if (iend - ip < 2) return -1;
+        size_t offset = ip[0] | (size_t)ip[1] << 8;
+        ip += 2;
+        if (offset == 0 || offset > (size_t)(op - dst)) return -1;
+        size_t match = token & 15;
+        if (match == 15) {
+            unsigned b;
+            do {
+                if (ip >= iend) return -1;
+                b = *ip++;
+                match += b;
+            } while (b == 255);
+        }
+        match += LZ4_MIN_MATCH;
+        if ((size_t)(oend - op) < match) return -1;
+        
+        const unsigned char* m = op - offset;
+        if (offset >= match) {
+            memcpy(op, m, match);
+            op += match;
+        } else if (offset == 1) {
+            memset(op, *m, match);
+            op += match;
+        } else {
+            while (match--) *op++ = *m++;
+        }
+    }
+    return (int)(op - dst);
+}
+
+// Page layout of a compressed table, and its size in rows from the last page's header
+void openPages(Table* table) {
+    long rows = PAGE_TARGET_BYTES / table->schema.row_size;
+    table->page_bytes = (rows > 0 ? rows : 1) * (long)table->schema.row_size;
+    table->slot_bytes = (PAGE_HEADER + table->page_bytes + PAGE_ALIGN - 1) / PAGE_ALIGN * PAGE_ALIGN;
+    
+    long pages = (table->file_size + table->slot_bytes - 1) / table->slot_bytes;
+    unsigned char header[PAGE_HEADER];
+    table->file_size = 0;
+    if (pages > 0 && preadFull(table->fd, header, PAGE_HEADER, (pages - 1) * table->slot_bytes) == PAGE_HEADER) {
+        CatalogReader r = {header, header + PAGE_HEADER, 1};
+        catalogGet(&r, 4);
+        long used = (long)catalogGet(&r, 4);
+        table->file_size = (pages - 1) * table->page_bytes + (used <= table->page_bytes ? used : 0);
+    }
+}
+
+// Hash chain of a page in the buffer cache
+size_t pageBucket(const Table* table, long page) {
+    return ((uintptr_t)table / sizeof(Table) * 31 + (size_t)page) % (2 * BUFFER_CACHE_PAGES);
+}
+
+void lockBufferCache(void) {
+#ifndef _WIN32
+    pthread_mutex_lock(&buffer_cache_lock);
+#endif
+}
+
+void unlockBufferCache(void) {
+#ifndef _WIN32
+    pthread_mutex_unlock(&buffer_cache_lock);
+#endif
+}
+
+// Find a page in the buffer cache, reading and decompressing it on a miss.
+// Pages past the end of the table come back empty. The caller holds the
+// buffer cache lock. A miss reserves a frame under it, then lets it go while
+// the page is read and decompressed; a thread wanting a page being loaded
+// waits for it. NULL if the page could not be read.
+CachedPage* fetchPage(Table* table, long page) {
+    BufferCache* cache = &buffer_cache;
+    if (!cache->buckets) {
+        cache->buckets = (CachedPage**)calloc(2 * BUFFER_CACHE_PAGES, sizeof(CachedPage*));
+        if (!cache->buckets) return NULL;
+    }
+    size_t bucket = pageBucket(table, page);
+    CachedPage* p = cache->buckets[bucket];
+    while (p && (p->table != table || p->page != page)) p = p->chain;
+#ifndef _WIN32
+    while (p && p->loading) {
+        pthread_cond_wait(&page_loaded, &buffer_cache_lock);
+        p = cache->buckets[bucket];
+        while (p && (p->table != table || p->page != page)) p = p->chain;
+    }
+#endif
+    if (p) {
+        if (cache->head != p) {
+            p->prev->next = p->next;
+            if (p->next) p->next->prev = p->prev;
+            else cache->tail = p->prev;
+            p->prev = NULL;
+            p->next = cache->head;
+            cache->head->prev = p;
+            cache->head = p;
+        }
+        metricsAdd(METRIC_CACHE_HITS, 1);
+        OpProfile* prof = profileOp();
+        if (prof) prof->cache_hits++;
+        return p;
+    }
+    
+    // Reuse the least recently used frame that has nothing to write back and
+    // is not being loaded; while every frame does, the cache grows until the
+    // checkpointer catches up
+    if (cache->count >= BUFFER_CACHE_PAGES) {
+        p = cache->tail;
+        while (p && (p->dirty || p->writing || p->loading)) p = p->prev;
+    }
+    if (!p) {
+        p = (CachedPage*)calloc(1, sizeof(CachedPage));
+        if (!p) return NULL;
+        cache->count++;
+    } else {
+        CachedPage** link = &cache->buckets[pageBucket(p->table, p->page)];
+        while (*link != p) link = &(*link)->chain;
+        *link = p->chain;
+        if (p->prev) p->prev->next = p->next;
+        else cache->head = p->next;
+        if (p->next) p->next->prev = p->prev;
+        else cache->tail = p->prev;
+    }
+    if (p->cap < table->page_bytes) {
+        char* data = (char*)realloc(p->data, table->page_bytes);
+        if (!data) {
+            free(p->data);
+            free(p);
+            cache->count--;
+            return NULL;
+        }
+        p->data = data;
+        p->cap = table->page_bytes;
+    }
+    p->table = table;
+    p->page = page;
+    p->used = 0;
+    p->imaged = 0;
+    p->chain = cache->buckets[bucket];
+    cache->buckets[bucket] = p;
+    p->prev = NULL;
+    p->next = cache->head;
+    if (cache->head) cache->head->prev = p;
+    else cache->tail = p;
+    cache->head = p;
+    
+    long used = 0;
+    if (page * table->page_bytes < table->file_size) {
+        p->loading = 1;
+        unlockBufferCache();
+        used = loadPage(table, page, p->data);
+        lockBufferCache();
+        p->loading = 0;
+#ifndef _WIN32
+        pthread_cond_broadcast(&page_loaded);
+#endif
+    } else {
+        memset(p->data, 0, table->page_bytes);
+    }
+    if (used < 0) {
+        evictPage(p);
+        return NULL;
+    }
+    p->used = used;
+    return p;
+}
+
+// Read a page from its slot and decompress it into data, zeroing the rest of
+// the page. Called without the buffer cache lock, so it reads into a buffer of
+// its own. The bytes of rows on the page, -1 if it could not be read.
+long loadPage(Table* table, long page, char* data) {
+    long start = page * table->slot_bytes;
+    unsigned char* image = (unsigned char*)malloc(table->slot_bytes);
+    if (!image) return -1;
+    // The first read takes the header and, for most pages, all of the stored bytes
+    long first = table->slot_bytes < 2 * PAGE_ALIGN ? table->slot_bytes : 2 * PAGE_ALIGN;
+    ssize_t bytes = preadFull(table->fd, image, first, start);
+    CatalogReader r = {image, image + PAGE_HEADER, bytes >= PAGE_HEADER};
+    long stored = (long)catalogGet(&r, 4);
+    long used = (long)catalogGet(&r, 4);
+    int codec = (int)catalogGet(&r, 1);
+    int ok = r.ok && used <= table->page_bytes && PAGE_HEADER + stored <= table->slot_bytes;
+    if (ok && PAGE_HEADER + stored > bytes &&
+        preadFull(table->fd, image + bytes, PAGE_HEADER + stored - bytes, start + bytes) !=
+            PAGE_HEADER + stored - bytes) {
+        ok = 0;
+    }
+    const unsigned char* payload = image + PAGE_HEADER;
+    if (ok) {
+        ok = codec == PAGE_CODEC_LZ4 ? lz4Decompress(payload, (int)stored, (unsigned char*)data, (int)used) == used
+                                     : codec == PAGE_CODEC_RAW && stored == used;
+    }
+    if (ok && codec == PAGE_CODEC_RAW) memcpy(data, payload, used);
+    if (ok) memset(data + used, 0, table->page_bytes - used);
+    free(image);
+    return ok ? used : -1;
+}
+
+// Take a page out of the buffer cache and free it; the caller holds the lock
+void evictPage(CachedPage* p) {
+    BufferCache* cache = &buffer_cache;
+    CachedPage** link = &cache->buckets[pageBucket(p->table, p->page)];
+    while (*link != p) link = &(*link)->chain;
+    *link = p->chain;
+    if (p->prev) p->prev->next = p->next;
+    else cache->head = p->next;
+    if (p->next) p->next->prev = p->prev;
+    else cache->tail = p->prev;
+    cache->count--;
+    if (p->dirty) cache->dirty--;
+    free(p->data);
+    free(p);
+}
+
+// Forget every cached page of a table (before it is closed or its file
+// replaced), first writing back the changes no checkpoint has yet
+void dropCachedPages(Table* table) {
+    if (!table->page_bytes) return;
+    lockCheckpointer();
+    if (table->wal) checkpointPages(table->wal);
+    lockBufferCache();
+    CachedPage* p = buffer_cache.head;
+    while (p) {
+        CachedPage* next = p->next;
+        if (p->table == table && p->loading) {
+            // Wait for the page being read in, then look through the cache again
+#ifndef _WIN32
+            pthread_cond_wait(&page_loaded, &buffer_cache_lock);
+#endif
+            next = buffer_cache.head;
+        } else if (p->table == table) {
+            evictPage(p);
+        }
+        p = next;
+    }
+    unlockBufferCache();
+    unlockCheckpointer();
+}
+
+// Write a cached page back to its slot; the caller holds the buffer cache lock
+int storePage(Table* table, CachedPage* p) {
+    if (!growScratch(table->slot_bytes)) return 0;
+    return writePageImage(table, p->page, p->data, p->used, buffer_cache.scratch);
+}
+
+// Make the buffer cache's scratch buffer hold at least bytes; the caller holds the lock
+int growScratch(size_t bytes) {
+    BufferCache* cache = &buffer_cache;
+    if (bytes <= cache->scratch_cap) return 1;
+    unsigned char* scratch = (unsigned char*)realloc(cache->scratch, bytes);
+    if (!scratch) return 0;
+    cache->scratch = scratch;
+    cache->scratch_cap = bytes;
+    return 1;
+}
+
+// Write used bytes of a page to its slot, LZ4-compressed (into image, which
+// has room for a slot) unless that does not make them smaller, and punch out
+// the rest of the slot so it takes no disk space
+int writePageImage(Table* table, long page, const char* data, long used, unsigned char* image) {
+    unsigned char* payload = image + PAGE_HEADER;
+    int stored = lz4Compress((const unsigned char*)data, (int)used, payload, (int)used - 1);
+    int codec = PAGE_CODEC_LZ4;
+    if (stored <= 0) {
+        memcpy(payload, data, used);
+        stored = (int)used;
+        codec = PAGE_CODEC_RAW;
+    }
+    memset(image, 0, PAGE_HEADER);
+    unsigned char* h = catalogPut(image, (uint32_t)stored, 4);
+    h = catalogPut(h, (uint32_t)used, 4);
+    catalogPut(h, codec, 1);
+    
+    long start = page * table->slot_bytes;
+    long length = PAGE_HEADER + stored;
+    if (!pwriteFull(table->fd, image, length, start)) return 0;
+#ifdef __linux__
+    long tail = (start + length + PAGE_ALIGN - 1) / PAGE_ALIGN * PAGE_ALIGN;
+    if (tail < start + table->slot_bytes) {
+        fallocate(table->fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, tail, start + table->slot_bytes - tail);
+    }
+#endif
+    return 1;
+}
+
+// Copy bytes of a compressed table out of the buffer cache; they never cross a
+// page boundary since pages hold whole rows
+int readPagedRows(Table* table, long offset, void* buf, size_t len) {
+    if (offset < 0 || offset + (long)len > table->file_size) return 0;
+    lockBufferCache();
+    CachedPage* p = fetchPage(table, offset / table->page_bytes);
+    if (p) memcpy(buf, p->data + offset % table->page_bytes, len);
+    unlockBufferCache();
+    return p != NULL;
+}
+
+// Write bytes of a compressed table through the buffer cache. With a log the
+// bytes (or, for a page's first change in the log file, the whole page) are
+// logged and the pages they touch left dirty for the checkpointer;
+// without one (a data file being rebuilt, or a log being replayed) each page
+// is rewritten at once. Writes may extend the table but not leave a gap.
+int writePagedRows(Table* table, long offset, const void* data, size_t len) {
+    const char* src = (const char*)data;
+    int ok = offset >= 0 && offset <= table->file_size;
+    PageLog* log = table->wal;
+    lockBufferCache();
+#ifndef _WIN32
+    // Only a checkpointer far behind makes writers wait: for it to take the
+    // dirty pages it has, once they fill twice the cache
+    if (ok && log && checkpointer.running && buffer_cache.dirty >= 2 * BUFFER_CACHE_PAGES) {
+        wakeCheckpointer();
+        pthread_cond_wait(&pages_cleaned, &buffer_cache_lock);
+    }
+#endif
+    while (ok && len > 0) {
+        long page = offset / table->page_bytes;
+        long within = offset % table->page_bytes;
+        size_t n = (size_t)(table->page_bytes - within) < len ? (size_t)(table->page_bytes - within) : len;
+        CachedPage* p = fetchPage(table, page);
+        if (!p) {
+            ok = 0;
+            break;
+        }
+        if (log && p->imaged == log->start_lsn + 1) {
+            unsigned char* bytes = beginPageRecord(log, WAL_WRITE, offset, n);
+            if (bytes) memcpy(bytes, src, n);
+            ok = bytes && appendPageRecord(log, n);
+        } else if (log) {
+            ok = logPageImage(log, p, within, src, n);
+        }
+        if (!ok) break;
+        memcpy(p->data + within, src, n);
+        if (within + (long)n > p->used) p->used = within + (long)n;
+        if (log) {
+            if (!p->dirty) buffer_cache.dirty++;
+            p->dirty = 1;
+        } else if (!storePage(table, p)) {
+            evictPage(p);
+            ok = 0;
+            break;
+        }
+        offset += (long)n;
+        src += n;
+        len -= n;
+        if (offset > table->file_size) table->file_size = offset;
+    }
+    int wake = log && (log->bytes >= CHECKPOINT_LOG_BYTES || buffer_cache.dirty >= CHECKPOINT_DIRTY_PAGES);
+    unlockBufferCache();
+    if (wake) wakeCheckpointer();
+    return ok;
+}
+
+// Cut a compressed table back to size bytes of rows (COPY FROM rolling back).
+// Dropping the cached pages checkpoints the table, so the log holds no write
+// past the new end. A cut last page is logged whole and left to the checkpointer.
+int truncatePages(Table* table, long size) {
+    long pages = (size + table->page_bytes - 1) / table->page_bytes;
+    dropCachedPages(table);
+    if (ftruncate(table->fd, pages * table->slot_bytes) != 0) return 0;
+    table->file_size = size;
+    if (size % table->page_bytes == 0) return 1;
+    
+    lockBufferCache();
+    CachedPage* p = fetchPage(table, pages - 1);
+    int ok = p != NULL;
+    if (p) {
+        p->used = size % table->page_bytes;
+        memset(p->data + p->used, 0, table->page_bytes - p->used);
+        ok = table->wal ? logPageImage(table->wal, p, 0, NULL, 0) : storePage(table, p);
+        if (ok && table->wal && !p->dirty) {
+            p->dirty = 1;
+            buffer_cache.dirty++;
+        }
+        if (!ok) evictPage(p);
+    }
+    unlockBufferCache();
+    return ok;
+}
+
+// Offset just past the last row of a table: where appended rows go
+long tableEnd(Table* table) {
+    return table->page_bytes ? table->file_size : getNextOffset(table->fd);
+}
+
+// Write rows (or part of one) at an offset of the data file. The caller holds the write lock.
+int writeRows(Table* table, long offset, const void* data, size_t len) {
+    if (table->page_bytes) return writePagedRows(table, offset, data, len);
+    lseek(table->fd, offset, SEEK_SET);
+    return writeFull(table->fd, data, len);
+}
+
+int truncateRows(Table* table, long size) {
+    if (table->page_bytes) return truncatePages(table, size);
+    return ftruncate(table->fd, size) == 0;
+}
+
+// Start a page log record of len bytes at offset in the log's buffer and
+// return where the caller puts the bytes; NULL if out of memory
+unsigned char* beginPageRecord(PageLog* log, int kind, long offset, size_t len) {
+    size_t need = WAL_RECORD + len;
+    if (need > log->buf_cap) {
+        unsigned char* buf = (unsigned char*)realloc(log->buf, need);
+        if (!buf) return NULL;
+        log->buf = buf;
+        log->buf_cap = need;
+    }
+    unsigned char* p = catalogPut(log->buf + 4, kind, 1);
+    p = catalogPut(p, (uint64_t)offset, 8);
+    return catalogPut(p, (uint32_t)len, 4);
+}
+
+// Checksum the record begun in a log's buffer and append it to the log. The
+// caller holds the buffer cache lock, which orders records as the pages change.
+int appendPageRecord(PageLog* log, size_t len) {
+    size_t need = WAL_RECORD + len;
+    catalogPut(log->buf, computeCrc32(log->buf + 4, need - 4), 4);
+    if (!writeFull(log->fd, log->buf, need)) return 0;
+    log->bytes += (long)need;
+    log->lsn += need;
+    return 1;
+}
+
+// Log the whole of a cached page as it is once n bytes from src are copied in
+// at within, which the caller then does. The caller holds the buffer cache lock.
+int logPageImage(PageLog* log, CachedPage* p, long within, const char* src, size_t n) {
+    long used = within + (long)n > p->used ? within + (long)n : p->used;
+    unsigned char* image = beginPageRecord(log, WAL_PAGE_IMAGE, p->page * p->table->page_bytes, used);
+    if (!image) return 0;
+    memcpy(image, p->data, used);
+    if (n > 0) memcpy(image + within, src, n);
+    if (!appendPageRecord(log, used)) return 0;
+    p->imaged = log->start_lsn + 1;
+    return 1;
+}
+
+// Start a new log file whose first record will be the next LSN, keeping the
+// current one as old_path until the checkpoint is synced. The caller holds the
+// buffer cache lock.
+int rotatePageLog(PageLog* log, const char* old_path) {
+    char tmp[280];
+    snprintf(tmp, sizeof(tmp), "%s.new", log->path);
+#ifdef _WIN32
+    int fd = open(tmp, _O_CREAT | _O_TRUNC | _O_RDWR | _O_BINARY, _S_IREAD | _S_IWRITE);
+#else
+    int fd = open(tmp, O_CREAT | O_TRUNC | O_RDWR, 0644);
+#endif
+    if (fd < 0) return 0;
+    unsigned char header[WAL_HEADER];
+    unsigned char* h = catalogPut(header, WAL_MAGIC, 4);
+    h = catalogPut(h, 0, 4);
+    catalogPut(h, log->lsn, 8);
+    int ok = writeFull(fd, header, WAL_HEADER);
+#ifdef _WIN32
+    remove(old_path);
+    if (ok) {
+        close(log->fd);
+        log->fd = -1;
+    }
+#endif
+    if (ok && rename(log->path, old_path) != 0) ok = 0;
+    if (ok && rename(tmp, log->path) != 0) {
+        rename(old_path, log->path);
+        ok = 0;
+    }
+    if (!ok) {
+        close(fd);
+        remove(tmp);
+        return 0;
+    }
+    if (log->fd >= 0) close(log->fd);
+    log->fd = fd;
+    log->bytes = WAL_HEADER;
+    log->start_lsn = log->lsn;
+    return 1;
+}
+
+int comparePages(const void* a, const void* b) {
+    long pa = (*(CachedPage* const*)a)->page;
+    long pb = (*(CachedPage* const*)b)->page;
+    return (pa > pb) - (pa < pb);
+}
+
+// Checkpoint a compressed table: switch writes to a new log, write the pages
+// that were dirty back in page order, sync the data file, then delete the old
+// log. Each page is copied under the buffer cache lock and compressed and
+// written outside it, so queries only wait for the copy. A page changed again
+// meanwhile stays dirty for the next checkpoint. The caller holds the
+// checkpointer lock.
+int checkpointPages(PageLog* log) {
+    Table* table = log->table;
+    BufferCache* cache = &buffer_cache;
+    Checkpointer* ck = &checkpointer;
+    char old_path[280];
+    snprintf(old_path, sizeof(old_path), "%s.old", log->path);
+    
+    lockBufferCache();
+    if (log->lsn == log->checkpoint_lsn && !log->old_pending) {
+        unlockBufferCache();
+        return 1;
+    }
+    long n = 0;
+    for (CachedPage* p = cache->head; p; p = p->next) {
+        if (p->table == table && p->dirty) n++;
+    }
+    CachedPage** pages = (CachedPage**)malloc((n ? n : 1) * sizeof(CachedPage*));
+    int ok = pages != NULL && (size_t)table->slot_bytes <= ck->cap;
+    if (pages && !ok) {
+        char* page = (char*)realloc(ck->page, table->slot_bytes);
+        if (page) ck->page = page;
+        unsigned char* image = (unsigned char*)realloc(ck->image, table->slot_bytes);
+        if (image) ck->image = image;
+        ok = page && image;
+        if (ok) ck->cap = table->slot_bytes;
+    }
+    if (ok && !log->old_pending) ok = rotatePageLog(log, old_path);
+    if (!ok) {
+#ifndef _WIN32
+        pthread_cond_broadcast(&pages_cleaned);
+#endif
+        unlockBufferCache();
+        free(pages);
+        return 0;
+    }
+    n = 0;
+    for (CachedPage* p = cache->head; p; p = p->next) {
+        if (p->table != table || !p->dirty) continue;
+        p->dirty = 0;
+        p->writing = 1;
+        cache->dirty--;
+        pages[n++] = p;
+    }
+#ifndef _WIN32
+    pthread_cond_broadcast(&pages_cleaned);
+#endif
+    unlockBufferCache();
+    
+    qsort(pages, n, sizeof(CachedPage*), comparePages);
+    for (long i = 0; i < n; i++) {
+        CachedPage* p = pages[i];
+        lockBufferCache();
+        long page = p->page;
+        long used = p->used;
+        memcpy(ck->page, p->data, used);
+        unlockBufferCache();
+        if (ok) ok = writePageImage(table, page, ck->page, used, ck->image);
+        lockBufferCache();
+        p->writing = 0;
+        if (!ok && !p->dirty) {
+            p->dirty = 1;
+            cache->dirty++;
+        }
+        unlockBufferCache();
+    }
+    free(pages);
+#ifndef _WIN32
+    if (ok && n > 0 && fsync(table->fd) != 0) ok = 0;
+#endif
+    if (ok) remove(old_path);
+    
+    lockBufferCache();
+    log->old_pending = !ok;
+    if (ok) {
+        log->checkpoint_lsn = log->start_lsn;
+        log->checkpoints++;
+    }
+    unlockBufferCache();
+    return ok;
+}
+
+// Checkpoint every compressed table, then give back the frames the cache grew
+// by while they were all dirty
+void checkpointAll(void) {
+    lockCheckpointer();
+    for (PageLog* log = checkpointer.logs; log; log = log->next) checkpointPages(log);
+    lockBufferCache();
+    BufferCache* cache = &buffer_cache;
+    CachedPage* p = cache->tail;
+    while (p && cache->count > BUFFER_CACHE_PAGES) {
+        CachedPage* prev = p->prev;
+        if (!p->dirty && !p->writing && !p->loading) evictPage(p);
+        p = prev;
+    }
+    unlockBufferCache();
+    unlockCheckpointer();
+}
+
+void lockCheckpointer(void) {
+#ifndef _WIN32
+    pthread_mutex_lock(&checkpoint_lock);
+#endif
+}
+
+void unlockCheckpointer(void) {
+#ifndef _WIN32
+    pthread_mutex_unlock(&checkpoint_lock);
+#endif
+}
+
+#ifndef _WIN32
+// Background checkpointer: sleeps until a log or the dirty pages grow past
+// their limits (or every CHECKPOINT_INTERVAL_MS) and checkpoints every table
+void* checkpointWriter(void* arg) {
+    (void)arg;
+    Checkpointer* ck = &checkpointer;
+    pthread_mutex_lock(&ck->wake_lock);
+    while (!ck->stop) {
+        if (!ck->requested) {
+            struct timespec deadline;
+            clock_gettime(CLOCK_REALTIME, &deadline);
+            deadline.tv_sec += CHECKPOINT_INTERVAL_MS / 1000;
+            deadline.tv_nsec += (CHECKPOINT_INTERVAL_MS % 1000) * 1000000L;
+            if (deadline.tv_nsec >= 1000000000L) {
+                deadline.tv_sec++;
+                deadline.tv_nsec -= 1000000000L;
+            }
+            pthread_cond_timedwait(&ck->wake, &ck->wake_lock, &deadline);
+        }
+        ck->requested = 0;
+        pthread_mutex_unlock(&ck->wake_lock);
+        checkpointAll();
+        pthread_mutex_lock(&ck->wake_lock);
+    }
+    pthread_mutex_unlock(&ck->wake_lock);
+    return NULL;
+}
+#endif
+
+// Ask for a checkpoint soon. Without a checkpointer thread (Windows) the
+// writer runs it itself.
+void wakeCheckpointer(void) {
+    Checkpointer* ck = &checkpointer;
+#ifndef _WIN32
+    if (ck->running) {
+        pthread_mutex_lock(&ck->wake_lock);
+        ck->requested = 1;
+        pthread_cond_signal(&ck->wake);
+        pthread_mutex_unlock(&ck->wake_lock);
+        return;
+    }
+#endif
+    (void)ck;
+    checkpointAll();
+}
+
+// Start the checkpointer with the first compressed table
+void startCheckpointer(void) {
+#ifndef _WIN32
+    Checkpointer* ck = &checkpointer;
+    if (ck->running) return;
+    pthread_mutex_init(&ck->wake_lock, NULL);
+    pthread_cond_init(&ck->wake, NULL);
+    ck->stop = 0;
+    ck->requested = 0;
+    ck->running = pthread_create(&ck->thread, NULL, checkpointWriter, NULL) == 0;
+#endif
+}
+
+// Stop the checkpointer once every table is closed
+void stopCheckpointer(void) {
+    Checkpointer* ck = &checkpointer;
+#ifndef _WIN32
+    if (ck->running) {
+        pthread_mutex_lock(&ck->wake_lock);
+        ck->stop = 1;
+        pthread_cond_signal(&ck->wake);
+        pthread_mutex_unlock(&ck->wake_lock);
+        pthread_join(ck->thread, NULL);
+        ck->running = 0;
+    }
+#endif
+    free(ck->page);
+    free(ck->image);
+    ck->page = NULL;
+    ck->image = NULL;
+    ck->cap = 0;
+}
+
+// Redo the records of a page log. Only the last record can have been cut
+// short or left with a bad checksum by a crash (or a bad one followed by
+// nothing but zeros, where the file grew but its last blocks never reached the
+// disk); that tail is dropped. Any other record that cannot be read or redone
+// is an error. -1 if there is no log at path, 0 on an error, 1 with lsn set
+// past the last record otherwise.
+int replayPageLog(Table* table, const char* path, uint64_t* lsn) {
+    FILE* in = fopen(path, "rb");
+    if (!in) return -1;
+    fseek(in, 0, SEEK_END);
+    long remaining = ftell(in) - WAL_HEADER;
+    fseek(in, 0, SEEK_SET);
+    // A crash while the log was being created can leave it without a header
+    if (remaining < 0) {
+        fclose(in);
+        return 1;
+    }
+    unsigned char header[WAL_HEADER];
+    CatalogReader r = {header, header + WAL_HEADER, 1};
+    if (fread(header, 1, WAL_HEADER, in) != WAL_HEADER || catalogGet(&r, 4) != WAL_MAGIC) {
+        fclose(in);
+        return 0;
+    }
+    catalogGet(&r, 4);
+    *lsn = catalogGet(&r, 8);
+    
+    unsigned char* rec = NULL;
+    int ok = 1;
+    while (ok && remaining >= WAL_RECORD) {
+        unsigned char head[WAL_RECORD];
+        if (fread(head, 1, WAL_RECORD, in) != WAL_RECORD) {
+            ok = 0;
+            break;
+        }
+        r = (CatalogReader){head, head + WAL_RECORD, 1};
+        uint32_t crc = (uint32_t)catalogGet(&r, 4);
+        int kind = (int)catalogGet(&r, 1);
+        long offset = (long)catalogGet(&r, 8);
+        long len = (long)catalogGet(&r, 4);
+        if (len > remaining - WAL_RECORD) break;
+        unsigned char* grown = (unsigned char*)realloc(rec, WAL_RECORD + len);
+        if (!grown) {
+            ok = 0;
+            break;
+        }
+        rec = grown;
+        memcpy(rec, head, WAL_RECORD);
+        const char* data = (const char*)rec + WAL_RECORD;
+        if (fread(rec + WAL_RECORD, 1, len, in) != (size_t)len) {
+            ok = 0;
+            break;
+        }
+        remaining -= WAL_RECORD + len;
+        if (computeCrc32(rec + 4, WAL_RECORD - 4 + len) != crc) {
+            int c;
+            while (remaining > 0 && (c = fgetc(in)) == 0) remaining--;
+            if (remaining > 0) ok = 0;
+            break;
+        }
+        if (kind == WAL_WRITE) {
+            ok = writePagedRows(table, offset, data, len);
+        } else if (kind == WAL_PAGE_IMAGE) {
+            ok = offset % table->page_bytes == 0 && len <= table->page_bytes &&
+                 restorePageImage(table, offset / table->page_bytes, data, len);
+        } else {
+            ok = 0;
+        }
+        if (ok) *lsn += WAL_RECORD + len;
+    }
+    free(rec);
+    fclose(in);
+    return ok;
+}
+
+// Put a page back from its logged image (while the log is replayed) without
+// reading its slot, which a crash may have left torn. The table grows to the
+// page, or ends on it if it was the last one.
+int restorePageImage(Table* table, long page, const char* data, long used) {
+    BufferCache* cache = &buffer_cache;
+    lockBufferCache();
+    CachedPage* p = cache->buckets ? cache->buckets[pageBucket(table, page)] : NULL;
+    while (p && (p->table != table || p->page != page)) p = p->chain;
+    if (p) evictPage(p);
+    int ok = growScratch(table->slot_bytes) && writePageImage(table, page, data, used, cache->scratch);
+    if (ok && table->file_size <= (page + 1) * table->page_bytes) {
+        table->file_size = page * table->page_bytes + used;
+    }
+    unlockBufferCache();
+    return ok;
+}
+
+// Open the log of a compressed table, first redoing what an earlier session
+// logged but did not checkpoint (<table>.wal.old, then <table>.wal). The
+// redone pages are synced before the logs are replaced. If a log cannot be
+// redone both are kept and the table is not opened (0). If no log can be
+// created the table writes its pages through.
+int openPageLog(Database* db, Table* table) {
+    PageLog* log = (PageLog*)calloc(1, sizeof(PageLog));
+    if (!log) return 0;
+    log->table = table;
+    snprintf(log->path, sizeof(log->path), "%s/%s.wal", db->db_dir, table->schema.name);
+    char old_path[280];
+    snprintf(old_path, sizeof(old_path), "%s.old", log->path);
+    
+    uint64_t lsn = 0;
+    uint64_t end = 0;
+    int old = replayPageLog(table, old_path, &end);
+    if (old > 0) lsn = end;
+    int current = old ? replayPageLog(table, log->path, &end) : 0;
+    if (current > 0 && end > lsn) lsn = end;
+    int ok = old && current;
+#ifndef _WIN32
+    if (ok && (old > 0 || current > 0) && fsync(table->fd) != 0) ok = 0;
+#endif
+    if (!ok) {
+        outputMessage("Error: Could not redo the log '%s'; it is kept and the table is not opened!\n",
+                      old ? log->path : old_path);
+        free(log);
+        return 0;
+    }
+    
+#ifdef _WIN32
+    log->fd = open(log->path, _O_CREAT | _O_TRUNC | _O_RDWR | _O_BINARY, _S_IREAD | _S_IWRITE);
+#else
+    log->fd = open(log->path, O_CREAT | O_TRUNC | O_RDWR, 0644);
+#endif
+    unsigned char header[WAL_HEADER];
+    unsigned char* h = catalogPut(header, WAL_MAGIC, 4);
+    h = catalogPut(h, 0, 4);
+    catalogPut(h, lsn, 8);
+    remove(old_path);
+    if (log->fd < 0 || !writeFull(log->fd, header, WAL_HEADER)) {
+        if (log->fd >= 0) close(log->fd);
+        remove(log->path);
+        free(log);
+        return 1;
+    }
+    log->lsn = log->start_lsn = log->checkpoint_lsn = lsn;
+    log->bytes = WAL_HEADER;
+    
+    lockCheckpointer();
+    log->next = checkpointer.logs;
+    checkpointer.logs = log;
+    table->wal = log;
+    startCheckpointer();
+    unlockCheckpointer();
+    return 1;
+}
+
+// Write back a table's dirty pages and close its log, deleting the log once
+// the pages are synced. Before the table is closed (force) or its data file
+// replaced; unless forced, a failed checkpoint keeps the log open and returns 0.
+int closePageLog(Table* table, int force) {
+    PageLog* log = table->wal;
+    if (!log) return 1;
+    lockCheckpointer();
+    int ok = checkpointPages(log);
+    if (!ok && !force) {
+        unlockCheckpointer();
+        return 0;
+    }
+    PageLog** link = &checkpointer.logs;
+    while (*link != log) link = &(*link)->next;
+    *link = log->next;
+    table->wal = NULL;
+    unlockCheckpointer();
+    close(log->fd);
+    if (ok) remove(log->path);
+    free(log->buf);
+    free(log);
+    return ok;
+}
+
+// Pages of a table in the buffer cache with changes not yet written back
+long cachedDirtyPages(Table* table) {
+    long n = 0;
+    lockBufferCache();
+    for (CachedPage* p = buffer_cache.head; p; p = p->next) {
+        if (p->table == table && (p->dirty || p->writing)) n++;
+    }
+    unlockBufferCache();
+    return n;
+}
+
+// Empty memtable
+Memtable* createMemtable(void) {
+    Memtable* m = (Memtable*)calloc(1, sizeof(Memtable));
+    if (!m) return NULL;
+    m->head = (MemNode*)calloc(1, sizeof(MemNode) + LSM_MAX_HEIGHT * sizeof(MemNode*));
+    if (!m->head) {
+        free(m);
+        return NULL;
+    }
+    m->head->height = LSM_MAX_HEIGHT;
+    m->height = 1;
+    return m;
+}
+
+void freeMemtable(Memtable* m) {
+    if (!m) return;
+    for (MemNode* node = m->head; node;) {
+        MemNode* next = node->next[0];
+        free(node);
+        node = next;
+    }
+    free(m);
+}
+
+// First node with a key at or after key (the first node if key is NULL), NULL
+// past the end. With prev set, it receives the last node before it on each level.
+MemNode* memtableSeek(Memtable* m, const IndexKey* key, MemNode** prev) {
+    MemNode* node = m->head;
+    for (int level = m->height - 1; level >= 0; level--) {
+        while (key && node->next[level] && compareKeys(&node->next[level]->key, key) < 0) {
+            node = node->next[level];
+        }
+        if (prev) prev[level] = node;
+    }
+    return node->next[0];
+}
+
+// Node holding key, NULL if the memtable has no version of it
+MemNode* memtableFind(Memtable* m, const IndexKey* key) {
+    MemNode* node = memtableSeek(m, key, NULL);
+    return node && compareKeys(&node->key, key) == 0 ? node : NULL;
+}
+
+// Store a version of the row with this key, replacing any earlier one. The node,
+// its links, the row and the key's tail share one allocation.
+int memtablePut(LsmTree* lsm, Memtable* m, const IndexKey* key, const Record* row, int row_size) {
+    MemNode* prev[LSM_MAX_HEIGHT];
+    MemNode* node = memtableSeek(m, key, prev);
+    if (node && compareKeys(&node->key, key) == 0) {
+        memcpy(node->row, row, row_size);
+        return 1;
+    }
+
+    int height = 1;
+    while (height < LSM_MAX_HEIGHT) {
+        lsm->random ^= lsm->random << 13;
+        lsm->random ^= lsm->random >> 17;
+        lsm->random ^= lsm->random << 5;
+        if (lsm->random & 3) break;
+        height++;
+    }
+    size_t links = sizeof(MemNode) + height * sizeof(MemNode*);
+    size_t tail = key->len > 8 ? key->len - 8 : 0;
+    size_t size = links + row_size + tail;
+    node = (MemNode*)malloc(size);
+    if (!node) return 0;
+    node->row = (Record*)((char*)node + links);
+    memcpy(node->row, row, row_size);
+    node->key = *key;
+    node->key.tail = NULL;
+    if (tail) {
+        node->key.tail = (unsigned char*)node->row + row_size;
+        memcpy(node->key.tail, key->tail, tail);
+    }
+    node->height = height;
+    for (int level = m->height; level < height; level++) prev[level] = m->head;
+    if (height > m->height) m->height = height;
+    for (int level = 0; level < height; level++) {
+        node->next[level] = prev[level]->next[level];
+        prev[level]->next[level] = node;
+    }
+    m->entries++;
+    m->bytes += size;
+    return 1;
+}
+
+// Bloom filter bits of a run, probed as the key filter's counters are
+void runBloomAdd(unsigned char* bits, uint64_t num_bits, const IndexKey* key) {
+    uint64_t h = hashIndexKey(key);
+    uint64_t h1 = (uint32_t)h;
+    uint64_t h2 = (h >> 32) | 1;
+    for (int k = 0; k < LSM_BLOOM_HASHES; k++) {
+        uint64_t b = (h1 + k * h2) & (num_bits - 1);
+        bits[b >> 3] |= (unsigned char)(1 << (b & 7));
+    }
+}
+
+int runMayContain(const LsmRun* run, const IndexKey* key) {
+    if (!run->bloom_bits) return run->rows > 0;
+    uint64_t h = hashIndexKey(key);
+    uint64_t h1 = (uint32_t)h;
+    uint64_t h2 = (h >> 32) | 1;
+    for (int k = 0; k < LSM_BLOOM_HASHES; k++) {
+        uint64_t b = (h1 + k * h2) & (run->bloom_bits - 1);
+        if (!(run->bloom[b >> 3] & (1 << (b & 7)))) return 0;
+    }
+    return 1;
+}
+
+// File name of a run
+void runPath(const LsmTree* lsm, uint64_t seq, char* out, size_t size) {
+    snprintf(out, size, "%s.run.%llu", lsm->base, (unsigned long long)seq);
+}
+
+// Start writing a run for up to expected_rows rows to <table>.<kind>.tmp. The
+// run only gets its sequence number once complete, so a run file of the next
+// number is always one that never made it into the manifest.
+int beginRun(LsmTree* lsm, RunWriter* w, const char* kind, int row_size, long expected_rows) {
+    memset(w, 0, sizeof(*w));
+    snprintf(w->tmp, sizeof(w->tmp), "%s.%s.tmp", lsm->base, kind);
+    w->row_size = row_size;
+    w->rows_per_block = LSM_BLOCK_BYTES / row_size > 0 ? LSM_BLOCK_BYTES / row_size : 1;
+    w->bloom_bits = 64;
+    while (w->bloom_bits < (uint64_t)(expected_rows > 0 ? expected_rows : 1) * LSM_BLOOM_BITS_PER_KEY) {
+        w->bloom_bits <<= 1;
+    }
+    w->bloom = (unsigned char*)calloc(w->bloom_bits / 8, 1);
+    w->out = fopen(w->tmp, "wb");
+    w->ok = w->bloom && w->out;
+    return w->ok;
+}
+
+// Append a row with this key; rows come in key order
+void runAppend(RunWriter* w, const IndexKey* key, const void* row) {
+    if (!w->ok) return;
+    if (w->rows % w->rows_per_block == 0) {
+        if (w->num_fences == w->fence_capacity) {
+            long capacity = w->fence_capacity ? 2 * w->fence_capacity : 64;
+            IndexKey* fences = (IndexKey*)realloc(w->fences, capacity * sizeof(IndexKey));
+            if (!fences) {
+                w->ok = 0;
+                return;
+            }
+            w->fences = fences;
+            w->fence_capacity = capacity;
+        }
+        w->fences[w->num_fences++] = copyKey(key, key->len);
+    }
+    runBloomAdd(w->bloom, w->bloom_bits, key);
+    if (fwrite(row, w->row_size, 1, w->out) != 1) w->ok = 0;
+    w->rows++;
+}
+
+// Throw away a run that was being written
+void abortRun(RunWriter* w) {
+    if (w->out) fclose(w->out);
+    remove(w->tmp);
+    for (long i = 0; i < w->num_fences; i++) freeKey(&w->fences[i]);
+    free(w->fences);
+    free(w->bloom);
+}
+
+// Write the fence keys, the Bloom filter and the trailer, make the file durable
+// and move it into place. Returns the run opened for reading, NULL on failure.
+LsmRun* finishRun(LsmTree* lsm, RunWriter* w, int level) {
+    unsigned char head[16];
+    uint64_t footer = (uint64_t)w->rows * w->row_size;
+    for (long i = 0; w->ok && i < w->num_fences; i++) {
+        unsigned char len[2];
+        catalogPut(len, w->fences[i].len, 2);
+        unsigned char bytes[MAX_KEY_BYTES];
+        for (uint32_t b = 0; b < w->fences[i].len; b++) bytes[b] = (unsigned char)keyByte(&w->fences[i], b);
+        if (fwrite(len, 2, 1, w->out) != 1 || fwrite(bytes, 1, w->fences[i].len, w->out) != w->fences[i].len) {
+            w->ok = 0;
+        }
+    }
+    catalogPut(head, w->bloom_bits, 8);
+    if (w->ok && (fwrite(head, 8, 1, w->out) != 1 || fwrite(w->bloom, w->bloom_bits / 8, 1, w->out) != 1)) {
+        w->ok = 0;
+    }
+    unsigned char trailer[LSM_TRAILER];
+    unsigned char* p = catalogPut(trailer, footer, 8);
+    p = catalogPut(p, (uint64_t)w->rows, 8);
+    p = catalogPut(p, (uint32_t)w->row_size, 4);
+    p = catalogPut(p, (uint32_t)w->rows_per_block, 4);
+    memcpy(p, LSM_RUN_MAGIC, 8);
+    if (w->ok && fwrite(trailer, LSM_TRAILER, 1, w->out) != 1) w->ok = 0;
+    if (w->ok && fflush(w->out) != 0) w->ok = 0;
+#ifndef _WIN32
+    if (w->ok && fsync(fileno(w->out)) != 0) w->ok = 0;
+#endif
+
+    LsmRun* run = w->ok ? (LsmRun*)calloc(1, sizeof(LsmRun)) : NULL;
+    if (!run) {
+        abortRun(w);
+        return NULL;
+    }
+    long file_bytes = ftell(w->out);
+    fclose(w->out);
+    w->out = NULL;
+    w->seq = lsm->next_seq++;
+    runPath(lsm, w->seq, w->path, sizeof(w->path));
+#ifdef _WIN32
+    remove(w->path);
+#endif
+    if (rename(w->tmp, w->path) != 0) {
+        free(run);
+        abortRun(w);
+        return NULL;
+    }
+    run->seq = w->seq;
+    run->level = level;
+#ifdef _WIN32
+    run->fd = open(w->path, _O_RDONLY | _O_BINARY);
+#else
+    run->fd = open(w->path, O_RDONLY);
+#endif
+    run->rows = w->rows;
+    run->rows_per_block = w->rows_per_block;
+    run->num_blocks = w->num_fences;
+    run->fences = w->fences;
+    run->bloom = w->bloom;
+    run->bloom_bits = w->bloom_bits;
+    run->file_bytes = file_bytes;
+    if (run->fd < 0) {
+        remove(w->path);
+        freeRun(NULL, run, 0);
+        return NULL;
+    }
+    return run;
+}
+
+// Open a run of the manifest, loading its fence keys and Bloom filter
+LsmRun* openRun(LsmTree* lsm, uint64_t seq, int level, int row_size) {
+    char path[272];
+    runPath(lsm, seq, path, sizeof(path));
+    LsmRun* run = (LsmRun*)calloc(1, sizeof(LsmRun));
+    if (!run) return NULL;
+    run->seq = seq;
+    run->level = level;
+#ifdef _WIN32
+    run->fd = open(path, _O_RDONLY | _O_BINARY);
+#else
+    run->fd = open(path, O_RDONLY);
+#endif
+    long size = run->fd >= 0 ? lseek(run->fd, 0, SEEK_END) : -1;
+    unsigned char trailer[LSM_TRAILER];
+    if (size < LSM_TRAILER || preadFull(run->fd, trailer, LSM_TRAILER, size - LSM_TRAILER) != LSM_TRAILER ||
+        memcmp(trailer + 24, LSM_RUN_MAGIC, 8) != 0) {
+        freeRun(NULL, run, 0);
+        return NULL;
+    }
+    CatalogReader r = {trailer, trailer + 24, 1};
+    uint64_t footer = catalogGet(&r, 8);
+    run->rows = (long)catalogGet(&r, 8);
+    int stored_size = (int)catalogGet(&r, 4);
+    run->rows_per_block = (long)catalogGet(&r, 4);
+    run->file_bytes = size;
+    if (stored_size != row_size || run->rows_per_block < 1 || footer != (uint64_t)run->rows * row_size ||
+        footer > (uint64_t)(size - LSM_TRAILER)) {
+        freeRun(NULL, run, 0);
+        return NULL;
+    }
+
+    size_t len = (size_t)(size - LSM_TRAILER - footer);
+    unsigned char* buf = (unsigned char*)malloc(len ? len : 1);
+    run->num_blocks = (run->rows + run->rows_per_block - 1) / run->rows_per_block;
+    run->fences = (IndexKey*)calloc(run->num_blocks ? run->num_blocks : 1, sizeof(IndexKey));
+    int ok = buf && run->fences && preadFull(run->fd, buf, len, (long)footer) == (ssize_t)len;
+    r.p = buf;
+    r.end = buf + len;
+    r.ok = ok;
+    for (long b = 0; r.ok && b < run->num_blocks; b++) {
+        uint32_t key_len = (uint32_t)catalogGet(&r, 2);
+        if (key_len > MAX_KEY_BYTES || (size_t)(r.end - r.p) < key_len) {
+            r.ok = 0;
+            break;
+        }
+        IndexKey key = makeKey(r.p, key_len);
+        run->fences[b] = copyKey(&key, key_len);
+        r.p += key_len;
+    }
+    run->bloom_bits = catalogGet(&r, 8);
+    if (r.ok && (run->bloom_bits < 8 || (run->bloom_bits & (run->bloom_bits - 1)) ||
+                 (uint64_t)(r.end - r.p) != run->bloom_bits / 8)) {
+        r.ok = 0;
+    }
+    if (r.ok) run->bloom = (unsigned char*)malloc(run->bloom_bits / 8);
+    if (run->bloom) memcpy(run->bloom, r.p, run->bloom_bits / 8);
+    free(buf);
+    if (!run->bloom) {
+        freeRun(NULL, run, 0);
+        return NULL;
+    }
+    return run;
+}
+
+// Close a run, deleting its file once it has been merged away
+void freeRun(LsmTree* lsm, LsmRun* run, int remove_file) {
+    if (!run) return;
+    if (run->fd >= 0) close(run->fd);
+    for (long b = 0; run->fences && b < run->num_blocks; b++) freeKey(&run->fences[b]);
+    free(run->fences);
+    free(run->bloom);
+    if (remove_file) {
+        char path[272];
+        runPath(lsm, run->seq, path, sizeof(path));
+        remove(path);
+    }
+    free(run);
+}
+
+// Block of a run that would hold key: the last one whose fence key is not
+// after it, -1 if key sorts before the whole run
+long runBlockFor(const LsmRun* run, const IndexKey* key) {
+    long lo = 0;
+    long hi = run->num_blocks - 1;
+    if (run->num_blocks == 0 || compareKeys(key, &run->fences[0]) < 0) return -1;
+    while (lo < hi) {
+        long mid = lo + (hi - lo + 1) / 2;
+        if (compareKeys(&run->fences[mid], key) <= 0) {
+            lo = mid;
+        } else {
+            hi = mid - 1;
+        }
+    }
+    return lo;
+}
+
+// Look key up in a run: the Bloom filter first, then the fence keys to pick the
+// one block to read. Returns 1 and copies the version found (possibly a delete)
+// to out if the run has the key.
+int runFind(Table* table, const LsmRun* run, const IndexKey* key, Record* out) {
+    if (!runMayContain(run, key)) return 0;
+    long block = runBlockFor(run, key);
+    if (block < 0) return 0;
+    int row_size = table->schema.row_size;
+    long first = block * run->rows_per_block;
+    long n = run->rows - first < run->rows_per_block ? run->rows - first : run->rows_per_block;
+    char* rows = (char*)malloc((size_t)n * row_size);
+    if (!rows) return 0;
+    int found = 0;
+    if (preadFull(run->fd, rows, (size_t)n * row_size, first * row_size) == (ssize_t)(n * row_size)) {
+        long lo = 0;
+        long hi = n - 1;
+        unsigned char buf[MAX_KEY_BYTES];
+        while (lo <= hi && !found) {
+            long mid = lo + (hi - lo) / 2;
+            Record* rec = (Record*)(rows + mid * row_size);
+            IndexKey k;
+            recordKey(table, rec, buf, &k);
+            int c = compareKeys(&k, key);
+            if (c == 0) {
+                if (out) memcpy(out, rec, row_size);
+                found = 1;
+            } else if (c < 0) {
+                lo = mid + 1;
+            } else {
+                hi = mid - 1;
+            }
+        }
+    }
+    free(rows);
+    return found;
+}
+
+// Hold frozen and the run list in place while they are read
+void pinLsm(LsmTree* lsm) {
+#ifndef _WIN32
+    pthread_rwlock_rdlock(&lsm->lock);
+#else
+    (void)lsm;
+#endif
+}
+
+void unpinLsm(LsmTree* lsm) {
+#ifndef _WIN32
+    pthread_rwlock_unlock(&lsm->lock);
+#else
+    (void)lsm;
+#endif
+}
+
+// Newest version of the row with this key: the active memtable, the frozen
+// one, then the runs from the newest. Returns 1 if the row is live, copying
+// it to out when out is set.
+int lsmFind(Table* table, const IndexKey* key, Record* out) {
+    LsmTree* lsm = table->lsm;
+    int row_size = table->schema.row_size;
+    MemNode* node = memtableFind(lsm->active, key);
+    if (node) {
+        if (out && node->row->id != 0) memcpy(out, node->row, row_size);
+        return node->row->id != 0;
+    }
+
+    pinLsm(lsm);
+    int live = -1;
+    node = lsm->frozen ? memtableFind(lsm->frozen, key) : NULL;
+    if (node) {
+        if (out && node->row->id != 0) memcpy(out, node->row, row_size);
+        live = node->row->id != 0;
+    }
+    Record* rec = live < 0 ? allocRecord(table) : NULL;
+    for (int r = lsm->num_runs - 1; rec && r >= 0 && live < 0; r--) {
+        if (!runFind(table, lsm->runs[r], key, rec)) continue;
+        live = rec->id != 0;
+        if (out && live) memcpy(out, rec, row_size);
+    }
+    free(rec);
+    unpinLsm(lsm);
+    return live > 0;
+}
+
+// Position a cursor on the first row of a memtable at or after lo
+void openMemCursor(LsmCursor* c, Table* table, Memtable* m, const IndexKey* lo) {
+    memset(c, 0, sizeof(*c));
+    c->table = table;
+    c->node = memtableSeek(m, lo, NULL);
+    c->row = c->node ? c->node->row : NULL;
+    if (c->node) c->key = c->node->key;
+}
+
+// Make row pos of a run the cursor's current row, reading the next chunk of
+// the run when pos is past the rows buffered
+void loadRunRow(LsmCursor* c) {
+    int row_size = c->table->schema.row_size;
+    c->row = NULL;
+    if (c->pos >= c->run->rows) return;
+    if (!c->buf) {
+        c->failed = 1;
+        return;
+    }
+    if (c->pos < c->buf_first || c->pos >= c->buf_first + c->buf_rows) {
+        long n = c->run->rows - c->pos < c->chunk_rows ? c->run->rows - c->pos : c->chunk_rows;
+        if (preadFull(c->run->fd, c->buf, (size_t)n * row_size, c->pos * row_size) != (ssize_t)(n * row_size)) {
+            c->failed = 1;
+            return;
+        }
+        c->buf_first = c->pos;
+        c->buf_rows = n;
+    }
+    c->row = (Record*)(c->buf + (c->pos - c->buf_first) * row_size);
+    recordKey(c->table, c->row, c->key_buf, &c->key);
+}
+
+// Position a cursor on the first row of a run at or after lo, starting from
+// the block the fence keys point to
+void openRunCursor(LsmCursor* c, Table* table, LsmRun* run, const IndexKey* lo) {
+    memset(c, 0, sizeof(*c));
+    c->table = table;
+    c->run = run;
+    c->chunk_rows = LSM_SCAN_BYTES / table->schema.row_size;
+    if (c->chunk_rows < run->rows_per_block) c->chunk_rows = run->rows_per_block;
+    c->buf = (char*)malloc((size_t)c->chunk_rows * table->schema.row_size);
+    c->buf_rows = 0;
+    long block = lo ? runBlockFor(run, lo) : 0;
+    c->pos = block > 0 ? block * run->rows_per_block : 0;
+    loadRunRow(c);
+    while (lo && c->row && compareKeys(&c->key, lo) < 0) {
+        c->pos++;
+        loadRunRow(c);
+    }
+}
+
+void advanceCursor(LsmCursor* c) {
+    if (c->run) {
+        c->pos++;
+        loadRunRow(c);
+        return;
+    }
+    c->node = c->node->next[0];
+    c->row = c->node ? c->node->row : NULL;
+    if (c->node) c->key = c->node->key;
+}
+
+void closeCursor(LsmCursor* c) {
+    free(c->buf);
+    c->buf = NULL;
+}
+
+// Cursor holding the smallest key of a merge, the newest one (lowest index)
+// among cursors on the same key; -1 once all are exhausted
+int mergeWinner(LsmCursor* cursors, int n) {
+    int winner = -1;
+    for (int i = 0; i < n; i++) {
+        if (cursors[i].row && (winner < 0 || compareKeys(&cursors[i].key, &cursors[winner].key) < 0)) winner = i;
+    }
+    return winner;
+}
+
+// Move every cursor on the winner's key past it, the winner last as the others
+// are compared with its key
+void advanceMerge(LsmCursor* cursors, int n, int winner) {
+    for (int i = 0; i < n; i++) {
+        if (i != winner && cursors[i].row && compareKeys(&cursors[i].key, &cursors[winner].key) == 0) {
+            advanceCursor(&cursors[i]);
+        }
+    }
+    advanceCursor(&cursors[winner]);
+}
+
+// Range scan of an LSM table: a merge of the memtables and the runs in key
+// order, the newest version of each key winning and deletes skipped
+int lsmScan(Table* table, const IndexKey* lo, const IndexKey* hi, ScanCallback cb, void* ctx) {
+    LsmTree* lsm = table->lsm;
+    pinLsm(lsm);
+    LsmCursor* cursors = (LsmCursor*)malloc((2 + lsm->num_runs) * sizeof(LsmCursor));
+    if (!cursors) {
+        unpinLsm(lsm);
+        return 0;
+    }
+    int n = 0;
+    openMemCursor(&cursors[n++], table, lsm->active, lo);
+    if (lsm->frozen) openMemCursor(&cursors[n++], table, lsm->frozen, lo);
+    for (int r = lsm->num_runs - 1; r >= 0; r--) openRunCursor(&cursors[n++], table, lsm->runs[r], lo);
+
+    int count = 0;
+    for (int w = mergeWinner(cursors, n); w >= 0; w = mergeWinner(cursors, n)) {
+        if (hi && compareKeyPrefix(&cursors[w].key, hi) > 0) break;
+        if (cursors[w].row->id != 0) {
+            count++;
+            if (!cb(ctx, cursors[w].row)) break;
+        }
+        advanceMerge(cursors, n, w);
+    }
+    for (int i = 0; i < n; i++) closeCursor(&cursors[i]);
+    free(cursors);
+    unpinLsm(lsm);
+    return count;
+}
+
+// Replace the manifest, which lists the runs oldest first, through a temporary
+// file. Runs in obsolete were merged away; a restart deletes any still there.
+int writeManifest(LsmTree* lsm, LsmRun** runs, int num_runs, LsmRun** obsolete, int num_obsolete) {
+    char path[272];
+    char tmp[280];
+    snprintf(path, sizeof(path), "%s.lsm", lsm->base);
+    snprintf(tmp, sizeof(tmp), "%s.tmp", path);
+    size_t size = 24 + 9 * (size_t)num_runs + 8 * (size_t)num_obsolete;
+    unsigned char* buf = (unsigned char*)malloc(size);
+    if (!buf) return 0;
+    memcpy(buf, LSM_MANIFEST_MAGIC, 8);
+    unsigned char* p = catalogPut(buf + 12, lsm->next_seq, 8);
+    p = catalogPut(p, (uint32_t)num_runs, 2);
+    p = catalogPut(p, (uint32_t)num_obsolete, 2);
+    for (int i = 0; i < num_runs; i++) {
+        p = catalogPut(p, runs[i]->seq, 8);
+        p = catalogPut(p, (uint32_t)runs[i]->level, 1);
+    }
+    for (int i = 0; i < num_obsolete; i++) p = catalogPut(p, obsolete[i]->seq, 8);
+    catalogPut(buf + 8, computeCrc32(buf + 12, size - 12), 4);
+
+    FILE* out = fopen(tmp, "wb");
+    int ok = out && fwrite(buf, size, 1, out) == 1 && fflush(out) == 0;
+#ifndef _WIN32
+    if (ok && fsync(fileno(out)) != 0) ok = 0;
+#endif
+    if (out && fclose(out) != 0) ok = 0;
+    free(buf);
+#ifdef _WIN32
+    if (ok) remove(path);
+#endif
+    if (ok && rename(tmp, path) != 0) ok = 0;
+    if (!ok) remove(tmp);
+    return ok;
+}
+
+// Swap the run list for one the worker built (dropping the frozen memtable
+// after a flush); readers see either list whole
+void installRuns(LsmTree* lsm, LsmRun** runs, int num_runs, Memtable** flushed) {
+#ifndef _WIN32
+    pthread_mutex_lock(&lsm->work_lock);
+    pthread_rwlock_wrlock(&lsm->lock);
+#endif
+    LsmRun** old = lsm->runs;
+    lsm->runs = runs;
+    lsm->num_runs = num_runs;
+    if (flushed) {
+        *flushed = lsm->frozen;
+        lsm->frozen = NULL;
+        lsm->flushes++;
+    } else {
+        lsm->merges++;
+    }
+#ifndef _WIN32
+    pthread_rwlock_unlock(&lsm->lock);
+    if (flushed) pthread_cond_broadcast(&lsm->flushed);
+    pthread_mutex_unlock(&lsm->work_lock);
+#endif
+    free(old);
+}
+
+// Write the frozen memtable out as a level-0 run, then drop it and its log.
+// Deletes are kept unless there is no older run they could hide rows in.
+int flushMemtable(Table* table) {
+    LsmTree* lsm = table->lsm;
+    Memtable* m = lsm->frozen;
+    RunWriter w;
+    int drop_deletes = lsm->num_runs == 0;
+    if (!beginRun(lsm, &w, "flush", table->schema.row_size, m->entries)) {
+        abortRun(&w);
+        return 0;
+    }
+    for (MemNode* node = m->head->next[0]; node; node = node->next[0]) {
+        if (drop_deletes && node->row->id == 0) continue;
+        runAppend(&w, &node->key, node->row);
+    }
+
+    LsmRun* run = NULL;
+    if (w.rows > 0) {
+        run = finishRun(lsm, &w, 0);
+        if (!run) return 0;
+    } else {
+        abortRun(&w);
+    }
+    LsmRun** runs = (LsmRun**)malloc((lsm->num_runs + 1) * sizeof(LsmRun*));
+    if (!runs) {
+        freeRun(lsm, run, 1);
+        return 0;
+    }
+    if (lsm->num_runs) memcpy(runs, lsm->runs, lsm->num_runs * sizeof(LsmRun*));
+    int num_runs = lsm->num_runs;
+    if (run) runs[num_runs++] = run;
+    if (!writeManifest(lsm, runs, num_runs, NULL, 0)) {
+        free(runs);
+        freeRun(lsm, run, 1);
+        return 0;
+    }
+
+    char log_path[272];
+    snprintf(log_path, sizeof(log_path), "%s.log.frozen", lsm->base);
+    remove(log_path);
+    Memtable* flushed = NULL;
+    installRuns(lsm, runs, num_runs, &flushed);
+    freeMemtable(flushed);
+    return 1;
+}
+
+// What a merge in progress has to make way for: 1 if a memtable was frozen
+// since it started, 2 if the worker is being stopped. Log appends that have
+// waited LSM_LOG_FLUSH_MS are written out meanwhile.
+int mergeInterrupt(LsmTree* lsm) {
+#ifndef _WIN32
+    syncLsmLog(lsm, LSM_LOG_FLUSH_MS * 1000000ULL);
+    pthread_mutex_lock(&lsm->work_lock);
+    int interrupt = lsm->stop ? 2 : lsm->frozen != NULL;
+    pthread_mutex_unlock(&lsm->work_lock);
+    return interrupt;
+#else
+    (void)lsm;
+    return 0;
+#endif
+}
+
+// Merge the newest runs once LSM_FANOUT of them share a level: they become one
+// run of the next level in their place. Deletes are dropped when the merge
+// takes in the oldest run, as nothing older is left for them to hide. A
+// memtable frozen meanwhile is flushed without waiting for the merge, its run
+// going after the merged one. Returns 1 if runs were merged.
+int mergeRuns(Table* table) {
+    LsmTree* lsm = table->lsm;
+    int count = lsm->num_runs;
+    int n = 0;
+    while (n < count && lsm->runs[count - 1 - n]->level == lsm->runs[count - 1]->level) n++;
+    if (n < LSM_FANOUT) return 0;
+    n = LSM_FANOUT;
+    int first = count - n;
+    int level = lsm->runs[first]->level;
+    int drop_deletes = first == 0;
+    LsmRun* inputs[LSM_FANOUT];
+    memcpy(inputs, lsm->runs + first, n * sizeof(LsmRun*));
+
+    LsmCursor cursors[LSM_FANOUT];
+    long expected = 0;
+    for (int i = 0; i < n; i++) expected += inputs[i]->rows;
+    RunWriter w;
+    if (!beginRun(lsm, &w, "merge", table->schema.row_size, expected)) {
+        abortRun(&w);
+        return 0;
+    }
+    for (int i = 0; i < n; i++) openRunCursor(&cursors[i], table, inputs[n - 1 - i], NULL);
+    long steps = 0;
+    for (int c = mergeWinner(cursors, n); c >= 0 && w.ok; c = mergeWinner(cursors, n)) {
+        if (!drop_deletes || cursors[c].row->id != 0) runAppend(&w, &cursors[c].key, cursors[c].row);
+        advanceMerge(cursors, n, c);
+        if (++steps % LSM_MERGE_CHECK != 0) continue;
+        int interrupt = mergeInterrupt(lsm);
+        if (interrupt == 1) flushMemtable(table);
+        if (interrupt == 2) w.ok = 0;
+    }
+    for (int i = 0; i < n; i++) {
+        if (cursors[i].failed) w.ok = 0;
+        closeCursor(&cursors[i]);
+    }
+
+    LsmRun* run = NULL;
+    if (w.rows > 0 || !w.ok) {
+        run = finishRun(lsm, &w, level + 1);
+        if (!run) return 0;
+    } else {
+        abortRun(&w);
+    }
+    int flushed = lsm->num_runs - count;
+    LsmRun** runs = (LsmRun**)malloc((first + 1 + flushed) * sizeof(LsmRun*));
+    if (!runs) {
+        freeRun(lsm, run, 1);
+        return 0;
+    }
+    memcpy(runs, lsm->runs, first * sizeof(LsmRun*));
+    int num_runs = first;
+    if (run) runs[num_runs++] = run;
+    memcpy(runs + num_runs, lsm->runs + count, flushed * sizeof(LsmRun*));
+    num_runs += flushed;
+    if (!writeManifest(lsm, runs, num_runs, inputs, n)) {
+        free(runs);
+        freeRun(lsm, run, 1);
+        return 0;
+    }
+    installRuns(lsm, runs, num_runs, NULL);
+    for (int i = 0; i < n; i++) freeRun(lsm, inputs[i], 1);
+    return 1;
+}
+
+#ifndef _WIN32
+// Background worker of an LSM table: flushes frozen memtables and merges runs,
+// sleeping in between, and writes out the buffered log appends at least every
+// LSM_LOG_FLUSH_MS. A failed flush is retried a second later.
+void* lsmWorker(void* arg) {
+    Table* table = (Table*)arg;
+    LsmTree* lsm = table->lsm;
+    pthread_mutex_lock(&lsm->work_lock);
+    while (!lsm->stop) {
+        pthread_mutex_unlock(&lsm->work_lock);
+        syncLsmLog(lsm, 0);
+        pthread_mutex_lock(&lsm->work_lock);
+        int worked = 0;
+        if (lsm->frozen) {
+            pthread_mutex_unlock(&lsm->work_lock);
+            worked = flushMemtable(table);
+            pthread_mutex_lock(&lsm->work_lock);
+            if (!worked) {
+                struct timespec deadline;
+                clock_gettime(CLOCK_REALTIME, &deadline);
+                deadline.tv_sec++;
+                pthread_cond_timedwait(&lsm->wake, &lsm->work_lock, &deadline);
+                continue;
+            }
+        } else {
+            pthread_mutex_unlock(&lsm->work_lock);
+            worked = mergeRuns(table);
+            pthread_mutex_lock(&lsm->work_lock);
+        }
+        if (!worked && !lsm->frozen && !lsm->stop) {
+            struct timespec deadline;
+            clock_gettime(CLOCK_REALTIME, &deadline);
+            deadline.tv_nsec += LSM_LOG_FLUSH_MS * 1000000L;
+            if (deadline.tv_nsec >= 1000000000L) {
+                deadline.tv_sec++;
+                deadline.tv_nsec -= 1000000000L;
+            }
+            pthread_cond_timedwait(&lsm->wake, &lsm->work_lock, &deadline);
+        }
+    }
+    pthread_mutex_unlock(&lsm->work_lock);
+    return NULL;
+}
+#endif
+
+// Start the worker; without threads (or if one cannot be started) flushes
+// and merges run on the writing thread instead
+void startLsmWorker(Table* table) {
+#ifndef _WIN32
+    LsmTree* lsm = table->lsm;
+    lsm->stop = 0;
+    lsm->running = pthread_create(&lsm->worker, NULL, lsmWorker, table) == 0;
+#else
+    (void)table;
+#endif
+}
+
+// Stop the worker once it has finished the flush or merge at hand. The
+// buffered log appends are written out, as later ones go straight to the file.
+void stopLsmWorker(Table* table) {
+#ifndef _WIN32
+    LsmTree* lsm = table->lsm;
+    if (!lsm->running) return;
+    pthread_mutex_lock(&lsm->work_lock);
+    lsm->stop = 1;
+    pthread_cond_signal(&lsm->wake);
+    pthread_mutex_unlock(&lsm->work_lock);
+    pthread_join(lsm->worker, NULL);
+    lsm->running = 0;
+    if (!flushLsmLog(lsm)) outputMessage("Error: Could not write to the log of '%s'!\n", table->schema.name);
+#else
+    (void)table;
+#endif
+}
+
+// Open the log for appending, cut back to whole rows
+int openLsmLog(Table* table) {
+    LsmTree* lsm = table->lsm;
+    char path[272];
+    snprintf(path, sizeof(path), "%s.log", lsm->base);
+#ifdef _WIN32
+    lsm->log_fd = open(path, _O_CREAT | _O_RDWR | _O_BINARY, _S_IREAD | _S_IWRITE);
+#else
+    lsm->log_fd = open(path, O_CREAT | O_RDWR, 0644);
+#endif
+    if (lsm->log_fd < 0) return 0;
+    long size = lseek(lsm->log_fd, 0, SEEK_END);
+    long whole = size - size % table->schema.row_size;
+    if (whole != size && ftruncate(lsm->log_fd, whole) != 0) return 0;
+    return lseek(lsm->log_fd, whole, SEEK_SET) == whole;
+}
+
+// Append bytes to the log file. A short write is cut back off the file, so
+// the log never ends in part of a row that later rows would follow.
+int appendLsmLog(LsmTree* lsm, const void* buf, size_t len) {
+    long at = lseek(lsm->log_fd, 0, SEEK_CUR);
+    if (at >= 0 && writeFull(lsm->log_fd, buf, len)) return 1;
+    if (at >= 0 && ftruncate(lsm->log_fd, at) == 0) lseek(lsm->log_fd, at, SEEK_SET);
+    return 0;
+}
+
+// Write the buffered appends to the log file; if that fails they stay
+// buffered for the next try. The caller holds log_lock.
+int flushLsmLog(LsmTree* lsm) {
+    if (lsm->log_len == 0) return 1;
+    if (!appendLsmLog(lsm, lsm->log_buf, lsm->log_len)) return 0;
+    lsm->log_len = 0;
+    return 1;
+}
+
+// Write out the buffered appends if the first of them is at least age
+// nanoseconds old
+void syncLsmLog(LsmTree* lsm, uint64_t age) {
+#ifndef _WIN32
+    pthread_mutex_lock(&lsm->log_lock);
+    if (lsm->log_len > 0 && profileClock() - lsm->log_since >= age) flushLsmLog(lsm);
+    pthread_mutex_unlock(&lsm->log_lock);
+#else
+    (void)lsm;
+    (void)age;
+#endif
+}
+
+// Freeze the active memtable once it is full: its log becomes
+// <table>.log.frozen and the worker writes it out as a run. Called after each
+// write. While the last frozen memtable is still being flushed the active one
+// keeps filling; only at twice the size does the writer wait for the flush.
+void freezeMemtable(Table* table) {
+    LsmTree* lsm = table->lsm;
+    if (lsm->active->bytes < LSM_MEMTABLE_BYTES) return;
+#ifndef _WIN32
+    pthread_mutex_lock(&lsm->work_lock);
+    if (lsm->frozen && lsm->running && lsm->active->bytes < 2 * LSM_MEMTABLE_BYTES) {
+        pthread_mutex_unlock(&lsm->work_lock);
+        return;
+    }
+    while (lsm->frozen && lsm->running) pthread_cond_wait(&lsm->flushed, &lsm->work_lock);
+    pthread_mutex_unlock(&lsm->work_lock);
+#endif
+    if (lsm->frozen && !flushMemtable(table)) return;
+    Memtable* fresh = createMemtable();
+    if (!fresh) return;
+    char path[272];
+    char frozen_path[280];
+    snprintf(path, sizeof(path), "%s.log", lsm->base);
+    snprintf(frozen_path, sizeof(frozen_path), "%s.frozen", path);
+
+#ifndef _WIN32
+    pthread_mutex_lock(&lsm->log_lock);
+#endif
+    int swapped = flushLsmLog(lsm);
+    if (swapped) {
+        close(lsm->log_fd);
+#ifdef _WIN32
+        remove(frozen_path);
+#endif
+        if (rename(path, frozen_path) != 0 || !openLsmLog(table)) {
+            // Keep writing to the memtable's log rather than lose the next rows
+            rename(frozen_path, path);
+            openLsmLog(table);
+            swapped = 0;
+        }
+    }
+#ifndef _WIN32
+    pthread_mutex_unlock(&lsm->log_lock);
+#endif
+    if (!swapped) {
+        freeMemtable(fresh);
+        return;
+    }
+#ifndef _WIN32
+    pthread_mutex_lock(&lsm->work_lock);
+    pthread_rwlock_wrlock(&lsm->lock);
+#endif
+    lsm->frozen = lsm->active;
+    lsm->active = fresh;
+#ifndef _WIN32
+    pthread_rwlock_unlock(&lsm->lock);
+    pthread_cond_signal(&lsm->wake);
+    pthread_mutex_unlock(&lsm->work_lock);
+    if (lsm->running) return;
+#endif
+    if (flushMemtable(table)) {
+        while (mergeRuns(table)) {}
+    }
+}
+
+// Put rows into the active memtable; the caller logs them
+int lsmApply(Table* table, const char* rows, long n) {
+    int row_size = table->schema.row_size;
+    unsigned char buf[MAX_KEY_BYTES];
+    IndexKey key;
+    for (long i = 0; i < n; i++) {
+        const Record* rec = (const Record*)(rows + i * row_size);
+        if (!recordKey(table, (Record*)rec, buf, &key) ||
+            !memtablePut(table->lsm, table->lsm->active, &key, rec, row_size)) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+// Append rows to the log. While the worker runs, they are buffered and reach
+// the file once LSM_LOG_BUFFER bytes pile up, when the memtable is frozen, or
+// within about LSM_LOG_FLUSH_MS, as the worker writes the buffer out; without
+// it they are written at once.
+int lsmLog(Table* table, const void* rows, long n) {
+    LsmTree* lsm = table->lsm;
+    size_t len = (size_t)n * table->schema.row_size;
+#ifndef _WIN32
+    if (lsm->running && lsm->log_buf) {
+        pthread_mutex_lock(&lsm->log_lock);
+        int ok = lsm->log_len + len <= LSM_LOG_BUFFER || flushLsmLog(lsm);
+        if (ok && len > LSM_LOG_BUFFER) {
+            ok = appendLsmLog(lsm, rows, len);
+        } else if (ok) {
+            if (lsm->log_len == 0) lsm->log_since = profileClock();
+            memcpy(lsm->log_buf + lsm->log_len, rows, len);
+            lsm->log_len += len;
+        }
+        pthread_mutex_unlock(&lsm->log_lock);
+        return ok;
+    }
+#endif
+    return appendLsmLog(lsm, rows, len);
+}
+
+// Write one row (a delete if its id is 0): log it, put it in the memtable,
+// and freeze the memtable if that filled it
+int lsmWrite(Table* table, const Record* rec) {
+    if (!lsmLog(table, rec, 1) || !lsmApply(table, (const char*)rec, 1)) return 0;
+    freezeMemtable(table);
+    return 1;
+}
+
+// INSERT into an LSM table: a point lookup rules out a duplicate key, then the
+// row is logged and put in the memtable
+void insertLsmRecord(Table* table, const IndexKey* key, Record* rec) {
+    lockFile(table->fd, 1);
+    if (lsmFind(table, key, NULL)) {
+        unlockFile(table->fd);
+        char text[256];
+        formatKey(table, key, text, sizeof(text));
+        outputMessage("Error: Record with ID %s already exists!\n", text);
+        return;
+    }
+    if (!lsmWrite(table, rec)) {
+        unlockFile(table->fd);
+        outputMessage("Error: Could not write to the log of '%s'!\n", table->schema.name);
+        return;
+    }
+    noteKeyStats(table, key);
+    table->record_count++;
+    table->version++;
+    unlockFile(table->fd);
+    metricsAdd(METRIC_ROWS_WRITTEN, 1);
+    outputMessage("Record inserted successfully.\n");
+}
+
+// UPDATE (rec set) or DELETE (rec NULL) of a row of an LSM table. Either writes
+// a new version of the row: the updated one with the old key columns, or the
+// old one with its id zeroed.
+void writeLsmRecord(Table* table, const IndexKey* key, Record* rec) {
+    Record* old = allocRecord(table);
+    lockFile(table->fd, 1);
+    if (!old || !lsmFind(table, key, old)) {
+        unlockFile(table->fd);
+        free(old);
+        outputMessage("Error: Record not found!\n");
+        return;
+    }
+    if (rec) {
+        for (int k = 0; k < table->schema.num_key_columns; k++) {
+            int col = table->schema.key_columns[k];
+            memcpy(recordField(table, rec, col), recordField(table, old, col), table->schema.columns[col].size);
+        }
+        rec->id = 1;
+    } else {
+        old->id = 0;
+    }
+    int ok = lsmWrite(table, rec ? rec : old);
+    free(old);
+    if (!ok) {
+        unlockFile(table->fd);
+        outputMessage("Error: Could not write to the log of '%s'!\n", table->schema.name);
+        return;
+    }
+    if (!rec) table->record_count--;
+    table->version++;
+    unlockFile(table->fd);
+    metricsAdd(METRIC_ROWS_WRITTEN, 1);
+    outputMessage(rec ? "Record updated successfully.\n" : "Record deleted successfully.\n");
+}
+
+// COPY FROM into an LSM table, a parsed chunk at a time: each row is checked
+// against the rows already there (those of earlier chunks included) and put
+// in the memtable, then the chunk is logged. The keys of the rows taken are
+// added to keys, for finishLsmCopy. line_base is the line before the chunk.
+int copyLsmRows(Table* table, CopyChunk* c, long line_base, KeyOffset* keys, long* num_keys) {
+    int row_size = table->schema.row_size;
+    unsigned char key_buf[MAX_KEY_BYTES];
+    IndexKey key;
+    long n = 0;
+    int ok = 1;
+    for (; n < c->count && ok; n++) {
+        Record* rec = (Record*)(c->rows + n * row_size);
+        recordKey(table, rec, key_buf, &key);
+        if (lsmFind(table, &key, NULL)) {
+            char text[256];
+            formatKey(table, &key, text, sizeof(text));
+            outputMessage("Error: Line %ld: Record with ID %s already exists!\n", line_base + c->row_lines[n], text);
+            ok = 0;
+            break;
+        }
+        if (!memtablePut(table->lsm, table->lsm->active, &key, rec, row_size)) {
+            outputMessage("Error: Out of memory importing into '%s'!\n", table->schema.name);
+            ok = 0;
+            break;
+        }
+        keys[*num_keys].key = copyKey(&key, key.len);
+        keys[*num_keys].offset = 0;
+        (*num_keys)++;
+    }
+    if (!lsmLog(table, c->rows, n)) {
+        outputMessage("Error: Could not write to the log of '%s'!\n", table->schema.name);
+        ok = 0;
+    }
+    if (ok) freezeMemtable(table);
+    return ok;
+}
+
+// End a COPY FROM into an LSM table. The rows are counted in, or, if the copy
+// failed, deleted again by writing a delete for each one.
+void finishLsmCopy(Table* table, KeyOffset* keys, long num_keys, int failed) {
+    Record* rec = failed ? allocRecord(table) : NULL;
+    long kept = 0;
+    for (long i = 0; i < num_keys; i++) {
+        if (!failed) {
+            noteKeyStats(table, &keys[i].key);
+            table->record_count++;
+        } else if (rec && lsmFind(table, &keys[i].key, rec)) {
+            rec->id = 0;
+            if (!lsmWrite(table, rec)) kept++;
+        } else {
+            kept++;
+        }
+        freeKey(&keys[i].key);
+    }
+    free(rec);
+    if (failed && kept > 0) outputMessage("Error: Could not roll back '%s'!\n", table->schema.name);
+    table->record_count += kept;
+    table->version++;
+}
+
+// Read a log into a memtable
+int replayLog(Table* table, const char* path, Memtable* m) {
+    int row_size = table->schema.row_size;
+    FILE* in = fopen(path, "rb");
+    if (!in) return 1;
+    long n = LSM_SCAN_BYTES / row_size > 0 ? LSM_SCAN_BYTES / row_size : 1;
+    char* rows = (char*)malloc((size_t)n * row_size);
+    unsigned char buf[MAX_KEY_BYTES];
+    IndexKey key;
+    int ok = rows != NULL;
+    size_t got;
+    while (ok && (got = fread(rows, row_size, n, in)) > 0) {
+        for (size_t i = 0; ok && i < got; i++) {
+            Record* rec = (Record*)(rows + i * row_size);
+            ok = recordKey(table, rec, buf, &key) && memtablePut(table->lsm, m, &key, rec, row_size);
+        }
+    }
+    free(rows);
+    fclose(in);
+    return ok;
+}
+
+int countLiveRow(void* ctx, Record* rec) {
+    Table* table = (Table*)ctx;
+    unsigned char buf[MAX_KEY_BYTES];
+    IndexKey key;
+    if (recordKey(table, rec, buf, &key)) noteKeyStats(table, &key);
+    table->record_count++;
+    return 1;
+}
+
+// Open the storage of an LSM table: the runs of the manifest, the logs
+// replayed into memtables (a frozen one that was not flushed before a crash
+// is frozen again), then a merge pass to count the rows.
+int openLsm(Database* db, Table* table) {
+    LsmTree* lsm = (LsmTree*)calloc(1, sizeof(LsmTree));
+    if (!lsm) return 0;
+    table->lsm = lsm;
+    snprintf(lsm->base, sizeof(lsm->base), "%s/%s", db->db_dir, table->schema.name);
+    lsm->log_fd = -1;
+    lsm->random = 2463534242u;
+    lsm->next_seq = 1;
+#ifndef _WIN32
+    pthread_rwlock_init(&lsm->lock, NULL);
+    pthread_mutex_init(&lsm->work_lock, NULL);
+    pthread_cond_init(&lsm->wake, NULL);
+    pthread_cond_init(&lsm->flushed, NULL);
+    pthread_mutex_init(&lsm->log_lock, NULL);
+#endif
+    lsm->active = createMemtable();
+    lsm->log_buf = (char*)malloc(LSM_LOG_BUFFER);
+    if (!lsm->active) return 0;
+
+    char path[272];
+    snprintf(path, sizeof(path), "%s.lsm", lsm->base);
+    FILE* in = fopen(path, "rb");
+    if (in) {
+        unsigned char head[24];
+        int ok = fread(head, 1, sizeof(head), in) == sizeof(head) && memcmp(head, LSM_MANIFEST_MAGIC, 8) == 0;
+        CatalogReader r = {head + 12, head + sizeof(head), ok};
+        uint32_t crc = (uint32_t)(head[8] | head[9] << 8 | head[10] << 16 | (uint32_t)head[11] << 24);
+        lsm->next_seq = catalogGet(&r, 8);
+        int num_runs = (int)catalogGet(&r, 2);
+        int num_obsolete = (int)catalogGet(&r, 2);
+        size_t size = 9 * (size_t)num_runs + 8 * (size_t)num_obsolete;
+        unsigned char* body = (unsigned char*)malloc(12 + size);
+        ok = ok && body && fread(body + 12, 1, size, in) == size;
+        if (ok) {
+            memcpy(body, head + 12, 12);
+            ok = computeCrc32(body, 12 + size) == crc;
+        }
+        lsm->runs = (LsmRun**)calloc(num_runs ? num_runs : 1, sizeof(LsmRun*));
+        r.p = body ? body + 12 : NULL;
+        r.end = r.p ? r.p + size : NULL;
+        r.ok = ok && lsm->runs;
+        for (int i = 0; r.ok && i < num_runs; i++) {
+            uint64_t seq = catalogGet(&r, 8);
+            int level = (int)catalogGet(&r, 1);
+            lsm->runs[i] = openRun(lsm, seq, level, table->schema.row_size);
+            if (!lsm->runs[i]) r.ok = 0;
+            lsm->num_runs += r.ok;
+        }
+        for (int i = 0; r.ok && i < num_obsolete; i++) {
+            char run_file[272];
+            runPath(lsm, catalogGet(&r, 8), run_file, sizeof(run_file));
+            remove(run_file);
+        }
+        free(body);
+        fclose(in);
+        if (!r.ok) {
+            outputMessage("Error: Damaged run list '%s'!\n", path);
+            return 0;
+        }
+    }
+    // A run written after the last manifest never made it into the table
+    char run_file[272];
+    runPath(lsm, lsm->next_seq, run_file, sizeof(run_file));
+    remove(run_file);
+    snprintf(run_file, sizeof(run_file), "%s.flush.tmp", lsm->base);
+    remove(run_file);
+    snprintf(run_file, sizeof(run_file), "%s.merge.tmp", lsm->base);
+    remove(run_file);
+
+    snprintf(path, sizeof(path), "%s.log.frozen", lsm->base);
+    struct stat st;
+    if (stat(path, &st) == 0) {
+        lsm->frozen = createMemtable();
+        if (!lsm->frozen || !replayLog(table, path, lsm->frozen)) return 0;
+    }
+    snprintf(path, sizeof(path), "%s.log", lsm->base);
+    if (!replayLog(table, path, lsm->active) || !openLsmLog(table)) return 0;
+
+    table->record_count = 0;
+    lsmScan(table, NULL, NULL, countLiveRow, table);
+    startLsmWorker(table);
+#ifndef _WIN32
+    if (lsm->frozen) {
+        pthread_mutex_lock(&lsm->work_lock);
+        pthread_cond_signal(&lsm->wake);
+        pthread_mutex_unlock(&lsm->work_lock);
+        if (lsm->running) return 1;
+    }
+#endif
+    if (lsm->frozen && flushMemtable(table)) {
+        while (mergeRuns(table)) {}
+    }
+    return 1;
+}
+
+// Stop the worker and release an LSM table's memory and files; the log keeps
+// the memtables' rows for the next start
+void freeLsm(Table* table) {
+    LsmTree* lsm = table->lsm;
+    if (!lsm) return;
+    stopLsmWorker(table);
+    for (int i = 0; i < lsm->num_runs; i++) freeRun(lsm, lsm->runs[i], 0);
+    free(lsm->runs);
+    freeMemtable(lsm->active);
+    freeMemtable(lsm->frozen);
+    if (lsm->log_fd >= 0) close(lsm->log_fd);
+#ifndef _WIN32
+    pthread_rwlock_destroy(&lsm->lock);
+    pthread_mutex_destroy(&lsm->work_lock);
+    pthread_cond_destroy(&lsm->wake);
+    pthread_cond_destroy(&lsm->flushed);
+    pthread_mutex_destroy(&lsm->log_lock);
+#endif
+    free(lsm->log_buf);
+    free(lsm);
+    table->lsm = NULL;
+}
+
+// Row callback of rewriteLsm: convert or widen a live row into the new run
+int rewriteLsmRow(void* ctx, Record* rec) {
+    LsmRewrite* rw = (LsmRewrite*)ctx;
+    unsigned char buf[MAX_KEY_BYTES];
+    IndexKey key;
+    memset(rw->row, 0, rw->w.row_size);
+    if (rw->convert) {
+        if (!rw->convert(rw->ctx, rec, (Record*)rw->row)) rw->w.ok = 0;
+    } else {
+        memcpy(rw->row, rec, rw->table->schema.row_size);
+    }
+    if (!recordKey(rw->table, rec, buf, &key)) rw->w.ok = 0;
+    runAppend(&rw->w, &key, rw->row);
+    return rw->w.ok;
+}
+
+// rewriteTable for an LSM table: the live rows, converted or widened, become
+// a single run that replaces all the others, and the logs are emptied. If the
+// catalog cannot be saved the old run list is put back.
+int rewriteLsm(Database* db, Table* table, int row_size, RowConverter convert, void* ctx) {
+    LsmTree* lsm = table->lsm;
+    LsmRewrite rw;
+    memset(&rw, 0, sizeof(rw));
+    rw.table = table;
+    rw.convert = convert;
+    rw.ctx = ctx;
+    rw.row = (char*)malloc(row_size > table->schema.row_size ? row_size : table->schema.row_size);
+    stopLsmWorker(table);
+    if (!rw.row || !beginRun(lsm, &rw.w, "merge", row_size, table->record_count)) {
+        abortRun(&rw.w);
+        free(rw.row);
+        startLsmWorker(table);
+        return 0;
+    }
+    lsmScan(table, NULL, NULL, rewriteLsmRow, &rw);
+    free(rw.row);
+    int level = 0;
+    for (int i = 0; i < lsm->num_runs; i++) {
+        if (lsm->runs[i]->level > level) level = lsm->runs[i]->level;
+    }
+    LsmRun* run = finishRun(lsm, &rw.w, level);
+    LsmRun** runs = run ? (LsmRun**)malloc(sizeof(LsmRun*)) : NULL;
+    if (runs) runs[0] = run;
+    if (!runs || !writeManifest(lsm, runs, 1, lsm->runs, lsm->num_runs)) {
+        free(runs);
+        freeRun(lsm, run, 1);
+        startLsmWorker(table);
+        return 0;
+    }
+    int old_size = table->schema.row_size;
+    table->schema.row_size = row_size;
+    if (!saveCatalog(db)) {
+        table->schema.row_size = old_size;
+        // The new run is only deleted once no manifest lists it
+        freeRun(lsm, run, writeManifest(lsm, lsm->runs, lsm->num_runs, runs, 1));
+        free(runs);
+        startLsmWorker(table);
+        return 0;
+    }
+
+    char path[272];
+    snprintf(path, sizeof(path), "%s.log.frozen", lsm->base);
+    remove(path);
+    if (ftruncate(lsm->log_fd, 0) != 0 || lseek(lsm->log_fd, 0, SEEK_SET) != 0) {
+        outputMessage("Error: Could not empty the log of '%s'!\n", table->schema.name);
+    }
+    for (int i = 0; i < lsm->num_runs; i++) freeRun(lsm, lsm->runs[i], 1);
+    free(lsm->runs);
+    lsm->runs = runs;
+    lsm->num_runs = 1;
+    freeMemtable(lsm->frozen);
+    lsm->frozen = NULL;
+    Memtable* fresh = createMemtable();
+    if (fresh) {
+        freeMemtable(lsm->active);
+        lsm->active = fresh;
+    } else {
+        // Keep the memtable: it repeats rows now in the run, at the old width
+        outputMessage("Error: Out of memory!\n");
+    }
+    startLsmWorker(table);
+    return 1;
+}
+
+// Delete the files of a dropped LSM table, the runs listed in its manifest included
+void removeLsmFiles(const char* db_dir, const char* name) {
+    char path[272];
+    LsmTree lsm;
+    memset(&lsm, 0, sizeof(lsm));
+    snprintf(lsm.base, sizeof(lsm.base), "%s/%s", db_dir, name);
+    snprintf(path, sizeof(path), "%s.lsm", lsm.base);
+    FILE* in = fopen(path, "rb");
+    if (in) {
+        unsigned char head[24];
+        if (fread(head, 1, sizeof(head), in) == sizeof(head) && memcmp(head, LSM_MANIFEST_MAGIC, 8) == 0) {
+            CatalogReader r = {head + 12, head + sizeof(head), 1};
+            uint64_t next_seq = catalogGet(&r, 8);
+            int num_runs = (int)catalogGet(&r, 2);
+            int count = num_runs + (int)catalogGet(&r, 2);
+            unsigned char entry[9];
+            for (int i = 0; i < count && fread(entry, i < num_runs ? 9 : 8, 1, in) == 1; i++) {
+                r.p = entry;
+                r.end = entry + 8;
+                runPath(&lsm, catalogGet(&r, 8), path, sizeof(path));
+                remove(path);
+            }
+            runPath(&lsm, next_seq, path, sizeof(path));
+            remove(path);
+        }
+        fclose(in);
+    }
+    static const char* suffixes[] = {".lsm", ".lsm.tmp", ".log", ".log.frozen", ".flush.tmp", ".merge.tmp"};
+    for (int i = 0; i < 6; i++) {
+        snprintf(path, sizeof(path), "%s%s", lsm.base, suffixes[i]);
+        remove(path);
+    }
+}
+
+// Bytes of an LSM table's logs and runs
+long lsmFileSize(Table* table) {
+    LsmTree* lsm = table->lsm;
+    char path[272];
+    struct stat st;
+    long size = 0;
+    snprintf(path, sizeof(path), "%s.log", lsm->base);
+    if (stat(path, &st) == 0) size += (long)st.st_size;
+    snprintf(path, sizeof(path), "%s.log.frozen", lsm->base);
+    if (stat(path, &st) == 0) size += (long)st.st_size;
+    pinLsm(lsm);
+    for (int i = 0; i < lsm->num_runs; i++) size += lsm->runs[i]->file_bytes;
+    unpinLsm(lsm);
+    return size;
+}
+
+// Read the row stored at offset; returns 1 if it is a live row
+int readRecordAt(Table* table, long offset, Record* rec) {
+    return readRecordColumns(table, offset, rec, ALL_COLUMNS);
+}
+
+// Read only the id and the leading part of the row that holds the requested
+// columns (bit i = column i); fields past the last requested one are left untouched
+int readRecordColumns(Table* table, long offset, Record* rec, unsigned columns) {
+    size_t wanted = recordReadSize(table, columns);
+    if (table->page_bytes) {
+        lockFile(table->fd, 0);
+        int ok = readPagedRows(table, offset, rec, wanted);
+        unlockFile(table->fd);
+        return ok && rec->id != 0;
+    }
+    
+    // Positional, so concurrent lookups on the shared descriptor do not race on its offset
+    lockFile(table->fd, 0);
+    ssize_t bytes = preadFull(table->fd, rec, wanted, offset);
+    unlockFile(table->fd);
+    return bytes == (ssize_t)wanted && rec->id != 0;
+}
+
+// Access the live row at offset: a pointer straight into the mapping in mmap
+// mode (no copy), otherwise the requested columns read into buf. NULL if dead.
+// The caller holds the file lock and a pin when the table is mapped.
+const Record* viewRecord(Table* table, long offset, Record* buf, unsigned columns) {
+    if (table->map) {
+        if (offset < 0 || offset + table->schema.row_size > table->file_size) return NULL;
+        const Record* rec = (const Record*)(table->map + offset);
+        metricsAdd(METRIC_CACHE_HITS, 1);
+        OpProfile* prof = profileOp();
+        if (prof) prof->cache_hits++;
+        return rec->id != 0 ? rec : NULL;
+    }
+    return readRecordColumns(table, offset, buf, columns) ? buf : NULL;
+}
+
+// Data file offset of the row with this primary key, -1 if there is none
+long findRecordOffset(Table* table, const IndexKey* key) {
+    if (!keyMayExist(table, key)) return -1;
+    BPTNode* leaf = findLeaf(table->root, key);
+    for (int i = 0; leaf && i < leaf->num_keys; i++) {
+        if (compareKeys(&leaf->keys[i], key) == 0) return leaf->offsets[i];
+    }
+    return -1;
+}
+
+// Find record by primary key. In mmap mode the result is a pinned view into
+// the mapping (no copy); otherwise the row is read into buf (row_size bytes).
+// Hand the result to releaseRecord when done with it.
+const Record* findRecord(Table* table, const IndexKey* key, Record* buf) {
+    if (table->lsm) {
+        if (!lsmFind(table, key, buf)) return NULL;
+        metricsAdd(METRIC_ROWS_READ, 1);
+        return buf;
+    }
+    long offset = findRecordOffset(table, key);
+    int id = table->schema.key_in_id ? (int)keyInt(key) : 1;
+    if (offset < 0) return NULL;
+    
+    pinTableMap(table);
+    if (table->map) {
+        adviseTable(table, 0);
+        lockFile(table->fd, 0);
+        const Record* view = viewRecord(table, offset, buf, ALL_COLUMNS);
+        unlockFile(table->fd);
+        if (view && view->id == id) {
+            metricsAdd(METRIC_ROWS_READ, 1);
+            return view;
+        }
+        unpinTableMap(table);
+        return NULL;
+    }
+    unpinTableMap(table);
+    if (!readRecordAt(table, offset, buf) || buf->id != id) return NULL;
+    metricsAdd(METRIC_ROWS_READ, 1);
+    return buf;
+}
+
+// Unpin a row returned by findRecord
+void releaseRecord(Table* table, const Record* rec, Record* buf) {
+    if (rec && rec != buf) unpinTableMap(table);
+}
+
+// Process-wide result writer for stdout
+OutputWriter* outputWriter(void) {
+    static OutputWriter writer;
+    if (!writer.buf) {
+        writer.buf = (char*)malloc(OUTPUT_BUFFER_SIZE);
+        writer.cap = writer.buf ? OUTPUT_BUFFER_SIZE : 0;
+        writer.out = stdout;
+    }
+    return &writer;
+}
+
+// Switch the format results are written in
+void setOutputFormat(int format) {
+    static const char* names[] = {"TABLE", "BINARY", "JSON", "CSV"};
+    outputFlush();
+#ifdef _WIN32
+    _setmode(_fileno(stdout), format == OUTPUT_BINARY ? _O_BINARY : _O_TEXT);
+#endif
+    outputWriter()->format = format;
+    outputMessage("Output format set to %s.\n", names[format]);
+}
+
+// Hand everything buffered so far to stdout
+void outputFlush(void) {
+    flushWriter(outputWriter());
+}
+
+void flushWriter(OutputWriter* w) {
+    if (w->len) writeOut(w, w->buf, w->len);
+    w->len = w->frame = 0;
+    fflush(w->out);
+}
+
+// Hand formatted output to the stream unless it is being discarded
+void writeOut(OutputWriter* w, const void* data, size_t len) {
+    if (w->discard) return;
+    fwrite(data, 1, len, w->out);
+    if (w->capture) captureOutput(w->capture, data, len);
+}
+
+// Append to a capture, giving up once it passes its limit
+void captureOutput(OutputCapture* c, const void* data, size_t len) {
+    if (c->failed) return;
+    if (c->len + len > c->limit) {
+        c->failed = 1;
+        return;
+    }
+    if (c->len + len > c->cap) {
+        size_t cap = c->cap ? c->cap * 2 : 4096;
+        while (cap < c->len + len) cap *= 2;
+        char* grown = (char*)realloc(c->data, cap);
+        if (!grown) {
+            c->failed = 1;
+            return;
+        }
+        c->data = grown;
+        c->cap = cap;
+    }
+    memcpy(c->data + c->len, data, len);
+    c->len += len;
+}
+
+// Make room for n more bytes. Text formats write the whole buffer out; binary
+// output keeps the open frame buffered until its length is known, so a frame
+// wider than the buffer (long VARCHAR values) grows it.
+void outputReserve(OutputWriter* w, size_t n) {
+    if (w->len + n <= w->cap) return;
+    size_t done = (w->format == OUTPUT_BINARY) ? w->frame : w->len;
+    writeOut(w, w->buf, done);
+    memmove(w->buf, w->buf + done, w->len - done);
+    w->len -= done;
+    w->frame = 0;
+    if (w->len + n > w->cap) {
+        size_t cap = w->cap * 2 > w->len + n ? w->cap * 2 : w->len + n;
+        char* buf = (char*)realloc(w->buf, cap);
+        if (!buf) {
+            writeOut(w, w->buf, w->len);
+            w->len = 0;
+            return;
+        }
+        w->buf = buf;
+        w->cap = cap;
+    }
+}
+
+void outputLittleEndian(OutputWriter* w, uint64_t v, int bytes) {
+    outputReserve(w, bytes);
+    for (int i = 0; i < bytes; i++) {
+        w->buf[w->len++] = (char)(v >> (8 * i));
+    }
+}
+
+void outputBytes(OutputWriter* w, const void* data, size_t len) {
+    outputReserve(w, len);
+    if (w->len + len > w->cap) {
+        writeOut(w, data, len);
+        return;
+    }
+    memcpy(w->buf + w->len, data, len);
+    w->len += len;
+}
+
+void outputString(OutputWriter* w, const char* s) {
+    outputBytes(w, s, strlen(s));
+}
+
+// Format v in decimal two digits at a time; out needs room for 20 characters
+int formatInt(char* out, long long v) {
+    static const char pairs[] =
+        "0001020304050607080910111213141516171819202122232425262728293031323334353637383940414243444546474849"
+        "5051525354555657585960616263646566676869707172737475767778798081828384858687888990919293949596979899";
+    char tmp[20];
+    int n = 0;
+    unsigned long long u = (v < 0) ? 0ull - (unsigned long long)v : (unsigned long long)v;
+    while (u >= 100) {
+        int i = (int)(u % 100) * 2;
+        u /= 100;
+        tmp[n++] = pairs[i + 1];
+        tmp[n++] = pairs[i];
+    }
+    if (u >= 10) {
+        tmp[n++] = pairs[u * 2 + 1];
+        tmp[n++] = pairs[u * 2];
+    } else {
+        tmp[n++] = (char)('0' + u);
+    }
+    
+    int len = 0;
+    if (v < 0) out[len++] = '-';
+    while (n > 0) out[len++] = tmp[--n];
+    return len;
+}
+
+void outputInt(OutputWriter* w, long long v) {
+    outputReserve(w, 20);
+    w->len += formatInt(w->buf + w->len, v);
+}
+
+// Write s as a JSON string literal, copying runs that need no escaping in one go
+void outputJsonString(OutputWriter* w, const char* s) {
+    outputBytes(w, "\"", 1);
+    while (*s) {
+        const char* run = s;
+        while (*s && *s != '"' && *s != '\\' && (unsigned char)*s >= 0x20) s++;
+        outputBytes(w, run, s - run);
+        if (!*s) break;
+        
+        char esc[8];
+        unsigned char c = (unsigned char)*s++;
+        if (c == '"' || c == '\\') {
+            esc[0] = '\\';
+            esc[1] = (char)c;
+            outputBytes(w, esc, 2);
+        } else if (c == '\n') {
+            outputBytes(w, "\\n", 2);
+        } else if (c == '\t') {
+            outputBytes(w, "\\t", 2);
+        } else if (c == '\r') {
+            outputBytes(w, "\\r", 2);
+        } else {
+            snprintf(esc, sizeof(esc), "\\u%04x", c);
+            outputBytes(w, esc, 6);
+        }
+    }
+    outputBytes(w, "\"", 1);
+}
+
+// Write s as a CSV field, quoted only when it contains a separator, quote or newline
+void outputCsvField(OutputWriter* w, const char* s) {
+    if (!s[strcspn(s, ",\"\r\n")]) {
+        outputString(w, s);
+        return;
+    }
+    outputBytes(w, "\"", 1);
+    while (*s) {
+        const char* run = s;
+        while (*s && *s != '"') s++;
+        outputBytes(w, run, s - run);
+        if (*s) {
+            outputBytes(w, "\"\"", 2);
+            s++;
+        }
+    }
+    outputBytes(w, "\"", 1);
+}
+
+// Check that s is a number in JSON syntax, so it can be copied out verbatim
+int isJsonNumber(const char* s) {
+    if (*s == '-') s++;
+    if (*s == '0') {
+        s++;
+    } else if (isdigit((unsigned char)*s)) {
+        while (isdigit((unsigned char)*s)) s++;
+    } else {
+        return 0;
+    }
+    if (*s == '.') {
+        s++;
+        if (!isdigit((unsigned char)*s)) return 0;
+        while (isdigit((unsigned char)*s)) s++;
+    }
+    if (*s == 'e' || *s == 'E') {
+        s++;
+        if (*s == '+' || *s == '-') s++;
+        if (!isdigit((unsigned char)*s)) return 0;
+        while (isdigit((unsigned char)*s)) s++;
+    }
+    return *s == '\0';
+}
+
+// Start a frame: type byte, then a u32 payload length patched in by closeFrame
+void openFrame(OutputWriter* w, char type) {
+    outputReserve(w, 5);
+    w->frame = w->len;
+    w->buf[w->len] = type;
+    w->len += 5;
+}
+
+void closeFrame(OutputWriter* w) {
+    uint32_t payload = (uint32_t)(w->len - w->frame - 5);
+    for (int i = 0; i < 4; i++) {
+        w->buf[w->frame + 1 + i] = (char)(payload >> (8 * i));
+    }
+    w->frame = w->len;
+}
+
+// Print a status or error line. Binary output wraps it in an 'M' or 'X' frame,
+// JSON in a {"message"} or {"error"} line; CSV sends it to stderr so stdout
+// stays a clean table.
+void outputMessage(const char* fmt, ...) {
+    OutputWriter* w = outputWriter();
+    va_list args;
+    if (strncmp(fmt, "Error:", 6) == 0) {
+        metricsAdd(METRIC_ERRORS, 1);
+        if (w->capture) w->capture->failed = 1;
+    }
+    va_start(args, fmt);
+    if (w->format == OUTPUT_TABLE || w->format == OUTPUT_CSV) {
+        if (w->format == OUTPUT_TABLE && w->len) outputFlush();
+        if (w->capture && w->format == OUTPUT_TABLE) {
+            // The result cache keeps messages too ("No records found.")
+            char text[2 * MAX_QUERY];
+            va_list copy;
+            va_copy(copy, args);
+            int n = vsnprintf(text, sizeof(text), fmt, copy);
+            va_end(copy);
+            if (n >= 0 && n < (int)sizeof(text)) {
+                captureOutput(w->capture, text, n);
+            } else {
+                w->capture->failed = 1;
+            }
+        } else if (w->capture) {
+            w->capture->failed = 1;
+        }
+        vfprintf(w->format == OUTPUT_CSV ? stderr : stdout, fmt, args);
+        va_end(args);
+        return;
+    }
+    
+    char text[2 * MAX_QUERY];
+    int n = vsnprintf(text, sizeof(text), fmt, args);
+    va_end(args);
+    if (n < 0) return;
+    
+    char* start = text;
+    while (*start == '\n') start++;
+    size_t len = strlen(start);
+    while (len > 0 && start[len - 1] == '\n') start[--len] = '\0';
+    int is_error = strncmp(start, "Error:", 6) == 0;
+    
+    if (w->format == OUTPUT_JSON) {
+        outputString(w, is_error ? "{\"error\":" : "{\"message\":");
+        outputJsonString(w, start);
+        outputBytes(w, "}\n", 2);
+    } else {
+        openFrame(w, is_error ? 'X' : 'M');
+        outputBytes(w, start, len);
+        closeFrame(w);
+    }
+    outputFlush();
+}
+
+// Map a schema column type to a result value type
+int valueType(const char* type) {
+    if (strcasecmp(type, "INT") == 0 || strcasecmp(type, "BIGINT") == 0) return VALUE_INT;
+    if (strcasecmp(type, "FLOAT") == 0) return VALUE_FLOAT;
+    return VALUE_TEXT;
+}
+
+// Start a result set.
+//
+// Binary output:
+//   'H' header: u16 title length, title, u16 column count, then per column
+//       u8 value type, u16 name length, name
+//   'R' per row: per value a u8 type tag followed by an i64 (VALUE_INT),
+//       an IEEE-754 f64 (VALUE_FLOAT), a u32 length and bytes (VALUE_TEXT),
+//       or nothing (VALUE_NULL)
+//   'E' end: u64 row count
+// Every frame is a type byte and a u32 payload length; integers are little-endian.
+//
+// JSON output is one JSON value per line: {"result":title,"columns":[{"name","type"}]},
+// an array per row, then {"count":rows}. CSV output is a header line and a line per row.
+void beginResult(const char* title, const ResultColumn* columns, int num_columns) {
+    static const char* type_names[] = {"NULL", "INT", "FLOAT", "TEXT"};
+    OutputWriter* w = outputWriter();
+    memcpy(w->columns, columns, num_columns * sizeof(ResultColumn));
+    w->num_columns = num_columns;
+    w->rows = 0;
+    
+    if (w->format == OUTPUT_TABLE) {
+        outputString(w, "\n--- ");
+        outputString(w, title);
+        outputString(w, " ---\n");
+    } else if (w->format == OUTPUT_JSON) {
+        outputString(w, "{\"result\":");
+        outputJsonString(w, title);
+        outputString(w, ",\"columns\":[");
+        for (int i = 0; i < num_columns; i++) {
+            outputString(w, i ? ",{\"name\":" : "{\"name\":");
+            outputJsonString(w, columns[i].name);
+            outputString(w, ",\"type\":\"");
+            outputString(w, type_names[columns[i].type]);
+            outputString(w, "\"}");
+        }
+        outputString(w, "]}\n");
+    } else if (w->format == OUTPUT_CSV) {
+        for (int i = 0; i < num_columns; i++) {
+            if (i) outputBytes(w, ",", 1);
+            outputCsvField(w, columns[i].name);
+        }
+        outputBytes(w, "\n", 1);
+    } else {
+        size_t len = strlen(title);
+        openFrame(w, 'H');
+        outputLittleEndian(w, len, 2);
+        outputBytes(w, title, len);
+        outputLittleEndian(w, num_columns, 2);
+        for (int i = 0; i < num_columns; i++) {
+            len = strlen(columns[i].name);
+            outputLittleEndian(w, columns[i].type, 1);
+            outputLittleEndian(w, len, 2);
+            outputBytes(w, columns[i].name, len);
+        }
+        closeFrame(w);
+    }
+}
+
+void beginRow(void) {
+    OutputWriter* w = outputWriter();
+    w->column = 0;
+    if (w->format == OUTPUT_BINARY) {
+        openFrame(w, 'R');
+    } else if (w->format == OUTPUT_JSON) {
+        outputBytes(w, "[", 1);
+    }
+}
+
+// Write the separator and, in table output, the label of the next value
+const ResultColumn* nextValue(OutputWriter* w) {
+    const ResultColumn* c = &w->columns[w->column];
+    if (w->format == OUTPUT_TABLE) {
+        if (w->column) outputBytes(w, ", ", 2);
+        outputString(w, c->is_key ? "ID" : c->name);
+        outputBytes(w, ": ", 2);
+    } else if (w->format != OUTPUT_BINARY && w->column) {
+        outputBytes(w, ",", 1);
+    }
+    w->column++;
+    return c;
+}
+
+// Emit the next value of the row from its stored text. Numeric columns go out
+// as native numbers; empty numeric fields are NULL, unparsable ones stay text.
+void outputValue(const char* text) {
+    OutputWriter* w = outputWriter();
+    const ResultColumn* c = nextValue(w);
+    if (w->format == OUTPUT_TABLE) {
+        outputString(w, text);
+        return;
+    }
+    if (w->format == OUTPUT_CSV) {
+        outputCsvField(w, text);
+        return;
+    }
+    if (w->format == OUTPUT_JSON) {
+        if (c->type != VALUE_TEXT && *text == '\0') {
+            outputString(w, "null");
+        } else if (c->type != VALUE_TEXT && isJsonNumber(text)) {
+            outputString(w, text);
+        } else {
+            outputJsonString(w, text);
+        }
+        return;
+    }
+    
+    if (c->type != VALUE_TEXT) {
+        char* end;
+        if (*text == '\0') {
+            outputLittleEndian(w, VALUE_NULL, 1);
+            return;
+        }
+        if (c->type == VALUE_INT) {
+            errno = 0;
+            long long v = strtoll(text, &end, 10);
+            if (*end == '\0' && errno == 0) {
+                outputLittleEndian(w, VALUE_INT, 1);
+                outputLittleEndian(w, (uint64_t)v, 8);
+                return;
+            }
+        } else {
+            double v = strtod(text, &end);
+            if (*end == '\0') {
+                uint64_t bits;
+                memcpy(&bits, &v, sizeof(bits));
+                outputLittleEndian(w, VALUE_FLOAT, 1);
+                outputLittleEndian(w, bits, 8);
+                return;
+            }
+        }
+    }
+    
+    size_t len = strlen(text);
+    outputLittleEndian(w, VALUE_TEXT, 1);
+    outputLittleEndian(w, len, 4);
+    outputBytes(w, text, len);
+}
+
+// Emit the next value of the row from a native integer
+void outputIntValue(long long v) {
+    OutputWriter* w = outputWriter();
+    nextValue(w);
+    if (w->format == OUTPUT_BINARY) {
+        outputLittleEndian(w, VALUE_INT, 1);
+        outputLittleEndian(w, (uint64_t)v, 8);
+    } else {
+        outputInt(w, v);
+    }
+}
+
+void endRow(void) {
+    OutputWriter* w = outputWriter();
+    w->rows++;
+    if (w->format == OUTPUT_BINARY) {
+        closeFrame(w);
+    } else if (w->format == OUTPUT_JSON) {
+        outputBytes(w, "]\n", 2);
+    } else {
+        outputBytes(w, "\n", 1);
+    }
+}
+
+void endResult(void) {
+    OutputWriter* w = outputWriter();
+    if (w->format == OUTPUT_TABLE) {
+        if (w->rows == 0) outputString(w, "No records found.\n");
+        outputString(w, "--- End ---\n");
+    } else if (w->format == OUTPUT_JSON) {
+        outputString(w, "{\"count\":");
+        outputInt(w, w->rows);
+        outputString(w, "}\n");
+    } else if (w->format == OUTPUT_BINARY) {
+        openFrame(w, 'E');
+        outputLittleEndian(w, (uint64_t)w->rows, 8);
+        closeFrame(w);
+    }
+    outputFlush();
+}
+
+// Insert record
+void insertRecord(Table* table, Record* rec) {
+    unsigned char buf[MAX_KEY_BYTES];
+    IndexKey key;
+    if (!table->schema.key_in_id) rec->id = 1;
+    if (!recordKey(table, rec, buf, &key)) {
+        outputMessage("Error: Invalid primary key value!\n");
+        return;
+    }
+    if (table->lsm) {
+        insertLsmRecord(table, &key, rec);
+        return;
+    }
+    
+    // The index decides on duplicates from the keys alone before the row is written
+    lockFile(table->fd, 1);
+    long offset = tableEnd(table);
+    if (!insertIntoBPTree(table, &key, offset)) {
+        unlockFile(table->fd);
+        char text[256];
+        formatKey(table, &key, text, sizeof(text));
+        outputMessage("Error: Record with ID %s already exists!\n", text);
+        return;
+    }
+    if (!writeRows(table, offset, rec, table->schema.row_size)) {
+        // Take back the key and whatever part of the row reached the file;
+        // the key filter only counts the key once the row is written
+        removeFromBPTree(table, &key);
+        truncateRows(table, offset);
+        unlockFile(table->fd);
+        outputMessage("Error: Could not write to table file!\n");
+        return;
+    }
+    noteTableGrowth(table, offset + table->schema.row_size);
+    noteKeyStats(table, &key);
+    addKeyFilter(table, &key);
+    table->record_count++;
+    table->version++;
+    unlockFile(table->fd);
+    metricsAdd(METRIC_ROWS_WRITTEN, 1);
+    outputMessage("Record inserted successfully.\n");
+}
+
+// Update record; the key columns keep their stored values
+void updateRecord(Table* table, const IndexKey* key, Record* rec) {
+    if (table->lsm) {
+        writeLsmRecord(table, key, rec);
+        return;
+    }
+    BPTNode* leaf = keyMayExist(table, key) ? findLeaf(table->root, key) : NULL;
+    long offset = -1;
+    for (int i = 0; leaf && i < leaf->num_keys; i++) {
+        if (compareKeys(&leaf->keys[i], key) == 0) {
+            offset = leaf->offsets[i];
+            break;
+        }
+    }
+    
+    if (offset == -1) {
+        outputMessage("Error: Record not found!\n");
+        return;
+    }
+    
+    lockFile(table->fd, 1);
+    if (table->schema.key_in_id) {
+        rec->id = (int)keyInt(key);
+    } else {
+        Record* old = allocRecord(table);
+        if (!old || !readRecordAt(table, offset, old)) {
+            unlockFile(table->fd);
+            free(old);
+            outputMessage("Error: Record not found!\n");
+            return;
+        }
+        for (int k = 0; k < table->schema.num_key_columns; k++) {
+            int col = table->schema.key_columns[k];
+            memcpy(recordField(table, rec, col), recordField(table, old, col), table->schema.columns[col].size);
+        }
+        rec->id = 1;
+        free(old);
+    }
+    if (!writeRows(table, offset, rec, table->schema.row_size)) {
+        unlockFile(table->fd);
+        outputMessage("Error: Could not write to table file!\n");
+        return;
+    }
+    table->version++;
+    unlockFile(table->fd);
+    metricsAdd(METRIC_ROWS_WRITTEN, 1);
+    outputMessage("Record updated successfully.\n");
+}
+
+// Delete record
+void deleteRecord(Table* table, const IndexKey* key) {
+    if (table->lsm) {
+        writeLsmRecord(table, key, NULL);
+        return;
+    }
+    BPTNode* leaf = keyMayExist(table, key) ? findLeaf(table->root, key) : NULL;
+    long offset = -1;
+    int key_index = -1;
+    
+    for (int i = 0; leaf && i < leaf->num_keys; i++) {
+        if (compareKeys(&leaf->keys[i], key) == 0) {
+            offset = leaf->offsets[i];
+            key_index = i;
+            break;
+        }
+    }
+    
+    if (offset == -1) {
+        outputMessage("Error: Record not found!\n");
+        return;
+    }
+    
+    // Zeroing the id marks the slot dead; the key stays while the row is live
+    lockFile(table->fd, 1);
+    int dead = 0;
+    if (!writeRows(table, offset, &dead, sizeof(dead))) {
+        unlockFile(table->fd);
+        outputMessage("Error: Could not write to table file!\n");
+        return;
+    }
+    
+    removeKeyFilter(table, key);
+    freeKey(&leaf->keys[key_index]);
+    for (int i = key_index; i < leaf->num_keys - 1; i++) {
+        leaf->keys[i] = leaf->keys[i + 1];
+        leaf->offsets[i] = leaf->offsets[i + 1];
+    }
+    leaf->num_keys--;
+    
+    table->record_count--;
+    table->stats.dead_rows++;
+    table->version++;
+    unlockFile(table->fd);
+    metricsAdd(METRIC_ROWS_WRITTEN, 1);
+    outputMessage("Record deleted successfully.\n");
+}
+
+// Scan live rows with keys from lo to hi (NULL = unbounded; keys that hi is a
+// prefix of are included) in key order, stopping when cb returns 0. Only the
+// columns in the bitmask are read from disk.
+int scanTable(Table* table, const IndexKey* lo, const IndexKey* hi, unsigned columns,
+              ScanCallback cb, void* ctx) {
+    if (table->lsm) {
+        int count = lsmScan(table, lo, hi, cb, ctx);
+        metricsAdd(METRIC_ROWS_READ, count);
+        return count;
+    }
+    BPTNode* leaf = findLeaf(table->root, lo);
+    int count = 0;
+    int stop = 0;
+    
+    pinTableMap(table);
+    if (!table->map) {
+        unpinTableMap(table);
+        count = table->page_bytes ? scanPagedTable(table, leaf, lo, hi, columns, cb, ctx)
+                                  : scanTableAsync(table, leaf, lo, hi, columns, cb, ctx);
+        metricsAdd(METRIC_ROWS_READ, count);
+        return count;
+    }
+    adviseTable(table, 1);
+    while (leaf && !stop) {
+        // Mapped rows are read under one shared lock per leaf instead of one per row
+        lockFile(table->fd, 0);
+        for (int i = 0; i < leaf->num_keys; i++) {
+            if (lo && compareKeys(&leaf->keys[i], lo) < 0) continue;
+            if (hi && compareKeyPrefix(&leaf->keys[i], hi) > 0) {
+                stop = 1;
+                break;
+            }
+            const Record* rec = viewRecord(table, leaf->offsets[i], NULL, columns);
+            if (!rec) continue;
+            count++;
+            if (!cb(ctx, (Record*)rec)) {
+                stop = 1;
+                break;
+            }
+        }
+        unlockFile(table->fd);
+        leaf = leaf->next;
+    }
+    unpinTableMap(table);
+    metricsAdd(METRIC_ROWS_READ, count);
+    return count;
+}
+
+// Range scan of a compressed table: rows are copied out of the buffer cache,
+// which reads and decompresses each page the first time one of its rows is
+// needed. Once two rows in a row come from the same page the whole page is
+// copied, and its other rows are read from the copy without the cache lock
+// until the table is next written.
+int scanPagedTable(Table* table, BPTNode* leaf, const IndexKey* lo, const IndexKey* hi,
+                   unsigned columns, ScanCallback cb, void* ctx) {
+    Record* rec = allocRecord(table);
+    char* copy = (char*)malloc(table->page_bytes);
+    size_t len = recordReadSize(table, columns);
+    long copied = -1;            // Page held in copy, at copied_version of the table
+    uint64_t copied_version = 0;
+    long last = -1;              // Page of the row before
+    int count = 0;
+    int stop = 0;
+    if (!rec || !copy) {
+        free(rec);
+        free(copy);
+        return 0;
+    }
+    
+    while (leaf && !stop) {
+        lockFile(table->fd, 0);
+        for (int i = 0; i < leaf->num_keys; i++) {
+            if (lo && compareKeys(&leaf->keys[i], lo) < 0) continue;
+            if (hi && compareKeyPrefix(&leaf->keys[i], hi) > 0) {
+                stop = 1;
+                break;
+            }
+            long offset = leaf->offsets[i];
+            if (offset < 0 || offset + (long)len > table->file_size) continue;
+            long page = offset / table->page_bytes;
+            long within = offset % table->page_bytes;
+            if (page != copied || table->version != copied_version) {
+                lockBufferCache();
+                CachedPage* p = fetchPage(table, page);
+                if (p && page == last) {
+                    memcpy(copy, p->data, p->used);
+                    copied = page;
+                    copied_version = table->version;
+                } else if (p) {
+                    memcpy(rec, p->data + within, len);
+                }
+                unlockBufferCache();
+                last = page;
+                if (!p) continue;
+            }
+            if (page == copied && table->version == copied_version) memcpy(rec, copy + within, len);
+            if (rec->id == 0) continue;
+            count++;
+            if (!cb(ctx, rec)) {
+                stop = 1;
+                break;
+            }
+        }
+        unlockFile(table->fd);
+        leaf = leaf->next;
+    }
+    free(copy);
+    free(rec);
+    return count;
+}
+
+// Per-thread async read context, created on first use
+static _Thread_local AioContext aio_thread_ctx;
+
+#ifdef __linux__
+// Set up an io_uring with the given number of entries; 0 if the kernel refuses
+int aioSetupRing(AioContext* aio, unsigned entries) {
+    struct io_uring_params p;
+    memset(&p, 0, sizeof(p));
+    int fd = (int)syscall(__NR_io_uring_setup, entries, &p);
+    if (fd < 0) return 0;
+    
+    aio->sq_ring_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    aio->cq_ring_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    int single_mmap = (p.features & IORING_FEAT_SINGLE_MMAP) != 0;
+    if (single_mmap) {
+        if (aio->cq_ring_size > aio->sq_ring_size) aio->sq_ring_size = aio->cq_ring_size;
+        aio->cq_ring_size = aio->sq_ring_size;
+    }
+    
+    aio->sq_ring = mmap(NULL, aio->sq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                        fd, IORING_OFF_SQ_RING);
+    aio->cq_ring = single_mmap ? aio->sq_ring
+                               : mmap(NULL, aio->cq_ring_size, PROT_READ | PROT_WRITE,
+                                      MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_CQ_RING);
+    aio->sqes_size = p.sq_entries * sizeof(struct io_uring_sqe);
+    aio->sqes = (struct io_uring_sqe*)mmap(NULL, aio->sqes_size, PROT_READ | PROT_WRITE,
+                                           MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQES);
+    if (aio->sq_ring == MAP_FAILED || aio->cq_ring == MAP_FAILED || aio->sqes == MAP_FAILED) {
+        if (aio->sq_ring != MAP_FAILED) munmap(aio->sq_ring, aio->sq_ring_size);
+        if (!single_mmap && aio->cq_ring != MAP_FAILED) munmap(aio->cq_ring, aio->cq_ring_size);
+        if (aio->sqes != MAP_FAILED) munmap(aio->sqes, aio->sqes_size);
+        close(fd);
+        return 0;
+    }
+    
+    char* sq = (char*)aio->sq_ring;
+    char* cq = (char*)aio->cq_ring;
+    aio->sq_tail = (unsigned*)(sq + p.sq_off.tail);
+    aio->sq_mask = (unsigned*)(sq + p.sq_off.ring_mask);
+    aio->sq_array = (unsigned*)(sq + p.sq_off.array);
+    aio->cq_head = (unsigned*)(cq + p.cq_off.head);
+    aio->cq_tail = (unsigned*)(cq + p.cq_off.tail);
+    aio->cq_mask = (unsigned*)(cq + p.cq_off.ring_mask);
+    aio->cqes = (struct io_uring_cqe*)(cq + p.cq_off.cqes);
+    aio->entries = p.sq_entries;
+    aio->ring_fd = fd;
+    return 1;
+}
+#endif
+
+// Async read context of the calling thread (io_uring when the kernel has it)
+AioContext* aioContext(void) {
+    AioContext* aio = &aio_thread_ctx;
+    if (!aio->initialized) {
+        aio->initialized = 1;
+        aio->ring_fd = -1;
+#ifdef __linux__
+        aioSetupRing(aio, 2 * AIO_QUEUE_DEPTH);
+#endif
+    }
+    return aio;
+}
+
+// Tear down the calling thread's ring
+void aioShutdown(void) {
+    AioContext* aio = &aio_thread_ctx;
+#ifdef __linux__
+    if (aio->ring_fd >= 0) {
+        munmap(aio->sqes, aio->sqes_size);
+        if (aio->cq_ring != aio->sq_ring) munmap(aio->cq_ring, aio->cq_ring_size);
+        munmap(aio->sq_ring, aio->sq_ring_size);
+        close(aio->ring_fd);
+    }
+#endif
+    memset(aio, 0, sizeof(*aio));
+}
+
+// Blocking positional read used by the fallback path
+ssize_t preadFull(int fd, void* buf, size_t len, long offset) {
+#ifdef _WIN32
+    if (lseek(fd, offset, SEEK_SET) < 0) return -1;
+    ssize_t bytes = read(fd, buf, (unsigned)len);
+#else
+    ssize_t bytes = pread(fd, buf, len, offset);
+#endif
+    Metrics* m = metricsLocal();
+    __atomic_store_n(&m->counters[METRIC_SYSCALLS], m->counters[METRIC_SYSCALLS] + 1, __ATOMIC_RELAXED);
+    __atomic_store_n(&m->counters[METRIC_CACHE_MISSES], m->counters[METRIC_CACHE_MISSES] + 1, __ATOMIC_RELAXED);
+    if (bytes > 0) {
+        __atomic_store_n(&m->counters[METRIC_BYTES_READ], m->counters[METRIC_BYTES_READ] + bytes, __ATOMIC_RELAXED);
+    }
+    OpProfile* prof = profileOp();
+    if (prof) {
+        prof->syscalls++;
+        if (bytes > 0) prof->bytes += bytes;
+    }
+    return bytes;
+}
+
+// Collect finished reads from the completion queue; with block set, wait for at least one
+void aioReap(AioContext* aio, int block) {
+#ifdef __linux__
+    OpProfile* prof = profileOp();
+    if (block) {
+        syscall(__NR_io_uring_enter, aio->ring_fd, 0, 1, IORING_ENTER_GETEVENTS, NULL, 0);
+        metricsAdd(METRIC_SYSCALLS, 1);
+        if (prof) prof->syscalls++;
+    }
+    unsigned head = *aio->cq_head;
+    unsigned tail = __atomic_load_n(aio->cq_tail, __ATOMIC_ACQUIRE);
+    while (head != tail) {
+        struct io_uring_cqe* cqe = &aio->cqes[head & *aio->cq_mask];
+        AioRequest* req = (AioRequest*)(uintptr_t)cqe->user_data;
+        req->result = cqe->res;
+        if (cqe->res > 0) {
+            metricsAdd(METRIC_CACHE_MISSES, 1);
+            metricsAdd(METRIC_BYTES_READ, (uint64_t)cqe->res);
+            if (prof) prof->bytes += cqe->res;
+        }
+        // Kernels without IORING_OP_READ reject it; redo that read synchronously
+        if (cqe->res == -EINVAL) req->result = preadFull(req->fd, req->buf, req->len, req->offset);
+        req->done = 1;
+        aio->inflight--;
+        head++;
+    }
+    __atomic_store_n(aio->cq_head, head, __ATOMIC_RELEASE);
+#else
+    (void)aio;
+    (void)block;
+#endif
+}
+
+// Queue a batch of reads. With io_uring they are all handed to the kernel in a
+// single io_uring_enter and complete in the background; otherwise (or when
+// async is off) they are done right here with pread.
+void aioSubmit(AioContext* aio, int fd, AioRequest* reqs, int n, int async) {
+    for (int i = 0; i < n; i++) {
+        reqs[i].fd = fd;
+        reqs[i].done = 0;
+    }
+    
+#ifdef __linux__
+    if (async && n > 0 && aio->ring_fd >= 0 && aio->inflight + n <= aio->entries) {
+        unsigned tail = *aio->sq_tail;
+        for (int i = 0; i < n; i++) {
+            unsigned idx = tail & *aio->sq_mask;
+            struct io_uring_sqe* sqe = &aio->sqes[idx];
+            memset(sqe, 0, sizeof(*sqe));
+            sqe->opcode = IORING_OP_READ;
+            sqe->fd = fd;
+            sqe->addr = (unsigned long long)(uintptr_t)reqs[i].buf;
+            sqe->len = (unsigned)reqs[i].len;
+            sqe->off = (unsigned long long)reqs[i].offset;
+            sqe->user_data = (unsigned long long)(uintptr_t)&reqs[i];
+            aio->sq_array[idx] = idx;
+            tail++;
+        }
+        __atomic_store_n(aio->sq_tail, tail, __ATOMIC_RELEASE);
+        
+        int to_submit = n;
+        while (to_submit > 0) {
+            int r = (int)syscall(__NR_io_uring_enter, aio->ring_fd, to_submit, 0, 0, NULL, 0);
+            metricsAdd(METRIC_SYSCALLS, 1);
+            OpProfile* prof = profileOp();
+            if (prof) prof->syscalls++;
+            if (r > 0) {
+                to_submit -= r;
+                aio->inflight += r;
+            } else if (r < 0 && errno == EINTR) {
+                continue;
+            } else if (r < 0 && (errno == EAGAIN || errno == EBUSY) && aio->inflight > 0) {
+                aioReap(aio, 1);
+            } else {
+                break;
+            }
+        }
+        if (to_submit == 0) return;
+        
+        // The ring is unusable: let submitted reads finish, drop it and read synchronously
+        while (aio->inflight > 0) aioReap(aio, 1);
+        aioShutdown();
+        aio->initialized = 1;
+        aio->ring_fd = -1;
+    }
+#endif
+    (void)aio;
+    (void)async;
+    for (int i = 0; i < n; i++) {
+        if (reqs[i].done) continue;
+        reqs[i].result = preadFull(fd, reqs[i].buf, reqs[i].len, reqs[i].offset);
+        reqs[i].done = 1;
+    }
+}
+
+// Wait until every request of a submitted batch has completed
+void aioWait(AioContext* aio, AioRequest* reqs, int n) {
+    for (int i = 0; i < n; i++) {
+        while (!reqs[i].done) aioReap(aio, 1);
+    }
+}
+
+// Bytes to read for a row when only the columns in the bitmask are needed
+size_t recordReadSize(Table* table, unsigned columns) {
+    if (columns == ALL_COLUMNS) return table->schema.row_size;
+    int end = 0;
+    for (int i = 0; i < table->schema.num_columns; i++) {
+        Column* column = &table->schema.columns[i];
+        if (isIdColumn(&table->schema, i) || !(columns & columnBit(i))) continue;
+        if (column->offset + storedSize(column) > end) end = column->offset + storedSize(column);
+    }
+    return offsetof(Record, data) + (size_t)end;
+}
+
+// Fill a batch with the next rows of a range scan, advancing the leaf cursor
+void fillScanBatch(Table* table, ScanBatch* batch, BPTNode** leaf, int* pos, const IndexKey* hi,
+                   size_t len) {
+    batch->n = 0;
+    while (*leaf && batch->n < AIO_QUEUE_DEPTH) {
+        if (*pos >= (*leaf)->num_keys) {
+            *leaf = (*leaf)->next;
+            *pos = 0;
+            continue;
+        }
+        if (hi && compareKeyPrefix(&(*leaf)->keys[*pos], hi) > 0) {
+            *leaf = NULL;
+            break;
+        }
+        AioRequest* req = &batch->reqs[batch->n];
+        req->offset = (*leaf)->offsets[*pos];
+        req->buf = batch->rows + (size_t)batch->n * table->schema.row_size;
+        req->len = len;
+        batch->n++;
+        (*pos)++;
+    }
+}
+
+// Range scan through read(): while one batch of rows is handed to cb, the next
+// AIO_QUEUE_DEPTH rows are already being read by io_uring
+int scanTableAsync(Table* table, BPTNode* leaf, const IndexKey* lo, const IndexKey* hi,
+                   unsigned columns, ScanCallback cb, void* ctx) {
+    ScanBatch* batches = (ScanBatch*)malloc(2 * sizeof(ScanBatch));
+    char* rows = (char*)malloc(2 * AIO_QUEUE_DEPTH * (size_t)table->schema.row_size);
+    if (!batches || !rows) {
+        free(batches);
+        free(rows);
+        return 0;
+    }
+    batches[0].rows = rows;
+    batches[1].rows = rows + AIO_QUEUE_DEPTH * (size_t)table->schema.row_size;
+    
+    AioContext* aio = aioContext();
+    size_t len = recordReadSize(table, columns);
+    int pos = 0;
+    int count = 0;
+    int stop = 0;
+    int cur = 0;
+    int inflight[2] = {0, 0};
+    
+    while (lo && leaf && pos < leaf->num_keys && compareKeys(&leaf->keys[pos], lo) < 0) {
+        if (++pos >= leaf->num_keys) {
+            leaf = leaf->next;
+            pos = 0;
+        }
+    }
+    
+    lockFile(table->fd, 0);
+    fillScanBatch(table, &batches[cur], &leaf, &pos, hi, len);
+    aioSubmit(aio, table->fd, batches[cur].reqs, batches[cur].n, table->use_uring);
+    inflight[cur] = 1;
+    
+    while (batches[cur].n > 0 && !stop) {
+        int next = 1 - cur;
+        fillScanBatch(table, &batches[next], &leaf, &pos, hi, len);
+        if (batches[next].n > 0) {
+            aioSubmit(aio, table->fd, batches[next].reqs, batches[next].n, table->use_uring);
+            inflight[next] = 1;
+        }
+        
+        aioWait(aio, batches[cur].reqs, batches[cur].n);
+        inflight[cur] = 0;
+        for (int i = 0; i < batches[cur].n && !stop; i++) {
+            Record* rec = (Record*)batches[cur].reqs[i].buf;
+            if (batches[cur].reqs[i].result != (ssize_t)len || rec->id == 0) continue;
+            count++;
+            if (!cb(ctx, rec)) stop = 1;
+        }
+        cur = next;
+    }
+    
+    // Reap the read-ahead batch before its buffers go away
+    for (int b = 0; b < 2; b++) {
+        if (inflight[b]) aioWait(aio, batches[b].reqs, batches[b].n);
+    }
+    unlockFile(table->fd);
+    free(rows);
+    free(batches);
+    return count;
+}
+
+// Fetch the rows of a sorted list of keys (WHERE id IN (...)): all index probes
+// are done first and the row reads of each batch go to the device together
+int lookupRecords(Table* table, const IndexKey* keys, int n, unsigned columns, ScanCallback cb,
+                  void* ctx) {
+    int count = 0;
+    int stop = 0;
+    
+    if (table->lsm) {
+        Record* rec = allocRecord(table);
+        for (int k = 0; rec && k < n && !stop; k++) {
+            if (!lsmFind(table, &keys[k], rec)) continue;
+            count++;
+            stop = !cb(ctx, rec);
+        }
+        free(rec);
+        metricsAdd(METRIC_ROWS_READ, count);
+        return count;
+    }
+    
+    pinTableMap(table);
+    if (table->map) {
+        adviseTable(table, 0);
+        for (int k = 0; k < n && !stop; k++) {
+            BPTNode* leaf = keyMayExist(table, &keys[k]) ? findLeaf(table->root, &keys[k]) : NULL;
+            for (int i = 0; leaf && i < leaf->num_keys; i++) {
+                if (compareKeys(&leaf->keys[i], &keys[k]) != 0) continue;
+                lockFile(table->fd, 0);
+                const Record* rec = viewRecord(table, leaf->offsets[i], NULL, columns);
+                unlockFile(table->fd);
+                if (rec) {
+                    count++;
+                    stop = !cb(ctx, (Record*)rec);
+                }
+                break;
+            }
+        }
+        unpinTableMap(table);
+        metricsAdd(METRIC_ROWS_READ, count);
+        return count;
+    }
+    unpinTableMap(table);
+    
+    if (table->page_bytes) {
+        Record* rec = allocRecord(table);
+        for (int k = 0; rec && k < n && !stop; k++) {
+            long offset = findRecordOffset(table, &keys[k]);
+            if (offset < 0 || !readRecordColumns(table, offset, rec, columns)) continue;
+            count++;
+            stop = !cb(ctx, rec);
+        }
+        free(rec);
+        metricsAdd(METRIC_ROWS_READ, count);
+        return count;
+    }
+    
+    ScanBatch* batch = (ScanBatch*)malloc(sizeof(ScanBatch));
+    if (!batch) return 0;
+    batch->rows = (char*)malloc(AIO_QUEUE_DEPTH * (size_t)table->schema.row_size);
+    if (!batch->rows) {
+        free(batch);
+        return 0;
+    }
+    AioContext* aio = aioContext();
+    size_t len = recordReadSize(table, columns);
+    
+    for (int k = 0; k < n && !stop;) {
+        batch->n = 0;
+        for (; k < n && batch->n < AIO_QUEUE_DEPTH; k++) {
+            BPTNode* leaf = keyMayExist(table, &keys[k]) ? findLeaf(table->root, &keys[k]) : NULL;
+            for (int i = 0; leaf && i < leaf->num_keys; i++) {
+                if (compareKeys(&leaf->keys[i], &keys[k]) != 0) continue;
+                AioRequest* req = &batch->reqs[batch->n];
+                req->offset = leaf->offsets[i];
+                req->buf = batch->rows + (size_t)batch->n * table->schema.row_size;
+                req->len = len;
+                batch->n++;
+                break;
+            }
+        }
+        
+        lockFile(table->fd, 0);
+        aioSubmit(aio, table->fd, batch->reqs, batch->n, table->use_uring);
+        aioWait(aio, batch->reqs, batch->n);
+        unlockFile(table->fd);
+        for (int i = 0; i < batch->n && !stop; i++) {
+            Record* rec = (Record*)batch->reqs[i].buf;
+            if (batch->reqs[i].result != (ssize_t)len || rec->id == 0) continue;
+            count++;
+            if (!cb(ctx, rec)) stop = 1;
+        }
+    }
+    free(batch->rows);
+    free(batch);
+    metricsAdd(METRIC_ROWS_READ, count);
+    return count;
+}
+
+// Value of a column as text (an INT key lives in rec->id)
+const char* fieldValue(Table* table, Record* rec, int col, char* buf) {
+    if (isIdColumn(&table->schema, col)) {
+        snprintf(buf, MAX_FIELD, "%d", rec->id);
+        return buf;
+    }
+    return fieldText(table, rec, col);
+}
+
+// Resolve "table.column" or an unambiguous "column" against the query's tables
+int resolveColumn(SelectQuery* q, const char* name, ColumnRef* ref) {
+    const char* col_name = name;
+    const char* dot = strchr(name, '.');
+    int found = 0;
+    
+    for (int s = 0; s < q->num_tables; s++) {
+        TableSchema* schema = &q->tables[s]->schema;
+        if (dot) {
+            if ((size_t)(dot - name) != strlen(schema->name) ||
+                strncasecmp(name, schema->name, dot - name) != 0) continue;
+            col_name = dot + 1;
+        }
+        for (int i = 0; i < schema->num_columns; i++) {
+            if (strcasecmp(schema->columns[i].name, col_name) == 0) {
+                ref->side = s;
+                ref->col = i;
+                found++;
+                break;
+            }
+        }
+    }
+    
+    if (found == 0) {
+        outputMessage("Error: Unknown column '%s'!\n", name);
+        return 0;
+    }
+    if (found > 1) {
+        outputMessage("Error: Ambiguous column '%s'!\n", name);
+        return 0;
+    }
+    return 1;
+}
+
+// Find kw as a whole word in s (case-insensitive)
+char* findKeyword(char* s, const char* kw) {
+    size_t len = strlen(kw);
+    for (char* p = stristr(s, kw); p; p = stristr(p + 1, kw)) {
+        int starts = (p == s) || !(isalnum((unsigned char)p[-1]) || p[-1] == '_' || p[-1] == '.');
+        int ends = !(isalnum((unsigned char)p[len]) || p[len] == '_');
+        if (starts && ends) return p;
+    }
+    return NULL;
+}
+
+// Does name ("id", "col" or "table.col") refer to the FROM table's primary key?
+// Only single-column keys can be named as "id".
+int isPrimaryKeyRef(SelectQuery* q, const char* name) {
+    return q->tables[0]->schema.num_key_columns == 1 && keyColumnIndex(q->tables[0], name) == 0;
+}
+
+// Does s start with the keyword kw as a whole word (case-insensitive)?
+int startsWithKeyword(const char* s, const char* kw) {
+    size_t len = strlen(kw);
+    return strncasecmp(s, kw, len) == 0 && !(isalnum((unsigned char)s[len]) || s[len] == '_');
+}
+
+// Parse the key side of a condition at *pos: a key column ("id" for a single
+// key) or "(col, ...)" naming leading key columns in key order. Returns how
+// many key columns it names, 0 after printing an error.
+int parseKeyRef(Table* table, char** pos) {
+    TableSchema* schema = &table->schema;
+    char* p = *pos;
+    int n = 0;
+    
+    while (isspace((unsigned char)*p)) p++;
+    int tuple = (*p == '(');
+    if (tuple) p++;
+    while (1) {
+        char name[2 * MAX_FIELD + 1];
+        size_t len = 0;
+        while (isspace((unsigned char)*p)) p++;
+        while ((isalnum((unsigned char)*p) || *p == '_' || *p == '.') && len < sizeof(name) - 1) {
+            name[len++] = *p++;
+        }
+        name[len] = '\0';
+        if (len == 0 || n >= schema->num_key_columns || keyColumnIndex(table, name) != n) break;
+        n++;
+        while (isspace((unsigned char)*p)) p++;
+        if (!tuple) {
+            *pos = p;
+            return n;
+        }
+        if (*p == ',') {
+            p++;
+        } else if (*p == ')') {
+            *pos = p + 1;
+            return n;
+        } else {
+            break;
+        }
+    }
+    
+    if (schema->num_key_columns == 1) {
+        outputMessage("Error: Expected 'id'!\n");
+        return 0;
+    }
+    char names[MAX_KEY_COLUMNS * (MAX_FIELD + 2)] = "";
+    for (int k = 0; k < schema->num_key_columns; k++) {
+        if (k > 0) strcat(names, ", ");
+        strcat(names, schema->columns[schema->key_columns[k]].name);
+    }
+    outputMessage("Error: Expected the primary key (%s) or its leading columns!\n", names);
+    return 0;
+}
+
+// Parse the value side for the first num_columns key columns at *pos: a value,
+// or "(v1, v2, ...)" with one per column. Values are numbers, quoted strings or
+// bare words. The encoding goes to buf (MAX_KEY_BYTES) and key points into it.
+int parseKeyValue(Table* table, int num_columns, char** pos, unsigned char* buf, IndexKey* key) {
+    char* p = *pos;
+    uint32_t len = 0;
+    
+    while (isspace((unsigned char)*p)) p++;
+    int tuple = (*p == '(');
+    if (tuple) {
+        p++;
+    } else if (num_columns > 1) {
+        outputMessage("Error: Expected a value for each key column, e.g. (v1, v2)!\n");
+        return 0;
+    }
+    for (int k = 0; k < num_columns; k++) {
+        while (isspace((unsigned char)*p)) p++;
+        if (k > 0) {
+            if (*p != ',') {
+                outputMessage("Error: Expected a value for each key column, e.g. (v1, v2)!\n");
+                return 0;
+            }
+            p++;
+            while (isspace((unsigned char)*p)) p++;
+        }
+        
+        const char* value = p;
+        size_t n;
+        if (*p == '\'' || *p == '"') {
+            char quote = *p++;
+            value = p;
+            while (*p && *p != quote) p++;
+            if (!*p) {
+                outputMessage("Error: Unterminated string!\n");
+                return 0;
+            }
+            n = (size_t)(p++ - value);
+        } else {
+            while (*p && !isspace((unsigned char)*p) && *p != ',' && *p != ')' && *p != ';') p++;
+            n = (size_t)(p - value);
+        }
+        
+        int col = table->schema.key_columns[k];
+        int bytes = encodeKeyValue(table, col, value, n, buf + len);
+        if (bytes < 0) {
+            if (isIdColumn(&table->schema, col)) {
+                outputMessage("Error: Invalid ID value!\n");
+            } else {
+                outputMessage("Error: Invalid value '%.*s' for key column '%s'!\n", (int)n, value,
+                              table->schema.columns[col].name);
+            }
+            return 0;
+        }
+        len += (uint32_t)bytes;
+    }
+    if (tuple) {
+        while (isspace((unsigned char)*p)) p++;
+        if (*p != ')') {
+            outputMessage("Error: Expected ')'!\n");
+            return 0;
+        }
+        p++;
+    }
+    
+    *pos = p;
+    *key = makeKey(buf, len);
+    return 1;
+}
+
+// Parse "key = value" naming the whole primary key, as UPDATE and DELETE need
+int parseKeyEquals(Table* table, char* text, unsigned char* buf, IndexKey* key) {
+    int n = parseKeyRef(table, &text);
+    if (!n) return 0;
+    if (n < table->schema.num_key_columns) {
+        outputMessage("Error: Expected a value for every primary key column!\n");
+        return 0;
+    }
+    while (isspace((unsigned char)*text)) text++;
+    if (*text != '=') {
+        outputMessage("Error: Expected '='!\n");
+        return 0;
+    }
+    text++;
+    return parseKeyValue(table, n, &text, buf, key);
+}
+
+// Parse a WHERE condition on the FROM table's key into q: "= value", "BETWEEN
+// a AND b" or "IN (v1, ...)". With a composite key, = and BETWEEN may name only
+// leading key columns and then match every key that starts with the values.
+// *point is set when = gives the whole key. Returns the text after the
+// condition, NULL after printing an error.
+char* parseKeyCondition(SelectQuery* q, char* text, int* point) {
+    Table* table = q->tables[0];
+    char* p = text;
+    int n = parseKeyRef(table, &p);
+    if (!n) return NULL;
+    int full = (n == table->schema.num_key_columns);
+    
+    while (isspace((unsigned char)*p)) p++;
+    if (*p == '=') {
+        p++;
+        if (!parseKeyValue(table, n, &p, q->key_bytes, &q->key_lo)) return NULL;
+        q->key_hi = q->key_lo;
+        q->key_bounded = 1;
+        *point = full;
+    } else if (startsWithKeyword(p, "BETWEEN")) {
+        p += 7;
+        if (!parseKeyValue(table, n, &p, q->key_bytes, &q->key_lo)) return NULL;
+        while (isspace((unsigned char)*p)) p++;
+        if (!startsWithKeyword(p, "AND")) {
+            outputMessage("Error: Expected 'AND'!\n");
+            return NULL;
+        }
+        p += 3;
+        if (!parseKeyValue(table, n, &p, q->key_bytes + MAX_KEY_BYTES, &q->key_hi)) return NULL;
+        if (compareKeys(&q->key_lo, &q->key_hi) > 0) {
+            outputMessage("Error: Invalid range!\n");
+            return NULL;
+        }
+        q->key_bounded = 1;
+    } else if (startsWithKeyword(p, "IN")) {
+        p += 2;
+        while (isspace((unsigned char)*p)) p++;
+        if (*p != '(') {
+            outputMessage("Error: Expected '(' after IN!\n");
+            return NULL;
+        }
+        if (!full) {
+            outputMessage("Error: Expected a value for every primary key column!\n");
+            return NULL;
+        }
+        p++;
+        q->in_keys = (IndexKey*)malloc(MAX_IN_LIST * sizeof(IndexKey));
+        if (!q->in_keys) {
+            outputMessage("Error: Out of memory!\n");
+            return NULL;
+        }
+        q->num_in_keys = 0;
+        while (1) {
+            unsigned char buf[MAX_KEY_BYTES];
+            IndexKey key;
+            while (isspace((unsigned char)*p)) p++;
+            if (*p == ')') {
+                p++;
+                break;
+            }
+            if (q->num_in_keys > 0 && *p++ != ',') {
+                outputMessage("Error: Invalid IN list!\n");
+                return NULL;
+            }
+            if (q->num_in_keys >= MAX_IN_LIST) {
+                outputMessage("Error: Invalid IN list!\n");
+                return NULL;
+            }
+            if (!parseKeyValue(table, n, &p, buf, &key)) return NULL;
+            q->in_keys[q->num_in_keys++] = copyKey(&key, key.len);
+        }
+        qsort(q->in_keys, q->num_in_keys, sizeof(IndexKey), compareIndexKeys);
+        int unique = 0;
+        for (int k = 0; k < q->num_in_keys; k++) {
+            if (k == 0 || compareKeys(&q->in_keys[k], &q->in_keys[unique - 1]) != 0) {
+                q->in_keys[unique++] = q->in_keys[k];
+            } else {
+                freeKey(&q->in_keys[k]);
+            }
+        }
+        q->num_in_keys = unique;
+    } else if (!*p || *p == ';') {
+        outputMessage("Error: Expected condition!\n");
+        return NULL;
+    } else {
+        outputMessage("Error: Unsupported condition!\n");
+        return NULL;
+    }
+    return p;
+}
+
+// Parse a WHERE condition: one on the FROM table's key (see parseKeyCondition)
+// or "col = value" on another of its columns, which filters the table's scan
+char* parseCondition(SelectQuery* q, char* text, int* point) {
+    Table* table = q->tables[0];
+    char name[2 * MAX_FIELD + 1];
+    size_t len = 0;
+    char* p = text;
+    while (isspace((unsigned char)*p)) p++;
+    while ((isalnum((unsigned char)*p) || *p == '_' || *p == '.') && len < sizeof(name) - 1) {
+        name[len++] = *p++;
+    }
+    name[len] = '\0';
+    int col = len ? columnIndex(table, name) : -1;
+    if (col < 0 || isKeyColumn(&table->schema, col) || keyColumnIndex(table, name) >= 0) {
+        return parseKeyCondition(q, text, point);
+    }
+    return parseFilterCondition(q, col, p);
+}
+
+// Parse "= value" filtering the FROM table on col: a number for a numeric
+// column, otherwise a quoted string or a bare word. An encoded column is
+// filtered on dictionary codes, so the value is looked up once here.
+char* parseFilterCondition(SelectQuery* q, int col, char* text) {
+    Table* table = q->tables[0];
+    Column* column = &table->schema.columns[col];
+    char* p = text;
+    while (isspace((unsigned char)*p)) p++;
+    if (*p != '=') {
+        outputMessage("Error: Only '=' is supported on column '%s'!\n", column->name);
+        return NULL;
+    }
+    p++;
+    while (isspace((unsigned char)*p)) p++;
+    
+    const char* value = p;
+    size_t n;
+    if (*p == '\'' || *p == '"') {
+        char quote = *p++;
+        value = p;
+        while (*p && *p != quote) p++;
+        if (!*p) {
+            outputMessage("Error: Unterminated string!\n");
+            return NULL;
+        }
+        n = (size_t)(p++ - value);
+    } else {
+        while (*p && !isspace((unsigned char)*p) && *p != ';') p++;
+        n = (size_t)(p - value);
+        if (n == 0) {
+            outputMessage("Error: Expected a value for column '%s'!\n", column->name);
+            return NULL;
+        }
+    }
+    q->filter_value = (char*)malloc(n + 1);
+    if (!q->filter_value) {
+        outputMessage("Error: Out of memory!\n");
+        return NULL;
+    }
+    memcpy(q->filter_value, value, n);
+    q->filter_value[n] = '\0';
+    if (valueType(column->type) != VALUE_TEXT) {
+        char* end;
+        q->filter_num = strtod(q->filter_value, &end);
+        if (end == q->filter_value || *end) {
+            outputMessage("Error: Invalid value '%s' for column '%s'!\n", q->filter_value, column->name);
+            return NULL;
+        }
+    }
+    q->filter_col = col;
+    if (column->encoded) {
+        ColumnDict* dict = columnDict(table, col);
+        q->filter_code = dict ? dictFind(dict, value, n) : -1;
+    }
+    return p;
+}
+
+// Does a row of the FROM table pass the WHERE filter? Encoded columns compare
+// codes; empty numeric values never match.
+int filterMatches(SelectQuery* q, Record* rec) {
+    Table* table = q->tables[0];
+    Column* column = &table->schema.columns[q->filter_col];
+    const char* field = recordField(table, rec, q->filter_col);
+    if (column->encoded) return (long)fieldCode(field) == q->filter_code;
+    if (valueType(column->type) == VALUE_TEXT) return strcmp(field, q->filter_value) == 0;
+    char* end;
+    double v = strtod(field, &end);
+    return end != field && v == q->filter_num;
+}
+
+// Scan callback passing on the rows that pass the filter
+int filterScanRow(void* ctx, Record* rec) {
+    FilterScan* fs = (FilterScan*)ctx;
+    return filterMatches(fs->q, rec) ? fs->cb(fs->ctx, rec) : 1;
+}
+
+// Whether the filter can pass any row: a value missing from an encoded
+// column's dictionary is in no row, so nothing needs to be read
+int filterMayMatch(SelectQuery* q) {
+    return q->filter_col < 0 || !q->tables[0]->schema.columns[q->filter_col].encoded || q->filter_code >= 0;
+}
+
+// Does a key of the FROM table satisfy the WHERE condition on it?
+int keyInQuery(SelectQuery* q, const IndexKey* key) {
+    if (q->key_bounded && (compareKeys(key, &q->key_lo) < 0 || compareKeyPrefix(key, &q->key_hi) > 0)) {
+        return 0;
+    }
+    return q->num_in_keys < 0 ||
+           bsearch(key, q->in_keys, q->num_in_keys, sizeof(IndexKey), compareIndexKeys) != NULL;
+}
+
+// Resolve a column of the select list or ORDER BY; a bare "id" is the FROM table's key
+int resolveSelectColumn(SelectQuery* q, const char* name, ColumnRef* ref) {
+    if (isPrimaryKeyRef(q, name)) {
+        ref->side = 0;
+        ref->col = q->tables[0]->schema.primary_key_index;
+        return 1;
+    }
+    return resolveColumn(q, name, ref);
+}
+
+// Normalized join key: numeric columns compare by value (formatted into buf,
+// JOIN_KEY_MAX bytes; integral values as exact integers so 64-bit keys keep
+// every digit), strings byte-wise as stored in the row. Empty values behave
+// like NULL and produce an empty key that never matches.
+const char* joinKey(Table* table, Record* rec, int col, char* buf) {
+    const char* val = fieldValue(table, rec, col, buf);
+    
+    if (isIdColumn(&table->schema, col) || valueType(table->schema.columns[col].type) != VALUE_TEXT) {
+        char* end;
+        errno = 0;
+        long long v = strtoll(val, &end, 10);
+        if (end != val && *end == '\0' && errno == 0) {
+            snprintf(buf, JOIN_KEY_MAX, "%lld", v);
+            return buf;
+        }
+        double d = strtod(val, &end);
+        if (end != val && *end == '\0') {
+            if (d >= -9e18 && d <= 9e18 && (double)(long long)d == d) {
+                snprintf(buf, JOIN_KEY_MAX, "%lld", (long long)d);
+            } else {
+                snprintf(buf, JOIN_KEY_MAX, "%.17g", d);
+            }
+            return buf;
+        }
+    }
+    return val;
+}
+
+// FNV-1a hash of a join key
+unsigned long hashJoinKey(const char* key) {
+    unsigned long h = 2166136261UL;
+    while (*key) {
+        h ^= (unsigned char)*key++;
+        h *= 16777619UL;
+    }
+    return h;
+}
+
+// Hand a matched pair to the consumer in (FROM, JOIN) order
+int emitJoinedRow(JoinState* js, Record* outer_rec, Record* inner_rec) {
+    Record* rows[2];
+    rows[js->outer] = outer_rec;
+    rows[1 - js->outer] = inner_rec;
+    js->matches++;
+    if (!js->cb(js->ctx, rows)) {
+        js->stopped = 1;
+        return 0;
+    }
+    return 1;
+}
+
+// Scan one side of the join; the FROM table honours the WHERE key condition
+void scanJoinSide(JoinState* js, int side, ScanCallback cb) {
+    SelectQuery* q = js->q;
+    ProfiledCallback pc = {cb, NULL, js, PROF_JOIN};
+    void* ctx = js;
+    if (active_profile) {
+        cb = profiledScanRow;
+        ctx = &pc;
+    }
+    
+    FilterScan fs = {q, cb, ctx};
+    if (side == 0 && q->filter_col >= 0) {
+        cb = filterScanRow;
+        ctx = &fs;
+    }
+    
+    int prev = profileEnter(PROF_SCAN + side);
+    long rows = 0;
+    if (side == 0 && !filterMayMatch(q)) {
+        // Nothing to read
+    } else if (side == 0 && q->num_in_keys >= 0) {
+        rows = lookupRecords(q->tables[0], q->in_keys, q->num_in_keys, q->needed[0], cb, ctx);
+    } else if (side == 0 && q->key_bounded) {
+        rows = scanTable(q->tables[0], &q->key_lo, &q->key_hi, q->needed[0], cb, ctx);
+    } else {
+        rows = scanTable(q->tables[side], NULL, NULL, q->needed[side], cb, ctx);
+    }
+    profileLeave(prev);
+    profileRows(PROF_SCAN + side, rows);
+}
+
+// Index nested-loop join: probe the inner table's B+ tree with each outer key
+int indexJoinProbe(void* ctx, Record* rec) {
+    JoinState* js = (JoinState*)ctx;
+    int inner = 1 - js->outer;
+    Table* table = js->q->tables[inner];
+    char buf[JOIN_KEY_MAX];
+    unsigned char key_buf[MAX_KEY_BYTES];
+    
+    const char* value = joinKey(js->q->tables[js->outer], rec, js->q->join_on[js->outer].col, buf);
+    if (!*value) return 1;
+    int len = encodeKeyValue(table, table->schema.primary_key_index, value, strlen(value), key_buf);
+    if (len < 0) return 1;
+    IndexKey key = makeKey(key_buf, (uint32_t)len);
+    if (inner == 0 && !keyInQuery(js->q, &key)) return 1;
+    
+    int prev = profileEnter(PROF_SCAN + inner);
+    const Record* match = findRecord(table, &key, js->inner_row);
+    profileLeave(prev);
+    if (!match) return 1;
+    if (inner == 0 && js->q->filter_col >= 0 && !filterMatches(js->q, (Record*)match)) {
+        releaseRecord(table, match, js->inner_row);
+        return 1;
+    }
+    profileRows(PROF_SCAN + inner, 1);
+    int more = emitJoinedRow(js, rec, (Record*)match);
+    releaseRecord(table, match, js->inner_row);
+    return more;
+}
+
+// Add a build-side row to the in-memory hash table
+int hashJoinBuild(void* ctx, Record* rec) {
+    JoinState* js = (JoinState*)ctx;
+    int build = 1 - js->outer;
+    Table* table = js->q->tables[build];
+    char buf[JOIN_KEY_MAX];
+    
+    const char* key = joinKey(table, rec, js->q->join_on[build].col, buf);
+    if (!key[0]) return 1;
+    size_t key_len = strlen(key) + 1;
+    JoinEntry* entry = (JoinEntry*)malloc(sizeof(JoinEntry) + table->schema.row_size + key_len);
+    if (!entry) {
+        js->failed = js->stopped = 1;
+        return 0;
+    }
+    memcpy(entry->row, rec, table->schema.row_size);
+    entry->key = (char*)memcpy(entry->row + table->schema.row_size, key, key_len);
+    entry->hash = hashJoinKey(entry->key);
+    size_t b = entry->hash & (js->num_buckets - 1);
+    entry->next = js->buckets[b];
+    js->buckets[b] = entry;
+    return 1;
+}
+
+// Look up a probe-side row and emit every match
+int hashJoinProbe(void* ctx, Record* rec) {
+    JoinState* js = (JoinState*)ctx;
+    char buf[JOIN_KEY_MAX];
+    
+    const char* key = joinKey(js->q->tables[js->outer], rec, js->q->join_on[js->outer].col, buf);
+    if (!key[0]) return 1;
+    unsigned long h = hashJoinKey(key);
+    for (JoinEntry* e = js->buckets[h & (js->num_buckets - 1)]; e; e = e->next) {
+        if (e->hash == h && strcmp(e->key, key) == 0) {
+            if (!emitJoinedRow(js, rec, (Record*)e->row)) return 0;
+        }
+    }
+    return 1;
+}
+
+// Spill a row into its grace partition; js->outer is set to the side being scanned
+int hashJoinPartition(void* ctx, Record* rec) {
+    JoinState* js = (JoinState*)ctx;
+    Table* table = js->q->tables[js->outer];
+    char buf[JOIN_KEY_MAX];
+    
+    const char* key = joinKey(table, rec, js->q->join_on[js->outer].col, buf);
+    if (!key[0]) return 1;
+    int p = (int)((hashJoinKey(key) >> 8) % JOIN_PARTITIONS);
+    if (fwrite(rec, table->schema.row_size, 1, js->parts[p]) != 1) {
+        js->failed = js->stopped = 1;
+        return 0;
+    }
+    return 1;
+}
+
+// Size the bucket array for the expected number of build rows
+int allocJoinBuckets(JoinState* js, long rows) {
+    js->num_buckets = 64;
+    while ((long)js->num_buckets < rows) js->num_buckets <<= 1;
+    js->buckets = (JoinEntry**)calloc(js->num_buckets, sizeof(JoinEntry*));
+    return js->buckets != NULL;
+}
+
+// Release the hash table built for one join pass
+void freeJoinBuckets(JoinState* js) {
+    if (!js->buckets) return;
+    for (size_t b = 0; b < js->num_buckets; b++) {
+        JoinEntry* e = js->buckets[b];
+        while (e) {
+            JoinEntry* next = e->next;
+            free(e);
+            e = next;
+        }
+    }
+    free(js->buckets);
+    js->buckets = NULL;
+}
+
+// Grace hash join: partition both sides to temp files, then join partition by
+// partition. A failure to spill or build stops the join with js->failed set;
+// the partitions joined before it have already been emitted.
+void graceHashJoin(JoinState* js, int build, int probe) {
+    FILE* build_parts[JOIN_PARTITIONS];
+    FILE* probe_parts[JOIN_PARTITIONS];
+    int ok = 1;
+    
+    for (int p = 0; p < JOIN_PARTITIONS; p++) {
+        build_parts[p] = tmpfile();
+        probe_parts[p] = tmpfile();
+        if (!build_parts[p] || !probe_parts[p]) ok = 0;
+    }
+    
+    if (ok) {
+        memcpy(js->parts, build_parts, sizeof(build_parts));
+        js->outer = build;
+        scanJoinSide(js, build, hashJoinPartition);
+        memcpy(js->parts, probe_parts, sizeof(probe_parts));
+        js->outer = probe;
+        if (!js->failed) scanJoinSide(js, probe, hashJoinPartition);
+        ok = !js->failed;
+    } else {
+        outputMessage("Error: Could not create join spill files!\n");
+    }
+    
+    long per_partition = js->q->tables[build]->record_count / JOIN_PARTITIONS + 1;
+    int build_size = js->q->tables[build]->schema.row_size;
+    int probe_size = js->q->tables[probe]->schema.row_size;
+    Record* rec = (Record*)malloc(build_size > probe_size ? build_size : probe_size);
+    if (ok && !rec) js->failed = 1;
+    for (int p = 0; ok && rec && p < JOIN_PARTITIONS && !js->stopped; p++) {
+        if (!allocJoinBuckets(js, per_partition)) {
+            js->failed = 1;
+            break;
+        }
+        rewind(build_parts[p]);
+        while (fread(rec, build_size, 1, build_parts[p]) == 1) {
+            if (!hashJoinBuild(js, rec)) break;
+        }
+        rewind(probe_parts[p]);
+        while (!js->stopped && fread(rec, probe_size, 1, probe_parts[p]) == 1) {
+            hashJoinProbe(js, rec);
+        }
+        freeJoinBuckets(js);
+    }
+    free(rec);
+    
+    for (int p = 0; p < JOIN_PARTITIONS; p++) {
+        if (build_parts[p]) fclose(build_parts[p]);
+        if (probe_parts[p]) fclose(probe_parts[p]);
+    }
+}
+
+// The side a join probes through its primary key index, or -1 for a hash join
+int indexJoinInner(SelectQuery* q) {
+    for (int inner = 1; inner >= 0; inner--) {
+        Table* t = q->tables[inner];
+        if (t->schema.num_key_columns == 1 && q->join_on[inner].col == t->schema.primary_key_index) return inner;
+    }
+    return -1;
+}
+
+// Execute SELECT ... FROM a JOIN b ON a.x = b.y, handing each joined row to cb.
+// Joins on a primary key use an index nested-loop join through the B+ tree;
+// everything else is a hash join built on the smaller table, partitioned to
+// disk when the build side would not fit in JOIN_MEM_LIMIT. A hash join that
+// runs out of memory or spill space stops with an error rather than emit an
+// incomplete result; the in-memory one does so before any row goes out.
+int executeJoin(SelectQuery* q, RowCallback cb, void* ctx) {
+    JoinState js;
+    memset(&js, 0, sizeof(js));
+    js.q = q;
+    js.cb = cb;
+    js.ctx = ctx;
+    
+    int inner = indexJoinInner(q);
+    if (inner >= 0) {
+        js.outer = 1 - inner;
+        js.inner_row = allocRecord(q->tables[inner]);
+        if (!js.inner_row) {
+            outputMessage("Error: Out of memory building join!\n");
+            return 0;
+        }
+        scanJoinSide(&js, js.outer, indexJoinProbe);
+        free(js.inner_row);
+        return js.matches;
+    }
+    
+    int build = (q->tables[1]->record_count <= q->tables[0]->record_count) ? 1 : 0;
+    int probe = 1 - build;
+    long build_rows = q->tables[build]->record_count;
+    
+    size_t entry_size = sizeof(JoinEntry) + q->tables[build]->schema.row_size;
+    if ((size_t)build_rows * entry_size > JOIN_MEM_LIMIT) {
+        graceHashJoin(&js, build, probe);
+        if (js.failed) outputMessage("Error: Join failed, out of memory or spill space!\n");
+        return js.matches;
+    }
+    
+    if (!allocJoinBuckets(&js, build_rows)) {
+        outputMessage("Error: Out of memory building join!\n");
+        return 0;
+    }
+    js.outer = probe;
+    scanJoinSide(&js, build, hashJoinBuild);
+    if (!js.failed) scanJoinSide(&js, probe, hashJoinProbe);
+    freeJoinBuckets(&js);
+    if (js.failed) outputMessage("Error: Out of memory building join!\n");
+    return js.matches;
+}
+
+// Initialize a single-table SELECT with no filter, ordering or limit
+void initSelectQuery(SelectQuery* q, Table* table) {
+    memset(q, 0, sizeof(*q));
+    q->tables[0] = table;
+    q->num_tables = 1;
+    q->limit = -1;
+    q->num_in_keys = -1;
+    q->filter_col = -1;
+    q->needed[0] = q->needed[1] = ALL_COLUMNS;
+}
+
+// Release what parsing the WHERE clause allocated
+void freeSelectQuery(SelectQuery* q) {
+    for (int i = 0; i < q->num_in_keys; i++) freeKey(&q->in_keys[i]);
+    free(q->in_keys);
+    q->in_keys = NULL;
+    q->num_in_keys = -1;
+    free(q->filter_value);
+    q->filter_value = NULL;
+    q->filter_col = -1;
+}
+
+// Push the projection into the scans: each side only reads the columns that are
+// selected, joined on or sorted by
+void planColumns(SelectQuery* q) {
+    if (q->num_columns == 0) {
+        q->needed[0] = q->needed[1] = ALL_COLUMNS;
+        return;
+    }
+    q->needed[0] = q->needed[1] = 0;
+    for (int i = 0; i < q->num_columns; i++) {
+        q->needed[q->columns[i].side] |= columnBit(q->columns[i].col);
+    }
+    if (q->num_tables == 2) {
+        q->needed[0] |= columnBit(q->join_on[0].col);
+        q->needed[1] |= columnBit(q->join_on[1].col);
+    }
+    if (q->has_order) q->needed[q->order_by.side] |= columnBit(q->order_by.col);
+    if (q->filter_col >= 0) q->needed[0] |= columnBit(q->filter_col);
+}
+
+// Adapt a single-table scan to the row callback used by joins and sorts
+int scanRowAdapter(void* ctx, Record* rec) {
+    RowSink* sink = (RowSink*)ctx;
+    Record* rows[2] = {rec, NULL};
+    return sink->cb(sink->ctx, rows);
+}
+
+// Whether a key range can hold rows: ranges outside the key heads in the
+// table statistics read nothing
+int rangeMayMatch(SelectQuery* q) {
+    Table* table = q->tables[0];
+    if (table->record_count == 0) return 0;
+    uint64_t mask = q->key_hi.len < 8 ? ~0ULL << (8 * (8 - q->key_hi.len)) : ~0ULL;
+    return q->key_lo.head <= table->stats.max_head && (table->stats.min_head & mask) <= q->key_hi.head;
+}
+
+// Produce the query's rows in scan (or join) order
+void produceRows(SelectQuery* q, RowCallback cb, void* ctx) {
+    if (q->num_tables == 2) {
+        // Joined rows are charged back to the operator consuming them
+        ProfiledCallback jc = {NULL, cb, ctx, PROF_STATEMENT};
+        if (active_profile) {
+            jc.op = active_profile->current;
+            cb = profiledRow;
+            ctx = &jc;
+        }
+        int prev = profileEnter(PROF_JOIN);
+        int matches = executeJoin(q, cb, ctx);
+        profileLeave(prev);
+        profileRows(PROF_JOIN, matches);
+        return;
+    }
+    
+    RowSink sink = {cb, ctx, -1, 0};
+    ProfiledCallback pc = {scanRowAdapter, NULL, &sink, PROF_STATEMENT};
+    ScanCallback scan_cb = scanRowAdapter;
+    void* scan_ctx = &sink;
+    if (active_profile) {
+        pc.op = active_profile->current;
+        scan_cb = profiledScanRow;
+        scan_ctx = &pc;
+    }
+    
+    FilterScan fs = {q, scan_cb, scan_ctx};
+    if (q->filter_col >= 0) {
+        scan_cb = filterScanRow;
+        scan_ctx = &fs;
+    }
+    
+    Table* table = q->tables[0];
+    int prev = profileEnter(PROF_SCAN);
+    long rows = 0;
+    if (!filterMayMatch(q)) {
+        // Nothing to read
+    } else if (q->num_in_keys >= 0) {
+        rows = lookupRecords(table, q->in_keys, q->num_in_keys, q->needed[0], scan_cb, scan_ctx);
+    } else if (!q->key_bounded) {
+        if (table->record_count > 0) rows = scanTable(table, NULL, NULL, q->needed[0], scan_cb, scan_ctx);
+    } else if (rangeMayMatch(q)) {
+        rows = scanTable(table, &q->key_lo, &q->key_hi, q->needed[0], scan_cb, scan_ctx);
+    }
+    profileLeave(prev);
+    profileRows(PROF_SCAN, rows);
+}
+
+// Pass rows through until the LIMIT is reached, then stop the producer
+int limitRowCallback(void* ctx, Record** rows) {
+    RowSink* sink = (RowSink*)ctx;
+    sink->emitted++;
+    if (!sink->cb(sink->ctx, rows)) return 0;
+    return sink->limit < 0 || sink->emitted < sink->limit;
+}
+
+// Compute the ORDER BY key of a row: numbers are parsed once, strings copied
+void computeSortKey(SortState* st, SortItem* item, Record** rows) {
+    Table* table = st->q->tables[st->key.col.side];
+    Record* rec = rows[st->key.col.side];
+    char buf[MAX_FIELD];
+    const char* val = fieldValue(table, rec, st->key.col.col, buf);
+    
+    item->key = &st->key;
+    item->is_null = (*val == '\0');
+    item->num = 0;
+    item->str = "";
+    if (item->is_null) return;
+    if (st->key.numeric) {
+        char* end;
+        item->num = strtod(val, &end);
+        if (end == val) item->is_null = 1;
+    } else {
+        item->str = val;
+    }
+}
+
+// Order two sort items (NULLs first, ties keep arrival order)
+int compareSortItems(const void* a, const void* b) {
+    const SortItem* x = (const SortItem*)a;
+    const SortItem* y = (const SortItem*)b;
+    int c;
+    
+    if (x->is_null || y->is_null) {
+        c = y->is_null - x->is_null;
+    } else if (x->key->numeric) {
+        c = (x->num > y->num) - (x->num < y->num);
+    } else {
+        c = strcmp(x->str, y->str);
+    }
+    if (x->key->desc) c = -c;
+    if (c == 0) c = (x->seq > y->seq) - (x->seq < y->seq);
+    return c;
+}
+
+// Copy the rows of a sort item so it outlives the producer's buffers, and
+// point its key at the copies
+int copySortRows(SortState* st, SortItem* item, Record** rows) {
+    if (!item->recs) item->recs = (char*)malloc(st->row_bytes);
+    if (!item->recs) return 0;
+    for (int s = 0; s < st->q->num_tables; s++) {
+        memcpy(item->recs + st->row_offset[s], rows[s], st->q->tables[s]->schema.row_size);
+    }
+    Record* copies[2];
+    sortItemRows(st, item, copies);
+    computeSortKey(st, item, copies);
+    return 1;
+}
+
+// The rows held by a sort item
+void sortItemRows(SortState* st, SortItem* item, Record** rows) {
+    rows[0] = (Record*)(item->recs + st->row_offset[0]);
+    rows[1] = st->q->num_tables == 2 ? (Record*)(item->recs + st->row_offset[1]) : NULL;
+}
+
+// Hand a buffered item to the output callback
+int emitSortItem(SortState* st, SortItem* item) {
+    Record* rows[2];
+    sortItemRows(st, item, rows);
+    return limitRowCallback(&st->out, rows);
+}
+
+// Restore the heap property below index i (root holds the greatest item)
+void siftDownSortHeap(SortItem* heap, long n, long i) {
+    while (1) {
+        long largest = i;
+        long l = 2 * i + 1;
+        long r = l + 1;
+        if (l < n && compareSortItems(&heap[l], &heap[largest]) > 0) largest = l;
+        if (r < n && compareSortItems(&heap[r], &heap[largest]) > 0) largest = r;
+        if (largest == i) return;
+        SortItem tmp = heap[i];
+        heap[i] = heap[largest];
+        heap[largest] = tmp;
+        i = largest;
+    }
+}
+
+// Top-N: keep the LIMIT best rows in a bounded max-heap
+int topNRowCallback(void* ctx, Record** rows) {
+    SortState* st = (SortState*)ctx;
+    SortItem item;
+    
+    computeSortKey(st, &item, rows);
+    item.seq = st->seq++;
+    item.recs = NULL;
+    
+    if (st->count < st->capacity) {
+        if (!copySortRows(st, &item, rows)) return st->failed = 1, 0;
+        long i = st->count++;
+        st->items[i] = item;
+        while (i > 0 && compareSortItems(&st->items[i], &st->items[(i - 1) / 2]) > 0) {
+            SortItem tmp = st->items[i];
+            st->items[i] = st->items[(i - 1) / 2];
+            st->items[(i - 1) / 2] = tmp;
+            i = (i - 1) / 2;
+        }
+    } else if (compareSortItems(&item, &st->items[0]) < 0) {
+        // Reuse the evicted item's row buffer
+        item.recs = st->items[0].recs;
+        copySortRows(st, &item, rows);
+        st->items[0] = item;
+        siftDownSortHeap(st->items, st->count, 0);
+    }
+    return 1;
+}
+
+// Write the buffered items as a sorted run and empty the buffer
+int spillSortRun(SortState* st) {
+    FILE** runs = (FILE**)realloc(st->runs, (st->num_runs + 1) * sizeof(FILE*));
+    if (!runs) return 0;
+    st->runs = runs;
+    FILE* run = tmpfile();
+    if (!run) {
+        outputMessage("Error: Could not create sort spill file!\n");
+        return 0;
+    }
+    st->runs[st->num_runs++] = run;
+    
+    qsort(st->items, st->count, sizeof(SortItem), compareSortItems);
+    int ok = 1;
+    for (long i = 0; i < st->count; i++) {
+        if (ok && (fwrite(&st->items[i].seq, sizeof(long), 1, run) != 1 ||
+                   fwrite(st->items[i].recs, st->row_bytes, 1, run) != 1)) {
+            ok = 0;
+        }
+        free(st->items[i].recs);
+    }
+    st->count = 0;
+    rewind(run);
+    return ok;
+}
+
+// External sort: buffer rows and spill sorted runs once the buffer is full
+int sortRowCallback(void* ctx, Record** rows) {
+    SortState* st = (SortState*)ctx;
+    if (st->count == st->capacity && !spillSortRun(st)) return st->failed = 1, 0;
+    
+    SortItem* item = &st->items[st->count];
+    item->seq = st->seq++;
+    item->recs = NULL;
+    if (!copySortRows(st, item, rows)) return st->failed = 1, 0;
+    st->count++;
+    return 1;
+}
+
+// Read the next row of a run; returns 0 at the end of the run
+int readSortRun(SortState* st, FILE* run, SortItem* item) {
+    if (fread(&item->seq, sizeof(long), 1, run) != 1) return 0;
+    if (fread(item->recs, st->row_bytes, 1, run) != 1) return 0;
+    Record* rows[2];
+    sortItemRows(st, item, rows);
+    computeSortKey(st, item, rows);
+    return 1;
+}
+
+// k-way merge of runs, either into another run (out) or to the output callback
+int mergeSortRuns(SortState* st, FILE** runs, int n, FILE* out) {
+    SortItem* heads = (SortItem*)calloc(n, sizeof(SortItem));
+    int* heap = (int*)malloc(n * sizeof(int));
+    int size = 0;
+    int ok = heads && heap;
+    
+    for (int i = 0; ok && i < n; i++) {
+        heads[i].recs = (char*)malloc(st->row_bytes);
+        if (!heads[i].recs) ok = 0;
+    }
+    
+    // Min-heap of run indices ordered by their current head
+    for (int i = 0; ok && i < n; i++) {
+        if (!readSortRun(st, runs[i], &heads[i])) continue;
+        int j = size++;
+        heap[j] = i;
+        while (j > 0 && compareSortItems(&heads[heap[j]], &heads[heap[(j - 1) / 2]]) < 0) {
+            int tmp = heap[j];
+            heap[j] = heap[(j - 1) / 2];
+            heap[(j - 1) / 2] = tmp;
+            j = (j - 1) / 2;
+        }
+    }
+    
+    while (ok && size > 0) {
+        int r = heap[0];
+        if (out) {
+            if (fwrite(&heads[r].seq, sizeof(long), 1, out) != 1 ||
+                fwrite(heads[r].recs, st->row_bytes, 1, out) != 1) {
+                ok = 0;
+                break;
+            }
+        } else if (!emitSortItem(st, &heads[r])) {
+            break;
+        }
+        
+        if (!readSortRun(st, runs[r], &heads[r])) heap[0] = heap[--size];
+        int j = 0;
+        while (1) {
+            int smallest = j;
+            int l = 2 * j + 1;
+            int rr = l + 1;
+            if (l < size && compareSortItems(&heads[heap[l]], &heads[heap[smallest]]) < 0) smallest = l;
+            if (rr < size && compareSortItems(&heads[heap[rr]], &heads[heap[smallest]]) < 0) smallest = rr;
+            if (smallest == j) break;
+            int tmp = heap[j];
+            heap[j] = heap[smallest];
+            heap[smallest] = tmp;
+            j = smallest;
+        }
+    }
+    
+    if (heads) {
+        for (int i = 0; i < n; i++) free(heads[i].recs);
+    }
+    free(heads);
+    free(heap);
+    return ok;
+}
+
+// Merge spilled runs down to SORT_MERGE_FAN_IN, then stream the final merge
+void finishExternalSort(SortState* st) {
+    if (!st->failed && st->count > 0 && !spillSortRun(st)) st->failed = 1;
+    
+    while (!st->failed && st->num_runs > SORT_MERGE_FAN_IN) {
+        FILE* merged = tmpfile();
+        if (!merged || !mergeSortRuns(st, st->runs, SORT_MERGE_FAN_IN, merged)) {
+            if (merged) fclose(merged);
+            st->failed = 1;
+            break;
+        }
+        for (int i = 0; i < SORT_MERGE_FAN_IN; i++) fclose(st->runs[i]);
+        memmove(st->runs, st->runs + SORT_MERGE_FAN_IN,
+                (st->num_runs - SORT_MERGE_FAN_IN) * sizeof(FILE*));
+        st->num_runs -= SORT_MERGE_FAN_IN;
+        rewind(merged);
+        st->runs[st->num_runs++] = merged;
+    }
+    
+    if (!st->failed) mergeSortRuns(st, st->runs, st->num_runs, NULL);
+    for (int i = 0; i < st->num_runs; i++) fclose(st->runs[i]);
+    free(st->runs);
+}
+
+// Run ORDER BY through a top-N heap (small LIMIT) or an external merge sort
+long sortRows(SelectQuery* q, RowCallback cb, void* ctx) {
+    SortState st;
+    memset(&st, 0, sizeof(st));
+    st.q = q;
+    st.out.cb = cb;
+    st.out.ctx = ctx;
+    st.out.limit = q->limit;
+    st.key.col = q->order_by;
+    st.key.desc = q->order_desc;
+    
+    Table* table = q->tables[q->order_by.side];
+    st.key.numeric = isIdColumn(&table->schema, q->order_by.col) ||
+                     valueType(table->schema.columns[q->order_by.col].type) != VALUE_TEXT;
+    for (int s = 0; s < q->num_tables; s++) {
+        st.row_offset[s] = st.row_bytes;
+        st.row_bytes += q->tables[s]->schema.row_size;
+    }
+    
+    int top_n = q->limit >= 0 && q->limit <= TOPN_MAX_ROWS;
+    if (top_n) {
+        st.capacity = q->limit;
+    } else {
+        st.capacity = SORT_MEM_LIMIT / (st.row_bytes + sizeof(SortItem));
+    }
+    st.items = (SortItem*)malloc((st.capacity ? st.capacity : 1) * sizeof(SortItem));
+    if (!st.items) {
+        outputMessage("Error: Out of memory sorting rows!\n");
+        return 0;
+    }
+    
+    produceRows(q, top_n ? topNRowCallback : sortRowCallback, &st);
+    
+    if (top_n || st.num_runs == 0) {
+        if (!st.failed) {
+            qsort(st.items, st.count, sizeof(SortItem), compareSortItems);
+            for (long i = 0; i < st.count; i++) {
+                if (!emitSortItem(&st, &st.items[i])) break;
+            }
+        }
+        for (long i = 0; i < st.count; i++) free(st.items[i].recs);
+    } else {
+        finishExternalSort(&st);
+    }
+    free(st.items);
+    if (st.failed) outputMessage("Error: Sort failed!\n");
+    return st.out.emitted;
+}
+
+// Whether the rows already come out in the requested order
+int usesIndexOrder(SelectQuery* q) {
+    return !q->has_order ||
+           (q->num_tables == 1 && !q->order_desc &&
+            q->order_by.col == q->tables[0]->schema.key_columns[0]);
+}
+
+// Produce the query's rows in the requested order, honouring LIMIT. Rows already
+// come out of the leaf chain in id order, so ORDER BY id ASC (or no ORDER BY)
+// streams straight from the scan and stops reading once LIMIT rows are out.
+long runSelect(SelectQuery* q, RowCallback cb, void* ctx) {
+    if (q->limit == 0) return 0;
+    planColumns(q);
+    
+    if (usesIndexOrder(q)) {
+        RowSink sink = {cb, ctx, q->limit, 0};
+        produceRows(q, limitRowCallback, &sink);
+        if (q->limit >= 0) profileRows(PROF_LIMIT, sink.emitted);
+        return sink.emitted;
+    }
+    
+    int prev = profileEnter(PROF_SORT);
+    long rows = sortRows(q, cb, ctx);
+    profileLeave(prev);
+    profileRows(PROF_SORT, rows);
+    return rows;
+}
+
+// Expand the select list (SELECT * = every column of every table) into
+// q->output and describe it as result columns
+int planOutput(SelectQuery* q, ResultColumn* columns) {
+    q->num_output = 0;
+    if (q->num_columns > 0) {
+        memcpy(q->output, q->columns, q->num_columns * sizeof(ColumnRef));
+        q->num_output = q->num_columns;
+    } else {
+        for (int s = 0; s < q->num_tables; s++) {
+            for (int i = 0; i < q->tables[s]->schema.num_columns; i++) {
+                q->output[q->num_output].side = s;
+                q->output[q->num_output].col = i;
+                q->num_output++;
+            }
+        }
+    }
+    
+    for (int i = 0; i < q->num_output; i++) {
+        Table* t = q->tables[q->output[i].side];
+        int col = q->output[i].col;
+        int is_key = (col == t->schema.primary_key_index && t->schema.num_key_columns == 1);
+        if (q->num_tables == 2) {
+            snprintf(columns[i].name, sizeof(columns[i].name), "%s.%s",
+                     t->schema.name, t->schema.columns[col].name);
+        } else {
+            snprintf(columns[i].name, sizeof(columns[i].name), "%s", t->schema.columns[col].name);
+        }
+        columns[i].type = isIdColumn(&t->schema, col) ? VALUE_INT : valueType(t->schema.columns[col].type);
+        columns[i].is_key = is_key && q->num_tables == 1;
+    }
+    return q->num_output;
+}
+
+// Row callback streaming a result row to the output writer
+int displaySelectRow(void* ctx, Record** rows) {
+    SelectQuery* q = (SelectQuery*)ctx;
+    int prev = profileEnter(PROF_OUTPUT);
+    beginRow();
+    for (int i = 0; i < q->num_output; i++) {
+        Table* t = q->tables[q->output[i].side];
+        Record* rec = rows[q->output[i].side];
+        int col = q->output[i].col;
+        if (isIdColumn(&t->schema, col)) {
+            outputIntValue(rec->id);
+        } else {
+            outputValue(fieldText(t, rec, col));
+        }
+    }
+    endRow();
+    profileLeave(prev);
+    profileRows(PROF_OUTPUT, 1);
+    return 1;
+}
+
+// Execute a SELECT and stream its rows
+void executeSelect(SelectQuery* q) {
+    char title[3 * MAX_FIELD + 256];
+    if (q->num_tables == 2) {
+        snprintf(title, sizeof(title), "Join %s with %s",
+                 q->tables[0]->schema.name, q->tables[1]->schema.name);
+    } else if (q->num_in_keys >= 0) {
+        snprintf(title, sizeof(title), "Result");
+    } else if (q->key_bounded) {
+        char lo[128];
+        char hi[128];
+        formatKey(q->tables[0], &q->key_lo, lo, sizeof(lo));
+        formatKey(q->tables[0], &q->key_hi, hi, sizeof(hi));
+        snprintf(title, sizeof(title), "Records in Range %s to %s", lo, hi);
+    } else if (q->filter_col >= 0) {
+        snprintf(title, sizeof(title), "Records from %s where %s = '%.*s'", q->tables[0]->schema.name,
+                 q->tables[0]->schema.columns[q->filter_col].name, MAX_FIELD, q->filter_value);
+    } else {
+        snprintf(title, sizeof(title), "All Records from %s", q->tables[0]->schema.name);
+    }
+    ResultColumn columns[MAX_SELECT_COLUMNS];
+    beginResult(title, columns, planOutput(q, columns));
+    runSelect(q, displaySelectRow, q);
+    endResult();
+}
+
+// One line of a text result (a query plan or the metrics dump): plain text in
+// table output, otherwise a row of a one-column result
+void outputTextLine(const char* text) {
+    OutputWriter* w = outputWriter();
+    if (w->format == OUTPUT_TABLE) {
+        outputString(w, text);
+        outputBytes(w, "\n", 1);
+        w->rows++;
+        return;
+    }
+    beginRow();
+    outputValue(text);
+    endRow();
+}
+
+// Describe how one side of a SELECT is read: the access path, the columns it
+// reads and the I/O mode
+void describeScan(SelectQuery* q, int side, const char* role, char* out, size_t size) {
+    Table* t = q->tables[side];
+    char lo[128];
+    char hi[128];
+    size_t n;
+    
+    if (side == 0 && q->num_in_keys >= 0) {
+        n = snprintf(out, size, "%sBatched Lookup on %s (%d keys)", role, t->schema.name, q->num_in_keys);
+    } else if (side == 0 && q->key_bounded) {
+        formatKey(t, &q->key_lo, lo, sizeof(lo));
+        formatKey(t, &q->key_hi, hi, sizeof(hi));
+        n = snprintf(out, size, "%sIndex Range Scan on %s (%s .. %s)%s", role, t->schema.name, lo, hi,
+                     rangeMayMatch(q) ? "" : ", skipped by statistics");
+    } else {
+        n = snprintf(out, size, "%sFull Scan on %s (%d rows)", role, t->schema.name, t->record_count);
+    }
+    if (n < size && side == 0 && q->filter_col >= 0) {
+        Column* column = &t->schema.columns[q->filter_col];
+        const char* how = "";
+        if (column->encoded) how = filterMayMatch(q) ? " on dictionary codes" : " not in the dictionary, nothing is read";
+        n += snprintf(out + n, size - n, ", filter %s = '%s'%s", column->name, q->filter_value, how);
+    }
+    if (n >= size) return;
+    
+    int read = 0;
+    for (int i = 0; i < t->schema.num_columns; i++) {
+        if (q->needed[side] & columnBit(i)) read++;
+    }
+    const char* io = t->map ? "mmap" : (t->use_uring && aioContext()->ring_fd >= 0) ? "io_uring" : "pread";
+    char runs[48];
+    if (t->lsm) {
+        pinLsm(t->lsm);
+        snprintf(runs, sizeof(runs), "memtable and %d runs", t->lsm->num_runs);
+        unpinLsm(t->lsm);
+        io = runs;
+    }
+    snprintf(out + n, size - n, ", %d of %d columns, %s", read, t->schema.num_columns, io);
+}
+
+// Append the counters of an analyzed operator to a plan line
+void formatOpProfile(const OpProfile* op, char* out, size_t size) {
+    size_t n = strlen(out);
+    if (n >= size) return;
+    n += snprintf(out + n, size - n, "  (rows=%ld time=%.3fms", op->rows, op->nanos / 1e6);
+    if (n < size && op->bytes) n += snprintf(out + n, size - n, " read=%llu bytes", (unsigned long long)op->bytes);
+    if (n < size && op->syscalls) n += snprintf(out + n, size - n, " syscalls=%ld", op->syscalls);
+    if (n < size && op->cache_hits) n += snprintf(out + n, size - n, " cache_hits=%ld", op->cache_hits);
+    if (n < size && op->nodes) n += snprintf(out + n, size - n, " index_nodes=%ld", op->nodes);
+    if (n < size && op->locks) {
+        n += snprintf(out + n, size - n, " locks=%ld lock_wait=%.3fms", op->locks, op->lock_nanos / 1e6);
+    }
+    if (n < size) snprintf(out + n, size - n, ")");
+}
+
+// One operator of a plan, indented under its parent, with its counters when analyzed
+void explainStep(int depth, int op, const char* text) {
+    if (plan_capture) {
+        size_t n = strlen(plan_capture);
+        snprintf(plan_capture + n, SLOWLOG_PLAN - n, "%s%s", depth ? " -> " : "", text);
+        return;
+    }
+    char line[3 * MAX_FIELD + 512];
+    size_t n = 0;
+    for (int i = 1; i < depth; i++) n += snprintf(line + n, sizeof(line) - n, "   ");
+    snprintf(line + n, sizeof(line) - n, "%s%s", depth ? "-> " : "", text);
+    if (active_profile && op >= 0) formatOpProfile(&active_profile->ops[op], line, sizeof(line));
+    outputTextLine(line);
+}
+
+// The operator tree of a SELECT, from the output down to the scans, one
+// explainStep per operator
+void explainPlan(SelectQuery* q, int point) {
+    char text[2][3 * MAX_FIELD + 256];
+    int depth = 1;
+    int num_output = q->num_columns;
+    for (int s = 0; !q->num_columns && s < q->num_tables; s++) num_output += q->tables[s]->schema.num_columns;
+    
+    planColumns(q);
+    snprintf(text[0], sizeof(text[0]), "Output (%d columns)", num_output);
+    explainStep(0, PROF_OUTPUT, text[0]);
+    if (q->limit == 0) {
+        explainStep(1, -1, "Limit 0, nothing is read");
+    } else if (point && q->num_tables == 1) {
+        char key[128];
+        formatKey(q->tables[0], &q->key_lo, key, sizeof(key));
+        snprintf(text[0], sizeof(text[0]), "Point Lookup on %s (key = %s)", q->tables[0]->schema.name, key);
+        explainStep(1, PROF_SCAN, text[0]);
+    } else {
+        if (!usesIndexOrder(q)) {
+            Table* t = q->tables[q->order_by.side];
+            const char* col = t->schema.columns[q->order_by.col].name;
+            const char* dir = q->order_desc ? "DESC" : "ASC";
+            if (q->limit >= 0 && q->limit <= TOPN_MAX_ROWS) {
+                snprintf(text[0], sizeof(text[0]), "Top-N Sort on %s %s (limit %ld)", col, dir, q->limit);
+            } else {
+                snprintf(text[0], sizeof(text[0]), "Sort on %s %s (spills past %d MB)", col, dir,
+                         SORT_MEM_LIMIT / (1024 * 1024));
+                if (q->limit >= 0) {
+                    size_t n = strlen(text[0]);
+                    snprintf(text[0] + n, sizeof(text[0]) - n, ", limit %ld", q->limit);
+                }
+            }
+            explainStep(depth++, PROF_SORT, text[0]);
+        } else if (q->limit >= 0) {
+            snprintf(text[0], sizeof(text[0]), "Limit %ld", q->limit);
+            explainStep(depth++, PROF_LIMIT, text[0]);
+        }
+        
+        if (q->num_tables == 1) {
+            describeScan(q, 0, "", text[0], sizeof(text[0]));
+            explainStep(depth, PROF_SCAN, text[0]);
+        } else {
+            const char* on[2] = {q->tables[0]->schema.columns[q->join_on[0].col].name,
+                                 q->tables[1]->schema.columns[q->join_on[1].col].name};
+            int inner = indexJoinInner(q);
+            int first;
+            if (inner >= 0) {
+                first = 1 - inner;
+                snprintf(text[0], sizeof(text[0]), "Index Nested Loop Join (%s.%s = %s.%s)",
+                         q->tables[0]->schema.name, on[0], q->tables[1]->schema.name, on[1]);
+                explainStep(depth++, PROF_JOIN, text[0]);
+                describeScan(q, first, "outer: ", text[0], sizeof(text[0]));
+                snprintf(text[1], sizeof(text[1]), "inner: Index Lookup on %s (%s)",
+                         q->tables[inner]->schema.name, on[inner]);
+            } else {
+                first = (q->tables[1]->record_count <= q->tables[0]->record_count) ? 1 : 0;
+                size_t entry_size = sizeof(JoinEntry) + q->tables[first]->schema.row_size;
+                int grace = (size_t)q->tables[first]->record_count * entry_size > JOIN_MEM_LIMIT;
+                snprintf(text[0], sizeof(text[0]), "%s (%s.%s = %s.%s)",
+                         grace ? "Grace Hash Join, partitioned to disk" : "Hash Join",
+                         q->tables[0]->schema.name, on[0], q->tables[1]->schema.name, on[1]);
+                explainStep(depth++, PROF_JOIN, text[0]);
+                describeScan(q, first, "build: ", text[0], sizeof(text[0]));
+                describeScan(q, 1 - first, "probe: ", text[1], sizeof(text[1]));
+            }
+            explainStep(depth, PROF_SCAN + first, text[0]);
+            explainStep(depth, PROF_SCAN + 1 - first, text[1]);
+        }
+    }
+}
+
+// Print the plan of a SELECT. Under EXPLAIN ANALYZE every operator carries
+// what it did while the statement ran.
+void explainSelect(SelectQuery* q, int point) {
+    QueryProfile* p = active_profile;
+    ResultColumn plan_column = {"plan", VALUE_TEXT, 0};
+    beginResult(p ? "Query Plan (analyzed)" : "Query Plan", &plan_column, 1);
+    explainPlan(q, point);
+    
+    if (p) {
+        uint64_t end = profileClock();
+        char line[128];
+        snprintf(line, sizeof(line), "Parse: %.3f ms", (p->exec_start - p->start) / 1e6);
+        outputTextLine(line);
+        snprintf(line, sizeof(line), "Execution: %.3f ms", (end - p->exec_start) / 1e6);
+        outputTextLine(line);
+        snprintf(line, sizeof(line), "Total: %.3f ms", (end - p->start) / 1e6);
+        outputTextLine(line);
+        p->explained = 1;
+    }
+    endResult();
+}
+
+// EXPLAIN [ANALYZE] statement. EXPLAIN prints the plan of a SELECT without
+// running it; EXPLAIN ANALYZE runs the statement with the profiler attached,
+// drops the rows it returns and reports what each operator did.
+void explainQuery(Database* db, const char* query) {
+    while (isspace((unsigned char)*query)) query++;
+    int analyze = strncasecmp(query, "ANALYZE", 7) == 0 && isspace((unsigned char)query[7]);
+    if (analyze) {
+        query += 7;
+        while (isspace((unsigned char)*query)) query++;
+    }
+    if (explain_mode != EXPLAIN_NONE) {
+        outputMessage("Error: EXPLAIN cannot be nested!\n");
+        return;
+    }
+    if (!*query) {
+        outputMessage("Error: Expected a statement after EXPLAIN!\n");
+        return;
+    }
+    if (!analyze && (strncasecmp(query, "SELECT", 6) != 0 || !isspace((unsigned char)query[6]))) {
+        outputMessage("Error: EXPLAIN supports SELECT statements only!\n");
+        return;
+    }
+    
+    char statement[MAX_QUERY];
+    snprintf(statement, sizeof(statement), "%s", query);
+    QueryProfile p;
+    memset(&p, 0, sizeof(p));
+    explain_mode = analyze ? EXPLAIN_ANALYZE : EXPLAIN_PLAN;
+    if (analyze) {
+        p.start = p.mark = p.exec_start = profileClock();
+        active_profile = &p;
+    }
+    executeStatement(db, statement);
+    
+    // Statements other than SELECT have no operators: report their totals
+    if (analyze && !p.explained) {
+        profileEnter(PROF_STATEMENT);
+        OpProfile total;
+        memset(&total, 0, sizeof(total));
+        for (int i = 0; i < PROF_OPS; i++) {
+            total.nanos += p.ops[i].nanos;
+            total.bytes += p.ops[i].bytes;
+            total.syscalls += p.ops[i].syscalls;
+            total.cache_hits += p.ops[i].cache_hits;
+            total.nodes += p.ops[i].nodes;
+            total.locks += p.ops[i].locks;
+            total.lock_nanos += p.ops[i].lock_nanos;
+        }
+        char line[256] = "Statement";
+        formatOpProfile(&total, line, sizeof(line));
+        ResultColumn plan_column = {"plan", VALUE_TEXT, 0};
+        active_profile = NULL;
+        beginResult("Query Plan (analyzed)", &plan_column, 1);
+        outputTextLine(line);
+        endResult();
+    }
+    active_profile = NULL;
+    explain_mode = EXPLAIN_NONE;
+}
+
+// Select all records
+void selectAllRecords(Table* table) {
+    SelectQuery q;
+    initSelectQuery(&q, table);
+    executeSelect(&q);
+}
+
+// Select records in a range of integer keys
+void selectRecords(Table* table, long long min_id, long long max_id) {
+    if (min_id > max_id) {
+        outputMessage("Error: Invalid range!\n");
+        return;
+    }
+    SelectQuery q;
+    initSelectQuery(&q, table);
+    q.key_bounded = 1;
+    q.key_lo = intKey(min_id);
+    q.key_hi = intKey(max_id);
+    executeSelect(&q);
+}
+
+int compareKeyOffsets(const void* a, const void* b) {
+    return compareKeys(&((const KeyOffset*)a)->key, &((const KeyOffset*)b)->key);
+}
+
+// Number of threads COPY FROM parses with
+int copyThreads(void) {
+#ifdef _WIN32
+    return 1;
+#else
+    long n = sysconf(_SC_NPROCESSORS_ONLN);
+    if (n < 1) return 1;
+    return n > COPY_MAX_THREADS ? COPY_MAX_THREADS : (int)n;
+#endif
+}
+
+// Find where the complete rows in buf end (at most COPY_BATCH_ROWS of them; a
+// trailing partial row waits for the next batch unless at_eof) and split them
+// into parts chunks on row boundaries. Newlines inside quoted values do not
+// end a row. bounds gets parts + 1 entries; returns the end of the last row.
+long splitCopyInput(const char* buf, long len, int at_eof, int parts, long* bounds) {
+    long usable = at_eof ? len : 0;
+    long rows = 0;
+    int quoted = 0;
+    for (long i = 0; i < len; i++) {
+        if (buf[i] == '"') {
+            quoted = !quoted;
+        } else if (buf[i] == '\n' && !quoted) {
+            usable = i + 1;
+            if (++rows == COPY_BATCH_ROWS) break;
+        }
+    }
+    
+    bounds[0] = 0;
+    for (int k = 1; k <= parts; k++) bounds[k] = usable;
+    quoted = 0;
+    int k = 1;
+    for (long i = 0; i < usable && k < parts; i++) {
+        if (buf[i] == '"') {
+            quoted = !quoted;
+        } else if (buf[i] == '\n' && !quoted && i + 1 >= usable * k / parts) {
+            bounds[k++] = i + 1;
+        }
+    }
+    return usable;
+}
+
+// Check an imported value against its column type and store it in rec
+int storeCopyValue(Table* table, Record* rec, int col, const char* text, char* err) {
+    Column* column = &table->schema.columns[col];
+    char* end;
+    
+    if (isIdColumn(&table->schema, col)) {
+        errno = 0;
+        long v = strtol(text, &end, 10);
+        if (*text == '\0' || *end || errno || v == 0 || v < INT_MIN || v > INT_MAX) {
+            snprintf(err, MAX_QUERY, "Invalid ID '%s'", text);
+            return 0;
+        }
+        rec->id = (int)v;
+        return 1;
+    }
+    
+    int type = valueType(column->type);
+    unsigned char key[8];
+    if (type != VALUE_TEXT && isKeyColumn(&table->schema, col) &&
+        encodeKeyValue(table, col, text, strlen(text), key) < 0) {
+        snprintf(err, MAX_QUERY, "Invalid key '%s' for column '%s'", text, column->name);
+        return 0;
+    }
+    if (*text && type == VALUE_INT) {
+        errno = 0;
+        long long v = strtoll(text, &end, 10);
+        if (*end || errno) {
+            snprintf(err, MAX_QUERY, "Invalid %s '%s' for column '%s'", column->type, text, column->name);
+            return 0;
+        }
+        char* field = recordField(table, rec, col);
+        field[formatInt(field, v)] = '\0';
+        return 1;
+    }
+    if (*text && type == VALUE_FLOAT) {
+        strtod(text, &end);
+        if (*end) {
+            snprintf(err, MAX_QUERY, "Invalid FLOAT '%s' for column '%s'", text, column->name);
+            return 0;
+        }
+    }
+    if (strlen(text) >= (size_t)column->size) {
+        snprintf(err, MAX_QUERY, "Value for column '%s' is longer than %d bytes",
+                 column->name, column->size - 1);
+        return 0;
+    }
+    if (column->encoded) {
+        long code = encodeValue(table, col, text, strlen(text));
+        if (code < 0) {
+            snprintf(err, MAX_QUERY, "Could not add '%s' to the dictionary of column '%s'", text, column->name);
+            return 0;
+        }
+        storeCode(recordField(table, rec, col), (uint32_t)code);
+        return 1;
+    }
+    strcpy(recordField(table, rec, col), text);
+    return 1;
+}
+
+// Parse one CSV row starting at *pos into rec and move *pos to the next row
+int parseCopyRow(CopyChunk* c, const char** pos, Record* rec) {
+    Table* table = c->table;
+    const char* p = *pos;
+    int col = 0;
+    int ok = 1;
+    
+    memset(rec, 0, table->schema.row_size);
+    if (!table->schema.key_in_id) rec->id = 1;
+    while (1) {
+        char* field = c->field;
+        size_t n = 0;
+        int quoted = 0;
+        int too_long = 0;
+        
+        while (p < c->end) {
+            char ch = *p;
+            if (quoted) {
+                if (ch == '"') {
+                    if (p + 1 < c->end && p[1] == '"') {
+                        p++;
+                    } else {
+                        quoted = 0;
+                        p++;
+                        continue;
+                    }
+                } else if (ch == '\n') {
+                    c->lines++;
+                }
+            } else if (ch == '"') {
+                quoted = 1;
+                p++;
+                continue;
+            } else if (ch == ',' || ch == '\n' || ch == '\r') {
+                break;
+            }
+            if (n < c->field_cap - 1) {
+                field[n++] = ch;
+            } else {
+                too_long = 1;
+            }
+            p++;
+        }
+        field[n] = '\0';
+        
+        if (ok && col < table->schema.num_columns) {
+            if (too_long) {
+                snprintf(c->error, sizeof(c->error), "Value for column '%s' is longer than %d bytes",
+                         table->schema.columns[col].name, (int)c->field_cap - 1);
+                ok = 0;
+            } else if (!storeCopyValue(table, rec, col, field, c->error)) {
+                ok = 0;
+            }
+        }
+        col++;
+        if (p < c->end && *p == ',') {
+            p++;
+            continue;
+        }
+        break;
+    }
+    
+    if (ok && col != table->schema.num_columns) {
+        snprintf(c->error, sizeof(c->error), "Expected %d values, got %d",
+                 table->schema.num_columns, col);
+        ok = 0;
+    }
+    if (p < c->end && *p == '\r') p++;
+    if (p < c->end && *p == '\n') {
+        p++;
+        c->lines++;
+    }
+    *pos = p;
+    return ok;
+}
+
+// Thread body of COPY FROM: parse and type-check every row of one chunk
+void* parseCopyChunk(void* arg) {
+    CopyChunk* c = (CopyChunk*)arg;
+    const char* p = c->start;
+    
+    while (p < c->end) {
+        if (*p == '\n' || (*p == '\r' && p + 1 < c->end && p[1] == '\n')) {
+            p += (*p == '\r') ? 2 : 1;
+            c->lines++;
+            continue;
+        }
+        size_t row_size = c->table->schema.row_size;
+        if (c->count == c->capacity) {
+            long capacity = c->capacity ? c->capacity * 2 : 1024;
+            char* rows = (char*)realloc(c->rows, capacity * row_size);
+            if (rows) c->rows = rows;
+            long* row_lines = rows ? (long*)realloc(c->row_lines, capacity * sizeof(long)) : NULL;
+            if (!row_lines) {
+                snprintf(c->error, sizeof(c->error), "Out of memory");
+                c->error_line = c->lines + 1;
+                return NULL;
+            }
+            c->row_lines = row_lines;
+            c->capacity = capacity;
+        }
+        long line = c->lines + 1;
+        if (!parseCopyRow(c, &p, (Record*)(c->rows + c->count * row_size))) {
+            c->error_line = line;
+            return NULL;
+        }
+        c->row_lines[c->count++] = line;
+    }
+    return NULL;
+}
+
+int writeFull(int fd, const void* buf, size_t len) {
+    const char* p = (const char*)buf;
+    while (len > 0) {
+        ssize_t n = write(fd, p, len);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) return 0;
+        p += n;
+        len -= (size_t)n;
+    }
+    return 1;
+}
+
+// Positional write that leaves the file offset alone, so the checkpointer can
+// write pages while the query thread uses the same descriptor
+int pwriteFull(int fd, const void* buf, size_t len, long offset) {
+#ifdef _WIN32
+    if (lseek(fd, offset, SEEK_SET) < 0) return 0;
+    return writeFull(fd, buf, len);
+#else
+    const char* p = (const char*)buf;
+    while (len > 0) {
+        ssize_t n = pwrite(fd, p, len, offset);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) return 0;
+        p += n;
+        offset += (long)n;
+        len -= (size_t)n;
+    }
+    return 1;
+#endif
+}
+
+// COPY table FROM 'file': parse the CSV in parallel chunks, append the rows to
+// the data file, then rebuild the index bottom-up from the sorted keys. Any bad
+// row or duplicate ID truncates the file back and leaves the table unchanged;
+// either is reported with its line in the file.
+void copyFrom(Table* table, const char* path, int header) {
+    FILE* in = fopen(path, "rb");
+    if (!in) {
+        outputMessage("Error: Could not open '%s'!\n", path);
+        return;
+    }
+    
+    char* buf = (char*)malloc(COPY_BATCH_BYTES);
+    CopyChunk chunks[COPY_MAX_THREADS];
+    memset(chunks, 0, sizeof(chunks));
+    KeyOffset* keys = NULL;
+    long* lines = NULL;    // Line of each row appended, by its position in the file
+    long num_keys = 0;
+    long key_capacity = 0;
+    int threads = copyThreads();
+    int failed = 0;
+    long row_size = table->schema.row_size;
+    
+    // One field buffer per thread, as wide as the widest column
+    size_t field_cap = INT_FIELD_SIZE;
+    for (int i = 0; i < table->schema.num_columns; i++) {
+        if ((size_t)table->schema.columns[i].size > field_cap) field_cap = table->schema.columns[i].size;
+    }
+    for (int t = 0; t < COPY_MAX_THREADS && buf; t++) {
+        chunks[t].field_cap = field_cap + 1;
+        chunks[t].field = (char*)malloc(field_cap + 1);
+        if (!chunks[t].field) {
+            free(buf);
+            buf = NULL;
+        }
+    }
+    if (!buf) {
+        outputMessage("Error: Out of memory importing '%s'!\n", path);
+        for (int t = 0; t < COPY_MAX_THREADS; t++) free(chunks[t].field);
+        fclose(in);
+        return;
+    }
+    
+    lockFile(table->fd, 1);
+    long start_size = tableEnd(table);
+    long offset = start_size;
+    long line_base = 0;
+    long len = 0;
+    int at_eof = 0;
+    
+    while (!failed) {
+        if (!at_eof) {
+            size_t got = fread(buf + len, 1, COPY_BATCH_BYTES - len, in);
+            len += (long)got;
+            at_eof = (got == 0 || feof(in));
+        }
+        long skip = 0;
+        if (header) {
+            while (skip < len && buf[skip] != '\n') skip++;
+            if (skip == len && !at_eof) continue;
+            if (skip < len) skip++;
+            line_base = 1;
+            header = 0;
+        }
+        if (len - skip == 0) break;
+        
+        int parts = (int)((len - skip) / COPY_MIN_CHUNK) + 1;
+        if (parts > threads) parts = threads;
+        long bounds[COPY_MAX_THREADS + 1];
+        long usable = splitCopyInput(buf + skip, len - skip, at_eof, parts, bounds);
+        if (usable == 0) {
+            outputMessage("Error: Line %ld: Row does not fit in the import buffer (unterminated quote?)!\n",
+                          line_base + 1);
+            failed = 1;
+            break;
+        }
+        
+        for (int t = 0; t < parts; t++) {
+            chunks[t].table = table;
+            chunks[t].start = buf + skip + bounds[t];
+            chunks[t].end = buf + skip + bounds[t + 1];
+            chunks[t].count = 0;
+            chunks[t].lines = 0;
+            chunks[t].error_line = 0;
+        }
+#ifdef _WIN32
+        for (int t = 0; t < parts; t++) parseCopyChunk(&chunks[t]);
+#else
+        pthread_t tids[COPY_MAX_THREADS];
+        int started[COPY_MAX_THREADS] = {0};
+        for (int t = 1; t < parts; t++) {
+            started[t] = pthread_create(&tids[t], NULL, parseCopyChunk, &chunks[t]) == 0;
+        }
+        parseCopyChunk(&chunks[0]);
+        for (int t = 1; t < parts; t++) {
+            if (started[t]) {
+                pthread_join(tids[t], NULL);
+            } else {
+                parseCopyChunk(&chunks[t]);
+            }
+        }
+#endif
+        
+        for (int t = 0; t < parts && !failed; t++) {
+            CopyChunk* c = &chunks[t];
+            if (c->error_line) {
+                outputMessage("Error: Line %ld: %s!\n", line_base + c->error_line, c->error);
+                failed = 1;
+                break;
+            }
+            if (num_keys + c->count > key_capacity) {
+                long capacity = (num_keys + c->count) * 2;
+                KeyOffset* grown = (KeyOffset*)realloc(keys, capacity * sizeof(KeyOffset));
+                if (grown) keys = grown;
+                long* grown_lines = grown && !table->lsm ? (long*)realloc(lines, capacity * sizeof(long)) : NULL;
+                if (grown_lines) lines = grown_lines;
+                if (!grown || (!table->lsm && !grown_lines)) {
+                    outputMessage("Error: Out of memory importing '%s'!\n", path);
+                    failed = 1;
+                    break;
+                }
+                key_capacity = capacity;
+            }
+            if (table->lsm) {
+                failed = !copyLsmRows(table, c, line_base, keys, &num_keys);
+                line_base += c->lines;
+                continue;
+            }
+            if (!writeRows(table, offset, c->rows, c->count * row_size)) {
+                outputMessage("Error: Could not write to table file!\n");
+                failed = 1;
+                break;
+            }
+            for (long i = 0; i < c->count; i++) {
+                unsigned char key_buf[MAX_KEY_BYTES];
+                IndexKey key;
+                recordKey(table, (Record*)(c->rows + i * row_size), key_buf, &key);
+                keys[num_keys].key = copyKey(&key, key.len);
+                keys[num_keys].offset = offset;
+                lines[num_keys] = line_base + c->row_lines[i];
+                num_keys++;
+                offset += row_size;
+            }
+            line_base += c->lines;
+        }
+        
+        memmove(buf, buf + skip + usable, len - skip - usable);
+        len -= skip + usable;
+        if (at_eof && len == 0) break;
+    }
+    fclose(in);
+    free(buf);
+    for (int t = 0; t < COPY_MAX_THREADS; t++) {
+        free(chunks[t].rows);
+        free(chunks[t].row_lines);
+        free(chunks[t].field);
+    }
+    
+    if (table->lsm) {
+        finishLsmCopy(table, keys, num_keys, failed);
+        unlockFile(table->fd);
+        free(keys);
+        free(lines);
+        if (!failed) {
+            metricsAdd(METRIC_ROWS_WRITTEN, (uint64_t)num_keys);
+            outputMessage("Copied %ld rows into '%s'.\n", num_keys, table->schema.name);
+        }
+        return;
+    }
+    
+    // Merge the new keys into the existing index, rejecting duplicate IDs. A
+    // duplicate within the file is reported at its later line.
+    KeyOffset* merged = NULL;
+    long total = table->record_count + num_keys;
+    char text[256];
+    if (!failed) {
+        qsort(keys, num_keys, sizeof(KeyOffset), compareKeyOffsets);
+        for (long i = 1; i < num_keys; i++) {
+            if (compareKeys(&keys[i].key, &keys[i - 1].key) == 0) {
+                long line = lines[(keys[i].offset - start_size) / row_size];
+                long other = lines[(keys[i - 1].offset - start_size) / row_size];
+                formatKey(table, &keys[i].key, text, sizeof(text));
+                outputMessage("Error: Line %ld: Duplicate ID %s in '%s'!\n", line > other ? line : other, text, path);
+                failed = 1;
+                break;
+            }
+        }
+    }
+    if (!failed) {
+        merged = (KeyOffset*)malloc((total ? total : 1) * sizeof(KeyOffset));
+        if (!merged) {
+            outputMessage("Error: Out of memory importing '%s'!\n", path);
+            failed = 1;
+        }
+    }
+    if (!failed) {
+        long n = 0;
+        long i = 0;
+        for (BPTNode* leaf = findLeaf(table->root, NULL); leaf && !failed; leaf = leaf->next) {
+            for (int k = 0; k < leaf->num_keys; k++) {
+                while (i < num_keys && compareKeys(&keys[i].key, &leaf->keys[k]) < 0) merged[n++] = keys[i++];
+                if (i < num_keys && compareKeys(&keys[i].key, &leaf->keys[k]) == 0) {
+                    formatKey(table, &keys[i].key, text, sizeof(text));
+                    outputMessage("Error: Line %ld: Record with ID %s already exists!\n",
+                                  lines[(keys[i].offset - start_size) / row_size], text);
+                    failed = 1;
+                    break;
+                }
+                merged[n].key = leaf->keys[k];
+                merged[n].offset = leaf->offsets[k];
+                n++;
+            }
+        }
+        while (!failed && i < num_keys) merged[n++] = keys[i++];
+        if (!failed) {
+            // The merged entries take over the old leaves' keys
+            clearBPTree(table, 0);
+            bulkLoadBPTree(table, merged, n);
+            table->record_count += num_keys;
+            if (table->filter.counters && table->record_count >= table->filter.capacity) {
+                rebuildKeyFilter(table);
+            } else {
+                for (long k = 0; k < num_keys; k++) addKeyFilter(table, &keys[k].key);
+            }
+            table->version++;
+            if (n > 0) {
+                table->stats.min_head = merged[0].key.head;
+                table->stats.max_head = merged[n - 1].key.head;
+            }
+            noteTableGrowth(table, offset);
+        }
+    }
+    
+    if (failed && !truncateRows(table, start_size)) {
+        outputMessage("Error: Could not roll back '%s'!\n", table->schema.name);
+    }
+    unlockFile(table->fd);
+    for (long i = 0; failed && i < num_keys; i++) freeKey(&keys[i].key);
+    free(keys);
+    free(lines);
+    free(merged);
+    if (!failed) {
+        metricsAdd(METRIC_ROWS_WRITTEN, (uint64_t)num_keys);
+        outputMessage("Copied %ld rows into '%s'.\n", num_keys, table->schema.name);
+    }
+}
+
+// Row callback of COPY TO: one CSV line per row
+int copyToRow(void* ctx, Record* rec) {
+    CopyExport* ex = (CopyExport*)ctx;
+    TableSchema* schema = &ex->table->schema;
+    for (int i = 0; i < schema->num_columns; i++) {
+        if (i > 0) outputBytes(&ex->writer, ",", 1);
+        if (isIdColumn(schema, i)) {
+            outputInt(&ex->writer, rec->id);
+        } else {
+            outputCsvField(&ex->writer, fieldText(ex->table, rec, i));
+        }
+    }
+    outputBytes(&ex->writer, "\n", 1);
+    ex->rows++;
+    return 1;
+}
+
+// COPY table TO 'file': stream the leaf chain in key order as CSV
+void copyTo(Table* table, const char* path, int header) {
+    CopyExport ex;
+    memset(&ex, 0, sizeof(ex));
+    ex.table = table;
+    ex.writer.format = OUTPUT_CSV;
+    ex.writer.cap = OUTPUT_BUFFER_SIZE;
+    ex.writer.buf = (char*)malloc(ex.writer.cap);
+    ex.writer.out = fopen(path, "wb");
+    if (!ex.writer.buf || !ex.writer.out) {
+        outputMessage("Error: Could not open '%s' for writing!\n", path);
+        if (ex.writer.out) fclose(ex.writer.out);
+        free(ex.writer.buf);
+        return;
+    }
+    
+    if (header) {
+        for (int i = 0; i < table->schema.num_columns; i++) {
+            if (i > 0) outputBytes(&ex.writer, ",", 1);
+            outputCsvField(&ex.writer, table->schema.columns[i].name);
+        }
+        outputBytes(&ex.writer, "\n", 1);
     }
-    printf("\n--- Records in Range %d to %d ---\n", min_id, max_id);
-    BPTNode* leaf = table->root;
-    while (leaf && !leaf->is_leaf) leaf = leaf->children[0];
+    scanTable(table, NULL, NULL, ALL_COLUMNS, copyToRow, &ex);
+    flushWriter(&ex.writer);
     
-    int found = 0;
-    while (leaf) {
-        for (int i = 0; i < leaf->num_keys; i++) {
-            if (leaf->keys[i] >= min_id && leaf->keys[i] <= max_id) {
-                Record rec;
-                lockFile(table->fd, 0);
-                lseek(table->fd, leaf->offsets[i], SEEK_SET);
-                read(table->fd, &rec, sizeof(Record));
-                unlockFile(table->fd);
-                if (rec.id != 0) {
-                    displayRecord(table, &rec);
-                    found++;
-                }
-            }
-        }
-        leaf = leaf->next;
+    int failed = ferror(ex.writer.out);
+    if (fclose(ex.writer.out) != 0) failed = 1;
+    free(ex.writer.buf);
+    if (failed) {
+        outputMessage("Error: Could not write '%s'!\n", path);
+    } else {
+        outputMessage("Copied %ld rows to '%s'.\n", ex.rows, path);
     }
-    if (!found) printf("No records found.\n");
-    printf("--- End ---\n");
 }
 
-// Free B+-tree
-void freeBPTree(BPTNode* node) {
+// Whether any key or separator of the table can be longer than the 8 bytes
+// held inline: only those own heap tails
+int keysHaveTails(const TableSchema* schema) {
+    if (schema->key_in_id) return 0;
+    if (schema->num_key_columns > 1) return 1;
+    return valueType(schema->columns[schema->key_columns[0]].type) == VALUE_TEXT;
+}
+
+// Empty the table's B+-tree for a rebuild. Key tails are released (the leaf
+// keys only if the caller has not taken them over, leaf_keys = 0), then all
+// nodes go back to the arena at once.
+void clearBPTree(Table* table, int leaf_keys) {
+    if (keysHaveTails(&table->schema)) freeBPTreeKeys(table->root, leaf_keys);
+    resetNodeArena(&table->nodes);
+    table->root = NULL;
+}
+
+// Free B+-tree; without key tails this only releases the slabs
+void freeBPTree(Table* table) {
+    if (keysHaveTails(&table->schema)) freeBPTreeKeys(table->root, 1);
+    freeNodeArena(&table->nodes);
+    table->root = NULL;
+}
+
+// Free the separators of a B+-tree, and the leaf keys if leaf_keys is set
+void freeBPTreeKeys(BPTNode* node, int leaf_keys) {
     if (!node) return;
     if (!node->is_leaf) {
         for (int i = 0; i <= node->num_keys; i++) {
-            freeBPTree(node->children[i]);
+            freeBPTreeKeys(node->children[i], leaf_keys);
         }
     }
-    free(node);
+    if (!node->is_leaf || leaf_keys) {
+        for (int i = 0; i < node->num_keys; i++) freeKey(&node->keys[i]);
+    }
 }
 
 // Free database
 void freeDatabase(Database* db) {
     if (!db) return;
-    for (int i = 0; i < db->num_tables; i++) {
-        freeBPTree(db->tables[i].root);
-        close(db->tables[i].fd);
-    }
+    stopSlowLog();
+    configureResultCache(db, 0);
+    for (int i = 0; i < db->num_tables; i++) freeTable(db->tables[i]);
+    stopCheckpointer();
+    aioShutdown();
+    for (int i = 0; i < db->num_unopened; i++) free(db->unopened[i].columns);
+    free(db->unopened);
+    free(db->tables);
+    free(db->table_index);
     free(db->db_dir);
     free(db);
 }
 
+// Build the result cache key of a statement: the output format, then the text
+// with whitespace outside ' or " quoted literals collapsed and the trailing ';'
+// dropped. Only SELECT (1) and SHOW TABLES (2) are cached; returns 0 for
+// anything else.
+int resultCacheKey(const char* query, char* key, size_t size) {
+    static const char formats[] = "TBJC";
+    size_t n = 0;
+    char quote = 0;  // Quote character of the literal being copied, 0 outside one
+    key[n++] = formats[outputWriter()->format];
+    for (const char* p = query; *p; p++) {
+        char c = *p;
+        if (!quote && isspace((unsigned char)c)) {
+            if (n > 1 && key[n - 1] != ' ') c = ' ';
+            else continue;
+        }
+        if (!quote && (c == '\'' || c == '"')) quote = c;
+        else if (c == quote) quote = 0;
+        if (n + 1 >= size) return 0;
+        key[n++] = c;
+    }
+    while (n > 1 && (key[n - 1] == ' ' || key[n - 1] == ';')) n--;
+    key[n] = '\0';
+    
+    if (strncasecmp(key + 1, "SELECT ", 7) == 0) return 1;
+    return strcasecmp(key + 1, "SHOW TABLES") == 0 ? 2 : 0;
+}
+
+// Drop every entry; a capacity of 0 turns the cache off
+int configureResultCache(Database* db, size_t capacity) {
+    ResultCache* cache = &db->results;
+    clearResultCache(cache);
+    if (!capacity) {
+        free(cache->buckets);
+        cache->buckets = NULL;
+    } else if (!cache->buckets) {
+        cache->buckets = (CachedResult**)calloc(RESULT_CACHE_BUCKETS, sizeof(CachedResult*));
+        if (!cache->buckets) capacity = 0;
+    }
+    cache->capacity = capacity;
+    return capacity != 0;
+}
+
+void clearResultCache(ResultCache* cache) {
+    while (cache->head) evictCachedResult(cache, cache->head);
+}
+
+// Unlink an entry from its bucket and the LRU list and free it
+void evictCachedResult(ResultCache* cache, CachedResult* e) {
+    CachedResult** link = &cache->buckets[e->hash % RESULT_CACHE_BUCKETS];
+    while (*link != e) link = &(*link)->chain;
+    *link = e->chain;
+    if (e->prev) e->prev->next = e->next;
+    else cache->head = e->next;
+    if (e->next) e->next->prev = e->prev;
+    else cache->tail = e->prev;
+    cache->bytes -= sizeof(CachedResult) + strlen(e->key) + e->len;
+    free(e->key);
+    free(e->data);
+    free(e);
+}
+
+// Sum of the versions of the tables an entry was computed from
+uint64_t resultDataVersion(Database* db, const CachedResult* e) {
+    uint64_t version = 0;
+    if (e->num_tables < 0) {
+        for (int i = 0; i < db->num_tables; i++) version += db->tables[i]->version;
+    } else {
+        for (int i = 0; i < e->num_tables; i++) version += e->tables[i]->version;
+    }
+    return version;
+}
+
+// Insert a new entry as the most recently used, evicting from the tail to make room
+void storeCachedResult(ResultCache* cache, CachedResult* e) {
+    CachedResult** bucket = &cache->buckets[e->hash % RESULT_CACHE_BUCKETS];
+    e->chain = *bucket;
+    *bucket = e;
+    e->prev = NULL;
+    e->next = cache->head;
+    if (cache->head) cache->head->prev = e;
+    else cache->tail = e;
+    cache->head = e;
+    cache->bytes += sizeof(CachedResult) + strlen(e->key) + e->len;
+    while (cache->bytes > cache->capacity && cache->tail != e) evictCachedResult(cache, cache->tail);
+}
+
+// Answer a SELECT or SHOW TABLES from the result cache, or run it and keep what
+// it wrote. An entry is stale once the catalog or one of the tables it read has
+// changed since; stale entries are dropped when they are next looked up.
+// Returns 0 when the statement cannot be cached and has not been run.
+int cachedStatement(Database* db, char* query) {
+    ResultCache* cache = &db->results;
+    char key[MAX_QUERY + 2];
+    int kind = resultCacheKey(query, key, sizeof(key));
+    if (!kind) return 0;
+    unsigned long hash = hashJoinKey(key);
+    OutputWriter* w = outputWriter();
+    
+    CachedResult* e = cache->buckets[hash % RESULT_CACHE_BUCKETS];
+    while (e && (e->hash != hash || strcmp(e->key, key) != 0)) e = e->chain;
+    if (e && (e->schema_version != db->schema_version || resultDataVersion(db, e) != e->data_version)) {
+        evictCachedResult(cache, e);
+        e = NULL;
+    }
+    if (e) {
+        metricsAdd(METRIC_RESULT_HITS, 1);
+        if (cache->head != e) {
+            e->prev->next = e->next;
+            if (e->next) e->next->prev = e->prev;
+            else cache->tail = e->prev;
+            e->prev = NULL;
+            e->next = cache->head;
+            cache->head->prev = e;
+            cache->head = e;
+        }
+        flushWriter(w);
+        writeOut(w, e->data, e->len);
+        fflush(w->out);
+        return 1;
+    }
+    metricsAdd(METRIC_RESULT_MISSES, 1);
+    
+    e = (CachedResult*)calloc(1, sizeof(CachedResult));
+    if (!e) {
+        executeStatement(db, query);
+        return 1;
+    }
+    e->num_tables = (kind == 2) ? -1 : 0;
+    OutputCapture capture = {NULL, 0, 0, cache->capacity / 4, 0};
+    flushWriter(w);
+    w->capture = &capture;
+    result_deps = e;
+    executeStatement(db, query);
+    flushWriter(w);
+    w->capture = NULL;
+    result_deps = NULL;
+    
+    e->key = capture.failed ? NULL : strdup(key);
+    if (!e->key) {
+        free(capture.data);
+        free(e);
+        return 1;
+    }
+    e->hash = hash;
+    e->schema_version = db->schema_version;
+    e->data_version = resultDataVersion(db, e);
+    e->data = capture.data;
+    e->len = capture.len;
+    storeCachedResult(cache, e);
+    return 1;
+}
+
 // Process query
+// Run a statement, counting it and timing it for SHOW STATS
 void processQuery(Database* db, char* query) {
+    uint64_t start = profileClock();
+    uint64_t before[METRIC_COUNTERS];
+    int logging = __atomic_load_n(&slow_log.enabled, __ATOMIC_ACQUIRE);
+    if (logging) slowLogBegin(start, before);
+    if (!db->results.capacity || !cachedStatement(db, query)) executeStatement(db, query);
+    uint64_t nanos = profileClock() - start;
+    int type = statementType(query);
+    recordStatement(type, nanos);
+    if (logging) slowLogEnd(query, type, nanos, before);
+}
+
+void executeStatement(Database* db, char* query) {
     char query_copy[MAX_QUERY];
     strncpy(query_copy, query, MAX_QUERY - 1);
     query_copy[MAX_QUERY - 1] = '\0';
     
     char* token = strtok(query_copy, " \n;");
     if (!token) {
-        printf("Error: Empty query!\n");
+        outputMessage("Error: Empty query!\n");
         return;
     }
 
@@ -650,35 +9720,76 @@ void processQuery(Database* db, char* query) {
     if (strcmp(command, "CREATE") == 0) {
         token = strtok(NULL, " \n");
         if (!token || strcasecmp(token, "TABLE") != 0) {
-            printf("Error: Expected 'TABLE' after CREATE!\n");
+            outputMessage("Error: Expected 'TABLE' after CREATE!\n");
             return;
         }
         
         token = strtok(NULL, " (\n");
         if (!token) {
-            printf("Error: Expected table name!\n");
+            outputMessage("Error: Expected table name!\n");
             return;
         }
         char table_name[MAX_FIELD];
         strncpy(table_name, trim(token), MAX_FIELD - 1);
         
         // Parse columns
-        Column columns[MAX_COLUMNS];
+        Column* columns = (Column*)calloc(MAX_COLUMNS, sizeof(Column));
         int num_columns = 0;
-        int pk_index = 0;
+        char key_names[MAX_KEY_COLUMNS][MAX_FIELD];
+        int num_key_names = 0;
         
         token = strtok(NULL, "");
-        if (!token) {
-            printf("Error: Expected column definitions!\n");
+        if (!token || !columns) {
+            outputMessage("Error: Expected column definitions!\n");
+            free(columns);
             return;
         }
         
-        // Simple parsing: column_name type, column_name type, ...
+        // Simple parsing: column_name type [PRIMARY KEY], ..., [PRIMARY KEY (col, ...)]
         char* col_start = token;
-        while (*col_start && num_columns < MAX_COLUMNS) {
+        int valid = 1;
+        while (*col_start && valid) {
             while (*col_start && (isspace(*col_start) || *col_start == '(' || *col_start == ',')) col_start++;
             if (!*col_start || *col_start == ')') break;
             
+            // Table constraint naming the key columns in key order
+            if (startsWithKeyword(col_start, "PRIMARY")) {
+                char* p = col_start + 7;
+                while (isspace((unsigned char)*p)) p++;
+                if (!startsWithKeyword(p, "KEY") || num_key_names > 0) {
+                    outputMessage("Error: Invalid PRIMARY KEY clause!\n");
+                    valid = 0;
+                    break;
+                }
+                p += 3;
+                while (isspace((unsigned char)*p)) p++;
+                if (*p++ != '(') {
+                    outputMessage("Error: Expected '(' after PRIMARY KEY!\n");
+                    valid = 0;
+                    break;
+                }
+                while (valid) {
+                    while (isspace((unsigned char)*p) || *p == ',') p++;
+                    if (*p == ')' || !*p) break;
+                    if (num_key_names == MAX_KEY_COLUMNS) {
+                        outputMessage("Error: A primary key can have at most %d columns!\n", MAX_KEY_COLUMNS);
+                        valid = 0;
+                        break;
+                    }
+                    int j = 0;
+                    while (*p && !isspace((unsigned char)*p) && *p != ',' && *p != ')' && j < MAX_FIELD - 1) {
+                        key_names[num_key_names][j++] = *p++;
+                    }
+                    key_names[num_key_names++][j] = '\0';
+                }
+                if (valid && (*p != ')' || num_key_names == 0)) {
+                    outputMessage("Error: Invalid PRIMARY KEY clause!\n");
+                    valid = 0;
+                }
+                col_start = p + 1;
+                continue;
+            }
+            
             // Get column name
             char col_name[MAX_FIELD] = {0};
             int j = 0;
@@ -690,19 +9801,45 @@ void processQuery(Database* db, char* query) {
             // Skip whitespace
             while (*col_start && isspace(*col_start)) col_start++;
             
-            // Get type
-            char col_type[20] = {0};
+            // Get type, with an optional (length)
+            char col_type[32] = {0};
             j = 0;
-            while (*col_start && !isspace(*col_start) && *col_start != ',' && *col_start != ')' && j < 19) {
-                col_type[j++] = toupper(*col_start++);
+            while (*col_start && *col_start != ',' && *col_start != ')' && j < 31) {
+                if (*col_start == '(') {
+                    while (*col_start && *col_start != ')' && j < 31) col_type[j++] = *col_start++;
+                    if (*col_start == ')' && j < 31) col_type[j++] = *col_start++;
+                    break;
+                }
+                if (isspace(*col_start) && col_start[strspn(col_start, " \t")] != '(') break;
+                col_type[j++] = *col_start++;
             }
             col_type[j] = '\0';
             
-            strncpy(columns[num_columns].name, col_name, MAX_FIELD - 1);
-            strncpy(columns[num_columns].type, col_type, 19);
-            columns[num_columns].size = MAX_FIELD;
+            if (num_columns == MAX_COLUMNS) {
+                outputMessage("Error: A table can have at most %d columns!\n", MAX_COLUMNS);
+                valid = 0;
+                break;
+            }
+            snprintf(columns[num_columns].name, MAX_FIELD, "%s", col_name);
+            if (!parseColumnType(col_type, &columns[num_columns])) {
+                outputMessage("Error: Invalid type '%s' for column '%s'!\n", col_type, col_name);
+                valid = 0;
+                break;
+            }
+            
             
-            if (num_columns == 0) pk_index = 0; // First column is PK
+            // Inline PRIMARY KEY; without one the first column is the key
+            while (isspace((unsigned char)*col_start)) col_start++;
+            if (startsWithKeyword(col_start, "PRIMARY")) {
+                char* p = col_start + 7;
+                while (isspace((unsigned char)*p)) p++;
+                if (!startsWithKeyword(p, "KEY") || num_key_names > 0) {
+                    outputMessage("Error: Invalid PRIMARY KEY clause!\n");
+                    valid = 0;
+                    break;
+                }
+                strcpy(key_names[num_key_names++], col_name);
+            }
             
             num_columns++;
             
@@ -710,24 +9847,91 @@ void processQuery(Database* db, char* query) {
             while (*col_start && *col_start != ',' && *col_start != ')') col_start++;
         }
         
-        if (num_columns > 0) {
-            createTable(db, table_name, columns, num_columns, pk_index);
-        } else {
-            printf("Error: No columns defined!\n");
+        int key_columns[MAX_KEY_COLUMNS] = {0};
+        int num_key_columns = num_key_names > 0 ? num_key_names : 1;
+        int key_bytes = 0;
+        for (int k = 0; valid && k < num_key_names; k++) {
+            key_columns[k] = -1;
+            for (int c = 0; c < num_columns; c++) {
+                if (strcasecmp(columns[c].name, key_names[k]) == 0) key_columns[k] = c;
+            }
+            for (int m = 0; m < k && key_columns[k] >= 0; m++) {
+                if (key_columns[m] == key_columns[k]) key_columns[k] = -1;
+            }
+            if (key_columns[k] < 0) {
+                outputMessage("Error: Invalid primary key column '%s'!\n", key_names[k]);
+                valid = 0;
+            }
+        }
+        for (int k = 0; valid && num_columns > 0 && k < num_key_columns; k++) {
+            Column* column = &columns[key_columns[k]];
+            key_bytes += valueType(column->type) == VALUE_TEXT ? column->size : 8;
+        }
+        if (valid && key_bytes > MAX_KEY_BYTES) {
+            outputMessage("Error: The primary key is longer than %d bytes!\n", MAX_KEY_BYTES);
+            valid = 0;
+        }
+        
+        // Table options after the column list, in any order
+        int compression = COMPRESSION_NONE;
+        int engine = ENGINE_HEAP;
+        char* p = valid && *col_start == ')' ? col_start + 1 : NULL;
+        while (p) {
+            while (isspace((unsigned char)*p)) p++;
+            int is_compression = startsWithKeyword(p, "COMPRESSION");
+            if (!is_compression && !startsWithKeyword(p, "ENGINE")) break;
+            p += is_compression ? 11 : 6;
+            while (isspace((unsigned char)*p)) p++;
+            char name[MAX_FIELD];
+            int j = 0;
+            while (*p && !isspace((unsigned char)*p) && *p != ';' && j < MAX_FIELD - 1) name[j++] = *p++;
+            name[j] = '\0';
+            if (is_compression && strcasecmp(name, "LZ4") == 0) {
+                compression = COMPRESSION_LZ4;
+            } else if (is_compression && strcasecmp(name, "NONE") == 0) {
+                compression = COMPRESSION_NONE;
+            } else if (is_compression) {
+                outputMessage("Error: Unknown compression '%s', expected LZ4 or NONE!\n", name);
+                valid = 0;
+                break;
+            } else if (strcasecmp(name, "LSM") == 0) {
+                engine = ENGINE_LSM;
+            } else if (strcasecmp(name, "HEAP") == 0) {
+                engine = ENGINE_HEAP;
+            } else {
+                outputMessage("Error: Unknown engine '%s', expected HEAP or LSM!\n", name);
+                valid = 0;
+                break;
+            }
+        }
+        if (valid && engine == ENGINE_LSM && compression != COMPRESSION_NONE) {
+            outputMessage("Error: LSM tables cannot be compressed!\n");
+            valid = 0;
+        }
+        
+        if (valid && num_columns > 0) {
+            createTable(db, table_name, columns, num_columns, key_columns, num_key_columns, compression, engine);
+        } else if (valid) {
+            outputMessage("Error: No columns defined!\n");
         }
+        free(columns);
     }
     else if (strcmp(command, "SHOW") == 0) {
-        token = strtok(NULL, " \n");
-        if (!token || strcasecmp(token, "TABLES") != 0) {
-            printf("Error: Expected 'TABLES' after SHOW!\n");
-            return;
+        token = strtok(NULL, " \n;");
+        if (token && strcasecmp(token, "TABLES") == 0) {
+            listTables(db);
+        } else if (token && strcasecmp(token, "STATS") == 0) {
+            showStats(db);
+        } else if (token && strcasecmp(token, "METRICS") == 0) {
+            showMetrics(db);
+        } else {
+            outputMessage("Error: Expected TABLES, STATS or METRICS after SHOW!\n");
         }
-        listTables(db);
     }
     else if (strcmp(command, "DESCRIBE") == 0 || strcmp(command, "DESC") == 0) {
-        token = strtok(NULL, " \n");
+        token = strtok(NULL, " \n;");
         if (!token) {
-            printf("Error: Expected table name!\n");
+            outputMessage("Error: Expected table name!\n");
             return;
         }
         describeTable(db, token);
@@ -735,12 +9939,12 @@ void processQuery(Database* db, char* query) {
     else if (strcmp(command, "INSERT") == 0) {
         token = strtok(NULL, " \n");
         if (!token || strcasecmp(token, "INTO") != 0) {
-            printf("Error: Expected 'INTO' after INSERT!\n");
+            outputMessage("Error: Expected 'INTO' after INSERT!\n");
             return;
         }
         token = strtok(NULL, " \n");
         if (!token) {
-            printf("Error: Expected table name!\n");
+            outputMessage("Error: Expected table name!\n");
             return;
         }
         char table_name[MAX_FIELD];
@@ -748,143 +9952,479 @@ void processQuery(Database* db, char* query) {
         
         Table* table = findTable(db, table_name);
         if (!table) {
-            printf("Error: Table '%s' not found!\n", table_name);
+            outputMessage("Error: Table '%s' not found!\n", table_name);
             return;
         }
         
         token = strtok(NULL, " \n");
         if (!token || strcasecmp(token, "VALUES") != 0) {
-            printf("Error: Expected 'VALUES'!\n");
+            outputMessage("Error: Expected 'VALUES'!\n");
             return;
         }
         
         token = strtok(NULL, "");
         if (!token) {
-            printf("Error: Expected values!\n");
+            outputMessage("Error: Expected values!\n");
             return;
         }
         
-        Record rec = {0};
+        Record* rec = allocRecord(table);
+        if (!rec) {
+            outputMessage("Error: Out of memory!\n");
+            return;
+        }
         
-        // Parse ID
+        // Parse the values in column order
         char* val_start = token;
+        int col_idx = 0;
+        int valid = 1;
         while (*val_start && (*val_start == ' ' || *val_start == '(')) val_start++;
-        rec.id = atoi(val_start);
         
-        // Parse other values
-        int col_idx = 1;
-        while (*val_start && *val_start != ',') val_start++;
-        if (*val_start == ',') val_start++;
-        
-        while (*val_start && col_idx < table->schema.num_columns) {
+        while (*val_start && col_idx < table->schema.num_columns && valid) {
             while (*val_start && (isspace(*val_start) || *val_start == ',')) val_start++;
             
+            char* value = val_start;
+            size_t len;
             if (*val_start == '\'' || *val_start == '\"') {
                 char quote = *val_start++;
-                int j = 0;
-                while (*val_start && *val_start != quote && j < MAX_FIELD - 1) {
-                    rec.data[col_idx][j++] = *val_start++;
-                }
-                rec.data[col_idx][j] = '\0';
+                value = val_start;
+                while (*val_start && *val_start != quote) val_start++;
+                len = val_start - value;
                 if (*val_start == quote) val_start++;
             } else {
-                int j = 0;
-                while (*val_start && *val_start != ',' && *val_start != ')' && j < MAX_FIELD - 1) {
-                    if (!isspace(*val_start)) {
-                        rec.data[col_idx][j++] = *val_start;
-                    }
-                    val_start++;
+                while (*val_start && *val_start != ',' && *val_start != ')') val_start++;
+                len = val_start - value;
+                while (len > 0 && isspace((unsigned char)value[len - 1])) len--;
+            }
+            if (isIdColumn(&table->schema, col_idx)) {
+                unsigned char key[8];
+                valid = encodeKeyValue(table, col_idx, value, len, key) > 0;
+                if (valid) {
+                    rec->id = (int)strtol(value, NULL, 10);
+                } else {
+                    outputMessage("Error: Invalid ID value!\n");
                 }
-                rec.data[col_idx][j] = '\0';
+            } else {
+                valid = storeField(table, rec, col_idx, value, len);
             }
             col_idx++;
         }
         
-        insertRecord(db, table_name, &rec);
+        if (valid) insertRecord(table, rec);
+        free(rec);
     }
     else if (strcmp(command, "SELECT") == 0) {
+        // Collect the select list ("*" or "col1, col2, ...") up to FROM
+        char select_list[MAX_QUERY] = "";
         token = strtok(NULL, " \n");
-        if (!token || strcmp(token, "*") != 0) {
-            printf("Error: Expected '*'!\n");
+        while (token && strcasecmp(token, "FROM") != 0) {
+            strncat(select_list, token, sizeof(select_list) - strlen(select_list) - 2);
+            strcat(select_list, " ");
+            token = strtok(NULL, " \n");
+        }
+        if (!select_list[0]) {
+            outputMessage("Error: Expected '*' or a column list!\n");
             return;
         }
-        token = strtok(NULL, " \n");
-        if (!token || strcasecmp(token, "FROM") != 0) {
-            printf("Error: Expected 'FROM'!\n");
+        if (!token) {
+            outputMessage("Error: Expected 'FROM'!\n");
             return;
         }
-        token = strtok(NULL, " \n");
+        token = strtok(NULL, " \n;");
         if (!token) {
-            printf("Error: Expected table name!\n");
+            outputMessage("Error: Expected table name!\n");
             return;
         }
         
         char table_name[MAX_FIELD];
         strncpy(table_name, token, MAX_FIELD - 1);
+        table_name[MAX_FIELD - 1] = '\0';
         
         Table* table = findTable(db, table_name);
         if (!table) {
-            printf("Error: Table '%s' not found!\n", table_name);
+            outputMessage("Error: Table '%s' not found!\n", table_name);
             return;
         }
         
-        token = strtok(NULL, " \n");
-        if (!token) {
-            selectAllRecords(table);
-        } else if (strcasecmp(token, "WHERE") == 0) {
-            token = strtok(NULL, " \n");
-            if (!token || strcasecmp(token, "id") != 0) {
-                printf("Error: Expected 'id'!\n");
+        SelectQuery q;
+        initSelectQuery(&q, table);
+        
+        token = strtok(NULL, " \n;");
+        if (token && strcasecmp(token, "INNER") == 0) token = strtok(NULL, " \n;");
+        if (token && strcasecmp(token, "JOIN") == 0) {
+            token = strtok(NULL, " \n;");
+            if (!token) {
+                outputMessage("Error: Expected table name after JOIN!\n");
+                return;
+            }
+            q.tables[1] = findTable(db, token);
+            if (!q.tables[1]) {
+                outputMessage("Error: Table '%s' not found!\n", token);
                 return;
             }
+            q.num_tables = 2;
+            
             token = strtok(NULL, " \n");
-            if (!token) {
-                printf("Error: Expected condition!\n");
+            if (!token || strcasecmp(token, "ON") != 0) {
+                outputMessage("Error: Expected 'ON'!\n");
                 return;
             }
-            if (strcasecmp(token, "=") == 0) {
-                token = strtok(NULL, " ;\n");
-                if (!token) {
-                    printf("Error: Expected ID value!\n");
+            char* on = strtok(NULL, "");
+            if (!on) {
+                outputMessage("Error: Expected join condition!\n");
+                return;
+            }
+            
+            // Split "a.x = b.y [WHERE ...] [ORDER BY ...] [LIMIT n]" after the condition
+            char* clause = NULL;
+            const char* clause_words[] = {"WHERE", "ORDER", "LIMIT"};
+            for (int k = 0; k < 3; k++) {
+                char* pos = findKeyword(on, clause_words[k]);
+                if (pos && (!clause || pos < clause)) clause = pos;
+            }
+            if (clause && clause > on) *(clause - 1) = '\0';
+            char* eq = strchr(on, '=');
+            if (!eq || (clause && eq > clause)) {
+                outputMessage("Error: Expected '=' in join condition!\n");
+                return;
+            }
+            *eq = '\0';
+            char* rhs = trim(eq + 1);
+            rhs[strcspn(rhs, " ;\n")] = '\0';
+            if (!resolveColumn(&q, trim(on), &q.join_on[0]) ||
+                !resolveColumn(&q, rhs, &q.join_on[1])) {
+                return;
+            }
+            if (q.join_on[0].side == q.join_on[1].side) {
+                outputMessage("Error: Join condition must compare columns of both tables!\n");
+                return;
+            }
+            if (q.join_on[0].side == 1) {
+                ColumnRef tmp = q.join_on[0];
+                q.join_on[0] = q.join_on[1];
+                q.join_on[1] = tmp;
+            }
+            token = clause ? strtok(clause, " \n;") : NULL;
+        }
+        
+        // Resolve the select list now that the tables are known
+        if (strcmp(trim(select_list), "*") != 0) {
+            char* name = select_list;
+            while (name) {
+                char* comma = strchr(name, ',');
+                if (comma) *comma = '\0';
+                name = trim(name);
+                if (!*name || strcmp(name, "*") == 0) {
+                    outputMessage("Error: Expected '*' or a column list!\n");
                     return;
                 }
-                int id = atoi(token);
-                Record* rec = findRecord(table, id);
-                if (rec) {
-                    printf("\n--- Result ---\n");
-                    displayRecord(table, rec);
-                    printf("--- End ---\n");
-                } else {
-                    printf("No records found.\n");
-                }
-            } else if (strcasecmp(token, "BETWEEN") == 0) {
-                token = strtok(NULL, " \n");
-                if (!token) {
-                    printf("Error: Expected min ID!\n");
+                if (q.num_columns >= MAX_SELECT_COLUMNS) {
+                    outputMessage("Error: Too many columns selected!\n");
                     return;
                 }
-                int min_id = atoi(token);
+                if (!resolveSelectColumn(&q, name, &q.columns[q.num_columns])) return;
+                q.num_columns++;
+                name = comma ? comma + 1 : NULL;
+            }
+        }
+        
+        int point = 0;
+        int failed = 0;
+        while (token) {
+            if (strcasecmp(token, "WHERE") == 0) {
+                char* rest = strtok(NULL, "");
+                if (!rest) {
+                    outputMessage("Error: Expected 'id'!\n");
+                    failed = 1;
+                    break;
+                }
+                rest = parseCondition(&q, rest, &point);
+                if (!rest) {
+                    failed = 1;
+                    break;
+                }
+                token = strtok(rest, " \n;");
+                continue;
+            } else if (strcasecmp(token, "ORDER") == 0) {
                 token = strtok(NULL, " \n");
-                if (!token || strcasecmp(token, "AND") != 0) {
-                    printf("Error: Expected 'AND'!\n");
-                    return;
+                if (!token || strcasecmp(token, "BY") != 0) {
+                    outputMessage("Error: Expected 'BY' after ORDER!\n");
+                    failed = 1;
+                    break;
                 }
-                token = strtok(NULL, " ;\n");
+                token = strtok(NULL, " ,\n;");
                 if (!token) {
-                    printf("Error: Expected max ID!\n");
+                    outputMessage("Error: Expected ORDER BY column!\n");
+                    failed = 1;
+                    break;
+                }
+                if (!resolveSelectColumn(&q, token, &q.order_by)) {
+                    failed = 1;
+                    break;
+                }
+                q.has_order = 1;
+            } else if (strcasecmp(token, "ASC") == 0 || strcasecmp(token, "DESC") == 0) {
+                if (!q.has_order) {
+                    outputMessage("Error: Unexpected '%s'!\n", token);
+                    failed = 1;
+                    break;
+                }
+                q.order_desc = (toupper(token[0]) == 'D');
+            } else if (strcasecmp(token, "LIMIT") == 0) {
+                token = strtok(NULL, " \n;");
+                char* end;
+                q.limit = token ? strtol(token, &end, 10) : -1;
+                if (!token || *end || q.limit < 0) {
+                    outputMessage("Error: Expected a non-negative LIMIT!\n");
+                    failed = 1;
+                    break;
+                }
+            } else {
+                outputMessage("Error: Unexpected '%s'!\n", token);
+                failed = 1;
+                break;
+            }
+            token = strtok(NULL, " \n;");
+        }
+        
+        statement_parsed = profileClock();
+        if (active_profile) {
+            active_profile->exec_start = statement_parsed;
+            outputWriter()->discard = !failed;
+        }
+        if (failed) {
+            // The error has been reported
+        } else if (explain_mode == EXPLAIN_PLAN) {
+            explainSelect(&q, point);
+        } else if (point && q.num_tables == 1) {
+            Record* buf = allocRecord(table);
+            int prev = profileEnter(PROF_SCAN);
+            const Record* rec = q.limit != 0 && buf ? findRecord(table, &q.key_lo, buf) : NULL;
+            profileLeave(prev);
+            profileRows(PROF_SCAN, rec != NULL);
+            if (rec || outputWriter()->format != OUTPUT_TABLE) {
+                Record* rows[2] = {(Record*)rec, NULL};
+                ResultColumn columns[MAX_SELECT_COLUMNS];
+                beginResult("Result", columns, planOutput(&q, columns));
+                if (rec) displaySelectRow(&q, rows);
+                endResult();
+            } else {
+                outputMessage("No records found.\n");
+            }
+            releaseRecord(table, rec, buf);
+            free(buf);
+        } else {
+            executeSelect(&q);
+        }
+        if (active_profile) {
+            outputWriter()->discard = 0;
+            profileEnter(PROF_STATEMENT);
+            if (!failed) explainSelect(&q, point);
+        } else if (!failed && explain_mode == EXPLAIN_NONE && slowLogWants()) {
+            captureSelectPlan(&q, point);
+        }
+        freeSelectQuery(&q);
+    }
+    else if (strcmp(command, "EXPLAIN") == 0) {
+        explainQuery(db, query + (token - query_copy) + strlen(token));
+    }
+    else if (strcmp(command, "SET") == 0) {
+        token = strtok(NULL, " \n;");
+        if (token && strcasecmp(token, "SLOWLOG") == 0) {
+            token = strtok(NULL, " \n;");
+            if (token && strcasecmp(token, "OFF") == 0) {
+                configureSlowLog(db, -1, 0);
+                outputMessage("Slow query log disabled.\n");
+                return;
+            }
+            char* end = NULL;
+            double threshold = token ? strtod(token, &end) : -1;
+            if (!token || *end || threshold < 0) {
+                outputMessage("Error: Expected OFF or a threshold in milliseconds!\n");
+                return;
+            }
+            double sample = 0;
+            token = strtok(NULL, " \n;");
+            if (token && strcasecmp(token, "SAMPLE") == 0) {
+                token = strtok(NULL, " \n;");
+                sample = token ? strtod(token, &end) : -1;
+                if (!token || *end || sample < 0 || sample > 1) {
+                    outputMessage("Error: Expected a SAMPLE rate between 0 and 1!\n");
                     return;
                 }
-                int max_id = atoi(token);
-                selectRecords(table, min_id, max_id);
+            } else if (token) {
+                outputMessage("Error: Unexpected '%s'!\n", token);
+                return;
+            }
+            if (!configureSlowLog(db, threshold, sample)) {
+                outputMessage("Error: Out of memory starting the slow query log!\n");
+                return;
+            }
+            if (sample > 0) {
+                outputMessage("Logging statements over %g ms and %g%% of the rest to '%s'.\n",
+                              threshold, sample * 100, slow_log.path);
+            } else {
+                outputMessage("Logging statements over %g ms to '%s'.\n", threshold, slow_log.path);
+            }
+            return;
+        }
+        if (token && strcasecmp(token, "CACHE") == 0) {
+            token = strtok(NULL, " \n;");
+            if (token && strcasecmp(token, "OFF") == 0) {
+                configureResultCache(db, 0);
+                outputMessage("Result cache disabled.\n");
+                return;
+            }
+            char* end = NULL;
+            double megabytes = token ? strtod(token, &end) : -1;
+            if (!token || *end || megabytes <= 0 || megabytes > 1024 * 1024) {
+                outputMessage("Error: Expected OFF or a size in megabytes!\n");
+                return;
+            }
+            if (!configureResultCache(db, (size_t)(megabytes * 1024 * 1024))) {
+                outputMessage("Error: Out of memory starting the result cache!\n");
+                return;
+            }
+            outputMessage("Caching up to %g MB of query results.\n", megabytes);
+            return;
+        }
+        if (token && strcasecmp(token, "OUTPUT") == 0) {
+            token = strtok(NULL, " \n;");
+            if (token && strcasecmp(token, "BINARY") == 0) {
+                setOutputFormat(OUTPUT_BINARY);
+            } else if (token && strcasecmp(token, "JSON") == 0) {
+                setOutputFormat(OUTPUT_JSON);
+            } else if (token && strcasecmp(token, "CSV") == 0) {
+                setOutputFormat(OUTPUT_CSV);
+            } else if (token && strcasecmp(token, "TABLE") == 0) {
+                setOutputFormat(OUTPUT_TABLE);
             } else {
-                printf("Error: Unsupported condition!\n");
+                outputMessage("Error: Expected TABLE, BINARY, JSON or CSV!\n");
+            }
+            return;
+        }
+        if (!token || strcasecmp(token, "IO") != 0) {
+            outputMessage("Error: Expected 'IO', 'OUTPUT', 'SLOWLOG' or 'CACHE' after SET!\n");
+            return;
+        }
+        token = strtok(NULL, " \n;");
+        if (token && strcasecmp(token, "MMAP") == 0) {
+            setIoMode(db, IO_MMAP);
+        } else if (token && strcasecmp(token, "URING") == 0) {
+            setIoMode(db, IO_URING);
+        } else if (token && strcasecmp(token, "SYSCALL") == 0) {
+            setIoMode(db, IO_SYSCALL);
+        } else {
+            outputMessage("Error: Expected SYSCALL, URING or MMAP!\n");
+        }
+    }
+    else if (strcmp(command, "COPY") == 0) {
+        token = strtok(NULL, " \n");
+        if (!token) {
+            outputMessage("Error: Expected table name!\n");
+            return;
+        }
+        Table* table = findTable(db, token);
+        if (!table) {
+            outputMessage("Error: Table '%s' not found!\n", token);
+            return;
+        }
+        
+        token = strtok(NULL, " \n");
+        int from = token && strcasecmp(token, "FROM") == 0;
+        if (!token || (!from && strcasecmp(token, "TO") != 0)) {
+            outputMessage("Error: Expected FROM or TO!\n");
+            return;
+        }
+        
+        char* rest = strtok(NULL, "");
+        while (rest && isspace(*rest)) rest++;
+        if (!rest || (*rest != '\'' && *rest != '"')) {
+            outputMessage("Error: Expected a quoted file name!\n");
+            return;
+        }
+        char* close_quote = strchr(rest + 1, *rest);
+        if (!close_quote) {
+            outputMessage("Error: Unterminated file name!\n");
+            return;
+        }
+        *close_quote = '\0';
+        char* path = rest + 1;
+        
+        char* option = strtok(close_quote + 1, " \n;");
+        int header = option && strcasecmp(option, "HEADER") == 0;
+        if (option && !header) {
+            outputMessage("Error: Unexpected '%s'!\n", option);
+            return;
+        }
+        
+        if (from) {
+            copyFrom(table, path, header);
+            encodeColumns(db, table, 0);
+        } else {
+            copyTo(table, path, header);
+        }
+    }
+    else if (strcmp(command, "DROP") == 0) {
+        token = strtok(NULL, " \n");
+        if (!token || strcasecmp(token, "TABLE") != 0) {
+            outputMessage("Error: Expected 'TABLE' after DROP!\n");
+            return;
+        }
+        token = strtok(NULL, " \n;");
+        if (!token) {
+            outputMessage("Error: Expected table name!\n");
+            return;
+        }
+        dropTable(db, token);
+    }
+    else if (strcmp(command, "ALTER") == 0) {
+        token = strtok(NULL, " \n");
+        if (!token || strcasecmp(token, "TABLE") != 0) {
+            outputMessage("Error: Expected 'TABLE' after ALTER!\n");
+            return;
+        }
+        token = strtok(NULL, " \n");
+        Table* table = token ? findTable(db, token) : NULL;
+        if (!table) {
+            outputMessage("Error: Table '%s' not found!\n", token ? token : "");
+            return;
+        }
+        token = strtok(NULL, " \n;");
+        if (token && strcasecmp(token, "ENCODE") == 0) {
+            int encoded = encodeColumns(db, table, 1);
+            if (encoded > 0) {
+                outputMessage("Encoded %d column(s) of '%s'.\n", encoded, table->schema.name);
+            } else if (encoded == 0) {
+                outputMessage("No columns of '%s' to encode.\n", table->schema.name);
             }
+            return;
         }
+        if (!token || strcasecmp(token, "ADD") != 0) {
+            outputMessage("Error: Expected 'ADD' or 'ENCODE'!\n");
+            return;
+        }
+        token = strtok(NULL, " \n;");
+        if (token && strcasecmp(token, "COLUMN") == 0) token = strtok(NULL, " \n;");
+        char* type = strtok(NULL, "\n;");
+        if (!token || !type) {
+            outputMessage("Error: Expected column name and type!\n");
+            return;
+        }
+        
+        Column column;
+        memset(&column, 0, sizeof(column));
+        strncpy(column.name, token, MAX_FIELD - 1);
+        if (!parseColumnType(trim(type), &column)) {
+            outputMessage("Error: Invalid type '%s' for column '%s'!\n", type, column.name);
+            return;
+        }
+        addColumn(db, table, &column);
     }
     else if (strcmp(command, "UPDATE") == 0) {
         token = strtok(NULL, " \n");
         if (!token) {
-            printf("Error: Expected table name!\n");
+            outputMessage("Error: Expected table name!\n");
             return;
         }
         char table_name[MAX_FIELD];
@@ -892,125 +10432,107 @@ void processQuery(Database* db, char* query) {
         
         Table* table = findTable(db, table_name);
         if (!table) {
-            printf("Error: Table '%s' not found!\n", table_name);
+            outputMessage("Error: Table '%s' not found!\n", table_name);
             return;
         }
         
         token = strtok(NULL, " \n");
         if (!token || strcasecmp(token, "SET") != 0) {
-            printf("Error: Expected 'SET'!\n");
+            outputMessage("Error: Expected 'SET'!\n");
             return;
         }
         
-        Record rec = {0};
-        int id = -1;
-        
         token = strtok(NULL, "");
         if (!token) {
-            printf("Error: Expected SET values!\n");
+            outputMessage("Error: Expected SET values!\n");
             return;
         }
         
-        // Parse SET clause
-        for (int col = 1; col < table->schema.num_columns; col++) {
+        Record* rec = allocRecord(table);
+        if (!rec) {
+            outputMessage("Error: Out of memory!\n");
+            return;
+        }
+        
+        // Split off the WHERE clause, then parse the SET clause; key columns
+        // cannot be changed
+        char* where_pos = findKeyword(token, "WHERE");
+        if (where_pos) *where_pos = '\0';
+        for (int col = 0; col < table->schema.num_columns; col++) {
+            if (isKeyColumn(&table->schema, col)) continue;
             char* col_pos = stristr(token, table->schema.columns[col].name);
             if (col_pos) {
                 char* eq = strchr(col_pos, '=');
                 if (eq) {
                     eq++;
                     while (*eq && isspace(*eq)) eq++;
+                    char* value = eq;
+                    size_t len;
                     if (*eq == '\'' || *eq == '\"') {
                         char quote = *eq++;
-                        int j = 0;
-                        while (*eq && *eq != quote && j < MAX_FIELD - 1) {
-                            rec.data[col][j++] = *eq++;
-                        }
-                        rec.data[col][j] = '\0';
+                        value = eq;
+                        while (*eq && *eq != quote) eq++;
                     } else {
-                        int j = 0;
-                        while (*eq && *eq != ',' && !isspace(*eq) && j < MAX_FIELD - 1) {
-                            rec.data[col][j++] = *eq++;
-                        }
-                        rec.data[col][j] = '\0';
+                        while (*eq && *eq != ',' && !isspace(*eq)) eq++;
+                    }
+                    len = eq - value;
+                    if (!storeField(table, rec, col, value, len)) {
+                        free(rec);
+                        return;
                     }
                 }
             }
         }
         
         // Parse WHERE clause
-        char* where_pos = stristr(token, "WHERE");
-        if (where_pos) {
-            char* id_pos = stristr(where_pos, "id");
-            if (id_pos) {
-                char* eq = strchr(id_pos, '=');
-                if (eq) {
-                    eq++;
-                    id = atoi(eq);
-                }
-            }
-        }
-        
-        if (id == -1) {
-            printf("Error: Invalid UPDATE syntax!\n");
-            return;
+        unsigned char key_buf[MAX_KEY_BYTES];
+        IndexKey key;
+        if (!where_pos) {
+            outputMessage("Error: Invalid UPDATE syntax!\n");
+        } else if (parseKeyEquals(table, where_pos + 5, key_buf, &key)) {
+            updateRecord(table, &key, rec);
         }
-        
-        updateRecord(db, table_name, id, &rec);
+        free(rec);
     }
     else if (strcmp(command, "DELETE") == 0) {
         token = strtok(NULL, " \n");
         if (!token || strcasecmp(token, "FROM") != 0) {
-            printf("Error: Expected 'FROM'!\n");
+            outputMessage("Error: Expected 'FROM'!\n");
             return;
         }
         token = strtok(NULL, " \n");
         if (!token) {
-            printf("Error: Expected table name!\n");
+            outputMessage("Error: Expected table name!\n");
+            return;
+        }
+        Table* table = findTable(db, token);
+        if (!table) {
+            outputMessage("Error: Table '%s' not found!\n", token);
             return;
         }
-        char table_name[MAX_FIELD];
-        strncpy(table_name, token, MAX_FIELD - 1);
         
         token = strtok(NULL, "");
         if (!token) {
-            printf("Error: Expected WHERE clause!\n");
+            outputMessage("Error: Expected WHERE clause!\n");
             return;
         }
         
         char* where_pos = stristr(token, "WHERE");
         if (!where_pos) {
-            printf("Error: Expected 'WHERE'!\n");
-            return;
-        }
-        
-        char* id_pos = stristr(where_pos, "id");
-        if (!id_pos) {
-            printf("Error: Expected 'id'!\n");
-            return;
-        }
-        
-        char* eq = strchr(id_pos, '=');
-        if (!eq) {
-            printf("Error: Expected '='!\n");
-            return;
-        }
-        
-        eq++;
-        while (*eq && isspace(*eq)) eq++;
-        
-        int id = atoi(eq);
-        if (id == 0 && *eq != '0') {
-            printf("Error: Invalid ID value!\n");
+            outputMessage("Error: Expected 'WHERE'!\n");
             return;
         }
         
-        deleteRecord(db, table_name, id);
+        unsigned char key_buf[MAX_KEY_BYTES];
+        IndexKey key;
+        if (parseKeyEquals(table, where_pos + 5, key_buf, &key)) deleteRecord(table, &key);
     }
     else {
-        printf("Error: Unknown command '%s'!\n", command);
+        outputMessage("Error: Unknown command '%s'!\n", command);
     }
 }
 
+#ifndef SOUMYADB_NO_MAIN
 int main() {
     Database* db = createDatabase("dbms_data");
     if (!db) {
@@ -1022,17 +10544,34 @@ int main() {
     printf("Multi-Table DBMS (Type 'EXIT' to quit)\n");
     printf("Loaded %d tables.\n", db->num_tables);
     printf("\nSupported commands:\n");
-    printf("  CREATE TABLE table_name (col1 type, col2 type, ...)\n");
-    printf("  SHOW TABLES\n");
+    printf("  CREATE TABLE table_name (col1 type, col2 type, ... [, PRIMARY KEY (col1, col2)]) [COMPRESSION LZ4] [ENGINE LSM]\n");
+    printf("  SHOW TABLES | STATS | METRICS\n");
     printf("  DESCRIBE table_name\n");
     printf("  INSERT INTO table_name VALUES (val1, 'val2', ...)\n");
     printf("  SELECT * FROM table_name [WHERE id = value]\n");
     printf("  SELECT * FROM table_name WHERE id BETWEEN min AND max\n");
+    printf("  SELECT * FROM table_a JOIN table_b ON table_a.col = table_b.col [WHERE id ...]\n");
+    printf("  SELECT * FROM table_name [WHERE ...] [ORDER BY col [ASC|DESC]] [LIMIT n]\n");
+    printf("  SELECT col1, col2 FROM table_name ...\n");
     printf("  UPDATE table_name SET col='val' WHERE id = value\n");
     printf("  DELETE FROM table_name WHERE id = value\n");
+    printf("  SELECT * FROM table_name WHERE id IN (v1, v2, ...)\n");
+    printf("  SELECT * FROM table_name WHERE (k1, k2) = (v1, v2) | k1 BETWEEN a AND b\n");
+    printf("  SELECT * FROM table_name WHERE col = value\n");
+    printf("  SET IO SYSCALL | URING | MMAP\n");
+    printf("  SET OUTPUT TABLE | BINARY | JSON | CSV\n");
+    printf("  SET SLOWLOG OFF | ms [SAMPLE rate]\n");
+    printf("  SET CACHE MB | OFF\n");
+    printf("  COPY table_name FROM | TO 'file.csv' [HEADER]\n");
+    printf("  DROP TABLE table_name\n");
+    printf("  ALTER TABLE table_name ADD [COLUMN] col type\n");
+    printf("  ALTER TABLE table_name ENCODE\n");
+    printf("  EXPLAIN [ANALYZE] statement\n");
     
     while (1) {
-        printf("\nQuery> ");
+        if (outputWriter()->format == OUTPUT_TABLE) {
+            printf("\nQuery> ");
+        }
         if (!fgets(query, MAX_QUERY, stdin)) break;
         query[strcspn(query, "\n")] = 0;
         if (strcasecmp(query, "EXIT") == 0) break;
@@ -1040,7 +10579,10 @@ int main() {
         processQuery(db, query);
     }
 
+    if (!saveCatalog(db)) outputMessage("Error: Could not save the catalog!\n");
+    if (!saveMetrics(db)) outputMessage("Error: Could not save the statistics!\n");
     freeDatabase(db);
-    printf("Database closed. Goodbye!\n");
+    outputMessage("Database closed. Goodbye!\n");
     return 0;
-}
\ No newline at end of file
+}
+#endif
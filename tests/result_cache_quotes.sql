@@ -0,0 +1,9 @@
+SET CACHE 4
+CREATE TABLE t (id INT, v VARCHAR(20))
+INSERT INTO t VALUES (1, "a b")
+INSERT INTO t VALUES (2, "a  b")
+SELECT * FROM t WHERE v = "a b"
+SELECT * FROM t WHERE v = "a  b"
+SELECT * FROM t WHERE v = "a  b"
+SELECT * FROM t WHERE v = 'a  b'
+EXIT
@@ -0,0 +1,29 @@
+# Run a SQL script through the shell in an empty directory and check that
+# every line of the matching .expected file appears in its output, in order.
+#
+#   cmake -DSHELL=<soumyadb> -DSCRIPT=<name.sql> -DWORK_DIR=<dir> -P run_sql.cmake
+
+file(REMOVE_RECURSE "${WORK_DIR}")
+file(MAKE_DIRECTORY "${WORK_DIR}")
+execute_process(COMMAND "${SHELL}"
+                INPUT_FILE "${SCRIPT}"
+                OUTPUT_VARIABLE output
+                ERROR_VARIABLE output
+                WORKING_DIRECTORY "${WORK_DIR}"
+                RESULT_VARIABLE status)
+if(NOT status EQUAL 0)
+    message(FATAL_ERROR "${SHELL} exited with ${status}:\n${output}")
+endif()
+
+string(REGEX REPLACE "\\.sql$" ".expected" expected_file "${SCRIPT}")
+file(STRINGS "${expected_file}" expected)
+set(rest "${output}")
+foreach(line IN LISTS expected)
+    string(FIND "${rest}" "${line}" at)
+    if(at EQUAL -1)
+        message(FATAL_ERROR "Expected '${line}' next in the output:\n${output}")
+    endif()
+    string(LENGTH "${line}" length)
+    math(EXPR at "${at} + ${length}")
+    string(SUBSTRING "${rest}" ${at} -1 rest)
+endforeach()